@@ -0,0 +1,666 @@
+/* Benchmark driver for shusefs (make bench).
+ *
+ * Starts the mock device (bench/mock_device.c), mounts it with shusefs and
+ * measures:
+ *
+ *   - time from starting shusefs until the mount serves the device config
+ *     and switch state;
+ *   - open/read/close latency of a /proc field file on an idle device;
+ *   - NotifyStatus frames absorbed per second, for each replay rate, and the
+ *     /proc read latency while they arrive;
+ *   - script upload throughput, from writing scripts/script_1.js until the
+ *     device has the whole file.
+ *
+ * Results go to stdout as JSON lines, one object per metric:
+ *
+ *   {"metric":"mount_ready_ms","value":41.210,"unit":"ms"}
+ *
+ * preceded by one {"bench":...} line recording the parameters of the run,
+ * so results of runs with the same parameters can be compared. Progress and
+ * errors go to stderr.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_READY_TIMEOUT_MS 30000
+#define BENCH_NOTIFY_TIMEOUT_MS 120000
+#define BENCH_UPLOAD_TIMEOUT_MS 60000
+#define BENCH_EXIT_TIMEOUT_MS 10000
+/* Sentinel apower of the first replay run; later runs count up from it. The
+ * trace is recorded below it, and /proc shows one decimal. */
+#define BENCH_SENTINEL_BASE 9000.0
+
+typedef struct {
+  /* Options */
+  const char *shusefs;
+  const char *mock;
+  const char *trace;
+  const char *log_path;
+  char mountpoint[PATH_MAX];
+  int made_mountpoint;
+  int port;
+  int latency_ms;
+  const char *rates;
+  long notify_count;
+  int reads;
+  long upload_bytes;
+  char **shusefs_args; /* Passed on to shusefs before the URL */
+  int shusefs_argc;
+
+  /* Mock device, commanded over its stdin, reporting on its stdout */
+  pid_t mock_pid;
+  int mock_in;
+  int mock_out;
+  char mock_buf[1024];
+  size_t mock_len;
+
+  pid_t shusefs_pid;
+} bench_t;
+
+/* Latency samples of one measurement */
+typedef struct {
+  uint64_t *ns;
+  size_t count;
+  size_t capacity;
+} samples_t;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void sleep_ms(int ms) {
+  struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+static void emit_metric(const char *name, double value, const char *unit) {
+  printf("{\"metric\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}\n", name, value,
+         unit);
+  fflush(stdout);
+}
+
+/* ============================================================================
+ * SAMPLES
+ * ============================================================================
+ */
+
+static int samples_add(samples_t *samples, uint64_t ns) {
+  if (samples->count == samples->capacity) {
+    size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+    uint64_t *grown = realloc(samples->ns, capacity * sizeof(*grown));
+    if (!grown) {
+      return -1;
+    }
+    samples->ns = grown;
+    samples->capacity = capacity;
+  }
+  samples->ns[samples->count++] = ns;
+  return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Emit <prefix>_p50/_p90/_p99/_max in microseconds */
+static void samples_emit(samples_t *samples, const char *prefix) {
+  if (samples->count == 0) {
+    return;
+  }
+  qsort(samples->ns, samples->count, sizeof(*samples->ns), compare_u64);
+
+  static const struct {
+    const char *suffix;
+    double quantile;
+  } s_quantiles[] = {{"p50", 0.50}, {"p90", 0.90}, {"p99", 0.99}, {"max", 1}};
+  for (size_t i = 0; i < sizeof(s_quantiles) / sizeof(s_quantiles[0]); i++) {
+    size_t index =
+        (size_t) ((double) (samples->count - 1) * s_quantiles[i].quantile);
+    char name[96];
+    snprintf(name, sizeof(name), "%s_%s", prefix, s_quantiles[i].suffix);
+    emit_metric(name, (double) samples->ns[index] / 1000.0, "us");
+  }
+}
+
+static void samples_free(samples_t *samples) {
+  free(samples->ns);
+  memset(samples, 0, sizeof(*samples));
+}
+
+/* ============================================================================
+ * MOCK DEVICE
+ * ============================================================================
+ */
+
+static int mock_start(bench_t *bench) {
+  int to_mock[2];
+  int from_mock[2];
+  if (pipe(to_mock) != 0) {
+    return -1;
+  }
+  if (pipe(from_mock) != 0) {
+    close(to_mock[0]);
+    close(to_mock[1]);
+    return -1;
+  }
+
+  char port[16];
+  char latency[16];
+  snprintf(port, sizeof(port), "%d", bench->port);
+  snprintf(latency, sizeof(latency), "%d", bench->latency_ms);
+
+  bench->mock_pid = fork();
+  if (bench->mock_pid == 0) {
+    dup2(to_mock[0], STDIN_FILENO);
+    dup2(from_mock[1], STDOUT_FILENO);
+    close(to_mock[0]);
+    close(to_mock[1]);
+    close(from_mock[0]);
+    close(from_mock[1]);
+    execl(bench->mock, bench->mock, "-p", port, "-d", latency, bench->trace,
+          (char *) NULL);
+    fprintf(stderr, "bench: Cannot run %s: %s\n", bench->mock,
+            strerror(errno));
+    _exit(127);
+  }
+
+  close(to_mock[0]);
+  close(from_mock[1]);
+  bench->mock_in = to_mock[1];
+  bench->mock_out = from_mock[0];
+  if (bench->mock_pid < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Next event line of the mock, waiting up to `timeout_ms`. Returns 1 with
+ * the line in `line`, 0 on timeout, -1 if the mock has exited. */
+static int mock_event(bench_t *bench, int timeout_ms, char *line,
+                      size_t size) {
+  uint64_t deadline = now_ns() + (uint64_t) timeout_ms * 1000000ull;
+
+  for (;;) {
+    char *end = memchr(bench->mock_buf, '\n', bench->mock_len);
+    if (end) {
+      size_t len = (size_t) (end - bench->mock_buf);
+      snprintf(line, size, "%.*s", (int) len, bench->mock_buf);
+      bench->mock_len -= len + 1;
+      memmove(bench->mock_buf, end + 1, bench->mock_len);
+      return 1;
+    }
+    if (bench->mock_len == sizeof(bench->mock_buf)) {
+      bench->mock_len = 0; /* Overlong line, drop it */
+    }
+
+    uint64_t now = now_ns();
+    if (now >= deadline) {
+      return 0;
+    }
+    struct pollfd pfd = {.fd = bench->mock_out, .events = POLLIN};
+    int ready = poll(&pfd, 1, (int) ((deadline - now) / 1000000ull) + 1);
+    if (ready < 0 && errno != EINTR) {
+      return -1;
+    }
+    if (ready <= 0) {
+      continue;
+    }
+
+    ssize_t n = read(bench->mock_out, bench->mock_buf + bench->mock_len,
+                     sizeof(bench->mock_buf) - bench->mock_len);
+    if (n <= 0) {
+      return -1;
+    }
+    bench->mock_len += (size_t) n;
+  }
+}
+
+/* Wait up to `timeout_ms` for an event starting with `prefix`, skipping
+ * others. Returns 0 with the event in `line`, -1 if it did not come. */
+static int mock_wait(bench_t *bench, const char *prefix, int timeout_ms,
+                     char *line, size_t size) {
+  uint64_t deadline = now_ns() + (uint64_t) timeout_ms * 1000000ull;
+
+  for (;;) {
+    uint64_t now = now_ns();
+    int left = now < deadline ? (int) ((deadline - now) / 1000000ull) : 0;
+    if (mock_event(bench, left, line, size) != 1) {
+      return -1;
+    }
+    if (strncmp(line, prefix, strlen(prefix)) == 0) {
+      return 0;
+    }
+  }
+}
+
+static int mock_command(bench_t *bench, const char *fmt, ...) {
+  char cmd[128];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(cmd, sizeof(cmd), fmt, ap);
+  va_end(ap);
+  if (len < 0 || (size_t) len >= sizeof(cmd)) {
+    return -1;
+  }
+  return write(bench->mock_in, cmd, (size_t) len) == len ? 0 : -1;
+}
+
+/* ============================================================================
+ * SHUSEFS
+ * ============================================================================
+ */
+
+static int shusefs_start(bench_t *bench) {
+  char url[64];
+  snprintf(url, sizeof(url), "ws://127.0.0.1:%d/rpc", bench->port);
+
+  char **argv = calloc((size_t) bench->shusefs_argc + 4, sizeof(*argv));
+  if (!argv) {
+    return -1;
+  }
+  int argc = 0;
+  argv[argc++] = (char *) bench->shusefs;
+  for (int i = 0; i < bench->shusefs_argc; i++) {
+    argv[argc++] = bench->shusefs_args[i];
+  }
+  argv[argc++] = url;
+  argv[argc++] = bench->mountpoint;
+
+  bench->shusefs_pid = fork();
+  if (bench->shusefs_pid == 0) {
+    int log = open(bench->log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log >= 0) {
+      dup2(log, STDOUT_FILENO);
+      dup2(log, STDERR_FILENO);
+      close(log);
+    }
+    close(bench->mock_in);
+    close(bench->mock_out);
+    execv(bench->shusefs, argv);
+    _exit(127);
+  }
+  free(argv);
+  return bench->shusefs_pid < 0 ? -1 : 0;
+}
+
+/* Whether shusefs has exited (reaped) */
+static int shusefs_exited(bench_t *bench) {
+  if (bench->shusefs_pid <= 0) {
+    return 1;
+  }
+  if (waitpid(bench->shusefs_pid, NULL, WNOHANG) == bench->shusefs_pid) {
+    bench->shusefs_pid = 0;
+    return 1;
+  }
+  return 0;
+}
+
+/* Unmount by SIGTERM, as a user's Ctrl+C would */
+static void shusefs_stop(bench_t *bench) {
+  if (shusefs_exited(bench)) {
+    return;
+  }
+  kill(bench->shusefs_pid, SIGTERM);
+  for (int waited = 0; waited < BENCH_EXIT_TIMEOUT_MS; waited += 10) {
+    if (shusefs_exited(bench)) {
+      return;
+    }
+    sleep_ms(10);
+  }
+  fprintf(stderr, "bench: shusefs did not exit, killing it\n");
+  kill(bench->shusefs_pid, SIGKILL);
+  waitpid(bench->shusefs_pid, NULL, 0);
+  bench->shusefs_pid = 0;
+}
+
+/* ============================================================================
+ * BENCHMARKS
+ * ============================================================================
+ */
+
+/* open/read/close `rel` under the mountpoint. Returns the bytes read, or -1;
+ * the time it took is added to `samples` if given. */
+static ssize_t read_file(bench_t *bench, const char *rel, char *buf,
+                         size_t size, samples_t *samples) {
+  char path[PATH_MAX + 64];
+  snprintf(path, sizeof(path), "%s/%s", bench->mountpoint, rel);
+
+  uint64_t start = now_ns();
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t n = read(fd, buf, size - 1);
+  close(fd);
+  if (samples) {
+    samples_add(samples, now_ns() - start);
+  }
+  if (n >= 0) {
+    buf[n] = '\0';
+  }
+  return n;
+}
+
+/* Time from starting shusefs until the config and switch state read back */
+static int bench_mount_ready(bench_t *bench) {
+  char buf[4096];
+  uint64_t start = now_ns();
+
+  if (shusefs_start(bench) != 0) {
+    fprintf(stderr, "bench: Cannot start %s\n", bench->shusefs);
+    return -1;
+  }
+
+  uint64_t deadline = start + BENCH_READY_TIMEOUT_MS * 1000000ull;
+  while (now_ns() < deadline) {
+    if (read_file(bench, "sys_config.json", buf, sizeof(buf), NULL) > 0 &&
+        read_file(bench, "proc/switch/0/output", buf, sizeof(buf), NULL) > 0) {
+      emit_metric("mount_ready_ms", (double) (now_ns() - start) / 1e6, "ms");
+      /* Let the rest of the initial sync (script code) finish */
+      sleep_ms(500);
+      return 0;
+    }
+    if (shusefs_exited(bench)) {
+      fprintf(stderr, "bench: shusefs exited before the mount was ready\n");
+      return -1;
+    }
+    sleep_ms(1);
+  }
+
+  fprintf(stderr, "bench: Mount not ready after %d ms\n",
+          BENCH_READY_TIMEOUT_MS);
+  return -1;
+}
+
+static int bench_proc_read(bench_t *bench) {
+  samples_t samples = {0};
+  char buf[64];
+
+  for (int i = 0; i < bench->reads; i++) {
+    if (read_file(bench, "proc/switch/0/apower", buf, sizeof(buf), &samples) <
+        0) {
+      fprintf(stderr, "bench: Cannot read proc/switch/0/apower: %s\n",
+              strerror(errno));
+      samples_free(&samples);
+      return -1;
+    }
+  }
+  samples_emit(&samples, "proc_read_idle_us");
+  samples_free(&samples);
+  return 0;
+}
+
+/* Replay `bench->notify_count` frames at `rate` and time until the sentinel
+ * frame after them shows in /proc, reading it as fast as possible meanwhile */
+static int bench_notify(bench_t *bench, double rate, int run) {
+  double sentinel = BENCH_SENTINEL_BASE + run;
+  char name[64];
+  char label[32];
+  if (rate > 0) {
+    snprintf(label, sizeof(label), "r%.0f", rate);
+  } else {
+    snprintf(label, sizeof(label), "max");
+  }
+
+  if (mock_command(bench, "replay %g %ld %g\n", rate, bench->notify_count,
+                   sentinel) != 0) {
+    fprintf(stderr, "bench: Cannot command the mock device\n");
+    return -1;
+  }
+
+  samples_t samples = {0};
+  uint64_t start = now_ns();
+  uint64_t deadline = start + BENCH_NOTIFY_TIMEOUT_MS * 1000000ull;
+  int seen = 0;
+  while (!seen && now_ns() < deadline) {
+    char buf[64];
+    if (read_file(bench, "proc/switch/0/apower", buf, sizeof(buf), &samples) >
+            0 &&
+        fabs(strtod(buf, NULL) - sentinel) < 0.05) {
+      seen = 1;
+    }
+  }
+  double absorb_s = (double) (now_ns() - start) / 1e9;
+
+  char line[128];
+  double send_s = 0;
+  if (mock_wait(bench, "replayed", 5000, line, sizeof(line)) == 0) {
+    sscanf(line, "replayed %*s %lf", &send_s);
+  }
+  if (!seen) {
+    fprintf(stderr, "bench: Replay at %s not absorbed after %d ms\n", label,
+            BENCH_NOTIFY_TIMEOUT_MS);
+    samples_free(&samples);
+    return -1;
+  }
+
+  snprintf(name, sizeof(name), "notify_%s_msgs_per_s", label);
+  emit_metric(name, (double) bench->notify_count / absorb_s, "msg/s");
+  snprintf(name, sizeof(name), "notify_%s_absorb_ms", label);
+  emit_metric(name, absorb_s * 1000.0, "ms");
+  snprintf(name, sizeof(name), "notify_%s_send_ms", label);
+  emit_metric(name, send_s * 1000.0, "ms");
+  snprintf(name, sizeof(name), "proc_read_%s_us", label);
+  samples_emit(&samples, name);
+  samples_free(&samples);
+  return 0;
+}
+
+/* Write scripts/script_1.js and time until the device holds all of it */
+static int bench_upload(bench_t *bench) {
+  size_t size = (size_t) bench->upload_bytes;
+  char *code = malloc(size + 64);
+  if (!code) {
+    return -1;
+  }
+  size_t len = 0;
+  while (len < size) {
+    len += (size_t) snprintf(code + len, size + 64 - len,
+                             "print('shusefs bench upload', %lu);\n",
+                             (unsigned long) len);
+  }
+  len = size;
+
+  char path[PATH_MAX + 64];
+  snprintf(path, sizeof(path), "%s/scripts/script_1.js", bench->mountpoint);
+  uint64_t start = now_ns();
+  int fd = open(path, O_WRONLY | O_TRUNC);
+  ssize_t written = fd >= 0 ? write(fd, code, len) : -1;
+  int closed = fd >= 0 ? close(fd) : -1;
+  free(code);
+  if (written != (ssize_t) len || closed != 0) {
+    fprintf(stderr, "bench: Cannot write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  /* The upload is in chunks; done when the device reports the full length */
+  uint64_t deadline = start + BENCH_UPLOAD_TIMEOUT_MS * 1000000ull;
+  char line[128];
+  for (;;) {
+    uint64_t now = now_ns();
+    int left = now < deadline ? (int) ((deadline - now) / 1000000ull) : 0;
+    if (mock_wait(bench, "putcode 1 ", left, line, sizeof(line)) != 0) {
+      fprintf(stderr, "bench: Upload of %lu bytes not finished after %d ms\n",
+              (unsigned long) len, BENCH_UPLOAD_TIMEOUT_MS);
+      return -1;
+    }
+    if (strtoul(line + strlen("putcode 1 "), NULL, 10) == len) {
+      break;
+    }
+  }
+
+  double elapsed_s = (double) (now_ns() - start) / 1e9;
+  emit_metric("script_upload_ms", elapsed_s * 1000.0, "ms");
+  emit_metric("script_upload_kib_per_s", (double) len / 1024.0 / elapsed_s,
+              "KiB/s");
+  return 0;
+}
+
+static int bench_run(bench_t *bench) {
+  if (bench_mount_ready(bench) != 0 || bench_proc_read(bench) != 0) {
+    return -1;
+  }
+
+  int ret = 0;
+  int run = 0;
+  const char *rate = bench->rates;
+  while (*rate) {
+    if (bench_notify(bench, strtod(rate, NULL), ++run) != 0) {
+      ret = -1;
+    }
+    rate += strcspn(rate, ",");
+    rate += *rate == ',';
+  }
+
+  if (bench_upload(bench) != 0) {
+    ret = -1;
+  }
+  return ret;
+}
+
+/* ============================================================================
+ * MAIN
+ * ============================================================================
+ */
+
+static void print_usage(const char *prog_name) {
+  fprintf(stderr,
+          "Usage: %s [options] [-- shusefs options]\n"
+          "  -s PATH   shusefs binary (default ./shusefs)\n"
+          "  -m PATH   Mock device binary (default build/mock_device)\n"
+          "  -t PATH   NotifyStatus trace to replay (default "
+          "bench/traces/notify_status.jsonl)\n"
+          "  -M DIR    Mountpoint (default a new directory in /tmp)\n"
+          "  -p PORT   Mock device port (default 18111)\n"
+          "  -d MS     Mock latency of GetConfig/GetCode/PutCode replies "
+          "(default 5)\n"
+          "  -r LIST   Replay rates in frames/sec, 0 = unthrottled "
+          "(default 1000,10000,0)\n"
+          "  -n COUNT  Frames per replay (default 20000)\n"
+          "  -R COUNT  Idle /proc reads (default 10000)\n"
+          "  -u BYTES  Script upload size (default 16384)\n"
+          "  -l FILE   shusefs output (default /dev/null)\n",
+          prog_name);
+}
+
+int main(int argc, char *argv[]) {
+  bench_t bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.shusefs = "./shusefs";
+  bench.mock = "build/mock_device";
+  bench.trace = "bench/traces/notify_status.jsonl";
+  bench.log_path = "/dev/null";
+  bench.port = 18111;
+  bench.latency_ms = 5;
+  bench.rates = "1000,10000,0";
+  bench.notify_count = 20000;
+  bench.reads = 10000;
+  bench.upload_bytes = 16384;
+
+  int argi = 1;
+  while (argi < argc && argv[argi][0] == '-') {
+    const char *opt = argv[argi];
+    const char *val = argi + 1 < argc ? argv[argi + 1] : NULL;
+    if (strcmp(opt, "--") == 0) {
+      argi++;
+      break;
+    }
+    if (!val) {
+      print_usage(argv[0]);
+      return 1;
+    }
+    if (strcmp(opt, "-s") == 0) {
+      bench.shusefs = val;
+    } else if (strcmp(opt, "-m") == 0) {
+      bench.mock = val;
+    } else if (strcmp(opt, "-t") == 0) {
+      bench.trace = val;
+    } else if (strcmp(opt, "-M") == 0) {
+      snprintf(bench.mountpoint, sizeof(bench.mountpoint), "%s", val);
+    } else if (strcmp(opt, "-p") == 0) {
+      bench.port = atoi(val);
+    } else if (strcmp(opt, "-d") == 0) {
+      bench.latency_ms = atoi(val);
+    } else if (strcmp(opt, "-r") == 0) {
+      bench.rates = val;
+    } else if (strcmp(opt, "-n") == 0) {
+      bench.notify_count = atol(val);
+    } else if (strcmp(opt, "-R") == 0) {
+      bench.reads = atoi(val);
+    } else if (strcmp(opt, "-u") == 0) {
+      bench.upload_bytes = atol(val);
+    } else if (strcmp(opt, "-l") == 0) {
+      bench.log_path = val;
+    } else {
+      print_usage(argv[0]);
+      return 1;
+    }
+    argi += 2;
+  }
+  bench.shusefs_args = argv + argi;
+  bench.shusefs_argc = argc - argi;
+
+  if (bench.port <= 0 || bench.latency_ms < 0 || bench.notify_count <= 0 ||
+      bench.reads <= 0 || bench.upload_bytes <= 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  if (!bench.mountpoint[0]) {
+    snprintf(bench.mountpoint, sizeof(bench.mountpoint),
+             "/tmp/shusefs-bench.XXXXXX");
+    if (!mkdtemp(bench.mountpoint)) {
+      fprintf(stderr, "bench: Cannot create a mountpoint: %s\n",
+              strerror(errno));
+      return 1;
+    }
+    bench.made_mountpoint = 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  printf(
+      "{\"bench\":\"shusefs\",\"latency_ms\":%d,\"rates\":\"%s\","
+      "\"notify_count\":%ld,\"reads\":%d,\"upload_bytes\":%ld}\n",
+      bench.latency_ms, bench.rates, bench.notify_count, bench.reads,
+      bench.upload_bytes);
+  fflush(stdout);
+
+  char line[128];
+  int ret = -1;
+  if (mock_start(&bench) != 0 ||
+      mock_wait(&bench, "ready", 5000, line, sizeof(line)) != 0) {
+    fprintf(stderr, "bench: Mock device did not start\n");
+  } else {
+    ret = bench_run(&bench);
+  }
+
+  shusefs_stop(&bench);
+  if (bench.mock_pid > 0) {
+    mock_command(&bench, "quit\n");
+    close(bench.mock_in);
+    close(bench.mock_out);
+    waitpid(bench.mock_pid, NULL, 0);
+  }
+  if (bench.made_mountpoint) {
+    rmdir(bench.mountpoint);
+  }
+  return ret == 0 ? 0 : 1;
+}
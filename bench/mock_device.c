@@ -0,0 +1,660 @@
+/* Mock Shelly Gen2 device for the benchmarks (make bench).
+ *
+ * Serves the JSON-RPC subset shusefs uses over a WebSocket at
+ * ws://127.0.0.1:PORT/rpc: a device with two switches, one input, a few
+ * scripts and no schedules. Replies to the calls that move data
+ * (*.GetConfig, Script.GetCode, Script.PutCode) can be held back by a fixed
+ * latency, and recorded NotifyStatus frames are replayed on command at a set
+ * rate.
+ *
+ * The benchmark driver talks to the mock over its stdin and stdout, one line
+ * per command or event:
+ *
+ *   stdin:   replay <rate> <count> <sentinel>
+ *              Send <count> trace frames at <rate> frames/sec (0 = as fast
+ *              as the connection drains), then one NotifyStatus setting
+ *              switch:0 apower to <sentinel>
+ *            quit
+ *   stdout:  ready                      Listening
+ *            connected                  A client opened the WebSocket
+ *            replayed <count> <seconds> The sentinel frame was queued
+ *            putcode <id> <length>      A Script.PutCode was applied
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/mongoose.h"
+
+#define MOCK_SWITCHES 2
+#define MOCK_SCRIPTS_MAX 10
+#define MOCK_CFG_REV 1
+#define MOCK_SCHEDULE_REV 1
+/* Replay stops feeding the connection while this much is unsent, so a slow
+ * reader is measured rather than buffered for */
+#define MOCK_SEND_BACKLOG (256 * 1024)
+#define MOCK_GET_CODE_MAX 2048
+
+typedef struct {
+  char *code;
+  size_t len;
+} mock_script_t;
+
+/* A reply held back by the configured latency */
+typedef struct delayed_reply {
+  unsigned long conn_id;
+  uint64_t due;
+  char *frame;
+  struct delayed_reply *next;
+} delayed_reply_t;
+
+typedef struct {
+  int active;
+  double rate;
+  long count;
+  long sent;
+  double sentinel;
+  uint64_t start;
+} replay_t;
+
+typedef struct {
+  struct mg_mgr mgr;
+  unsigned long client_id; /* WebSocket connection, 0 if none */
+  unsigned int latency_ms;
+
+  char **trace; /* Recorded frames, one per line of the trace file */
+  size_t trace_len;
+
+  mock_script_t scripts[MOCK_SCRIPTS_MAX];
+  int script_count;
+
+  delayed_reply_t *delayed;
+  delayed_reply_t *delayed_tail;
+  replay_t replay;
+
+  char stdin_buf[256];
+  size_t stdin_len;
+} mock_t;
+
+static volatile sig_atomic_t s_stop = 0;
+
+static void signal_handler(int signo) {
+  (void) signo;
+  s_stop = 1;
+}
+
+static void emit(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  putchar('\n');
+  fflush(stdout);
+}
+
+static struct mg_connection *mock_client(mock_t *mock) {
+  for (struct mg_connection *c = mock->mgr.conns; c; c = c->next) {
+    if (c->id == mock->client_id) {
+      return c;
+    }
+  }
+  return NULL;
+}
+
+/* ============================================================================
+ * TRACE
+ * ============================================================================
+ */
+
+/* Read the trace file: one recorded frame per line, blank lines skipped */
+static int trace_load(mock_t *mock, const char *path) {
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    fprintf(stderr, "mock: Cannot open trace %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+
+  size_t capacity = 0;
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t n;
+  while ((n = getline(&line, &line_size, in)) > 0) {
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+      line[--n] = '\0';
+    }
+    if (n == 0) {
+      continue;
+    }
+    if (mock->trace_len == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      char **trace = realloc(mock->trace, capacity * sizeof(*trace));
+      if (!trace) {
+        break;
+      }
+      mock->trace = trace;
+    }
+    mock->trace[mock->trace_len] = strdup(line);
+    if (!mock->trace[mock->trace_len]) {
+      break;
+    }
+    mock->trace_len++;
+  }
+  free(line);
+  fclose(in);
+
+  if (mock->trace_len == 0) {
+    fprintf(stderr, "mock: No frames in trace %s\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+static void replay_start(mock_t *mock, double rate, long count,
+                         double sentinel) {
+  mock->replay.active = 1;
+  mock->replay.rate = rate;
+  mock->replay.count = count;
+  mock->replay.sent = 0;
+  mock->replay.sentinel = sentinel;
+  mock->replay.start = mg_millis();
+}
+
+/* Send the replay frames that are due, as far as the send backlog allows */
+static void replay_pump(mock_t *mock) {
+  replay_t *replay = &mock->replay;
+  if (!replay->active) {
+    return;
+  }
+  struct mg_connection *c = mock_client(mock);
+  if (!c) {
+    return;
+  }
+
+  long due = replay->count;
+  if (replay->rate > 0) {
+    double elapsed = (double) (mg_millis() - replay->start) / 1000.0;
+    due = (long) (elapsed * replay->rate) + 1;
+    if (due > replay->count) {
+      due = replay->count;
+    }
+  }
+
+  while (replay->sent < due && c->send.len < MOCK_SEND_BACKLOG) {
+    const char *frame = mock->trace[replay->sent % mock->trace_len];
+    mg_ws_send(c, frame, strlen(frame), WEBSOCKET_OP_TEXT);
+    replay->sent++;
+  }
+
+  if (replay->sent == replay->count) {
+    char *frame = mg_mprintf(
+        "{\"src\":\"mock\",\"dst\":\"shusefs-client\",\"method\":"
+        "\"NotifyStatus\",\"params\":{\"switch:0\":{\"id\":0,\"apower\":%g}}}",
+        replay->sentinel);
+    mg_ws_send(c, frame, strlen(frame), WEBSOCKET_OP_TEXT);
+    free(frame);
+    replay->active = 0;
+    emit("replayed %ld %.3f", replay->count,
+         (double) (mg_millis() - replay->start) / 1000.0);
+  }
+}
+
+/* ============================================================================
+ * REPLIES
+ * ============================================================================
+ */
+
+/* Send the result `fmt` (mg_mprintf() format) for request `id`, after the
+ * configured latency if `delayed` */
+static void reply(mock_t *mock, struct mg_connection *c, long id, int delayed,
+                  const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  char *result = mg_vmprintf(fmt, &ap);
+  va_end(ap);
+  char *frame = mg_mprintf(
+      "{\"id\":%ld,\"src\":\"mock\",\"dst\":\"shusefs-client\",\"result\":%s}",
+      id, result);
+  free(result);
+
+  if (!delayed || mock->latency_ms == 0) {
+    mg_ws_send(c, frame, strlen(frame), WEBSOCKET_OP_TEXT);
+    free(frame);
+    return;
+  }
+
+  delayed_reply_t *entry = calloc(1, sizeof(*entry));
+  if (!entry) {
+    free(frame);
+    return;
+  }
+  entry->conn_id = c->id;
+  entry->due = mg_millis() + mock->latency_ms;
+  entry->frame = frame;
+  /* One latency for all, so the list stays ordered by due time */
+  if (mock->delayed_tail) {
+    mock->delayed_tail->next = entry;
+  } else {
+    mock->delayed = entry;
+  }
+  mock->delayed_tail = entry;
+}
+
+static void reply_error(struct mg_connection *c, long id, int code,
+                        const char *message) {
+  char *frame = mg_mprintf(
+      "{\"id\":%ld,\"src\":\"mock\",\"dst\":\"shusefs-client\",\"error\":"
+      "{\"code\":%d,\"message\":%m}}",
+      id, code, MG_ESC(message));
+  mg_ws_send(c, frame, strlen(frame), WEBSOCKET_OP_TEXT);
+  free(frame);
+}
+
+/* Send the delayed replies that are due */
+static void delayed_flush(mock_t *mock) {
+  uint64_t now = mg_millis();
+  while (mock->delayed && mock->delayed->due <= now) {
+    delayed_reply_t *entry = mock->delayed;
+    mock->delayed = entry->next;
+    if (!mock->delayed) {
+      mock->delayed_tail = NULL;
+    }
+
+    for (struct mg_connection *c = mock->mgr.conns; c; c = c->next) {
+      if (c->id == entry->conn_id) {
+        mg_ws_send(c, entry->frame, strlen(entry->frame), WEBSOCKET_OP_TEXT);
+        break;
+      }
+    }
+    free(entry->frame);
+    free(entry);
+  }
+}
+
+/* ============================================================================
+ * METHODS
+ * ============================================================================
+ */
+
+static const char *const s_sys_config =
+    "{\"device\":{\"name\":\"bench\",\"mac\":\"A8032AB1F0C4\","
+    "\"fw_id\":\"20240430-105751/1.3.1\",\"eco_mode\":false,"
+    "\"discoverable\":true},\"location\":{\"tz\":\"Europe/Sofia\","
+    "\"lat\":42.7,\"lon\":23.3},\"debug\":{\"websocket\":{\"enable\":false}},"
+    "\"sntp\":{\"server\":\"time.google.com\"},\"cfg_rev\":%d}";
+
+static const char *const s_mqtt_config =
+    "{\"enable\":false,\"server\":\"mqtt.local:1883\",\"client_id\":"
+    "\"shellyplus2pm-a8032ab1f0c4\",\"user\":null,\"ssl_ca\":null,"
+    "\"topic_prefix\":\"shellyplus2pm-a8032ab1f0c4\",\"rpc_ntf\":true,"
+    "\"status_ntf\":false}";
+
+static const char *const s_switch_config =
+    "{\"id\":%d,\"name\":\"Switch %d\",\"in_mode\":\"follow\","
+    "\"initial_state\":\"restore_last\",\"auto_on\":false,"
+    "\"auto_on_delay\":60.0,\"auto_off\":false,\"auto_off_delay\":60.0,"
+    "\"power_limit\":4480,\"voltage_limit\":280,\"current_limit\":10.0}";
+
+static const char *const s_switch_status =
+    "{\"id\":%d,\"source\":\"init\",\"output\":false,\"apower\":0.0,"
+    "\"voltage\":229.8,\"current\":0.0,\"freq\":50.0,"
+    "\"aenergy\":{\"total\":1000.0},\"temperature\":{\"tC\":44.0,"
+    "\"tF\":111.2}}";
+
+static const char *const s_input_config =
+    "{\"id\":0,\"name\":null,\"type\":\"switch\",\"enable\":true,"
+    "\"invert\":false,\"factory_reset\":true}";
+
+static void handle_shelly_get_config(mock_t *mock, struct mg_connection *c,
+                                     long id) {
+  char *sys = mg_mprintf(s_sys_config, MOCK_CFG_REV);
+  char *config = mg_mprintf("{\"sys\":%s,\"mqtt\":%s", sys, s_mqtt_config);
+  free(sys);
+  for (int i = 0; i < MOCK_SWITCHES && config; i++) {
+    char *sw = mg_mprintf(s_switch_config, i, i);
+    char *next = mg_mprintf("%s,\"switch:%d\":%s", config, i, sw);
+    free(sw);
+    free(config);
+    config = next;
+  }
+  for (int i = 0; i < mock->script_count && config; i++) {
+    char *next = mg_mprintf(
+        "%s,\"script:%d\":{\"id\":%d,\"name\":\"bench_%d\",\"enable\":true}",
+        config, i + 1, i + 1, i + 1);
+    free(config);
+    config = next;
+  }
+  if (config) {
+    reply(mock, c, id, 1, "%s,\"input:0\":%s}", config, s_input_config);
+  }
+  free(config);
+}
+
+static void handle_shelly_get_status(mock_t *mock, struct mg_connection *c,
+                                     long id) {
+  char *status = mg_mprintf(
+      "{\"sys\":{\"mac\":\"A8032AB1F0C4\",\"uptime\":86400,\"cfg_rev\":%d,"
+      "\"schedule_rev\":%d},\"input:0\":{\"id\":0,\"state\":false}",
+      MOCK_CFG_REV, MOCK_SCHEDULE_REV);
+  for (int i = 0; i < MOCK_SWITCHES && status; i++) {
+    char *sw = mg_mprintf(s_switch_status, i);
+    char *next = mg_mprintf("%s,\"switch:%d\":%s", status, i, sw);
+    free(sw);
+    free(status);
+    status = next;
+  }
+  if (status) {
+    reply(mock, c, id, 0, "%s}", status);
+  }
+  free(status);
+}
+
+static void handle_script_list(mock_t *mock, struct mg_connection *c,
+                               long id) {
+  /* Never empty: mg_mprintf() returns NULL for an empty string */
+  char *list = mg_mprintf("%s", "{\"scripts\":[");
+  for (int i = 0; i < mock->script_count && list; i++) {
+    char *next = mg_mprintf(
+        "%s%s{\"id\":%d,\"name\":\"bench_%d\",\"enable\":true,"
+        "\"running\":false}",
+        list, i ? "," : "", i + 1, i + 1);
+    free(list);
+    list = next;
+  }
+  if (list) {
+    reply(mock, c, id, 0, "%s]}", list);
+  }
+  free(list);
+}
+
+static mock_script_t *script_by_id(mock_t *mock, long script_id) {
+  if (script_id < 1 || script_id > mock->script_count) {
+    return NULL;
+  }
+  return &mock->scripts[script_id - 1];
+}
+
+static void handle_script_get_code(mock_t *mock, struct mg_connection *c,
+                                   long id, struct mg_str params) {
+  mock_script_t *script =
+      script_by_id(mock, mg_json_get_long(params, "$.id", -1));
+  if (!script) {
+    reply_error(c, id, -105, "Argument 'id', value not found!");
+    return;
+  }
+
+  long offset = mg_json_get_long(params, "$.offset", 0);
+  long len = mg_json_get_long(params, "$.len", MOCK_GET_CODE_MAX);
+  if (offset < 0 || (size_t) offset > script->len) {
+    offset = (long) script->len;
+  }
+  if (len <= 0 || len > MOCK_GET_CODE_MAX) {
+    len = MOCK_GET_CODE_MAX;
+  }
+  size_t left = script->len - (size_t) offset;
+  size_t n = (size_t) len < left ? (size_t) len : left;
+
+  /* mg_print_esc takes a length, 0 meaning strlen() */
+  reply(mock, c, id, 1, "{\"data\":%m,\"left\":%lu}", mg_print_esc, (int) n,
+        n ? script->code + offset : "", (unsigned long) (left - n));
+}
+
+static void handle_script_put_code(mock_t *mock, struct mg_connection *c,
+                                   long id, struct mg_str params) {
+  long script_id = mg_json_get_long(params, "$.id", -1);
+  mock_script_t *script = script_by_id(mock, script_id);
+  char *code = mg_json_get_str(params, "$.code");
+  if (!script || !code) {
+    free(code);
+    reply_error(c, id, -105, "Argument 'id', value not found!");
+    return;
+  }
+
+  bool append = false;
+  mg_json_get_bool(params, "$.append", &append);
+  size_t code_len = strlen(code);
+  size_t base = append ? script->len : 0;
+  char *grown = realloc(script->code, base + code_len + 1);
+  if (!grown) {
+    free(code);
+    reply_error(c, id, -103, "Out of memory");
+    return;
+  }
+  memcpy(grown + base, code, code_len + 1);
+  script->code = grown;
+  script->len = base + code_len;
+  free(code);
+
+  reply(mock, c, id, 1, "{\"len\":%lu}", (unsigned long) script->len);
+  emit("putcode %ld %lu", script_id, (unsigned long) script->len);
+}
+
+static void handle_request(mock_t *mock, struct mg_connection *c,
+                           struct mg_str msg) {
+  long id = mg_json_get_long(msg, "$.id", -1);
+  char *method = mg_json_get_str(msg, "$.method");
+  if (!method) {
+    return;
+  }
+
+  int params_len = 0;
+  int params_pos = mg_json_get(msg, "$.params", &params_len);
+  struct mg_str params = params_pos >= 0
+                             ? mg_str_n(msg.buf + params_pos, params_len)
+                             : mg_str("{}");
+  long component = mg_json_get_long(params, "$.id", 0);
+  int is_switch = component >= 0 && component < MOCK_SWITCHES;
+
+  if (strcmp(method, "Shelly.GetConfig") == 0) {
+    handle_shelly_get_config(mock, c, id);
+  } else if (strcmp(method, "Shelly.GetStatus") == 0) {
+    handle_shelly_get_status(mock, c, id);
+  } else if (strcmp(method, "Sys.GetConfig") == 0) {
+    reply(mock, c, id, 1, s_sys_config, MOCK_CFG_REV);
+  } else if (strcmp(method, "MQTT.GetConfig") == 0) {
+    reply(mock, c, id, 1, "%s", s_mqtt_config);
+  } else if (strcmp(method, "Switch.GetConfig") == 0 && is_switch) {
+    reply(mock, c, id, 1, s_switch_config, (int) component, (int) component);
+  } else if (strcmp(method, "Switch.GetStatus") == 0 && is_switch) {
+    reply(mock, c, id, 0, s_switch_status, (int) component);
+  } else if (strcmp(method, "Switch.Set") == 0 && is_switch) {
+    reply(mock, c, id, 0, "{\"was_on\":false}");
+  } else if (strcmp(method, "Input.GetConfig") == 0 && component == 0) {
+    reply(mock, c, id, 1, "%s", s_input_config);
+  } else if (strcmp(method, "Input.GetStatus") == 0 && component == 0) {
+    reply(mock, c, id, 0, "{\"id\":0,\"state\":false}");
+  } else if (strcmp(method, "Script.List") == 0) {
+    handle_script_list(mock, c, id);
+  } else if (strcmp(method, "Script.GetCode") == 0) {
+    handle_script_get_code(mock, c, id, params);
+  } else if (strcmp(method, "Script.PutCode") == 0) {
+    handle_script_put_code(mock, c, id, params);
+  } else if (strcmp(method, "Schedule.List") == 0) {
+    reply(mock, c, id, 0, "{\"jobs\":[],\"rev\":%d}", MOCK_SCHEDULE_REV);
+  } else if (strstr(method, ".SetConfig")) {
+    reply(mock, c, id, 0, "{\"restart_required\":false}");
+  } else {
+    reply_error(c, id, -114, "Method not found");
+  }
+  free(method);
+}
+
+static void event_handler(struct mg_connection *c, int ev, void *ev_data) {
+  mock_t *mock = (mock_t *) c->fn_data;
+
+  if (ev == MG_EV_HTTP_MSG) {
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    if (mg_match(hm->uri, mg_str("/rpc"), NULL)) {
+      mg_ws_upgrade(c, hm, NULL);
+    } else {
+      mg_http_reply(c, 404, "", "Not found\n");
+    }
+  } else if (ev == MG_EV_WS_OPEN) {
+    mock->client_id = c->id;
+    emit("connected");
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
+    handle_request(mock, c, wm->data);
+  } else if (ev == MG_EV_CLOSE && c->id == mock->client_id) {
+    mock->client_id = 0;
+  }
+}
+
+/* ============================================================================
+ * COMMANDS
+ * ============================================================================
+ */
+
+static void handle_command(mock_t *mock, const char *line) {
+  double rate = 0;
+  long count = 0;
+  double sentinel = 0;
+
+  if (sscanf(line, "replay %lf %ld %lf", &rate, &count, &sentinel) == 3 &&
+      rate >= 0 && count >= 0) {
+    replay_start(mock, rate, count, sentinel);
+  } else if (strcmp(line, "quit") == 0) {
+    s_stop = 1;
+  } else {
+    fprintf(stderr, "mock: Unknown command \"%s\"\n", line);
+  }
+}
+
+/* Read the commands waiting on stdin. The driver closing it ends the mock. */
+static void poll_commands(mock_t *mock) {
+  struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+  if (poll(&pfd, 1, 0) <= 0) {
+    return;
+  }
+
+  size_t space = sizeof(mock->stdin_buf) - mock->stdin_len - 1;
+  ssize_t n = read(STDIN_FILENO, mock->stdin_buf + mock->stdin_len, space);
+  if (n <= 0) {
+    s_stop = 1;
+    return;
+  }
+  mock->stdin_len += (size_t) n;
+  mock->stdin_buf[mock->stdin_len] = '\0';
+
+  char *line = mock->stdin_buf;
+  char *end;
+  while ((end = strchr(line, '\n')) != NULL) {
+    *end = '\0';
+    handle_command(mock, line);
+    line = end + 1;
+  }
+  mock->stdin_len = strlen(line);
+  memmove(mock->stdin_buf, line, mock->stdin_len + 1);
+  if (mock->stdin_len == sizeof(mock->stdin_buf) - 1) {
+    mock->stdin_len = 0; /* Overlong line, drop it */
+  }
+}
+
+/* ============================================================================
+ * MAIN
+ * ============================================================================
+ */
+
+static void print_usage(const char *prog_name) {
+  fprintf(stderr,
+          "Usage: %s [-p PORT] [-d MS] [-n SCRIPTS] [-b BYTES] TRACE\n"
+          "  -p PORT     Listen on 127.0.0.1:PORT (default 18111)\n"
+          "  -d MS       Latency of *.GetConfig and Script.GetCode/PutCode "
+          "replies\n"
+          "  -n SCRIPTS  Number of scripts on the device (default 3)\n"
+          "  -b BYTES    Initial size of each script (default 4096)\n",
+          prog_name);
+}
+
+static void mock_init_scripts(mock_t *mock, size_t bytes) {
+  for (int i = 0; i < mock->script_count; i++) {
+    mock_script_t *script = &mock->scripts[i];
+    script->code = malloc(bytes + 64);
+    if (!script->code) {
+      continue;
+    }
+    size_t len = 0;
+    while (len < bytes) {
+      len += (size_t) snprintf(script->code + len, bytes + 64 - len,
+                               "// bench_%d line at %lu\nlet x = 1;\n", i + 1,
+                               (unsigned long) len);
+    }
+    script->len = len;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  mock_t mock;
+  memset(&mock, 0, sizeof(mock));
+  int port = 18111;
+  long script_bytes = 4096;
+  mock.script_count = 3;
+
+  int argi = 1;
+  while (argi + 1 < argc && argv[argi][0] == '-') {
+    if (strcmp(argv[argi], "-p") == 0) {
+      port = atoi(argv[argi + 1]);
+    } else if (strcmp(argv[argi], "-d") == 0) {
+      mock.latency_ms = (unsigned int) atoi(argv[argi + 1]);
+    } else if (strcmp(argv[argi], "-n") == 0) {
+      mock.script_count = atoi(argv[argi + 1]);
+    } else if (strcmp(argv[argi], "-b") == 0) {
+      script_bytes = atol(argv[argi + 1]);
+    } else {
+      break;
+    }
+    argi += 2;
+  }
+  if (argi != argc - 1 || port <= 0 || mock.script_count < 0 ||
+      mock.script_count > MOCK_SCRIPTS_MAX || script_bytes < 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if (trace_load(&mock, argv[argi]) != 0) {
+    return 1;
+  }
+  mock_init_scripts(&mock, (size_t) script_bytes);
+
+  signal(SIGINT, signal_handler);
+  signal(SIGTERM, signal_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  mg_log_set(MG_LL_ERROR);
+  mg_mgr_init(&mock.mgr);
+  char url[64];
+  snprintf(url, sizeof(url), "http://127.0.0.1:%d", port);
+  if (!mg_http_listen(&mock.mgr, url, event_handler, &mock)) {
+    fprintf(stderr, "mock: Cannot listen on %s\n", url);
+    mg_mgr_free(&mock.mgr);
+    return 1;
+  }
+  emit("ready");
+
+  while (!s_stop) {
+    /* Poll without sleeping while a replay is feeding the connection */
+    mg_mgr_poll(&mock.mgr, mock.replay.active ? 0 : 1);
+    poll_commands(&mock);
+    delayed_flush(&mock);
+    replay_pump(&mock);
+  }
+
+  mg_mgr_free(&mock.mgr);
+  while (mock.delayed) {
+    delayed_reply_t *next = mock.delayed->next;
+    free(mock.delayed->frame);
+    free(mock.delayed);
+    mock.delayed = next;
+  }
+  for (int i = 0; i < mock.script_count; i++) {
+    free(mock.scripts[i].code);
+  }
+  for (size_t i = 0; i < mock.trace_len; i++) {
+    free(mock.trace[i]);
+  }
+  free(mock.trace);
+  return 0;
+}
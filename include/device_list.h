@@ -0,0 +1,50 @@
+#ifndef DEVICE_LIST_H
+#define DEVICE_LIST_H
+
+/* Devices of a multi-device mount (-f FILE). The file lists one device per
+ * line as "<name> <url> [tag...]", and groups by name pattern as
+ * "@<group> <glob...>", e.g.
+ *
+ *   # name    url                     tags
+ *   kitchen   ws://192.168.1.10/rpc   lights floor1
+ *   garage    ws://192.168.1.11/rpc   floor1
+ *   @plugs    plug-* socket-?
+ *
+ * Blank lines and everything after a '#' are ignored. Each device is mounted
+ * as the directory /<name>, so names must be unique and valid file names.
+ * Every tag, and every "@" line, makes a group of the devices carrying the
+ * tag or matching one of the globs (fnmatch() on the device name); both
+ * kinds may name the same group. */
+
+#define DEVICE_NAME_MAX 64
+#define DEVICE_URL_MAX 256
+#define DEVICE_TAGS_MAX 8
+
+typedef struct {
+  char name[DEVICE_NAME_MAX]; /* Directory under the mountpoint */
+  char url[DEVICE_URL_MAX];   /* WebSocket URL (ws:// or wss://) */
+  char tags[DEVICE_TAGS_MAX][DEVICE_NAME_MAX];
+  int tag_count;
+} device_entry_t;
+
+typedef struct {
+  char name[DEVICE_NAME_MAX]; /* Without the '@' */
+  int *members;               /* Indexes into device_list_t.devices */
+  int member_count;
+} device_group_t;
+
+typedef struct {
+  device_entry_t *devices;
+  int count;
+  device_group_t *groups;
+  int group_count;
+} device_list_t;
+
+/* Read the device list from `path`. Errors are reported with the offending
+ * line number. Returns 0 on success (at least one device), -1 on error. */
+int device_list_load(device_list_t *list, const char *path);
+
+/* Free the entries and groups of a loaded list */
+void device_list_free(device_list_t *list);
+
+#endif /* DEVICE_LIST_H */
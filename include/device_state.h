@@ -3,6 +3,7 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include "request_queue.h"
 
@@ -25,6 +26,13 @@ struct mg_connection;
 #define MAX_SCRIPT_NAME 64
 #define MAX_SCRIPT_CODE 20480
 #define SCRIPT_CHUNK_SIZE 2048
+#define SCRIPT_FETCH_WINDOW 4 /* Default Script.GetCode requests in flight */
+#define SCRIPT_UPLOAD_WINDOW 2 /* Script.PutCode requests in flight/script */
+#define SCRIPT_UPLOAD_CHUNK_MIN 512
+#define SCRIPT_UPLOAD_CHUNK_MAX 4096
+#define SCRIPT_UPLOAD_RTT_TARGET_MS 250 /* Shrink chunks above this RTT */
+#define SCRIPT_UPLOAD_RETRIES 3 /* Consecutive failed chunks to give up */
+#define SCRIPT_LOAD_TIMEOUT_SEC 10 /* Max wait in open() for script code */
 #define MAX_SWITCHES 16
 #define MAX_SWITCH_NAME 64
 #define MAX_INPUTS 16
@@ -59,7 +67,8 @@ typedef enum {
   SWITCH_INITIAL_UNKNOWN
 } switch_initial_state_t;
 
-/* Response type enumeration */
+/* Response type enumeration. Doubles as the method tag recorded in
+ * request_desc_t when a request is queued. */
 typedef enum {
   RESPONSE_TYPE_UNKNOWN = 0,
   RESPONSE_TYPE_SYS_GETCONFIG,
@@ -82,7 +91,10 @@ typedef enum {
   RESPONSE_TYPE_SCHEDULE_CREATE,
   RESPONSE_TYPE_SCHEDULE_UPDATE,
   RESPONSE_TYPE_SCHEDULE_DELETE,
-  RESPONSE_TYPE_OTHER
+  RESPONSE_TYPE_SHELLY_GETCONFIG,
+  RESPONSE_TYPE_SHELLY_GETSTATUS,
+  RESPONSE_TYPE_OTHER,
+  RESPONSE_TYPE_COUNT /* Number of response types, keep last */
 } response_type_t;
 
 /* ============================================================================
@@ -102,6 +114,8 @@ typedef struct {
     bool eco_mode;
     int sntp_enabled;
     char *timezone;
+    int cfg_rev; /* Device config revision this snapshot was taken at (-1 if
+                    unknown) */
   } parsed;
 
   int valid;          /* 1 if configuration is valid/loaded */
@@ -132,6 +146,25 @@ typedef struct {
   time_t last_update; /* Timestamp of last update */
 } mqtt_config_t;
 
+/* One recorded switch status update */
+typedef struct {
+  double ts; /* Wall-clock time the update was applied (epoch seconds) */
+  bool output;
+  double apower;
+  double voltage;
+  double current;
+  double energy_total;
+  double temperature_c;
+} switch_history_record_t;
+
+/* Fixed-size ring of recent switch status updates */
+typedef struct {
+  switch_history_record_t *records; /* `depth` slots, NULL when disabled */
+  unsigned int depth;
+  unsigned int head;  /* Slot the next record goes to */
+  unsigned int count; /* Records held (at most depth) */
+} switch_history_t;
+
 /* Individual switch configuration */
 typedef struct {
   int id;         /* Switch ID (0-15) */
@@ -184,13 +217,19 @@ typedef struct {
     time_t mtime_temperature;
   } status;
 
+  /* Status updates, oldest first from head (device_state_set_history_depth)
+   */
+  switch_history_t history;
+
   int valid;          /* 1 if configuration is valid/loaded */
   time_t last_update; /* Timestamp of last update */
 } switch_config_t;
 
-/* Switches state */
+/* Switches state. Slots are allocated from the device's arena the first
+ * time the device reports the switch, so a one-switch device carries one
+ * switch_config_t rather than MAX_SWITCHES of them. */
 typedef struct {
-  switch_config_t switches[MAX_SWITCHES];
+  switch_config_t *switches[MAX_SWITCHES]; /* NULL until reported */
   int count;          /* Number of valid switches */
   time_t last_update; /* Timestamp of last update */
 } switches_state_t;
@@ -203,6 +242,20 @@ typedef enum {
   INPUT_TYPE_UNKNOWN
 } input_type_t;
 
+/* One recorded input status update */
+typedef struct {
+  double ts; /* Wall-clock time the update was applied (epoch seconds) */
+  bool state;
+} input_history_record_t;
+
+/* Fixed-size ring of recent input status updates */
+typedef struct {
+  input_history_record_t *records; /* `depth` slots, NULL when disabled */
+  unsigned int depth;
+  unsigned int head;  /* Slot the next record goes to */
+  unsigned int count; /* Records held (at most depth) */
+} input_history_t;
+
 /* Individual input configuration */
 typedef struct {
   int id;         /* Input ID (0-15) */
@@ -227,13 +280,16 @@ typedef struct {
     time_t mtime_state;        /* Per-field mtime for inotify */
   } status;
 
+  /* Status updates (device_state_set_history_depth) */
+  input_history_t history;
+
   int valid;          /* 1 if configuration is valid/loaded */
   time_t last_update; /* Timestamp of last update */
 } input_config_t;
 
-/* Inputs state */
+/* Inputs state (slots allocated like switches_state_t's) */
 typedef struct {
-  input_config_t inputs[MAX_INPUTS];
+  input_config_t *inputs[MAX_INPUTS]; /* NULL until reported */
   int count;          /* Number of valid inputs */
   time_t last_update; /* Timestamp of last update */
 } inputs_state_t;
@@ -248,6 +304,11 @@ typedef struct {
   time_t modify_time;         /* Script modification timestamp */
   int valid;                  /* 1 if script slot is populated */
 
+  int code_size;       /* Last known code size, kept across eviction (-1 if
+                          unknown) */
+  int open_count;      /* Open file handles on script_N.js */
+  time_t last_access;  /* Last open/release, for idle eviction */
+
   /* Runtime status */
   bool running;              /* Script is currently running */
   int mem_used;              /* Memory used in bytes */
@@ -255,8 +316,38 @@ typedef struct {
   char *errors;              /* Error messages (dynamically allocated) */
   time_t last_status_update; /* Timestamp of last status update */
 
-  /* Upload tracking */
-  int last_upload_req_id; /* Request ID of last chunk in upload (-1 if none) */
+  /* Windowed upload (Script.PutCode). The code is escaped for JSON once;
+   * positions are kept both in code bytes (what the device counts) and in
+   * the escaped text the chunks are cut from. */
+  char *upload_esc;     /* Escaped code being uploaded (NULL when idle) */
+  char *upload_pending; /* Newer code to upload once this upload drains */
+  int upload_len;       /* Code bytes to upload */
+  int upload_next;      /* Next chunk to send (code bytes) */
+  int upload_next_esc;  /* Next chunk to send (escaped text) */
+  int upload_acked;     /* Acknowledged contiguously (code bytes) */
+  int upload_acked_esc; /* Acknowledged contiguously (escaped text) */
+  int upload_chunk;     /* Chunk size in code bytes, adapted to RTT/errors */
+  int upload_inflight;  /* PutCode requests outstanding for this script */
+  int upload_window;    /* Max PutCode requests in flight (drops to 1 after an
+                           error, so retries resume in place) */
+  int upload_recovering; /* 1 after a failed chunk: drain, then resume */
+  int upload_dirty;     /* 1 if a chunk past the failed one was applied */
+  int upload_retries;   /* Consecutive failed chunks */
+  int upload_stale;     /* 1 if outstanding replies are to be discarded */
+  double upload_srtt_ms; /* Smoothed chunk round-trip time */
+  uint64_t upload_sent_ms[SCRIPT_UPLOAD_WINDOW]; /* Queue times, oldest first */
+  int upload_sent_head;
+
+  /* Chunked retrieval (Script.GetCode). Chunks are requested ahead of the
+   * replies once the size is known, so several may be in flight at once. */
+  char *fetch_buf;    /* Code being assembled (NULL when idle) */
+  int fetch_size;     /* Total code size, -1 until the first chunk lands */
+  int fetch_next;     /* Next offset to request */
+  int fetch_received; /* Bytes received contiguously from offset 0 */
+  int fetch_chunk;    /* Chunk length to request */
+  int fetch_inflight; /* GetCode requests outstanding for this script */
+  int fetch_wanted;   /* 1 if a (re)fetch should start once idle */
+  int fetch_stale;    /* 1 if outstanding replies are to be discarded */
 } script_entry_t;
 
 /* Scripts state */
@@ -265,11 +356,23 @@ typedef struct {
   int count;          /* Number of valid scripts */
   time_t last_update; /* Timestamp of last update */
 
-  /* Chunk retrieval state */
-  int retrieving_id;  /* Script ID currently being retrieved (-1 if none) */
-  int current_offset; /* Current offset for chunked retrieval */
-  char *chunk_buffer; /* Temporary buffer for accumulating chunks */
-  size_t chunk_buffer_size; /* Current size of chunk buffer */
+  /* Chunk retrieval window, shared by all scripts */
+  int fetch_window;   /* Max Script.GetCode requests in flight */
+  int fetch_inflight; /* Script.GetCode requests currently in flight */
+
+  /* Reusable Script.PutCode params buffer */
+  char *upload_buf;
+  size_t upload_buf_size;
+
+  /* Code loading policy */
+  int lazy;            /* 1: fetch code on first open, not on connect */
+  int evict_idle_sec;  /* Drop code unused for this long (0 = never) */
+
+  /* Wakes open() calls waiting for code; code_gen changes on every fetch
+   * step so waiters can tell a wakeup from a timeout */
+  pthread_mutex_t code_mutex;
+  pthread_cond_t code_cond;
+  unsigned code_gen;
 } scripts_state_t;
 
 /* Schedule call (RPC method to execute) */
@@ -283,19 +386,81 @@ typedef struct {
   int id;                                    /* Schedule ID */
   bool enable;                               /* Schedule enabled flag */
   char timespec[MAX_SCHEDULE_TIMESPEC];      /* Cron-like time specification */
-  schedule_call_t calls[MAX_SCHEDULE_CALLS]; /* RPC calls to execute */
+  schedule_call_t *calls;                    /* RPC calls to execute */
   int call_count; /* Number of calls in this schedule */
   int valid;      /* 1 if schedule slot is populated */
 } schedule_entry_t;
 
-/* Schedules state */
+/* Schedules state. The list is replaced as a whole on every Schedule.List,
+ * so it lives in one array sized to the jobs reported (at most
+ * MAX_SCHEDULES), kept and reused while later lists fit. */
 typedef struct {
-  schedule_entry_t schedules[MAX_SCHEDULES];
+  schedule_entry_t *schedules; /* `count` entries, NULL until first listed */
+  int capacity;                /* Entries allocated */
   int count;          /* Number of valid schedules */
   int rev;            /* Revision number for change tracking */
   time_t last_update; /* Timestamp of last update */
+
+  /* Rendered crontab, rebuilt on the first read after the list changed.
+   * Readers share the state lock, so the mutex serializes the rebuild. */
+  unsigned long gen;         /* Bumped on every schedule list update */
+  char *crontab;             /* Rendering, NULL until the first read */
+  size_t crontab_len;
+  unsigned long crontab_gen; /* gen the rendering was made for */
+  pthread_mutex_t crontab_mutex;
+
+  /* Schedule.Create/Update/Delete batch: the list is fetched once, after
+   * the last operation of the batch has completed */
+  request_queue_t *ops_queue; /* Queue for the closing Schedule.List */
+  int ops_pending; /* Operations in flight, +1 while a batch is queued */
+  int ops_failed;  /* Failed, timed out or without a rev in the reply */
+  int ops_rev;     /* Highest rev the batch's operations reported */
 } schedules_state_t;
 
+/* Switch status fields (switch_config_t.status), as change bits */
+#define SWITCH_FIELD_ID (1u << 0)
+#define SWITCH_FIELD_SOURCE (1u << 1)
+#define SWITCH_FIELD_OUTPUT (1u << 2)
+#define SWITCH_FIELD_APOWER (1u << 3)
+#define SWITCH_FIELD_VOLTAGE (1u << 4)
+#define SWITCH_FIELD_CURRENT (1u << 5)
+#define SWITCH_FIELD_FREQ (1u << 6)
+#define SWITCH_FIELD_ENERGY (1u << 7)
+#define SWITCH_FIELD_RET_ENERGY (1u << 8)
+#define SWITCH_FIELD_TEMPERATURE (1u << 9)
+
+/* Input status fields (input_config_t.status), as change bits */
+#define INPUT_FIELD_ID (1u << 0)
+#define INPUT_FIELD_STATE (1u << 1)
+
+/* What an applied update touched */
+typedef enum {
+  STATE_CHANGE_SYS_CONFIG,
+  STATE_CHANGE_MQTT_CONFIG,
+  STATE_CHANGE_SWITCH_CONFIG, /* id: switch (also when it appears/goes) */
+  STATE_CHANGE_SWITCH_STATUS, /* id: switch, fields: SWITCH_FIELD_* bits */
+  STATE_CHANGE_INPUT_CONFIG,  /* id: input (also when it appears/goes) */
+  STATE_CHANGE_INPUT_STATUS,  /* id: input, fields: INPUT_FIELD_* bits */
+  STATE_CHANGE_SCRIPT,        /* id: script (list entry or code) */
+  STATE_CHANGE_SCRIPT_STATUS, /* id: script (running, mem_used, mem_peak) */
+  STATE_CHANGE_SCHEDULES
+} state_change_t;
+
+/* Change hook: called on the updating thread after the change is applied
+ * and the state lock released, so it may take the lock itself */
+typedef void (*device_state_change_fn_t)(void *user_data, state_change_t what,
+                                         int id, unsigned int fields);
+
+/* Arena for records that live as long as the device state (component
+ * slots): bump-allocated from chained blocks and freed together by
+ * device_state_destroy(). Allocations are zeroed. */
+typedef struct state_arena_block state_arena_block_t;
+typedef struct {
+  state_arena_block_t *blocks; /* Most recent first */
+  size_t used;                 /* Bytes handed out */
+  size_t reserved;             /* Bytes held in blocks */
+} state_arena_t;
+
 /* Overall device state */
 typedef struct {
   sys_config_t sys_config;
@@ -305,7 +470,31 @@ typedef struct {
   scripts_state_t scripts;
   schedules_state_t schedules;
 
-  pthread_mutex_t mutex; /* Single mutex for entire device state */
+  /* Single rwlock for entire device state. Updaters (WebSocket thread and
+   * FUSE write paths) take it exclusively; FUSE read paths share it so any
+   * number of concurrent readers can copy data out without serializing on
+   * each other or observing a half-applied update. */
+  pthread_rwlock_t lock;
+
+  /* Revisions the device last reported in its sys status (Shelly.GetStatus,
+   * NotifyStatus), -1 until known. Cached state is current while these match
+   * sys_config.parsed.cfg_rev and schedules.rev. */
+  int device_cfg_rev;
+  int device_schedule_rev;
+
+  /* Component slots; written under the state lock */
+  state_arena_t arena;
+
+  /* History ring depth of every slot (device_state_set_history_depth) */
+  unsigned int history_depth;
+
+  /* Optional change hook (device_state_set_change_hook) */
+  device_state_change_fn_t change_fn;
+  void *change_data;
+
+  /* Bumped after every change reported to the hook; see
+   * device_state_generation() */
+  unsigned long generation;
 
   /* Future: add more state components here
    * - status
@@ -324,30 +513,38 @@ int device_state_init(device_state_t *state);
 /* Destroy device state and free resources */
 void device_state_destroy(device_state_t *state);
 
+/* Take/release the state lock in shared (read) mode. Used by FUSE read paths
+ * that dereference component pointers returned by device_state_get_switch(),
+ * device_state_get_input() and device_state_get_script(). Must not be held
+ * across calls that take the lock themselves. */
+void device_state_read_lock(device_state_t *state);
+void device_state_read_unlock(device_state_t *state);
+
+/* Install a hook told about every applied config/status/script/schedule
+ * change (NULL to remove). Set it before the updaters start. */
+void device_state_set_change_hook(device_state_t *state,
+                                  device_state_change_fn_t fn,
+                                  void *user_data);
+
+/* Counter that changes whenever an applied change is reported, for caches of
+ * rendered state. Read it under the state lock together with the data it
+ * guards: a change is applied before its bump, so a value read with the data
+ * is never newer than that data. */
+unsigned long device_state_generation(device_state_t *state);
+
 /* ============================================================================
  * JSON-RPC UTILITIES
  * ============================================================================
  */
 
-/* Build JSON-RPC request */
-char *jsonrpc_build_request(const char *method, int id, const char *params);
-
 /* Send JSON-RPC request over WebSocket */
 int jsonrpc_send_request(struct mg_connection *conn, const char *request);
 
-/* Check if JSON-RPC response contains an error */
-int jsonrpc_is_error(const char *response_json, char *error_buf,
+/* Check if a classified JSON-RPC response carries an error, optionally
+ * copying its message into error_buf. NULL (no response) is not an error. */
+int jsonrpc_is_error(const jsonrpc_frame_t *response, char *error_buf,
                      size_t error_buf_size);
 
-/* Determine response type from JSON-RPC request */
-response_type_t device_state_get_response_type(const char *request_json);
-
-/* Extract script ID from JSON-RPC request params */
-int device_state_extract_script_id(const char *request_json);
-
-/* Extract switch ID from JSON-RPC request params */
-int device_state_extract_switch_id(const char *request_json);
-
 /* ============================================================================
  * SYSTEM CONFIGURATION (Sys.GetConfig / Sys.SetConfig)
  * ============================================================================
@@ -359,7 +556,8 @@ int device_state_request_sys_config(device_state_t *state,
                                     struct mg_connection *conn);
 
 /* Update system configuration with received data */
-int device_state_update_sys_config(device_state_t *state, const char *json);
+int device_state_update_sys_config(device_state_t *state,
+                                   const jsonrpc_frame_t *response);
 
 /* Get system configuration as string (for file operations) */
 int device_state_get_sys_config_str(device_state_t *state, char **output);
@@ -372,14 +570,15 @@ int device_state_serialize_sys_config(device_state_t *state);
 int device_state_set_sys_config(device_state_t *state, request_queue_t *queue,
                                 struct mg_connection *conn);
 
-/* Set system configuration on device from plain user-written JSON */
-int device_state_set_sys_config_from_json(const char *user_json,
+/* Set system configuration on device from plain user-written JSON. Only the
+ * keys that differ from the stored config are sent, and they are merged into
+ * it once the device accepts them. Returns the request ID, 0 if nothing
+ * changed (no request is sent), or -1 on error. */
+int device_state_set_sys_config_from_json(device_state_t *state,
+                                          const char *user_json,
                                           request_queue_t *queue,
                                           struct mg_connection *conn);
 
-/* Check if notification is about system configuration change */
-int device_state_is_sys_config_notification(const char *json, size_t len);
-
 /* ============================================================================
  * MQTT CONFIGURATION (MQTT.GetConfig / MQTT.SetConfig)
  * ============================================================================
@@ -391,7 +590,8 @@ int device_state_request_mqtt_config(device_state_t *state,
                                      struct mg_connection *conn);
 
 /* Update MQTT configuration with received data */
-int device_state_update_mqtt_config(device_state_t *state, const char *json);
+int device_state_update_mqtt_config(device_state_t *state,
+                                    const jsonrpc_frame_t *response);
 
 /* Get MQTT configuration as string (for file operations) */
 int device_state_get_mqtt_config_str(device_state_t *state, char **output);
@@ -404,14 +604,13 @@ int device_state_serialize_mqtt_config(device_state_t *state);
 int device_state_set_mqtt_config(device_state_t *state, request_queue_t *queue,
                                  struct mg_connection *conn);
 
-/* Set MQTT configuration on device from plain user-written JSON */
-int device_state_set_mqtt_config_from_json(const char *user_json,
+/* Set MQTT configuration on device from plain user-written JSON (changed
+ * keys only, see device_state_set_sys_config_from_json()) */
+int device_state_set_mqtt_config_from_json(device_state_t *state,
+                                           const char *user_json,
                                            request_queue_t *queue,
                                            struct mg_connection *conn);
 
-/* Check if notification is about MQTT configuration change */
-int device_state_is_mqtt_config_notification(const char *json, size_t len);
-
 /* ============================================================================
  * SWITCH CONFIGURATION (Switch.GetConfig / Switch.SetConfig)
  * ============================================================================
@@ -424,24 +623,23 @@ int device_state_request_switch_config(device_state_t *state,
                                        int switch_id);
 
 /* Update switch configuration with received data */
-int device_state_update_switch_config(device_state_t *state, const char *json,
+int device_state_update_switch_config(device_state_t *state,
+                                      const jsonrpc_frame_t *response,
                                       int switch_id);
 
 /* Get switch configuration as string (for file operations) */
 int device_state_get_switch_config_str(device_state_t *state, int switch_id,
                                        char **output);
 
-/* Set switch configuration on device from plain user-written JSON */
-int device_state_set_switch_config_from_json(const char *user_json,
+/* Set switch configuration on device from plain user-written JSON (changed
+ * keys only, see device_state_set_sys_config_from_json()) */
+int device_state_set_switch_config_from_json(device_state_t *state,
+                                             const char *user_json,
                                              request_queue_t *queue,
                                              struct mg_connection *conn,
                                              int switch_id);
 
-/* Check if notification is about switch configuration change */
-int device_state_is_switch_config_notification(const char *json, size_t len,
-                                               int switch_id);
-
-/* Helper: Get switch by ID */
+/* Helper: Get switch by ID (NULL if the device never reported it) */
 switch_config_t *device_state_get_switch(device_state_t *state, int switch_id);
 
 /* ============================================================================
@@ -460,16 +658,10 @@ int device_state_request_switch_status(device_state_t *state,
                                        int switch_id);
 
 /* Update switch status with received data */
-int device_state_update_switch_status(device_state_t *state, const char *json,
+int device_state_update_switch_status(device_state_t *state,
+                                      const jsonrpc_frame_t *response,
                                       int switch_id);
 
-/* Check if notification is about switch status change */
-int device_state_is_switch_status_notification(const char *json, size_t len);
-
-/* Update switch status from NotifyStatus notification */
-int device_state_update_switch_status_from_notification(device_state_t *state,
-                                                        const char *json);
-
 /* ============================================================================
  * INPUT CONFIGURATION (Input.GetConfig / Input.SetConfig)
  * ============================================================================
@@ -481,24 +673,23 @@ int device_state_request_input_config(device_state_t *state,
                                       struct mg_connection *conn, int input_id);
 
 /* Update input configuration with received data */
-int device_state_update_input_config(device_state_t *state, const char *json,
+int device_state_update_input_config(device_state_t *state,
+                                     const jsonrpc_frame_t *response,
                                      int input_id);
 
 /* Get input configuration as string (for file operations) */
 int device_state_get_input_config_str(device_state_t *state, int input_id,
                                       char **output);
 
-/* Set input configuration on device from plain user-written JSON */
-int device_state_set_input_config_from_json(const char *user_json,
+/* Set input configuration on device from plain user-written JSON (changed
+ * keys only, see device_state_set_sys_config_from_json()) */
+int device_state_set_input_config_from_json(device_state_t *state,
+                                            const char *user_json,
                                             request_queue_t *queue,
                                             struct mg_connection *conn,
                                             int input_id);
 
-/* Check if notification is about input configuration change */
-int device_state_is_input_config_notification(const char *json, size_t len,
-                                              int input_id);
-
-/* Helper: Get input by ID */
+/* Helper: Get input by ID (NULL if the device never reported it) */
 input_config_t *device_state_get_input(device_state_t *state, int input_id);
 
 /* ============================================================================
@@ -512,18 +703,31 @@ int device_state_request_input_status(device_state_t *state,
                                       struct mg_connection *conn, int input_id);
 
 /* Update input status with received data */
-int device_state_update_input_status(device_state_t *state, const char *json,
+int device_state_update_input_status(device_state_t *state,
+                                     const jsonrpc_frame_t *response,
                                      int input_id);
 
-/* Check if notification is about input status change */
-int device_state_is_input_status_notification(const char *json, size_t len);
+/* ============================================================================
+ * STATUS HISTORY
+ * ============================================================================
+ */
+
+/* Keep the last `depth` status updates of every switch and input (0 = no
+ * history). Each ring is allocated with its component's slot (here for the
+ * slots that exist already); recording an update never allocates. Call
+ * before the updaters start. Returns 0 on success, -1 if the
+ * rings could not be allocated (history stays disabled). */
+int device_state_set_history_depth(device_state_t *state, unsigned int depth);
 
-/* Update input status from NotifyStatus notification */
-int device_state_update_input_status_from_notification(device_state_t *state,
-                                                       const char *json);
+/* Render a switch's history as CSV, oldest first, into a malloc'd string:
+ * "ts,output,apower,voltage,current,energy,temperature". Caller holds the
+ * state lock and frees the string. Returns 0 on success, -1 on error. */
+int device_state_get_switch_history_csv_locked(device_state_t *state,
+                                               int switch_id, char **output);
 
-/* Extract input ID from JSON-RPC request params */
-int device_state_extract_input_id(const char *request_json);
+/* Same for an input: "ts,state" */
+int device_state_get_input_history_csv_locked(device_state_t *state,
+                                              int input_id, char **output);
 
 /* ============================================================================
  * SCRIPT LISTING (Script.List)
@@ -536,7 +740,8 @@ int device_state_request_script_list(device_state_t *state,
                                      struct mg_connection *conn);
 
 /* Update script list with received data */
-int device_state_update_script_list(device_state_t *state, const char *json);
+int device_state_update_script_list(device_state_t *state,
+                                    const jsonrpc_frame_t *response);
 
 /* ============================================================================
  * SCRIPT CODE MANAGEMENT (Script.GetCode / Script.PutCode)
@@ -546,47 +751,146 @@ int device_state_update_script_list(device_state_t *state, const char *json);
 /* Get script by ID (helper) */
 script_entry_t *device_state_get_script(device_state_t *state, int script_id);
 
-/* Request specific script code by ID */
+/* Request specific script code by ID. Marks the script for (re)retrieval and
+ * starts it if the fetch window has room; a retrieval already in progress is
+ * restarted once its outstanding chunks have drained. */
 int device_state_request_script_code(device_state_t *state,
                                      request_queue_t *queue,
                                      struct mg_connection *conn, int script_id);
 
-/* Update specific script code with received chunk */
-int device_state_update_script_code(device_state_t *state, const char *json,
-                                    int script_id);
+/* Queue Script.GetCode chunk requests for all scripts being retrieved, up to
+ * the fetch window. Returns the number of scripts still being retrieved. */
+int device_state_pump_script_code(device_state_t *state,
+                                  request_queue_t *queue);
+
+/* Set the maximum number of Script.GetCode requests in flight (>= 1) */
+void device_state_set_script_fetch_window(device_state_t *state, int window);
+
+/* Apply one Script.GetCode reply. `desc` is the descriptor the chunk request
+ * was queued with. Returns 1 if the script is now complete (call
+ * device_state_finalize_script_code), 0 if more chunks are due, -1 on error. */
+int device_state_update_script_code(device_state_t *state,
+                                    const jsonrpc_frame_t *response,
+                                    const request_desc_t *desc);
 
 /* Finalize script code retrieval (move from chunk buffer to script entry) */
 int device_state_finalize_script_code(device_state_t *state, int script_id);
 
+/* Install script code restored from the state cache, taking ownership of
+ * `code`. With lazy loading only the size is kept, so the first open still
+ * fetches the current code. Returns -1 if the script is unknown or its code
+ * is already loaded. */
+int device_state_restore_script_code(device_state_t *state, int script_id,
+                                     char *code);
+
+/* Choose when code is loaded: on connect (lazy = 0) or on first open
+ * (lazy = 1), and whether code idle for evict_idle_sec seconds is dropped
+ * again (0 = never) */
+void device_state_set_script_loading(device_state_t *state, int lazy,
+                                     int evict_idle_sec);
+
+/* Called on open() of script_N.js: makes sure the code is resident, fetching
+ * it and blocking for up to SCRIPT_LOAD_TIMEOUT_SEC if needed, and pins it
+ * against eviction until device_state_release_script_code(). *fetched is set
+ * if the code had to be loaded. Must not be called with the state lock held.
+ * Returns 0 on success, -1 if the code could not be loaded in time. */
+int device_state_acquire_script_code(device_state_t *state,
+                                     request_queue_t *queue,
+                                     struct mg_connection *conn, int script_id,
+                                     int *fetched);
+
+/* Called on release() of script_N.js */
+void device_state_release_script_code(device_state_t *state, int script_id);
+
+/* Drop code of scripts that nobody has had open for evict_idle_sec seconds.
+ * Returns the number of scripts evicted. */
+int device_state_evict_script_code(device_state_t *state);
+
 /* Get script code as string (for file operations) */
 int device_state_get_script_code_str(device_state_t *state, int script_id,
                                      char **output);
 
-/* Put (upload) script code to device */
+/* Put (upload) script code to device. Starts a windowed upload and returns
+ * without waiting for it; an upload already in progress for the script is
+ * replaced once its outstanding chunks have drained. */
 int device_state_put_script_code(device_state_t *state, request_queue_t *queue,
                                  struct mg_connection *conn, int script_id,
                                  const char *code);
 
+/* Queue Script.PutCode chunks for all uploads in progress, up to each
+ * upload's window. Returns the number of uploads still in progress. */
+int device_state_pump_script_upload(device_state_t *state,
+                                    request_queue_t *queue);
+
+/* Apply one Script.PutCode reply. Returns 1 if the upload is complete, 0 if
+ * it is still in progress, -1 if it failed for good. Either way the script
+ * is marked for a refresh from the device once it settles. */
+int device_state_update_script_upload(device_state_t *state,
+                                      const jsonrpc_frame_t *response,
+                                      const request_desc_t *desc);
+
 /* ============================================================================
- * SCRIPT STATUS NOTIFICATIONS
+ * NOTIFICATIONS (NotifyStatus / NotifyFullStatus / NotifyEvent)
  * ============================================================================
  */
 
-/* Check if notification contains script status updates */
-int device_state_is_script_status_notification(const char *json, size_t len);
-
-/* Update script runtime status from notification */
-int device_state_update_script_status(device_state_t *state, const char *json,
-                                      size_t len);
+/* Follow-up work found while applying a notification */
+typedef struct {
+  int sys_config_changed;
+  int mqtt_config_changed;
+  unsigned int switch_config_changed; /* Bit N set: switch:N config changed */
+  unsigned int input_config_changed;  /* Bit N set: input:N config changed */
+  int status_updates; /* Number of component status objects applied */
+  int deltas_applied; /* config_changed events applied in place */
+  unsigned int switch_status_changed[MAX_SWITCHES]; /* SWITCH_FIELD_* bits */
+  unsigned int input_status_changed[MAX_INPUTS];    /* INPUT_FIELD_* bits */
+  unsigned int script_status_changed; /* Bit N set: script N status applied */
+} notification_result_t;
+
+/* Apply a notification frame in a single walk over its params. Component
+ * status objects (switch:N, input:N, script:N) are applied to device state
+ * directly, as are config_changed events that carry the new values; the
+ * components of other config_changed events are reported in `result` so the
+ * caller can re-fetch just those. Returns 0 if the frame was a notification,
+ * -1 otherwise. */
+int device_state_apply_notification(device_state_t *state,
+                                    const jsonrpc_frame_t *frame,
+                                    notification_result_t *result);
 
 /* ============================================================================
- * NOTIFICATION UTILITIES
+ * COMPONENT DISCOVERY (Shelly.GetConfig / Shelly.GetStatus)
  * ============================================================================
  */
 
-/* Check if notification is about a specific component change */
-int device_state_is_component_notification(const char *json, size_t len,
-                                           const char *component);
+/* Components found in a Shelly.GetConfig response */
+typedef struct {
+  int has_sys;
+  int has_mqtt;
+  unsigned int switches; /* Bit N set: switch:N present */
+  unsigned int inputs;   /* Bit N set: input:N present */
+} discovery_result_t;
+
+/* Request the configuration of every component in one call */
+int device_state_request_device_config(device_state_t *state,
+                                       request_queue_t *queue,
+                                       struct mg_connection *conn);
+
+/* Apply a Shelly.GetConfig response: sys, mqtt, switch:N and input:N are
+ * stored exactly as their per-component GetConfig results would be, and
+ * reported in `result`. Returns 0 on success, -1 on error response. */
+int device_state_update_device_config(device_state_t *state,
+                                      const jsonrpc_frame_t *response,
+                                      discovery_result_t *result);
+
+/* Request the status of every component in one call */
+int device_state_request_device_status(device_state_t *state,
+                                       request_queue_t *queue,
+                                       struct mg_connection *conn);
+
+/* Apply a Shelly.GetStatus response to all known components under one lock.
+ * Returns number of status objects applied, or -1 on error response. */
+int device_state_update_device_status(device_state_t *state,
+                                      const jsonrpc_frame_t *response);
 
 /* ============================================================================
  * SCHEDULE MANAGEMENT (Schedule.List / Schedule.Create / Schedule.Update /
@@ -600,28 +904,51 @@ int device_state_request_schedule_list(device_state_t *state,
                                        struct mg_connection *conn);
 
 /* Update schedule list with received data */
-int device_state_update_schedule_list(device_state_t *state, const char *json);
+int device_state_update_schedule_list(device_state_t *state,
+                                      const jsonrpc_frame_t *response);
 
 /* Get crontab-format string representation of schedules */
 int device_state_get_crontab_str(device_state_t *state, char **output);
 
-/* Parse crontab content and sync changes to device.
+/* Same as device_state_get_crontab_str() for callers already holding the
+ * state lock (shared or exclusive) */
+int device_state_get_crontab_str_locked(device_state_t *state,
+                                        char **output);
+
+/* Borrow the cached crontab rendering, re-rendering it only if the schedule
+ * list changed since. The caller holds the state lock (shared is enough);
+ * the data stays valid until it releases the lock. Returns 0 on success, -1
+ * on error. */
+int device_state_get_crontab_view_locked(device_state_t *state,
+                                         const char **data, size_t *len);
+
+/* Parse crontab content and sync changes to device. Lines are matched to
+ * existing schedules by "# id:N" or, failing that, by content, so only lines
+ * that changed cost a request. The operations form one batch; the schedule
+ * list is refreshed once, when the last of them completes.
  * Returns number of schedule operations queued, or -1 on error. */
 int device_state_sync_crontab(device_state_t *state, request_queue_t *queue,
                               struct mg_connection *conn, const char *content,
                               size_t content_len);
 
-/* Create a new schedule on device */
+/* Create, update or delete a schedule on the device. Each call is tracked
+ * like a batch of one: the schedule list is refreshed after it completes,
+ * unless it is part of a larger batch. */
+
+/* Create a new schedule on device, running `calls` (at least one) */
 int device_state_create_schedule(device_state_t *state, request_queue_t *queue,
                                  struct mg_connection *conn, bool enable,
-                                 const char *timespec, const char *method,
-                                 const char *params);
+                                 const char *timespec,
+                                 const schedule_call_t *calls,
+                                 int call_count);
 
-/* Update an existing schedule on device */
+/* Update an existing schedule on device. A NULL timespec or calls keeps the
+ * schedule's own. */
 int device_state_update_schedule(device_state_t *state, request_queue_t *queue,
                                  struct mg_connection *conn, int schedule_id,
                                  bool enable, const char *timespec,
-                                 const char *method, const char *params);
+                                 const schedule_call_t *calls,
+                                 int call_count);
 
 /* Delete a schedule from device */
 int device_state_delete_schedule(device_state_t *state, request_queue_t *queue,
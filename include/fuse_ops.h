@@ -3,30 +3,59 @@
 
 #include <fuse.h>
 #include "device_state.h"
+#include "metrics.h"
 #include "request_queue.h"
 
-/* FUSE context data */
+/* FUSE context data: one per mounted device */
 typedef struct {
+  const char *name; /* Directory under the mountpoint, NULL if at its root */
   device_state_t *dev_state;
   request_queue_t *req_queue;
   struct mg_connection *conn;
-  pthread_mutex_t *fuse_mutex;
+  metrics_cache_t *metrics; /* Render cache behind /metrics, NULL to hide it */
 } fuse_context_data_t;
 
-/* Initialize FUSE operations with device state */
-int fuse_ops_init(device_state_t *dev_state, request_queue_t *req_queue,
-                  struct mg_connection *conn);
-
-/* Update connection pointer in FUSE context */
-void fuse_ops_update_conn(struct mg_connection *conn);
+/* Add a device to the mount. With a NULL name it is mounted at the root,
+ * which only works for a single device; named devices each get a /<name>
+ * directory. `metrics` serves its /metrics file (NULL: no /metrics). Must be
+ * called before fuse_start(). Returns the device's context, NULL on error. */
+fuse_context_data_t *fuse_ops_add_device(const char *name,
+                                         device_state_t *dev_state,
+                                         request_queue_t *req_queue,
+                                         metrics_cache_t *metrics);
+
+/* Add the group directory /@<name>, whose files apply each write to all of
+ * `members` (named devices added before) and report how it went on each.
+ * Must be called before fuse_start(). Returns 0 on success, -1 on error. */
+int fuse_ops_add_group(const char *name, fuse_context_data_t *const *members,
+                       int member_count);
+
+/* Update connection pointer in a device's FUSE context */
+void fuse_ops_update_conn(fuse_context_data_t *dev,
+                          struct mg_connection *conn);
+
+/* While a device is disconnected its last known state is served read-only:
+ * writes fail with EROFS. With `keep`, they are accepted instead, and the
+ * last write to each file is sent by fuse_ops_send_offline_writes(). */
+void fuse_ops_set_offline_writes(int keep);
+
+/* Send the writes kept while `dev` was disconnected. Call from the event
+ * loop once it is connected again (fuse_ops_update_conn()). */
+void fuse_ops_send_offline_writes(fuse_context_data_t *dev);
+
+/* Select multi-threaded (default) or single-threaded FUSE loop.
+ * Must be called before fuse_start(). */
+void fuse_ops_set_multithreaded(int enable);
+
+/* Let the kernel cache attributes and file pages, invalidating them as the
+ * device state changes (FUSE 3 only). Must be called before fuse_start(). */
+void fuse_ops_set_kernel_cache(int enable);
 
 /* Get FUSE operations structure */
 struct fuse_operations *fuse_ops_get(void);
 
-/* Start FUSE in a separate thread */
-int fuse_start(const char *mountpoint, device_state_t *dev_state,
-               request_queue_t *req_queue, struct mg_connection **conn_ptr,
-               pthread_t *fuse_thread);
+/* Start FUSE in a separate thread, serving every added device */
+int fuse_start(const char *mountpoint, pthread_t *fuse_thread);
 
 /* Stop FUSE and unmount */
 void fuse_stop(const char *mountpoint);
@@ -0,0 +1,69 @@
+#ifndef LOG_H
+#define LOG_H
+
+/* Leveled, per-category logging. Records are formatted by the thread that
+ * logs them into a lock-free ring buffer, and a background thread writes
+ * them out: the event loop and the FUSE workers never wait on stdout or
+ * stderr. A record below its category's level is skipped before its
+ * arguments are evaluated. Until log_start() (and after log_stop()) records
+ * are written directly. Errors and warnings go to stderr, the rest to
+ * stdout. */
+
+typedef enum {
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_DEBUG,
+  LOG_LEVEL_COUNT /* Number of levels, keep last */
+} log_level_t;
+
+typedef enum {
+  LOG_CAT_MAIN,   /* Startup, options, shutdown */
+  LOG_CAT_CONN,   /* WebSocket connections and reconnection */
+  LOG_CAT_RPC,    /* Requests and responses */
+  LOG_CAT_STATE,  /* Config and status updates */
+  LOG_CAT_SCRIPT, /* Script code transfers */
+  LOG_CAT_FUSE,   /* Filesystem operations */
+  LOG_CAT_CACHE,  /* State snapshots (-c) */
+  LOG_CAT_WS,     /* Mongoose's own log */
+  LOG_CAT_COUNT   /* Number of categories, keep last */
+} log_category_t;
+
+/* Longest record kept, newline included */
+#define LOG_RECORD_MAX 512
+
+/* Most verbose level logged per category (log_configure()); read by the
+ * macros below */
+extern log_level_t g_log_level[LOG_CAT_COUNT];
+
+#define LOG_AT(level, cat, ...)           \
+  do {                                    \
+    if ((level) <= g_log_level[cat]) {    \
+      log_write(level, cat, __VA_ARGS__); \
+    }                                     \
+  } while (0)
+
+#define log_error(cat, ...) LOG_AT(LOG_LEVEL_ERROR, cat, __VA_ARGS__)
+#define log_warn(cat, ...) LOG_AT(LOG_LEVEL_WARN, cat, __VA_ARGS__)
+#define log_info(cat, ...) LOG_AT(LOG_LEVEL_INFO, cat, __VA_ARGS__)
+#define log_debug(cat, ...) LOG_AT(LOG_LEVEL_DEBUG, cat, __VA_ARGS__)
+
+/* Set levels from a comma-separated list of "LEVEL" (every category) and
+ * "CATEGORY=LEVEL" items, applied in order, e.g. "warn,script=debug".
+ * Levels: error, warn, info (the default), debug. Returns 0 on success, -1
+ * on an unknown name. Call before log_start(). */
+int log_configure(const char *spec);
+
+/* Start the writer thread and route Mongoose's log through it. Returns 0 on
+ * success, -1 if records keep being written directly. */
+int log_start(void);
+
+/* Write out what is buffered and stop the writer thread */
+void log_stop(void);
+
+/* Log a record (use the macros). The format is printf's; records carry
+ * their own newline and are cut at LOG_RECORD_MAX bytes. */
+void log_write(log_level_t level, log_category_t cat, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#endif /* LOG_H */
@@ -0,0 +1,35 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "device_state.h"
+
+/* Switch, input and script status in OpenMetrics text format, as served by
+ * /metrics and the optional HTTP listener (-m). The exposition is rendered
+ * into a cached buffer and re-rendered only when the device state generation
+ * has moved, so repeated scrapes of an idle device only copy the buffer. */
+
+#define METRICS_CONTENT_TYPE \
+  "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+typedef struct {
+  pthread_mutex_t lock; /* Serializes renders and copies of the buffer */
+  char *buf;            /* Last exposition (NULL before the first render) */
+  size_t len;
+  unsigned long generation; /* device_state_generation() of buf */
+} metrics_cache_t;
+
+/* Initialize an empty cache. Returns 0 on success, -1 on error. */
+int metrics_cache_init(metrics_cache_t *cache);
+
+/* Free the cached exposition */
+void metrics_cache_destroy(metrics_cache_t *cache);
+
+/* Copy the current exposition into a new buffer (free() it), rendering it
+ * first if the state changed since the last call. The caller holds the state
+ * lock; read mode is enough. Returns 0 on success, -1 on error. */
+int metrics_get_locked(metrics_cache_t *cache, device_state_t *state,
+                       char **out, size_t *len);
+
+#endif /* METRICS_H */
@@ -2,32 +2,144 @@
 #define REQUEST_QUEUE_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include <time.h>
 
-#define MAX_PENDING_REQUESTS 64
+/* The queue starts with room for REQUEST_QUEUE_INITIAL_CAPACITY live
+ * requests and doubles on demand up to REQUEST_QUEUE_MAX_CAPACITY (both must
+ * be powers of two). */
+#define REQUEST_QUEUE_INITIAL_CAPACITY 64
+#define REQUEST_QUEUE_MAX_CAPACITY 8192
 #define REQUEST_TIMEOUT_SEC 30
 
+/* Default number of requests of each lane awaiting a response at once (0 =
+ * no limit). Keeping bulk traffic from piling up on the device is what keeps
+ * an interactive request from waiting behind it there. */
+#define REQUEST_LANE_INTERACTIVE_INFLIGHT 0
+#define REQUEST_LANE_CONFIG_INFLIGHT 8
+#define REQUEST_LANE_BULK_INFLIGHT 4
+
+/* Send priority classes. Queued requests go out interactive first, then
+ * config, then bulk; FIFO within a lane. */
+typedef enum {
+  REQUEST_LANE_CONFIG = 0,   /* Config and status reads/writes (default) */
+  REQUEST_LANE_INTERACTIVE,  /* User control, e.g. Switch.Set */
+  REQUEST_LANE_BULK,         /* Script transfers, schedule sync */
+  REQUEST_LANE_COUNT
+} request_lane_t;
+
 typedef enum {
   REQ_STATE_QUEUED,  /* Request queued, not yet sent */
+  REQ_STATE_SENDING, /* Claimed by the sender, being written out */
   REQ_STATE_PENDING, /* Request sent, awaiting response */
   REQ_STATE_COMPLETED,
   REQ_STATE_TIMEOUT,
   REQ_STATE_ERROR
 } request_state_t;
 
+/* Kind of an incoming JSON-RPC frame */
+typedef enum {
+  JSONRPC_FRAME_INVALID = 0,  /* Not a JSON object */
+  JSONRPC_FRAME_RESPONSE,     /* Has "result" or "error" */
+  JSONRPC_FRAME_NOTIFICATION, /* Has "method" and no result/error */
+  JSONRPC_FRAME_OTHER         /* Neither, e.g. an incoming request */
+} jsonrpc_frame_kind_t;
+
+/* Incoming frame, classified in a single pass over its top-level members.
+ * Spans point into the caller's buffer and have length 0 when absent. */
+typedef struct {
+  jsonrpc_frame_kind_t kind;
+  int id;       /* Numeric "id", -1 if absent */
+  int is_error; /* Response carries "error" instead of "result" */
+  const char *method; /* Contents of "method", without quotes */
+  size_t method_len;
+  const char *result; /* Value of "result" (or "error") */
+  size_t result_len;
+  const char *params; /* Value of "params" */
+  size_t params_len;
+} jsonrpc_frame_t;
+
+typedef struct request_desc request_desc_t;
+
+/* Completion callback: runs on the thread that delivers the response, after
+ * the response has been applied. `desc` is the descriptor the request was
+ * queued with (user data in desc->done_data); `response` is the classified
+ * response frame, valid for the call only, or NULL if the request timed out,
+ * or was superseded before it was sent (see desc->coalesce). Called without
+ * the queue mutex held, so it may queue follow-up requests. */
+typedef void (*request_done_fn_t)(int req_id, const request_desc_t *desc,
+                                  const jsonrpc_frame_t *response);
+
+/* What a request asks for, recorded when it is queued so responses can be
+ * dispatched without re-parsing the outgoing JSON */
+struct request_desc {
+  int method;       /* Caller-defined method tag (see response_type_t) */
+  int component_id; /* Switch/input/script/schedule ID, -1 if none */
+  int flags;        /* Method-specific flag bits */
+  int offset;       /* Byte offset of a chunked transfer (GetCode/PutCode) */
+  int length;       /* Bytes requested by a chunked transfer */
+  request_done_fn_t done_fn; /* Optional completion callback */
+  void *done_data;
+  /* Last writer wins: queuing replaces a request with the same method and
+   * component that is still waiting to be sent and also has this set */
+  int coalesce;
+  int lane; /* request_lane_t */
+};
+
 typedef struct {
-  int id;
+  int id; /* -1 when the slot is free */
   request_state_t state;
   char *request_data;
-  char *response_data;
+  request_desc_t desc;
   time_t timestamp;
-  pthread_cond_t cond;
+  uint64_t not_before; /* mg_millis() before which it is held back */
+  uint64_t sent_ns;    /* stats_now() when sent, for the round trip time */
 } request_entry_t;
 
+/* FIFO of the IDs of one lane's QUEUED requests, oldest first (ring
+ * buffer) */
+typedef struct {
+  int *send_fifo;
+  int fifo_capacity;
+  int fifo_head;
+  int fifo_len;
+  int in_flight;     /* Sent and awaiting a response */
+  int max_in_flight; /* 0 = no limit */
+} request_lane_queue_t;
+
+/* Called whenever a new request is queued, so the sender can wake up */
+typedef void (*request_notify_fn_t)(void *user_data);
+
+/* Called whenever a request is retired, after its done_fn: `response` is the
+ * response frame, or NULL if the request timed out or was superseded by the
+ * coalescing request `superseded_by` (0 otherwise) */
+typedef void (*request_retire_fn_t)(void *user_data, int req_id,
+                                    int superseded_by,
+                                    const jsonrpc_frame_t *response);
+
+/* Called whenever a request is queued, with its ID. Runs on the queuing
+ * thread with the queue mutex held, before the request can be sent. */
+typedef void (*request_added_fn_t)(void *user_data, int req_id);
+
 typedef struct {
-  request_entry_t entries[MAX_PENDING_REQUESTS];
+  /* Live requests, indexed by id & (capacity - 1). IDs are handed out
+   * sequentially, so two live requests only collide once more than
+   * `capacity` of them are outstanding, at which point the ring grows. */
+  request_entry_t *entries;
+  int capacity;
+  int count; /* Number of live entries */
+
+  request_lane_queue_t lanes[REQUEST_LANE_COUNT];
+
   pthread_mutex_t mutex;
   int next_id;
+  int debounce_ms; /* How long coalescing requests wait for a newer one */
+  request_notify_fn_t notify_fn; /* Wakeup hook for the sending thread */
+  void *notify_data;
+  request_retire_fn_t retire_fn; /* Observer of every retired request */
+  void *retire_data;
+  request_added_fn_t added_fn; /* Observer of every queued request */
+  void *added_data;
 } request_queue_t;
 
 typedef void (*unsolicited_msg_handler_t)(const char *msg, size_t len,
@@ -39,39 +151,101 @@ int request_queue_init(request_queue_t *queue);
 /* Destroy the request queue and free resources */
 void request_queue_destroy(request_queue_t *queue);
 
-/* Get the next request ID without consuming it */
-int request_queue_peek_next_id(request_queue_t *queue);
-
-/* Add a new request to the queue, returns request ID or -1 on error */
-int request_queue_add(request_queue_t *queue, const char *request_data);
-
-/* Handle incoming response by matching it to a pending request */
+/* Install (or clear, with fn == NULL) the hook invoked after every
+ * request_queue_add(). The hook runs with the queue mutex held, so it must be
+ * cheap and must not call back into the queue. */
+void request_queue_set_notify(request_queue_t *queue, request_notify_fn_t fn,
+                              void *user_data);
+
+/* Install (or clear, with fn == NULL) the hook invoked for every retired
+ * request. It runs without the queue mutex held, on the thread that retired
+ * the request; install it before requests are queued. */
+void request_queue_set_retire_hook(request_queue_t *queue,
+                                   request_retire_fn_t fn, void *user_data);
+
+/* Install (or clear, with fn == NULL) the hook invoked for every queued
+ * request. Like the notify hook it runs with the queue mutex held, so it
+ * must be cheap, must not call back into the queue, and must not wait for a
+ * lock that is held around request_queue_add(). */
+void request_queue_set_add_hook(request_queue_t *queue, request_added_fn_t fn,
+                                void *user_data);
+
+/* Hold coalescing requests back for `ms` milliseconds after the first one of
+ * a burst is queued, so the rest of the burst replaces it instead of being
+ * sent too (0, the default, sends them as soon as possible) */
+void request_queue_set_debounce(request_queue_t *queue, int ms);
+
+/* Limit how many requests of `lane` may await a response at once (0 = no
+ * limit). Further requests of the lane stay queued until one is answered or
+ * times out. */
+void request_queue_set_lane_limit(request_queue_t *queue, request_lane_t lane,
+                                  int max_in_flight);
+
+/* Queue a JSON-RPC request for `method`, with `params` (a JSON value, or
+ * NULL for none), returns its request ID or -1 on error. The ID is assigned
+ * and written into the frame under the queue mutex, so concurrent callers
+ * never send the same ID. `desc` is copied; pass NULL for untyped requests
+ * (method 0, no component, no callback). */
+int request_queue_add(request_queue_t *queue, const char *method,
+                      const char *params, const request_desc_t *desc);
+
+/* Handle incoming response by matching it to a pending request. The entry is
+ * retired (after running its completion callback, if any), so any pointer
+ * obtained from request_queue_get_request_data() for this ID is invalid
+ * afterwards. */
 int request_queue_handle_response(request_queue_t *queue, int req_id,
-                                  const char *response_data);
+                                  const jsonrpc_frame_t *response);
 
 /* Handle unsolicited message (no matching request ID) */
 void request_queue_handle_unsolicited(const char *msg, size_t len,
                                       unsolicited_msg_handler_t handler,
                                       void *user_data);
 
-/* Clean up timed-out requests */
+/* Clean up (retire) timed-out requests, running their completion callbacks
+ * with a NULL response */
 void request_queue_cleanup_timeouts(request_queue_t *queue);
 
-/* Get original request data by request ID (returns NULL if not found) */
+/* Retire every sent request, as for a timeout: the connection they were
+ * sent on is gone. Requests not sent yet stay queued for the next one. */
+void request_queue_fail_pending(request_queue_t *queue);
+
+/* Get original request data by request ID (returns NULL if not found).
+ * The pointer stays valid until the request is answered or times out. */
 const char *request_queue_get_request_data(request_queue_t *queue, int req_id);
 
-/* Get next queued request that needs to be sent (returns request data and ID
- * via out params) */
+/* Copy the descriptor of a live request. Returns 0 on success, -1 if the ID
+ * is unknown. */
+int request_queue_get_desc(request_queue_t *queue, int req_id,
+                           request_desc_t *desc);
+
+/* Claim the next queued request that needs to be sent (returns request data
+ * and ID via out params): the oldest of the highest-priority lane that has
+ * one due and is below its in-flight limit. It moves to SENDING, where
+ * coalescing no longer replaces it, so `request_data` stays valid until the
+ * request is answered or times out. */
 int request_queue_get_next_to_send(request_queue_t *queue, char **request_data,
                                    int *req_id);
 
-/* Mark a request as sent (transitions from QUEUED to PENDING) */
+/* Mark a claimed request as sent (transitions from SENDING to PENDING). A
+ * request never marked is retired like a lost one. */
 int request_queue_mark_sent(request_queue_t *queue, int req_id);
 
-/* Parse JSON-RPC message and extract ID */
-int jsonrpc_parse_id(const char *json, size_t len);
+/* Milliseconds until the first request held back by the debounce window may
+ * be sent, or -1 if none is held */
+int request_queue_next_due_ms(request_queue_t *queue);
+
+/* Requests of each lane waiting to be sent (`queued`) and awaiting a
+ * response (`in_flight`), for the statistics */
+void request_queue_get_depth(request_queue_t *queue,
+                             int queued[REQUEST_LANE_COUNT],
+                             int in_flight[REQUEST_LANE_COUNT]);
+
+/* Classify a JSON-RPC frame. Returns 0 on success, -1 if it is not a JSON
+ * object. */
+int jsonrpc_classify_frame(const char *json, size_t len,
+                           jsonrpc_frame_t *frame);
 
-/* Check if JSON-RPC message is a request or response */
-int jsonrpc_is_response(const char *json, size_t len);
+/* Check if a classified frame's method equals `method` */
+int jsonrpc_frame_method_is(const jsonrpc_frame_t *frame, const char *method);
 
 #endif /* REQUEST_QUEUE_H */
@@ -0,0 +1,32 @@
+#ifndef STATE_CACHE_H
+#define STATE_CACHE_H
+
+#include <stddef.h>
+#include "device_state.h"
+
+/* On-disk snapshot of device state, so a restart can serve the mount before
+ * the device has been asked for anything. The snapshot holds the raw config
+ * JSON of every component (in Shelly.GetConfig shape), the script list and
+ * code, and the schedule list; live status is not cached. It is trusted only
+ * until the device reports its revisions: config is current while the
+ * device's cfg_rev matches the one recorded in the cached sys config, and
+ * schedules while schedule_rev matches the cached Schedule.List rev. */
+
+#define STATE_CACHE_VERSION 1
+
+/* Build the cache file path for a device URL inside `dir`, e.g.
+ * "<dir>/192.168.1.5_80_rpc.json". Returns 0 on success, -1 if it does not
+ * fit. */
+int state_cache_path(const char *dir, const char *url, char *buf,
+                     size_t size);
+
+/* Restore state from the cache file. Returns 0 if a snapshot was loaded, -1
+ * if there is none or it is unusable (state is left as it was). */
+int state_cache_load(device_state_t *state, const char *path);
+
+/* Write the current state to the cache file, replacing it atomically.
+ * Nothing is written until the sys config has been loaded. Returns 0 on
+ * success, -1 on error. */
+int state_cache_save(device_state_t *state, const char *path);
+
+#endif /* STATE_CACHE_H */
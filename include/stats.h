@@ -0,0 +1,75 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "request_queue.h"
+
+/* Runtime statistics, served as /.shusefs/stats (text) and
+ * /.shusefs/stats.json. Always on: every thread that counts gets a shard of
+ * counters of its own on first use, which only it writes, so counting takes
+ * no lock and shares no cache line with other threads. Readers add the
+ * shards up; a count may lag by the updates in progress, never more. */
+
+/* Plain event counters */
+typedef enum {
+  STATS_REQUESTS_QUEUED,
+  STATS_REQUESTS_SENT,
+  STATS_REQUESTS_ANSWERED,
+  STATS_REQUESTS_SUPERSEDED, /* Replaced by a coalescing request */
+  STATS_REQUESTS_TIMED_OUT,  /* By request_queue_cleanup_timeouts() */
+  STATS_REQUESTS_LOST,       /* Sent on a connection that closed */
+  STATS_FRAMES_RECEIVED,
+  STATS_BYTES_SENT, /* WebSocket payload bytes */
+  STATS_BYTES_RECEIVED,
+  STATS_CONNECTS,
+  STATS_DISCONNECTS,
+  STATS_RECONNECT_ATTEMPTS,
+  STATS_LOG_DROPPED, /* Log records lost to a full buffer */
+  STATS_COUNTER_COUNT /* Number of counters, keep last */
+} stats_counter_t;
+
+/* FUSE operations, each counted and timed */
+typedef enum {
+  STATS_FUSE_GETATTR,
+  STATS_FUSE_READDIR,
+  STATS_FUSE_OPEN,
+  STATS_FUSE_READ,
+  STATS_FUSE_WRITE,
+  STATS_FUSE_TRUNCATE,
+  STATS_FUSE_FLUSH,
+  STATS_FUSE_RELEASE,
+  STATS_FUSE_POLL,
+  STATS_FUSE_OP_COUNT /* Number of operations, keep last */
+} stats_fuse_op_t;
+
+/* A device whose request queue depth is reported */
+typedef struct {
+  const char *name; /* NULL for the device at the mount root */
+  request_queue_t *queue;
+} stats_source_t;
+
+/* Record the start of the process, for the uptime line */
+void stats_init(void);
+
+/* Monotonic clock in nanoseconds, the time base of every duration below */
+uint64_t stats_now(void);
+
+void stats_add(stats_counter_t counter, uint64_t n);
+
+/* Count FUSE operation `op`, which started at `start` (stats_now()) */
+void stats_fuse_op(stats_fuse_op_t op, uint64_t start);
+
+/* Round trip of a request with method tag `method` (response_type_t), from
+ * sending it to its response */
+void stats_rpc(int method, uint64_t rtt_ns);
+
+/* A notification frame, which took `parse_ns` to apply */
+void stats_notification(uint64_t parse_ns);
+
+/* Render the statistics, with the queue depths of `sources`, as text or
+ * JSON into a new buffer (free() it). Returns 0 on success, -1 on error. */
+int stats_render(int json, const stats_source_t *sources, int source_count,
+                 char **out, size_t *len);
+
+#endif /* STATS_H */
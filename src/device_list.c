@@ -0,0 +1,307 @@
+#include "../include/device_list.h"
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ============================================================================
+ * PARSING
+ * ============================================================================
+ */
+
+/* Device names become directory names: letters, digits, '.', '_' and '-',
+ * not starting with '.' (which stays free for the mount's own entries) */
+static int valid_device_name(const char *name) {
+  if (!name[0] || name[0] == '.') {
+    return 0;
+  }
+  for (const char *p = name; *p; p++) {
+    int ok = (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+             (*p >= '0' && *p <= '9') || *p == '.' || *p == '_' || *p == '-';
+    if (!ok) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Next whitespace-separated word of `*line`, NUL-terminated in place; NULL
+ * at the end of the line */
+static char *next_word(char **line) {
+  char *p = *line;
+  while (*p == ' ' || *p == '\t') {
+    p++;
+  }
+  if (!*p) {
+    *line = p;
+    return NULL;
+  }
+
+  char *word = p;
+  while (*p && *p != ' ' && *p != '\t') {
+    p++;
+  }
+  if (*p) {
+    *p++ = '\0';
+  }
+  *line = p;
+  return word;
+}
+
+/* Strip the comment and line end of a line read from the file */
+static void strip_line(char *line) {
+  char *comment = strchr(line, '#');
+  if (comment) {
+    *comment = '\0';
+  }
+  line[strcspn(line, "\r\n")] = '\0';
+}
+
+static int check_name(const char *name, const char *what, const char *path,
+                      int line_no) {
+  if (!valid_device_name(name) || strlen(name) >= DEVICE_NAME_MAX) {
+    fprintf(stderr, "%s:%d: Invalid %s name \"%s\"\n", path, line_no, what,
+            name);
+    return -1;
+  }
+  return 0;
+}
+
+/* Parse a device line into `entry`. Returns 1 for a device, 0 for a blank,
+ * comment or group line, -1 on error (reported). */
+static int parse_line(char *line, const char *path, int line_no,
+                      device_entry_t *entry) {
+  strip_line(line);
+
+  char *name = next_word(&line);
+  if (!name || name[0] == '@') {
+    return 0;
+  }
+  char *url = next_word(&line);
+  if (!url) {
+    fprintf(stderr, "%s:%d: Expected \"<name> <url> [tag...]\"\n", path,
+            line_no);
+    return -1;
+  }
+
+  if (check_name(name, "device", path, line_no) != 0) {
+    return -1;
+  }
+  if ((strncmp(url, "ws://", 5) != 0 && strncmp(url, "wss://", 6) != 0) ||
+      strlen(url) >= DEVICE_URL_MAX) {
+    fprintf(stderr, "%s:%d: URL must start with ws:// or wss://\n", path,
+            line_no);
+    return -1;
+  }
+
+  memset(entry, 0, sizeof(*entry));
+  snprintf(entry->name, sizeof(entry->name), "%s", name);
+  snprintf(entry->url, sizeof(entry->url), "%s", url);
+
+  for (char *tag; (tag = next_word(&line)) != NULL;) {
+    if (check_name(tag, "tag", path, line_no) != 0) {
+      return -1;
+    }
+    if (entry->tag_count == DEVICE_TAGS_MAX) {
+      fprintf(stderr, "%s:%d: More than %d tags\n", path, line_no,
+              DEVICE_TAGS_MAX);
+      return -1;
+    }
+    snprintf(entry->tags[entry->tag_count++], DEVICE_NAME_MAX, "%s", tag);
+  }
+  return 1;
+}
+
+/* ============================================================================
+ * GROUPS
+ * ============================================================================
+ */
+
+/* The group called `name`, created empty if there is none yet. Returns NULL
+ * if out of memory. */
+static device_group_t *group_get(device_list_t *list, const char *name) {
+  for (int i = 0; i < list->group_count; i++) {
+    if (strcmp(list->groups[i].name, name) == 0) {
+      return &list->groups[i];
+    }
+  }
+
+  device_group_t *groups =
+      realloc(list->groups, (list->group_count + 1) * sizeof(*groups));
+  if (!groups) {
+    return NULL;
+  }
+  list->groups = groups;
+
+  device_group_t *group = &groups[list->group_count];
+  memset(group, 0, sizeof(*group));
+  snprintf(group->name, sizeof(group->name), "%s", name);
+  /* A group never has more members than there are devices */
+  group->members = malloc(list->count * sizeof(int));
+  if (!group->members) {
+    return NULL;
+  }
+  list->group_count++;
+  return group;
+}
+
+/* Add a device to a group unless it is a member already */
+static void group_add(device_group_t *group, int device) {
+  for (int i = 0; i < group->member_count; i++) {
+    if (group->members[i] == device) {
+      return;
+    }
+  }
+  group->members[group->member_count++] = device;
+}
+
+/* Build the groups: from the device tags, then from the "@<group> <glob...>"
+ * lines, read in a second pass now that every device is known */
+static int build_groups(device_list_t *list, FILE *in, const char *path) {
+  for (int i = 0; i < list->count; i++) {
+    for (int t = 0; t < list->devices[i].tag_count; t++) {
+      device_group_t *group = group_get(list, list->devices[i].tags[t]);
+      if (!group) {
+        fprintf(stderr, "Error: Out of memory reading %s\n", path);
+        return -1;
+      }
+      group_add(group, i);
+    }
+  }
+
+  rewind(in);
+  char buf[512];
+  int line_no = 0;
+  while (fgets(buf, sizeof(buf), in)) {
+    line_no++;
+    strip_line(buf);
+
+    char *line = buf;
+    char *name = next_word(&line);
+    if (!name || name[0] != '@') {
+      continue;
+    }
+    name++;
+    if (check_name(name, "group", path, line_no) != 0) {
+      return -1;
+    }
+
+    device_group_t *group = group_get(list, name);
+    if (!group) {
+      fprintf(stderr, "Error: Out of memory reading %s\n", path);
+      return -1;
+    }
+
+    int patterns = 0;
+    for (char *glob; (glob = next_word(&line)) != NULL; patterns++) {
+      for (int i = 0; i < list->count; i++) {
+        if (fnmatch(glob, list->devices[i].name, 0) == 0) {
+          group_add(group, i);
+        }
+      }
+    }
+    if (patterns == 0) {
+      fprintf(stderr, "%s:%d: Expected \"@<group> <glob...>\"\n", path,
+              line_no);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* ============================================================================
+ * LOADING
+ * ============================================================================
+ */
+
+int device_list_load(device_list_t *list, const char *path) {
+  if (!list || !path) {
+    return -1;
+  }
+
+  memset(list, 0, sizeof(*list));
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    fprintf(stderr, "Error: Cannot open device list %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+
+  char line[512];
+  int line_no = 0;
+  int capacity = 0;
+  int ret = 0;
+
+  while (ret == 0 && fgets(line, sizeof(line), in)) {
+    line_no++;
+
+    device_entry_t entry;
+    int parsed = parse_line(line, path, line_no, &entry);
+    if (parsed < 0) {
+      ret = -1;
+      break;
+    }
+    if (parsed == 0) {
+      continue;
+    }
+
+    for (int i = 0; i < list->count; i++) {
+      if (strcmp(list->devices[i].name, entry.name) == 0) {
+        fprintf(stderr, "%s:%d: Duplicate device name \"%s\"\n", path,
+                line_no, entry.name);
+        ret = -1;
+        break;
+      }
+    }
+    if (ret != 0) {
+      break;
+    }
+
+    if (list->count == capacity) {
+      int new_capacity = capacity ? capacity * 2 : 8;
+      device_entry_t *devices =
+          realloc(list->devices, new_capacity * sizeof(*devices));
+      if (!devices) {
+        fprintf(stderr, "Error: Out of memory reading %s\n", path);
+        ret = -1;
+        break;
+      }
+      list->devices = devices;
+      capacity = new_capacity;
+    }
+    list->devices[list->count++] = entry;
+  }
+
+  if (ret == 0 && list->count == 0) {
+    fprintf(stderr, "Error: No devices in %s\n", path);
+    ret = -1;
+  }
+  if (ret == 0) {
+    ret = build_groups(list, in, path);
+  }
+  fclose(in);
+
+  if (ret != 0) {
+    device_list_free(list);
+  }
+  return ret;
+}
+
+void device_list_free(device_list_t *list) {
+  if (!list) {
+    return;
+  }
+
+  for (int i = 0; i < list->group_count; i++) {
+    free(list->groups[i].members);
+  }
+  free(list->groups);
+  list->groups = NULL;
+  list->group_count = 0;
+
+  free(list->devices);
+  list->devices = NULL;
+  list->count = 0;
+}
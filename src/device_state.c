@@ -1,9 +1,74 @@
+/* pthread_rwlockattr_setkind_np() */
+#define _GNU_SOURCE
 #include "../include/device_state.h"
+#include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include "../include/log.h"
 #include "../include/mongoose.h"
+#include "../include/stats.h"
+
+static void schedules_clear(device_state_t *state);
+
+/* ============================================================================
+ * ARENA
+ * ============================================================================
+ */
+
+/* Sized for a few component slots. Larger requests get a block of their own,
+ * chained behind the current one so its free space stays in use. */
+#define STATE_ARENA_BLOCK 2048
+
+struct state_arena_block {
+  state_arena_block_t *next;
+  size_t size; /* Bytes in data */
+  size_t used; /* Bytes handed out from data */
+  max_align_t data[];
+};
+
+/* Zeroed memory for a record that lives until arena_free(); NULL if out of
+ * memory */
+static void *arena_alloc(state_arena_t *arena, size_t size) {
+  const size_t align = _Alignof(max_align_t);
+  size = (size + align - 1) & ~(align - 1);
+
+  state_arena_block_t *block = arena->blocks;
+  if (!block || block->size - block->used < size) {
+    size_t data_size = size > STATE_ARENA_BLOCK ? size : STATE_ARENA_BLOCK;
+    state_arena_block_t *fresh = calloc(1, sizeof(*fresh) + data_size);
+    if (!fresh) {
+      return NULL;
+    }
+    fresh->size = data_size;
+    if (block && data_size > STATE_ARENA_BLOCK) {
+      fresh->next = block->next;
+      block->next = fresh;
+    } else {
+      fresh->next = block;
+      arena->blocks = fresh;
+    }
+    arena->reserved += data_size;
+    block = fresh;
+  }
+
+  void *ptr = (unsigned char *) block->data + block->used;
+  block->used += size;
+  arena->used += size;
+  return ptr;
+}
+
+static void arena_free(state_arena_t *arena) {
+  while (arena->blocks) {
+    state_arena_block_t *next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+  arena->used = 0;
+  arena->reserved = 0;
+}
 
 /* ============================================================================
  * INITIALIZATION AND CLEANUP
@@ -17,8 +82,23 @@ int device_state_init(device_state_t *state) {
 
   memset(state, 0, sizeof(device_state_t));
 
-  /* Initialize single mutex for entire device state */
-  if (pthread_mutex_init(&state->mutex, NULL) != 0) {
+  /* Initialize single rwlock for entire device state. glibc's default
+   * prefers readers, so a steady stream of FUSE reads would starve the
+   * WebSocket thread's updates, and with them every device on its event
+   * loop; ask for writer preference instead. No thread takes the read lock
+   * twice, which that kind does not allow. (Other systems, e.g. macOS,
+   * already favour writers.) */
+  pthread_rwlockattr_t lock_attr;
+  if (pthread_rwlockattr_init(&lock_attr) != 0) {
+    return -1;
+  }
+#ifdef __GLIBC__
+  pthread_rwlockattr_setkind_np(&lock_attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  int lock_ret = pthread_rwlock_init(&state->lock, &lock_attr);
+  pthread_rwlockattr_destroy(&lock_attr);
+  if (lock_ret != 0) {
     return -1;
   }
 
@@ -26,6 +106,9 @@ int device_state_init(device_state_t *state) {
   state->sys_config.json_len = 0;
   state->sys_config.valid = 0;
   state->sys_config.parsed.timezone = NULL;
+  state->sys_config.parsed.cfg_rev = -1;
+  state->device_cfg_rev = -1;
+  state->device_schedule_rev = -1;
 
   state->mqtt_config.raw_json = NULL;
   state->mqtt_config.json_len = 0;
@@ -34,10 +117,28 @@ int device_state_init(device_state_t *state) {
   /* Initialize scripts */
   state->scripts.count = 0;
   state->scripts.last_update = 0;
-  state->scripts.retrieving_id = -1;
-  state->scripts.current_offset = 0;
-  state->scripts.chunk_buffer = NULL;
-  state->scripts.chunk_buffer_size = 0;
+  state->scripts.fetch_window = SCRIPT_FETCH_WINDOW;
+  state->scripts.fetch_inflight = 0;
+  state->scripts.upload_buf = NULL;
+  state->scripts.upload_buf_size = 0;
+  state->scripts.lazy = 0;
+  state->scripts.evict_idle_sec = 0;
+  state->scripts.code_gen = 0;
+  if (pthread_mutex_init(&state->scripts.code_mutex, NULL) != 0) {
+    pthread_rwlock_destroy(&state->lock);
+    return -1;
+  }
+  if (pthread_cond_init(&state->scripts.code_cond, NULL) != 0) {
+    pthread_mutex_destroy(&state->scripts.code_mutex);
+    pthread_rwlock_destroy(&state->lock);
+    return -1;
+  }
+  if (pthread_mutex_init(&state->schedules.crontab_mutex, NULL) != 0) {
+    pthread_cond_destroy(&state->scripts.code_cond);
+    pthread_mutex_destroy(&state->scripts.code_mutex);
+    pthread_rwlock_destroy(&state->lock);
+    return -1;
+  }
   for (int i = 0; i < MAX_SCRIPTS; i++) {
     state->scripts.scripts[i] = (script_entry_t) {.id = -1,
                                                   .name = {0},
@@ -51,39 +152,24 @@ int device_state_init(device_state_t *state) {
                                                   .mem_peak = 0,
                                                   .errors = NULL,
                                                   .last_status_update = 0,
-                                                  .last_upload_req_id = -1};
+                                                  .upload_esc = NULL,
+                                                  .upload_pending = NULL,
+                                                  .fetch_buf = NULL,
+                                                  .fetch_size = -1,
+                                                  .code_size = -1,
+                                                  .open_count = 0,
+                                                  .last_access = 0};
   }
 
-  /* Initialize switches */
+  /* Switch, input and schedule slots are allocated as the device reports
+   * them (switch_slot(), input_slot(), device_state_update_schedule_list()) */
   state->switches.count = 0;
   state->switches.last_update = 0;
-  for (int i = 0; i < MAX_SWITCHES; i++) {
-    memset(&state->switches.switches[i], 0, sizeof(switch_config_t));
-    state->switches.switches[i].id = -1;
-    state->switches.switches[i].valid = 0;
-  }
-
-  /* Initialize inputs */
   state->inputs.count = 0;
   state->inputs.last_update = 0;
-  for (int i = 0; i < MAX_INPUTS; i++) {
-    memset(&state->inputs.inputs[i], 0, sizeof(input_config_t));
-    state->inputs.inputs[i].id = -1;
-    state->inputs.inputs[i].valid = 0;
-  }
-
-  /* Initialize schedules */
   state->schedules.count = 0;
   state->schedules.rev = 0;
   state->schedules.last_update = 0;
-  for (int i = 0; i < MAX_SCHEDULES; i++) {
-    memset(&state->schedules.schedules[i], 0, sizeof(schedule_entry_t));
-    state->schedules.schedules[i].id = -1;
-    state->schedules.schedules[i].valid = 0;
-    for (int j = 0; j < MAX_SCHEDULE_CALLS; j++) {
-      state->schedules.schedules[i].calls[j].params_json = NULL;
-    }
-  }
 
   return 0;
 }
@@ -93,7 +179,7 @@ void device_state_destroy(device_state_t *state) {
     return;
   }
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_wrlock(&state->lock);
 
   /* Clean up sys_config */
   if (state->sys_config.raw_json) {
@@ -122,111 +208,190 @@ void device_state_destroy(device_state_t *state) {
       free(state->scripts.scripts[i].errors);
       state->scripts.scripts[i].errors = NULL;
     }
+    /* Clean up any retrieval or upload in progress */
+    if (state->scripts.scripts[i].fetch_buf) {
+      free(state->scripts.scripts[i].fetch_buf);
+      state->scripts.scripts[i].fetch_buf = NULL;
+    }
+    free(state->scripts.scripts[i].upload_esc);
+    state->scripts.scripts[i].upload_esc = NULL;
+    free(state->scripts.scripts[i].upload_pending);
+    state->scripts.scripts[i].upload_pending = NULL;
   }
+  free(state->scripts.upload_buf);
+  state->scripts.upload_buf = NULL;
 
-  /* Clean up chunk buffer */
-  if (state->scripts.chunk_buffer) {
-    free(state->scripts.chunk_buffer);
-    state->scripts.chunk_buffer = NULL;
-  }
-
-  /* Clean up switches */
+  /* Clean up switches and inputs (the slots themselves are in the arena) */
   for (int i = 0; i < MAX_SWITCHES; i++) {
-    if (state->switches.switches[i].raw_json) {
-      free(state->switches.switches[i].raw_json);
-      state->switches.switches[i].raw_json = NULL;
+    switch_config_t *sw = state->switches.switches[i];
+    if (sw) {
+      free(sw->raw_json);
+      free(sw->history.records);
+      state->switches.switches[i] = NULL;
     }
   }
-
-  /* Clean up inputs */
   for (int i = 0; i < MAX_INPUTS; i++) {
-    if (state->inputs.inputs[i].raw_json) {
-      free(state->inputs.inputs[i].raw_json);
-      state->inputs.inputs[i].raw_json = NULL;
+    input_config_t *inp = state->inputs.inputs[i];
+    if (inp) {
+      free(inp->raw_json);
+      free(inp->history.records);
+      state->inputs.inputs[i] = NULL;
     }
   }
+  arena_free(&state->arena);
 
   /* Clean up schedules */
-  for (int i = 0; i < MAX_SCHEDULES; i++) {
-    for (int j = 0; j < MAX_SCHEDULE_CALLS; j++) {
-      if (state->schedules.schedules[i].calls[j].params_json) {
-        free(state->schedules.schedules[i].calls[j].params_json);
-        state->schedules.schedules[i].calls[j].params_json = NULL;
-      }
-    }
+  schedules_clear(state);
+  free(state->schedules.schedules);
+  state->schedules.schedules = NULL;
+  state->schedules.capacity = 0;
+  free(state->schedules.crontab);
+  state->schedules.crontab = NULL;
+
+  pthread_rwlock_unlock(&state->lock);
+  pthread_mutex_destroy(&state->schedules.crontab_mutex);
+  pthread_cond_destroy(&state->scripts.code_cond);
+  pthread_mutex_destroy(&state->scripts.code_mutex);
+  pthread_rwlock_destroy(&state->lock);
+}
+
+void device_state_read_lock(device_state_t *state) {
+  pthread_rwlock_rdlock(&state->lock);
+}
+
+void device_state_read_unlock(device_state_t *state) {
+  pthread_rwlock_unlock(&state->lock);
+}
+
+void device_state_set_change_hook(device_state_t *state,
+                                  device_state_change_fn_t fn,
+                                  void *user_data) {
+  if (!state) {
+    return;
   }
+  state->change_fn = fn;
+  state->change_data = user_data;
+}
+
+unsigned long device_state_generation(device_state_t *state) {
+  return __atomic_load_n(&state->generation, __ATOMIC_ACQUIRE);
+}
 
-  pthread_mutex_unlock(&state->mutex);
-  pthread_mutex_destroy(&state->mutex);
+/* Report an applied change to the hook (state lock not held) */
+static void notify_change(device_state_t *state, state_change_t what, int id,
+                          unsigned int fields) {
+  __atomic_add_fetch(&state->generation, 1, __ATOMIC_RELEASE);
+  if (state->change_fn) {
+    state->change_fn(state->change_data, what, id, fields);
+  }
 }
 
 /* ============================================================================
- * JSON-RPC UTILITIES
+ * COMPONENT SLOTS
  * ============================================================================
  */
 
-char *jsonrpc_build_request(const char *method, int id, const char *params) {
-  if (!method) {
-    return NULL;
+/* Give a switch an empty history ring of `depth` records (none for 0).
+ * Returns -1 if out of memory, leaving the switch without history. */
+static int switch_history_reset(switch_config_t *sw, unsigned int depth) {
+  free(sw->history.records);
+  sw->history = (switch_history_t) {.records = NULL, .depth = 0};
+  if (depth == 0) {
+    return 0;
   }
+  sw->history.records = calloc(depth, sizeof(*sw->history.records));
+  if (!sw->history.records) {
+    return -1;
+  }
+  sw->history.depth = depth;
+  return 0;
+}
 
-  /* Generate a consistent client ID for this session */
-  /* Using a simple static ID - in production you might want a UUID */
-  static const char *client_id = "shusefs-client";
-
-  char *request = NULL;
-  int result;
+static int input_history_reset(input_config_t *inp, unsigned int depth) {
+  free(inp->history.records);
+  inp->history = (input_history_t) {.records = NULL, .depth = 0};
+  if (depth == 0) {
+    return 0;
+  }
+  inp->history.records = calloc(depth, sizeof(*inp->history.records));
+  if (!inp->history.records) {
+    return -1;
+  }
+  inp->history.depth = depth;
+  return 0;
+}
 
-  if (params && strlen(params) > 0) {
-    result = asprintf(&request,
-                      "{\"jsonrpc\":\"2.0\",\"id\":%d,\"src\":\"%s\","
-                      "\"method\":\"%s\",\"params\":%s}",
-                      id, client_id, method, params);
-  } else {
-    result = asprintf(
-        &request,
-        "{\"jsonrpc\":\"2.0\",\"id\":%d,\"src\":\"%s\",\"method\":\"%s\"}", id,
-        client_id, method);
+/* Slot of switch `id`, allocated from the arena the first time the device
+ * reports the switch. Slots are never freed before the state, so pointers to
+ * them stay valid once handed out. Caller holds the write lock. Returns NULL
+ * if out of memory. */
+static switch_config_t *switch_slot(device_state_t *state, int id) {
+  switch_config_t *sw = state->switches.switches[id];
+  if (sw) {
+    return sw;
   }
 
-  /* Check if allocation was successful */
-  if (result < 0) {
+  sw = arena_alloc(&state->arena, sizeof(*sw));
+  if (!sw) {
     return NULL;
   }
+  sw->id = -1;
+  if (switch_history_reset(sw, state->history_depth) != 0) {
+    log_warn(LOG_CAT_STATE, "Warning: No memory for switch %d history\n", id);
+  }
+  state->switches.switches[id] = sw;
+  return sw;
+}
+
+static input_config_t *input_slot(device_state_t *state, int id) {
+  input_config_t *inp = state->inputs.inputs[id];
+  if (inp) {
+    return inp;
+  }
 
-  return request;
+  inp = arena_alloc(&state->arena, sizeof(*inp));
+  if (!inp) {
+    return NULL;
+  }
+  inp->id = -1;
+  if (input_history_reset(inp, state->history_depth) != 0) {
+    log_warn(LOG_CAT_STATE, "Warning: No memory for input %d history\n", id);
+  }
+  state->inputs.inputs[id] = inp;
+  return inp;
 }
 
+/* ============================================================================
+ * JSON-RPC UTILITIES
+ * ============================================================================
+ */
+
 int jsonrpc_send_request(struct mg_connection *conn, const char *request) {
   if (!conn || !request) {
     return -1;
   }
 
-  mg_ws_send(conn, request, strlen(request), WEBSOCKET_OP_TEXT);
+  size_t len = strlen(request);
+  mg_ws_send(conn, request, len, WEBSOCKET_OP_TEXT);
+  stats_add(STATS_BYTES_SENT, len);
   return 0;
 }
 
-int jsonrpc_is_error(const char *response_json, char *error_buf,
-                     size_t error_buf_size) {
-  if (!response_json) {
-    return 0;
-  }
-
-  struct mg_str json_str = mg_str(response_json);
-
-  /* Check if error field exists */
-  int error_len = 0;
-  int error_pos = mg_json_get(json_str, "$.error", &error_len);
+/* The "result" (or "error") value of a classified response */
+static struct mg_str frame_result(const jsonrpc_frame_t *response) {
+  return mg_str_n(response->result, response->result_len);
+}
 
-  if (error_pos < 0) {
-    /* No error field found */
+int jsonrpc_is_error(const jsonrpc_frame_t *response, char *error_buf,
+                     size_t error_buf_size) {
+  if (!response || !response->is_error) {
     return 0;
   }
 
   /* Error found - optionally extract error message */
   if (error_buf && error_buf_size > 0) {
-    /* Create substring view of error object */
-    struct mg_str error_obj = mg_str_n(response_json + error_pos, error_len);
+    /* The frame's result span holds the error object */
+    struct mg_str error_obj = frame_result(response);
 
     /* Try to get error message */
     char *message = mg_json_get_str(error_obj, "$.message");
@@ -235,10 +400,10 @@ int jsonrpc_is_error(const char *response_json, char *error_buf,
       free(message);
     } else {
       /* If no message field, copy the entire error object */
-      size_t copy_len = (size_t) error_len < error_buf_size - 1
-                            ? (size_t) error_len
+      size_t copy_len = error_obj.len < error_buf_size - 1
+                            ? error_obj.len
                             : error_buf_size - 1;
-      memcpy(error_buf, response_json + error_pos, copy_len);
+      memcpy(error_buf, error_obj.buf, copy_len);
       error_buf[copy_len] = '\0';
     }
   }
@@ -246,144 +411,89 @@ int jsonrpc_is_error(const char *response_json, char *error_buf,
   return 1;
 }
 
-response_type_t device_state_get_response_type(const char *request_json) {
-  if (!request_json) {
-    return RESPONSE_TYPE_UNKNOWN;
-  }
-
-  struct mg_str json_str = mg_str(request_json);
-  char *method = mg_json_get_str(json_str, "$.method");
-
-  response_type_t result = RESPONSE_TYPE_UNKNOWN;
-
-  if (method) {
-    if (strstr(method, "Sys.GetConfig") != NULL) {
-      result = RESPONSE_TYPE_SYS_GETCONFIG;
-    } else if (strstr(method, "Sys.SetConfig") != NULL) {
-      result = RESPONSE_TYPE_SYS_SETCONFIG;
-    } else if (strstr(method, "MQTT.GetConfig") != NULL) {
-      result = RESPONSE_TYPE_MQTT_GETCONFIG;
-    } else if (strstr(method, "MQTT.SetConfig") != NULL) {
-      result = RESPONSE_TYPE_MQTT_SETCONFIG;
-    } else if (strstr(method, "Switch.GetConfig") != NULL) {
-      result = RESPONSE_TYPE_SWITCH_GETCONFIG;
-    } else if (strstr(method, "Switch.SetConfig") != NULL) {
-      result = RESPONSE_TYPE_SWITCH_SETCONFIG;
-    } else if (strstr(method, "Switch.Set") != NULL) {
-      result = RESPONSE_TYPE_SWITCH_SET;
-    } else if (strstr(method, "Switch.GetStatus") != NULL) {
-      result = RESPONSE_TYPE_SWITCH_GETSTATUS;
-    } else if (strstr(method, "Input.GetConfig") != NULL) {
-      result = RESPONSE_TYPE_INPUT_GETCONFIG;
-    } else if (strstr(method, "Input.SetConfig") != NULL) {
-      result = RESPONSE_TYPE_INPUT_SETCONFIG;
-    } else if (strstr(method, "Input.GetStatus") != NULL) {
-      result = RESPONSE_TYPE_INPUT_GETSTATUS;
-    } else if (strstr(method, "Script.List") != NULL) {
-      result = RESPONSE_TYPE_SCRIPT_LIST;
-    } else if (strstr(method, "Script.GetCode") != NULL) {
-      result = RESPONSE_TYPE_SCRIPT_GETCODE;
-    } else if (strstr(method, "Script.PutCode") != NULL) {
-      result = RESPONSE_TYPE_SCRIPT_PUTCODE;
-    } else if (strstr(method, "Schedule.List") != NULL) {
-      result = RESPONSE_TYPE_SCHEDULE_LIST;
-    } else if (strstr(method, "Schedule.Create") != NULL) {
-      result = RESPONSE_TYPE_SCHEDULE_CREATE;
-    } else if (strstr(method, "Schedule.Update") != NULL) {
-      result = RESPONSE_TYPE_SCHEDULE_UPDATE;
-    } else if (strstr(method, "Schedule.Delete") != NULL) {
-      result = RESPONSE_TYPE_SCHEDULE_DELETE;
-    }
-    /* Add more response types here as needed */
-
-    free(method);
-  }
+/* Single-pass JSON helpers. Objects are walked member by member with
+ * mg_json_next(), so each value is scanned once instead of once per
+ * mg_json_get() path lookup. */
 
-  return result;
+/* Check if an object key (as returned by mg_json_next, quotes included)
+ * equals `name` */
+static int json_key_is(struct mg_str key, const char *name) {
+  size_t n = strlen(name);
+  return key.len == n + 2 && memcmp(key.buf + 1, name, n) == 0;
 }
 
-int device_state_extract_script_id(const char *request_json) {
-  if (!request_json) {
+/* Parse a "type:N" component key (quotes included). Returns N, or -1 if the
+ * key is not of that type or N is not below `max`. */
+static int json_component_key_id(struct mg_str key, const char *type,
+                                 int max) {
+  size_t n = strlen(type);
+  if (key.len < n + 4 || memcmp(key.buf + 1, type, n) != 0 ||
+      key.buf[n + 1] != ':') {
     return -1;
   }
 
-  struct mg_str json_str = mg_str(request_json);
-
-  /* Get params object position and length */
-  int params_len = 0;
-  int params_pos = mg_json_get(json_str, "$.params", &params_len);
-
-  if (params_pos < 0) {
-    return -1;
+  int id = 0;
+  for (size_t i = n + 2; i < key.len - 1; i++) {
+    if (key.buf[i] < '0' || key.buf[i] > '9') {
+      return -1;
+    }
+    id = id * 10 + (key.buf[i] - '0');
+    if (id >= max) {
+      return -1;
+    }
   }
 
-  /* Create substring view of params object */
-  struct mg_str params_str = mg_str_n(request_json + params_pos, params_len);
-
-  double id_val = 0;
-  int result = -1;
+  return id;
+}
 
-  if (mg_json_get_num(params_str, "$.id", &id_val)) {
-    result = (int) id_val;
+/* Copy a JSON string value into buf (unescaped, always NUL-terminated).
+ * Returns 1 if the value was a string. */
+static int json_val_str(struct mg_str val, char *buf, size_t size) {
+  if (val.len < 2 || val.buf[0] != '"' || size == 0) {
+    return 0;
   }
-
-  return result;
+  if (!mg_json_unescape(mg_str_n(val.buf + 1, val.len - 2), buf, size)) {
+    buf[0] = '\0';
+    return 0;
+  }
+  return 1;
 }
 
-int device_state_extract_switch_id(const char *request_json) {
-  if (!request_json) {
-    return -1;
+/* Copy the string at `path` of `json` into buf (unescaped, truncated to fit,
+ * always NUL-terminated). Unlike mg_json_get_str() this only allocates for a
+ * value that does not fit. Returns 1 if there was a string, 0 otherwise
+ * (buf is left as it was). */
+static int json_get_str_buf(struct mg_str json, const char *path, char *buf,
+                            size_t size) {
+  struct mg_str tok = mg_json_get_tok(json, path);
+  if (tok.len < 2 || tok.buf[0] != '"' || size == 0) {
+    return 0;
   }
-
-  struct mg_str json_str = mg_str(request_json);
-
-  /* Get params object position and length */
-  int params_len = 0;
-  int params_pos = mg_json_get(json_str, "$.params", &params_len);
-
-  if (params_pos < 0) {
-    return -1;
+  if (mg_json_unescape(mg_str_n(tok.buf + 1, tok.len - 2), buf, size)) {
+    return 1;
   }
 
-  /* Create substring view of params object */
-  struct mg_str params_str = mg_str_n(request_json + params_pos, params_len);
-
-  double id_val = 0;
-  int result = -1;
-
-  if (mg_json_get_num(params_str, "$.id", &id_val)) {
-    result = (int) id_val;
+  char *str = mg_json_get_str(json, path);
+  if (!str) {
+    return 0;
   }
-
-  return result;
+  snprintf(buf, size, "%s", str);
+  free(str);
+  return 1;
 }
 
-int device_state_extract_input_id(const char *request_json) {
-  if (!request_json) {
-    return -1;
-  }
-
-  struct mg_str json_str = mg_str(request_json);
-
-  /* Get params object position and length */
-  int params_len = 0;
-  int params_pos = mg_json_get(json_str, "$.params", &params_len);
-
-  if (params_pos < 0) {
-    return -1;
+/* Update a numeric status field and its mtime if the value changed. Returns
+ * `bit` if it did, 0 otherwise. */
+static unsigned int update_num_field(double *field, time_t *mtime, double val,
+                                     time_t now, unsigned int bit) {
+  if (*field == val) {
+    return 0;
   }
-
-  /* Create substring view of params object */
-  struct mg_str params_str = mg_str_n(request_json + params_pos, params_len);
-
-  double id_val = 0;
-  int result = -1;
-
-  if (mg_json_get_num(params_str, "$.id", &id_val)) {
-    result = (int) id_val;
+  *field = val;
+  if (mtime) {
+    *mtime = now;
   }
-
-  return result;
+  return bit;
 }
 
 /* ============================================================================
@@ -398,61 +508,36 @@ int device_state_request_sys_config(device_state_t *state,
     return -1;
   }
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    return -1;
-  }
-
-  /* Build JSON-RPC request with correct ID */
-  char *request = jsonrpc_build_request("Sys.GetConfig", req_id, NULL);
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Sys.GetConfig request\n");
-    return -1;
-  }
-
   /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Sys.GetConfig to request queue\n");
-    free(request);
+  request_desc_t desc = {.method = RESPONSE_TYPE_SYS_GETCONFIG,
+                         .component_id = -1};
+  int req_id = request_queue_add(queue, "Sys.GetConfig", NULL, &desc);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Sys.GetConfig to request queue\n");
     return -1;
   }
 
-  printf("Requesting system configuration (ID: %d)...\n", req_id);
+  log_debug(LOG_CAT_STATE, "Requesting system configuration (ID: %d)...\n",
+            req_id);
 
   /* Request is queued and will be sent by ws_thread_func */
-  free(request);
   return req_id;
 }
 
-int device_state_update_sys_config(device_state_t *state, const char *json) {
-  if (!state || !json) {
-    return -1;
-  }
-
-  /* Parse common fields using mongoose JSON parser */
-  struct mg_str json_str = mg_str(json);
-
-  /* Extract the result object (not as string, but as JSON substring) */
-  int result_len = 0;
-  int result_pos = mg_json_get(json_str, "$.result", &result_len);
-
-  if (result_pos < 0 || result_len <= 0) {
-    fprintf(stderr, "Error: No result field in sys config response\n");
-    return -1;
-  }
-
+/* Store and parse a Sys config object (Sys.GetConfig result, or the "sys"
+ * member of Shelly.GetConfig) */
+static int apply_sys_config(device_state_t *state, const char *obj,
+                            int result_len) {
   /* Allocate and copy the result portion */
   char *result_str = malloc(result_len + 1);
   if (!result_str) {
     return -1;
   }
-  memcpy(result_str, json + result_pos, result_len);
+  memcpy(result_str, obj, result_len);
   result_str[result_len] = '\0';
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_wrlock(&state->lock);
 
   /* Free old data */
   if (state->sys_config.raw_json) {
@@ -468,7 +553,7 @@ int device_state_update_sys_config(device_state_t *state, const char *json) {
   state->sys_config.raw_json = malloc(json_len + 1);
   if (!state->sys_config.raw_json) {
     free(result_str);
-    pthread_mutex_unlock(&state->mutex);
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
   strcpy(state->sys_config.raw_json, result_str);
@@ -477,18 +562,12 @@ int device_state_update_sys_config(device_state_t *state, const char *json) {
   struct mg_str result = mg_str(result_str);
 
   /* Extract device name */
-  char *name = mg_json_get_str(result, "$.device.name");
-  if (name) {
-    snprintf(state->sys_config.parsed.device_name, MAX_DEVICE_NAME, "%s", name);
-    free(name);
-  }
+  json_get_str_buf(result, "$.device.name",
+                   state->sys_config.parsed.device_name, MAX_DEVICE_NAME);
 
   /* Extract location */
-  char *loc = mg_json_get_str(result, "$.location.tz");
-  if (loc) {
-    snprintf(state->sys_config.parsed.location, MAX_LOCATION, "%s", loc);
-    free(loc);
-  }
+  json_get_str_buf(result, "$.location.tz", state->sys_config.parsed.location,
+                   MAX_LOCATION);
 
   /* Extract eco_mode */
   double eco_val = 0;
@@ -502,32 +581,55 @@ int device_state_update_sys_config(device_state_t *state, const char *json) {
     state->sys_config.parsed.sntp_enabled = (int) sntp_val;
   }
 
+  /* Extract config revision, used to revalidate cached state */
+  double rev_val = 0;
+  if (mg_json_get_num(result, "$.cfg_rev", &rev_val)) {
+    state->sys_config.parsed.cfg_rev = (int) rev_val;
+  }
+
   free(result_str);
 
   state->sys_config.valid = 1;
   state->sys_config.last_update = time(NULL);
 
-  printf("System configuration updated successfully\n");
+  log_debug(LOG_CAT_STATE, "System configuration updated successfully\n");
 
-  pthread_mutex_unlock(&state->mutex);
+  pthread_rwlock_unlock(&state->lock);
+
+  notify_change(state, STATE_CHANGE_SYS_CONFIG, -1, 0);
   return 0;
 }
 
+int device_state_update_sys_config(device_state_t *state,
+                                    const jsonrpc_frame_t *response) {
+  if (!state || !response) {
+    return -1;
+  }
+
+  if (response->is_error || response->result_len == 0) {
+    log_error(LOG_CAT_STATE, "Error: No result field in sys config response\n");
+    return -1;
+  }
+
+  return apply_sys_config(state, response->result,
+                           (int) response->result_len);
+}
+
 int device_state_get_sys_config_str(device_state_t *state, char **output) {
   if (!state || !output) {
     return -1;
   }
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_rdlock(&state->lock);
 
   if (!state->sys_config.valid || !state->sys_config.raw_json) {
-    pthread_mutex_unlock(&state->mutex);
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
 
   *output = strdup(state->sys_config.raw_json);
 
-  pthread_mutex_unlock(&state->mutex);
+  pthread_rwlock_unlock(&state->lock);
 
   return (*output) ? 0 : -1;
 }
@@ -537,10 +639,10 @@ int device_state_serialize_sys_config(device_state_t *state) {
     return -1;
   }
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_wrlock(&state->lock);
 
   if (!state->sys_config.valid) {
-    pthread_mutex_unlock(&state->mutex);
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
 
@@ -579,12 +681,12 @@ int device_state_serialize_sys_config(device_state_t *state) {
 
   state->sys_config.raw_json = strdup(buffer);
   if (!state->sys_config.raw_json) {
-    pthread_mutex_unlock(&state->mutex);
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
   state->sys_config.json_len = strlen(buffer);
 
-  pthread_mutex_unlock(&state->mutex);
+  pthread_rwlock_unlock(&state->lock);
   return 0;
 }
 
@@ -596,15 +698,16 @@ int device_state_set_sys_config(device_state_t *state, request_queue_t *queue,
 
   /* Serialize parsed fields back to JSON before sending */
   if (device_state_serialize_sys_config(state) != 0) {
-    fprintf(stderr, "Error: Failed to serialize system configuration\n");
+    log_error(LOG_CAT_STATE,
+              "Error: Failed to serialize system configuration\n");
     return -1;
   }
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_wrlock(&state->lock);
 
   if (!state->sys_config.valid || !state->sys_config.raw_json) {
-    pthread_mutex_unlock(&state->mutex);
-    fprintf(stderr, "Error: No valid system configuration to set\n");
+    pthread_rwlock_unlock(&state->lock);
+    log_error(LOG_CAT_STATE, "Error: No valid system configuration to set\n");
     return -1;
   }
 
@@ -627,106 +730,32 @@ int device_state_set_sys_config(device_state_t *state, request_queue_t *queue,
     params = strdup(result_str);
     free(result_str);
   } else {
-    pthread_mutex_unlock(&state->mutex);
-    fprintf(stderr, "Error: Failed to extract config from stored data\n");
-    return -1;
-  }
-
-  pthread_mutex_unlock(&state->mutex);
-
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    free(params);
+    pthread_rwlock_unlock(&state->lock);
+    log_error(LOG_CAT_STATE,
+              "Error: Failed to extract config from stored data\n");
     return -1;
   }
 
-  /* Build JSON-RPC request with correct ID */
-  char *request = jsonrpc_build_request("Sys.SetConfig", req_id, params);
-  free(params);
-
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Sys.SetConfig request\n");
-    return -1;
-  }
+  pthread_rwlock_unlock(&state->lock);
 
   /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Sys.SetConfig to request queue\n");
-    free(request);
-    return -1;
-  }
-
-  printf("Setting system configuration (ID: %d)...\n", req_id);
-
-  /* Request is queued and will be sent by ws_thread_func */
-  free(request);
-  return req_id;
-}
-
-int device_state_set_sys_config_from_json(const char *user_json,
-                                          request_queue_t *queue,
-                                          struct mg_connection *conn) {
-  if (!user_json || !queue || !conn) {
-    return -1;
-  }
-
-  /* Validate that user_json is valid JSON */
-  struct mg_str json_str = mg_str(user_json);
-  int dummy_len = 0;
-  int validation = mg_json_get(json_str, "$", &dummy_len);
-  if (validation < 0) {
-    fprintf(stderr, "Error: Invalid JSON provided by user\n");
-    return -1;
-  }
-
-  /* Build params: {"config": {user_json}} */
-  size_t params_size = strlen(user_json) + 32;
-  char *params = malloc(params_size);
-  if (!params) {
-    fprintf(stderr, "Error: Failed to allocate params buffer\n");
-    return -1;
-  }
-  snprintf(params, params_size, "{\"config\":%s}", user_json);
-
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    free(params);
-    return -1;
-  }
-
-  /* Build JSON-RPC request */
-  char *request = jsonrpc_build_request("Sys.SetConfig", req_id, params);
+  request_desc_t desc = {.method = RESPONSE_TYPE_SYS_SETCONFIG,
+                         .component_id = -1};
+  int req_id = request_queue_add(queue, "Sys.SetConfig", params, &desc);
   free(params);
-
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Sys.SetConfig request\n");
-    return -1;
-  }
-
-  /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Sys.SetConfig to request queue\n");
-    free(request);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Sys.SetConfig to request queue\n");
     return -1;
   }
 
-  printf("Setting system configuration from user edit (ID: %d)...\n", req_id);
+  log_debug(LOG_CAT_STATE, "Setting system configuration (ID: %d)...\n",
+            req_id);
 
   /* Request is queued and will be sent by ws_thread_func */
-  free(request);
   return req_id;
 }
 
-int device_state_is_sys_config_notification(const char *json, size_t len) {
-  return device_state_is_component_notification(json, len, "sys");
-}
-
 /* ============================================================================
  * MQTT CONFIGURATION (MQTT.GetConfig / MQTT.SetConfig)
  * ============================================================================
@@ -739,61 +768,36 @@ int device_state_request_mqtt_config(device_state_t *state,
     return -1;
   }
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    return -1;
-  }
-
-  /* Build JSON-RPC request with correct ID */
-  char *request = jsonrpc_build_request("MQTT.GetConfig", req_id, NULL);
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build MQTT.GetConfig request\n");
-    return -1;
-  }
-
   /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add MQTT.GetConfig to request queue\n");
-    free(request);
+  request_desc_t desc = {.method = RESPONSE_TYPE_MQTT_GETCONFIG,
+                         .component_id = -1};
+  int req_id = request_queue_add(queue, "MQTT.GetConfig", NULL, &desc);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add MQTT.GetConfig to request queue\n");
     return -1;
   }
 
-  printf("Requesting MQTT configuration (ID: %d)...\n", req_id);
+  log_debug(LOG_CAT_STATE, "Requesting MQTT configuration (ID: %d)...\n",
+            req_id);
 
   /* Request is queued and will be sent by ws_thread_func */
-  free(request);
   return req_id;
 }
 
-int device_state_update_mqtt_config(device_state_t *state, const char *json) {
-  if (!state || !json) {
-    return -1;
-  }
-
-  /* Parse common fields using mongoose JSON parser */
-  struct mg_str json_str = mg_str(json);
-
-  /* Extract the result object (not as string, but as JSON substring) */
-  int result_len = 0;
-  int result_pos = mg_json_get(json_str, "$.result", &result_len);
-
-  if (result_pos < 0 || result_len <= 0) {
-    fprintf(stderr, "Error: No result field in mqtt config response\n");
-    return -1;
-  }
-
+/* Store and parse an MQTT config object (MQTT.GetConfig result, or the
+ * "mqtt" member of Shelly.GetConfig) */
+static int apply_mqtt_config(device_state_t *state, const char *obj,
+                             int result_len) {
   /* Allocate and copy the result portion */
   char *result_str = malloc(result_len + 1);
   if (!result_str) {
     return -1;
   }
-  memcpy(result_str, json + result_pos, result_len);
+  memcpy(result_str, obj, result_len);
   result_str[result_len] = '\0';
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_wrlock(&state->lock);
 
   /* Free old data */
   if (state->mqtt_config.raw_json) {
@@ -805,7 +809,7 @@ int device_state_update_mqtt_config(device_state_t *state, const char *json) {
   state->mqtt_config.raw_json = malloc(json_len + 1);
   if (!state->mqtt_config.raw_json) {
     free(result_str);
-    pthread_mutex_unlock(&state->mutex);
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
   strcpy(state->mqtt_config.raw_json, result_str);
@@ -820,38 +824,24 @@ int device_state_update_mqtt_config(device_state_t *state, const char *json) {
   }
 
   /* Extract server */
-  char *server = mg_json_get_str(result, "$.server");
-  if (server) {
-    snprintf(state->mqtt_config.parsed.server, MAX_SERVER_URL, "%s", server);
-    free(server);
-  }
+  json_get_str_buf(result, "$.server", state->mqtt_config.parsed.server,
+                   MAX_SERVER_URL);
 
   /* Extract client_id */
-  char *client_id = mg_json_get_str(result, "$.client_id");
-  if (client_id) {
-    snprintf(state->mqtt_config.parsed.client_id, MAX_CLIENT_ID, "%s",
-             client_id);
-    free(client_id);
-  }
+  json_get_str_buf(result, "$.client_id", state->mqtt_config.parsed.client_id,
+                   MAX_CLIENT_ID);
 
   /* Extract user */
-  char *user = mg_json_get_str(result, "$.user");
-  if (user) {
-    snprintf(state->mqtt_config.parsed.user, MAX_USER_ID, "%s", user);
-    free(user);
-  }
+  json_get_str_buf(result, "$.user", state->mqtt_config.parsed.user,
+                   MAX_USER_ID);
 
   /* Extract topic_prefix */
-  char *topic_prefix = mg_json_get_str(result, "$.topic_prefix");
-  if (topic_prefix) {
-    snprintf(state->mqtt_config.parsed.topic_prefix, MAX_TOPIC_PREFIX, "%s",
-             topic_prefix);
-    free(topic_prefix);
-  }
+  json_get_str_buf(result, "$.topic_prefix",
+                   state->mqtt_config.parsed.topic_prefix, MAX_TOPIC_PREFIX);
 
   /* Extract ssl_ca */
-  char *ssl_ca_str = mg_json_get_str(result, "$.ssl_ca");
-  if (ssl_ca_str) {
+  char ssl_ca_str[32];
+  if (json_get_str_buf(result, "$.ssl_ca", ssl_ca_str, sizeof(ssl_ca_str))) {
     if (strcmp(ssl_ca_str, "user_ca.pem") == 0) {
       state->mqtt_config.parsed.ssl_ca = SSL_CA_USER;
     } else if (strcmp(ssl_ca_str, "ca.pem") == 0) {
@@ -859,7 +849,6 @@ int device_state_update_mqtt_config(device_state_t *state, const char *json) {
     } else {
       state->mqtt_config.parsed.ssl_ca = SSL_CA_NONE;
     }
-    free(ssl_ca_str);
   }
 
   /* Extract enable_control */
@@ -897,27 +886,45 @@ int device_state_update_mqtt_config(device_state_t *state, const char *json) {
   state->mqtt_config.valid = 1;
   state->mqtt_config.last_update = time(NULL);
 
-  printf("MQTT configuration updated successfully\n");
+  log_debug(LOG_CAT_STATE, "MQTT configuration updated successfully\n");
+
+  pthread_rwlock_unlock(&state->lock);
 
-  pthread_mutex_unlock(&state->mutex);
+  notify_change(state, STATE_CHANGE_MQTT_CONFIG, -1, 0);
   return 0;
 }
 
+int device_state_update_mqtt_config(device_state_t *state,
+                                    const jsonrpc_frame_t *response) {
+  if (!state || !response) {
+    return -1;
+  }
+
+  if (response->is_error || response->result_len == 0) {
+    log_error(LOG_CAT_STATE,
+              "Error: No result field in mqtt config response\n");
+    return -1;
+  }
+
+  return apply_mqtt_config(state, response->result,
+                           (int) response->result_len);
+}
+
 int device_state_get_mqtt_config_str(device_state_t *state, char **output) {
   if (!state || !output) {
     return -1;
   }
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_rdlock(&state->lock);
 
   if (!state->mqtt_config.valid || !state->mqtt_config.raw_json) {
-    pthread_mutex_unlock(&state->mutex);
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
 
   *output = strdup(state->mqtt_config.raw_json);
 
-  pthread_mutex_unlock(&state->mutex);
+  pthread_rwlock_unlock(&state->lock);
 
   return (*output) ? 0 : -1;
 }
@@ -927,10 +934,10 @@ int device_state_serialize_mqtt_config(device_state_t *state) {
     return -1;
   }
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_wrlock(&state->lock);
 
   if (!state->mqtt_config.valid) {
-    pthread_mutex_unlock(&state->mutex);
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
 
@@ -1006,12 +1013,12 @@ int device_state_serialize_mqtt_config(device_state_t *state) {
 
   state->mqtt_config.raw_json = strdup(buffer);
   if (!state->mqtt_config.raw_json) {
-    pthread_mutex_unlock(&state->mutex);
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
   state->mqtt_config.json_len = strlen(buffer);
 
-  pthread_mutex_unlock(&state->mutex);
+  pthread_rwlock_unlock(&state->lock);
   return 0;
 }
 
@@ -1021,11 +1028,11 @@ int device_state_set_mqtt_config(device_state_t *state, request_queue_t *queue,
     return -1;
   }
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_wrlock(&state->lock);
 
   if (!state->mqtt_config.valid || !state->mqtt_config.raw_json) {
-    pthread_mutex_unlock(&state->mutex);
-    fprintf(stderr, "Error: No valid MQTT configuration to set\n");
+    pthread_rwlock_unlock(&state->lock);
+    log_error(LOG_CAT_STATE, "Error: No valid MQTT configuration to set\n");
     return -1;
   }
 
@@ -1044,16 +1051,17 @@ int device_state_set_mqtt_config(device_state_t *state, request_queue_t *queue,
     }
   }
 
-  pthread_mutex_unlock(&state->mutex);
+  pthread_rwlock_unlock(&state->lock);
 
   /* If no result field, serialize from parsed fields */
   if (!result_str) {
     if (device_state_serialize_mqtt_config(state) != 0) {
-      fprintf(stderr, "Error: Failed to serialize MQTT configuration\n");
+      log_error(LOG_CAT_STATE,
+                "Error: Failed to serialize MQTT configuration\n");
       return -1;
     }
 
-    pthread_mutex_lock(&state->mutex);
+    pthread_rwlock_wrlock(&state->lock);
     json_str = mg_str(state->mqtt_config.raw_json);
     result_pos = mg_json_get(json_str, "$.result", &result_len);
 
@@ -1065,10 +1073,11 @@ int device_state_set_mqtt_config(device_state_t *state, request_queue_t *queue,
         result_str[result_len] = '\0';
       }
     }
-    pthread_mutex_unlock(&state->mutex);
+    pthread_rwlock_unlock(&state->lock);
 
     if (!result_str) {
-      fprintf(stderr, "Error: Failed to extract config from stored data\n");
+      log_error(LOG_CAT_STATE,
+                "Error: Failed to extract config from stored data\n");
       return -1;
     }
   }
@@ -1076,103 +1085,27 @@ int device_state_set_mqtt_config(device_state_t *state, request_queue_t *queue,
   char *params = strdup(result_str);
   free(result_str);
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    free(params);
-    return -1;
-  }
-
-  /* Build JSON-RPC request with correct ID */
-  char *request = jsonrpc_build_request("MQTT.SetConfig", req_id, params);
-  free(params);
-
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build MQTT.SetConfig request\n");
-    return -1;
-  }
-
   /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add MQTT.SetConfig to request queue\n");
-    free(request);
+  request_desc_t desc = {.method = RESPONSE_TYPE_MQTT_SETCONFIG,
+                         .component_id = -1};
+  int req_id = request_queue_add(queue, "MQTT.SetConfig", params, &desc);
+  free(params);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add MQTT.SetConfig to request queue\n");
     return -1;
   }
 
-  printf("Setting MQTT configuration (ID: %d)...\n", req_id);
+  log_debug(LOG_CAT_STATE, "Setting MQTT configuration (ID: %d)...\n", req_id);
 
   /* Request is queued and will be sent by ws_thread_func */
-  free(request);
   return req_id;
 }
 
-int device_state_set_mqtt_config_from_json(const char *user_json,
-                                           request_queue_t *queue,
-                                           struct mg_connection *conn) {
-  if (!user_json || !queue || !conn) {
-    return -1;
-  }
-
-  /* Validate that user_json is valid JSON */
-  struct mg_str json_str = mg_str(user_json);
-  int dummy_len = 0;
-  int validation = mg_json_get(json_str, "$", &dummy_len);
-  if (validation < 0) {
-    fprintf(stderr, "Error: Invalid JSON provided by user\n");
-    return -1;
-  }
-
-  /* Build params: {"config": {user_json}} */
-  size_t params_size = strlen(user_json) + 32;
-  char *params = malloc(params_size);
-  if (!params) {
-    fprintf(stderr, "Error: Failed to allocate params buffer\n");
-    return -1;
-  }
-  snprintf(params, params_size, "{\"config\":%s}", user_json);
-
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    free(params);
-    return -1;
-  }
-
-  /* Build JSON-RPC request */
-  char *request = jsonrpc_build_request("MQTT.SetConfig", req_id, params);
-  free(params);
-
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build MQTT.SetConfig request\n");
-    return -1;
-  }
-
-  /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add MQTT.SetConfig to request queue\n");
-    free(request);
-    return -1;
-  }
-
-  printf("Setting MQTT configuration from user edit (ID: %d)...\n", req_id);
-
-  /* Request is queued and will be sent by ws_thread_func */
-  free(request);
-  return req_id;
-}
-
-int device_state_is_mqtt_config_notification(const char *json, size_t len) {
-  return device_state_is_component_notification(json, len, "mqtt");
-}
-
-/* ============================================================================
- * SWITCH CONFIGURATION (Switch.GetConfig / Switch.SetConfig)
- * ============================================================================
- */
+/* ============================================================================
+ * SWITCH CONFIGURATION (Switch.GetConfig / Switch.SetConfig)
+ * ============================================================================
+ */
 
 static switch_in_mode_t parse_switch_in_mode(const char *mode_str) {
   if (!mode_str) return SWITCH_IN_MODE_UNKNOWN;
@@ -1198,7 +1131,7 @@ switch_config_t *device_state_get_switch(device_state_t *state, int switch_id) {
   if (!state || switch_id < 0 || switch_id >= MAX_SWITCHES) {
     return NULL;
   }
-  return &state->switches.switches[switch_id];
+  return state->switches.switches[switch_id];
 }
 
 int device_state_request_switch_config(device_state_t *state,
@@ -1213,71 +1146,42 @@ int device_state_request_switch_config(device_state_t *state,
   char params[64];
   snprintf(params, sizeof(params), "{\"id\":%d}", switch_id);
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    return -1;
-  }
-
-  /* Build JSON-RPC request */
-  char *request = jsonrpc_build_request("Switch.GetConfig", req_id, params);
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Switch.GetConfig request\n");
-    return -1;
-  }
-
   /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Switch.GetConfig to request queue\n");
-    free(request);
+  request_desc_t desc = {.method = RESPONSE_TYPE_SWITCH_GETCONFIG,
+                         .component_id = switch_id};
+  int req_id = request_queue_add(queue, "Switch.GetConfig", params, &desc);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Switch.GetConfig to request queue\n");
     return -1;
   }
 
-  printf("Requesting switch %d configuration (ID: %d)...\n", switch_id, req_id);
+  log_debug(LOG_CAT_STATE, "Requesting switch %d configuration (ID: %d)...\n",
+            switch_id, req_id);
 
-  free(request);
   return req_id;
 }
 
-int device_state_update_switch_config(device_state_t *state, const char *json,
-                                      int switch_id) {
-  if (!state || !json || switch_id < 0 || switch_id >= MAX_SWITCHES) {
-    return -1;
-  }
-
-  /* Parse JSON response to extract result */
-  struct mg_str json_str = mg_str(json);
-
-  /* Check if this is an error response (e.g., switch doesn't exist) */
-  char error_msg[256];
-  if (jsonrpc_is_error(json, error_msg, sizeof(error_msg))) {
-    /* Silently ignore - switch probably doesn't exist on this device */
-    return -1;
-  }
-
-  /* Extract the result object */
-  int result_len = 0;
-  int result_pos = mg_json_get(json_str, "$.result", &result_len);
-
-  if (result_pos < 0 || result_len <= 0) {
-    fprintf(stderr, "Error: No result field in switch %d config response\n",
-            switch_id);
-    return -1;
-  }
-
+/* Store and parse a Switch config object (Switch.GetConfig result, or a
+ * "switch:N" member of Shelly.GetConfig) */
+static int apply_switch_config(device_state_t *state, int switch_id,
+                               const char *obj, int result_len) {
   /* Allocate and copy the result portion */
   char *result_str = malloc(result_len + 1);
   if (!result_str) {
     return -1;
   }
-  memcpy(result_str, json + result_pos, result_len);
+  memcpy(result_str, obj, result_len);
   result_str[result_len] = '\0';
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_wrlock(&state->lock);
 
-  switch_config_t *sw = &state->switches.switches[switch_id];
+  switch_config_t *sw = switch_slot(state, switch_id);
+  if (!sw) {
+    pthread_rwlock_unlock(&state->lock);
+    free(result_str);
+    return -1;
+  }
 
   /* Free old data */
   if (sw->raw_json) {
@@ -1292,26 +1196,25 @@ int device_state_update_switch_config(device_state_t *state, const char *json,
   struct mg_str result = mg_str(result_str);
 
   /* Parse fields */
-  char *name = mg_json_get_str(result, "$.name");
-  if (name) {
-    snprintf(sw->parsed.name, MAX_SWITCH_NAME, "%s", name);
-    free(name);
-  } else {
+  if (!json_get_str_buf(result, "$.name", sw->parsed.name, MAX_SWITCH_NAME)) {
     sw->parsed.name[0] = '\0';
   }
 
-  char *in_mode_str = mg_json_get_str(result, "$.in_mode");
-  sw->parsed.in_mode = parse_switch_in_mode(in_mode_str);
-  if (in_mode_str) free(in_mode_str);
+  char enum_str[32];
+  sw->parsed.in_mode = parse_switch_in_mode(
+      json_get_str_buf(result, "$.in_mode", enum_str, sizeof(enum_str))
+          ? enum_str
+          : NULL);
 
   double in_locked_val = 0;
   if (mg_json_get_num(result, "$.in_locked", &in_locked_val)) {
     sw->parsed.in_locked = (in_locked_val != 0);
   }
 
-  char *initial_state_str = mg_json_get_str(result, "$.initial_state");
-  sw->parsed.initial_state = parse_switch_initial_state(initial_state_str);
-  if (initial_state_str) free(initial_state_str);
+  sw->parsed.initial_state = parse_switch_initial_state(
+      json_get_str_buf(result, "$.initial_state", enum_str, sizeof(enum_str))
+          ? enum_str
+          : NULL);
 
   double auto_on_val = 0;
   if (mg_json_get_num(result, "$.auto_on", &auto_on_val)) {
@@ -1353,99 +1256,223 @@ int device_state_update_switch_config(device_state_t *state, const char *json,
     state->switches.count = switch_id + 1;
   }
 
-  printf("Switch %d configuration updated successfully\n", switch_id);
+  log_debug(LOG_CAT_STATE, "Switch %d configuration updated successfully\n",
+            switch_id);
+
+  pthread_rwlock_unlock(&state->lock);
 
-  pthread_mutex_unlock(&state->mutex);
+  notify_change(state, STATE_CHANGE_SWITCH_CONFIG, switch_id, 0);
   return 0;
 }
 
+int device_state_update_switch_config(device_state_t *state,
+                                      const jsonrpc_frame_t *response,
+                                      int switch_id) {
+  if (!state || !response || switch_id < 0 || switch_id >= MAX_SWITCHES) {
+    return -1;
+  }
+
+  /* Check if this is an error response (e.g., switch doesn't exist) */
+  if (response->is_error) {
+    /* Silently ignore - switch probably doesn't exist on this device */
+    return -1;
+  }
+
+  if (response->result_len == 0) {
+    log_error(LOG_CAT_STATE,
+              "Error: No result field in switch %d config response\n",
+              switch_id);
+    return -1;
+  }
+
+  return apply_switch_config(state, switch_id, response->result,
+                             (int) response->result_len);
+}
+
 int device_state_get_switch_config_str(device_state_t *state, int switch_id,
                                        char **output) {
   if (!state || !output || switch_id < 0 || switch_id >= MAX_SWITCHES) {
     return -1;
   }
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_rdlock(&state->lock);
 
-  switch_config_t *sw = &state->switches.switches[switch_id];
+  switch_config_t *sw = state->switches.switches[switch_id];
 
-  if (!sw->valid || !sw->raw_json) {
-    pthread_mutex_unlock(&state->mutex);
+  if (!sw || !sw->valid || !sw->raw_json) {
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
 
   *output = strdup(sw->raw_json);
 
-  pthread_mutex_unlock(&state->mutex);
+  pthread_rwlock_unlock(&state->lock);
 
   return (*output != NULL) ? 0 : -1;
 }
 
-int device_state_set_switch_config_from_json(const char *user_json,
-                                             request_queue_t *queue,
-                                             struct mg_connection *conn,
-                                             int switch_id) {
-  if (!user_json || !queue || !conn || switch_id < 0 ||
-      switch_id >= MAX_SWITCHES) {
+/* ============================================================================
+ * STATUS HISTORY
+ * ============================================================================
+ */
+
+int device_state_set_history_depth(device_state_t *state, unsigned int depth) {
+  if (!state) {
     return -1;
   }
 
-  /* Validate that user_json is valid JSON */
-  struct mg_str json_str = mg_str(user_json);
-  int dummy_len = 0;
-  int validation = mg_json_get(json_str, "$", &dummy_len);
-  if (validation < 0) {
-    fprintf(stderr, "Error: Invalid JSON provided by user\n");
+  pthread_rwlock_wrlock(&state->lock);
+  int ret = 0;
+  for (int i = 0; i < MAX_SWITCHES && ret == 0; i++) {
+    if (state->switches.switches[i]) {
+      ret = switch_history_reset(state->switches.switches[i], depth);
+    }
+  }
+  for (int i = 0; i < MAX_INPUTS && ret == 0; i++) {
+    if (state->inputs.inputs[i]) {
+      ret = input_history_reset(state->inputs.inputs[i], depth);
+    }
+  }
+  if (ret != 0) {
+    /* Leave history disabled everywhere rather than on some components */
+    depth = 0;
+    for (int i = 0; i < MAX_SWITCHES; i++) {
+      if (state->switches.switches[i]) {
+        switch_history_reset(state->switches.switches[i], 0);
+      }
+    }
+    for (int i = 0; i < MAX_INPUTS; i++) {
+      if (state->inputs.inputs[i]) {
+        input_history_reset(state->inputs.inputs[i], 0);
+      }
+    }
+  }
+  state->history_depth = depth;
+  pthread_rwlock_unlock(&state->lock);
+
+  return ret;
+}
+
+/* Wall-clock time with sub-second resolution, for history records */
+static double history_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (double) ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Record a switch's current status (caller holds the state lock) */
+static void history_push_switch(switch_config_t *sw) {
+  switch_history_t *hist = &sw->history;
+  if (!hist->records) {
+    return;
+  }
+
+  hist->records[hist->head] = (switch_history_record_t) {
+      .ts = history_now(),
+      .output = sw->status.output,
+      .apower = sw->status.apower,
+      .voltage = sw->status.voltage,
+      .current = sw->status.current,
+      .energy_total = sw->status.energy_total,
+      .temperature_c = sw->status.temperature_c};
+  hist->head = (hist->head + 1) % hist->depth;
+  if (hist->count < hist->depth) {
+    hist->count++;
+  }
+}
+
+/* Record an input's current status (caller holds the state lock) */
+static void history_push_input(input_config_t *inp) {
+  input_history_t *hist = &inp->history;
+  if (!hist->records) {
+    return;
+  }
+
+  hist->records[hist->head] = (input_history_record_t) {
+      .ts = history_now(), .state = inp->status.state};
+  hist->head = (hist->head + 1) % hist->depth;
+  if (hist->count < hist->depth) {
+    hist->count++;
+  }
+}
+
+int device_state_get_switch_history_csv_locked(device_state_t *state,
+                                               int switch_id, char **output) {
+  if (!state || !output || switch_id < 0 || switch_id >= MAX_SWITCHES) {
     return -1;
   }
 
-  /* Build params: {"id": switch_id, "config": {user_json}} */
-  size_t params_size = strlen(user_json) + 64;
-  char *params = malloc(params_size);
-  if (!params) {
-    fprintf(stderr, "Error: Failed to allocate params buffer\n");
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&buf, &len);
+  if (!out) {
     return -1;
   }
-  snprintf(params, params_size, "{\"id\":%d,\"config\":%s}", switch_id,
-           user_json);
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    free(params);
+  const switch_config_t *sw = state->switches.switches[switch_id];
+  if (!sw) {
+    fclose(out);
+    free(buf);
     return -1;
   }
 
-  /* Build JSON-RPC request */
-  char *request = jsonrpc_build_request("Switch.SetConfig", req_id, params);
-  free(params);
+  const switch_history_t *hist = &sw->history;
+  fputs("ts,output,apower,voltage,current,energy,temperature\n", out);
+  for (unsigned int i = 0; i < hist->count; i++) {
+    /* Oldest record first */
+    const switch_history_record_t *rec =
+        &hist->records[(hist->head + hist->depth - hist->count + i) %
+                       hist->depth];
+    fprintf(out, "%.3f,%d,%.1f,%.1f,%.3f,%.3f,%.1f\n", rec->ts,
+            rec->output ? 1 : 0, rec->apower, rec->voltage, rec->current,
+            rec->energy_total, rec->temperature_c);
+  }
 
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Switch.SetConfig request\n");
+  if (fclose(out) != 0) {
+    free(buf);
     return -1;
   }
 
-  /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Switch.SetConfig to request queue\n");
-    free(request);
+  *output = buf;
+  return 0;
+}
+
+int device_state_get_input_history_csv_locked(device_state_t *state,
+                                              int input_id, char **output) {
+  if (!state || !output || input_id < 0 || input_id >= MAX_INPUTS) {
     return -1;
   }
 
-  printf("Setting switch %d configuration from user edit (ID: %d)...\n",
-         switch_id, req_id);
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&buf, &len);
+  if (!out) {
+    return -1;
+  }
 
-  /* Request is queued and will be sent by ws_thread_func */
-  free(request);
-  return req_id;
-}
+  const input_config_t *inp = state->inputs.inputs[input_id];
+  if (!inp) {
+    fclose(out);
+    free(buf);
+    return -1;
+  }
+
+  const input_history_t *hist = &inp->history;
+  fputs("ts,state\n", out);
+  for (unsigned int i = 0; i < hist->count; i++) {
+    const input_history_record_t *rec =
+        &hist->records[(hist->head + hist->depth - hist->count + i) %
+                       hist->depth];
+    fprintf(out, "%.3f,%d\n", rec->ts, rec->state ? 1 : 0);
+  }
+
+  if (fclose(out) != 0) {
+    free(buf);
+    return -1;
+  }
 
-int device_state_is_switch_config_notification(const char *json, size_t len,
-                                               int switch_id) {
-  (void) switch_id; /* Currently we check for any switch notification */
-  return device_state_is_component_notification(json, len, "switch");
+  *output = buf;
+  return 0;
 }
 
 /* ============================================================================
@@ -1465,32 +1492,23 @@ int device_state_set_switch(device_state_t *state, request_queue_t *queue,
   snprintf(params, sizeof(params), "{\"id\":%d,\"on\":%s}", switch_id,
            on ? "true" : "false");
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    return -1;
-  }
-
-  /* Build JSON-RPC request */
-  char *request = jsonrpc_build_request("Switch.Set", req_id, params);
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Switch.Set request\n");
-    return -1;
-  }
-
   /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Switch.Set to request queue\n");
-    free(request);
+  /* A newer Switch.Set for this switch replaces it while it is queued; it
+   * goes out ahead of config and bulk traffic */
+  request_desc_t desc = {.method = RESPONSE_TYPE_SWITCH_SET,
+                         .component_id = switch_id,
+                         .coalesce = 1,
+                         .lane = REQUEST_LANE_INTERACTIVE};
+  int req_id = request_queue_add(queue, "Switch.Set", params, &desc);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Switch.Set to request queue\n");
     return -1;
   }
 
-  printf("Setting switch %d to %s (ID: %d)...\n", switch_id, on ? "ON" : "OFF",
-         req_id);
+  log_debug(LOG_CAT_STATE, "Setting switch %d to %s (ID: %d)...\n", switch_id,
+            on ? "ON" : "OFF", req_id);
 
-  free(request);
   return req_id;
 }
 
@@ -1506,488 +1524,245 @@ int device_state_request_switch_status(device_state_t *state,
   char params[64];
   snprintf(params, sizeof(params), "{\"id\":%d}", switch_id);
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
+  /* Add to request queue; a queued duplicate would fetch the same status, so
+   * it is replaced (this also keeps the status request that follows a write
+   * of proc/switch/N/output behind the Switch.Set as it is debounced) */
+  request_desc_t desc = {.method = RESPONSE_TYPE_SWITCH_GETSTATUS,
+                         .component_id = switch_id,
+                         .coalesce = 1};
+  int req_id = request_queue_add(queue, "Switch.GetStatus", params, &desc);
   if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Switch.GetStatus to request queue\n");
     return -1;
   }
 
-  /* Build JSON-RPC request */
-  char *request = jsonrpc_build_request("Switch.GetStatus", req_id, params);
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Switch.GetStatus request\n");
-    return -1;
-  }
+  log_debug(LOG_CAT_STATE, "Requesting switch %d status (ID: %d)...\n",
+            switch_id, req_id);
 
-  /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Switch.GetStatus to request queue\n");
-    free(request);
-    return -1;
+  return req_id;
+}
+
+/* Apply a Switch status object ({"id":0,"output":true,"apower":...}) in one
+ * pass. Shared by Switch.GetStatus/Switch.Set responses and NotifyStatus.
+ * Returns the SWITCH_FIELD_* bits that changed. Caller holds the state
+ * lock. */
+static unsigned int apply_switch_status(switch_config_t *sw,
+                                        struct mg_str obj, time_t now) {
+  struct mg_str key, val;
+  size_t ofs = 0;
+  unsigned int changed = 0;
+
+  while ((ofs = mg_json_next(obj, ofs, &key, &val)) > 0) {
+    double num = 0.0;
+    bool flag = false;
+
+    if (json_key_is(key, "id")) {
+      if (mg_json_get_num(val, "$", &num) && sw->status.id != (int) num) {
+        sw->status.id = (int) num;
+        sw->status.mtime_id = now;
+        changed |= SWITCH_FIELD_ID;
+      }
+    } else if (json_key_is(key, "source")) {
+      char source[sizeof(sw->status.source)];
+      if (json_val_str(val, source, sizeof(source)) &&
+          strcmp(sw->status.source, source) != 0) {
+        memcpy(sw->status.source, source, sizeof(source));
+        sw->status.mtime_source = now;
+        changed |= SWITCH_FIELD_SOURCE;
+      }
+    } else if (json_key_is(key, "output")) {
+      if (mg_json_get_bool(val, "$", &flag) && sw->status.output != flag) {
+        sw->status.output = flag;
+        sw->status.mtime_output = now;
+        changed |= SWITCH_FIELD_OUTPUT;
+      }
+    } else if (json_key_is(key, "apower")) {
+      if (mg_json_get_num(val, "$", &num)) {
+        changed |= update_num_field(&sw->status.apower,
+                                    &sw->status.mtime_apower, num, now,
+                                    SWITCH_FIELD_APOWER);
+      }
+    } else if (json_key_is(key, "voltage")) {
+      if (mg_json_get_num(val, "$", &num)) {
+        changed |= update_num_field(&sw->status.voltage,
+                                    &sw->status.mtime_voltage, num, now,
+                                    SWITCH_FIELD_VOLTAGE);
+      }
+    } else if (json_key_is(key, "current")) {
+      if (mg_json_get_num(val, "$", &num)) {
+        changed |= update_num_field(&sw->status.current,
+                                    &sw->status.mtime_current, num, now,
+                                    SWITCH_FIELD_CURRENT);
+      }
+    } else if (json_key_is(key, "freq")) {
+      if (mg_json_get_num(val, "$", &num)) {
+        changed |= update_num_field(&sw->status.freq, &sw->status.mtime_freq,
+                                    num, now, SWITCH_FIELD_FREQ);
+      }
+    } else if (json_key_is(key, "aenergy")) {
+      /* Energy counters (aenergy.total) */
+      if (mg_json_get_num(val, "$.total", &num)) {
+        changed |= update_num_field(&sw->status.energy_total,
+                                    &sw->status.mtime_energy, num, now,
+                                    SWITCH_FIELD_ENERGY);
+      }
+    } else if (json_key_is(key, "ret_aenergy")) {
+      /* Returned energy counters (ret_aenergy.total, optional) */
+      if (mg_json_get_num(val, "$.total", &num)) {
+        changed |= update_num_field(&sw->status.ret_energy_total,
+                                    &sw->status.mtime_ret_energy, num, now,
+                                    SWITCH_FIELD_RET_ENERGY);
+      }
+    } else if (json_key_is(key, "temperature")) {
+      /* Small {"tC":..,"tF":..} object */
+      struct mg_str tkey, tval;
+      size_t tofs = 0;
+      while ((tofs = mg_json_next(val, tofs, &tkey, &tval)) > 0) {
+        if (json_key_is(tkey, "tC") && mg_json_get_num(tval, "$", &num)) {
+          changed |= update_num_field(&sw->status.temperature_c,
+                                      &sw->status.mtime_temperature, num, now,
+                                      SWITCH_FIELD_TEMPERATURE);
+        } else if (json_key_is(tkey, "tF") &&
+                   mg_json_get_num(tval, "$", &num)) {
+          sw->status.temperature_f = num;
+        }
+      }
+    }
   }
 
-  printf("Requesting switch %d status (ID: %d)...\n", switch_id, req_id);
+  /* Parse overtemperature flag - could be in errors array */
+  /* For now, assume no overtemperature */
+  sw->status.overtemperature = false;
+
+  /* Updates that repeat the stored values add nothing to the history */
+  if (changed) {
+    history_push_switch(sw);
+  }
 
-  free(request);
-  return req_id;
+  sw->status.last_status_update = now;
+  return changed;
 }
 
-int device_state_update_switch_status(device_state_t *state, const char *json,
+int device_state_update_switch_status(device_state_t *state,
+                                      const jsonrpc_frame_t *response,
                                       int switch_id) {
-  if (!state || !json || switch_id < 0 || switch_id >= MAX_SWITCHES) {
+  if (!state || !response || switch_id < 0 || switch_id >= MAX_SWITCHES) {
     return -1;
   }
 
-  /* Parse JSON response to extract result */
-  struct mg_str json_str = mg_str(json);
-
   /* Check if this is an error response */
   char error_msg[256];
-  if (jsonrpc_is_error(json, error_msg, sizeof(error_msg))) {
-    fprintf(stderr, "Error getting switch %d status: %s\n", switch_id,
-            error_msg);
+  if (jsonrpc_is_error(response, error_msg, sizeof(error_msg))) {
+    log_error(LOG_CAT_STATE, "Error getting switch %d status: %s\n", switch_id,
+              error_msg);
     return -1;
   }
 
-  /* Extract the result object */
-  int result_len = 0;
-  int result_pos = mg_json_get(json_str, "$.result", &result_len);
-
-  if (result_pos < 0 || result_len <= 0) {
-    fprintf(stderr, "Error: No result field in switch %d status response\n",
-            switch_id);
+  if (response->result_len == 0) {
+    log_error(LOG_CAT_STATE,
+              "Error: No result field in switch %d status response\n",
+              switch_id);
     return -1;
   }
 
-  /* Create substring for result */
-  struct mg_str result_str = mg_str_n(json + result_pos, result_len);
+  struct mg_str result_str = frame_result(response);
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_wrlock(&state->lock);
 
   switch_config_t *sw = device_state_get_switch(state, switch_id);
   if (!sw || !sw->valid) {
-    pthread_mutex_unlock(&state->mutex);
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
 
-  time_t now = time(NULL);
-
-  /* Parse id */
-  double id_val = 0.0;
-  if (mg_json_get_num(result_str, "$.id", &id_val)) {
-    int new_id = (int) id_val;
-    if (sw->status.id != new_id) {
-      sw->status.id = new_id;
-      sw->status.mtime_id = now;
-    }
-  }
-
-  /* Parse source */
-  char *source_str = mg_json_get_str(result_str, "$.source");
-  if (source_str) {
-    if (strcmp(sw->status.source, source_str) != 0) {
-      strncpy(sw->status.source, source_str, sizeof(sw->status.source) - 1);
-      sw->status.source[sizeof(sw->status.source) - 1] = '\0';
-      sw->status.mtime_source = now;
-    }
-    free(source_str);
-  }
-
-  /* Parse output state */
-  bool output_val = false;
-  if (mg_json_get_bool(result_str, "$.output", &output_val)) {
-    if (sw->status.output != output_val) {
-      sw->status.output = output_val;
-      sw->status.mtime_output = now;
-    }
-  }
-
-  /* Parse power */
-  double apower_val = 0.0;
-  if (mg_json_get_num(result_str, "$.apower", &apower_val)) {
-    if (sw->status.apower != apower_val) {
-      sw->status.apower = apower_val;
-      sw->status.mtime_apower = now;
-    }
-  }
+  unsigned int changed = apply_switch_status(sw, result_str, time(NULL));
 
-  /* Parse voltage */
-  double voltage_val = 0.0;
-  if (mg_json_get_num(result_str, "$.voltage", &voltage_val)) {
-    if (sw->status.voltage != voltage_val) {
-      sw->status.voltage = voltage_val;
-      sw->status.mtime_voltage = now;
-    }
-  }
+  pthread_rwlock_unlock(&state->lock);
 
-  /* Parse current */
-  double current_val = 0.0;
-  if (mg_json_get_num(result_str, "$.current", &current_val)) {
-    if (sw->status.current != current_val) {
-      sw->status.current = current_val;
-      sw->status.mtime_current = now;
-    }
+  if (changed) {
+    notify_change(state, STATE_CHANGE_SWITCH_STATUS, switch_id, changed);
   }
 
-  /* Parse frequency (optional) */
-  double freq_val = 0.0;
-  if (mg_json_get_num(result_str, "$.freq", &freq_val)) {
-    if (sw->status.freq != freq_val) {
-      sw->status.freq = freq_val;
-      sw->status.mtime_freq = now;
-    }
-  }
+  log_debug(LOG_CAT_STATE,
+            "Switch %d status updated: output=%s, power=%.1fW, voltage=%.1fV, "
+            "current=%.2fA, temp=%.1fC, energy=%.3fWh\n",
+            switch_id, sw->status.output ? "ON" : "OFF", sw->status.apower,
+            sw->status.voltage, sw->status.current, sw->status.temperature_c,
+            sw->status.energy_total);
 
-  /* Parse energy total (aenergy.total) - access nested field directly */
-  double energy_total = 0.0;
-  if (mg_json_get_num(result_str, "$.aenergy.total", &energy_total)) {
-    if (sw->status.energy_total != energy_total) {
-      sw->status.energy_total = energy_total;
-      sw->status.mtime_energy = now;
-    }
-  }
+  return 0;
+}
 
-  /* Parse returned energy total (ret_aenergy.total, optional) - access nested
-   * field directly */
-  double ret_energy_total = 0.0;
-  if (mg_json_get_num(result_str, "$.ret_aenergy.total", &ret_energy_total)) {
-    if (sw->status.ret_energy_total != ret_energy_total) {
-      sw->status.ret_energy_total = ret_energy_total;
-      sw->status.mtime_ret_energy = now;
-    }
-  }
+/* ============================================================================
+ * INPUT CONFIGURATION (Input.GetConfig / Input.SetConfig)
+ * ============================================================================
+ */
 
-  /* Parse temperature - access nested fields directly */
-  double temp_c = 0.0;
-  double temp_f = 0.0;
-  if (mg_json_get_num(result_str, "$.temperature.tC", &temp_c)) {
-    if (sw->status.temperature_c != temp_c) {
-      sw->status.temperature_c = temp_c;
-      sw->status.mtime_temperature = now;
-    }
-  }
-  if (mg_json_get_num(result_str, "$.temperature.tF", &temp_f)) {
-    sw->status.temperature_f = temp_f;
+input_config_t *device_state_get_input(device_state_t *state, int input_id) {
+  if (!state || input_id < 0 || input_id >= MAX_INPUTS) {
+    return NULL;
   }
-
-  /* Parse overtemperature flag - could be in errors array */
-  /* For now, assume no overtemperature */
-  sw->status.overtemperature = false;
-
-  sw->status.last_status_update = now;
-
-  pthread_mutex_unlock(&state->mutex);
-
-  printf(
-      "Switch %d status updated: output=%s, power=%.1fW, voltage=%.1fV, "
-      "current=%.2fA, temp=%.1fC, energy=%.3fWh\n",
-      switch_id, sw->status.output ? "ON" : "OFF", sw->status.apower,
-      sw->status.voltage, sw->status.current, sw->status.temperature_c,
-      sw->status.energy_total);
-
-  return 0;
+  return state->inputs.inputs[input_id];
 }
 
-int device_state_is_switch_status_notification(const char *json, size_t len) {
-  if (!json || len == 0) {
-    return 0;
+int device_state_request_input_config(device_state_t *state,
+                                      request_queue_t *queue,
+                                      struct mg_connection *conn,
+                                      int input_id) {
+  if (!state || !queue || !conn || input_id < 0 || input_id >= MAX_INPUTS) {
+    return -1;
   }
 
-  struct mg_str json_str = mg_str_n(json, len);
+  /* Build params: {"id": input_id} */
+  char params[64];
+  snprintf(params, sizeof(params), "{\"id\":%d}", input_id);
 
-  /* Check for NotifyStatus or NotifyEvent with switch component */
-  char *method = mg_json_get_str(json_str, "$.method");
-  if (!method) {
-    return 0;
+  /* Add to request queue */
+  request_desc_t desc = {.method = RESPONSE_TYPE_INPUT_GETCONFIG,
+                         .component_id = input_id};
+  int req_id = request_queue_add(queue, "Input.GetConfig", params, &desc);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Input.GetConfig to request queue\n");
+    return -1;
   }
 
-  int is_switch_notif = 0;
-
-  if (strcmp(method, "NotifyStatus") == 0) {
-    /* Check if params contain switch status - look in the raw JSON */
-    if (strstr(json, "\"switch:") != NULL) {
-      is_switch_notif = 1;
-    }
-  } else if (strcmp(method, "NotifyEvent") == 0) {
-    /* Check for switch component events */
-    is_switch_notif =
-        device_state_is_component_notification(json, len, "switch");
-  }
+  log_debug(LOG_CAT_STATE, "Requesting input %d configuration (ID: %d)...\n",
+            input_id, req_id);
 
-  free(method);
-  return is_switch_notif;
+  return req_id;
 }
 
-int device_state_update_switch_status_from_notification(device_state_t *state,
-                                                        const char *json) {
-  if (!state || !json) {
+/* Store and parse an Input config object (Input.GetConfig result, or an
+ * "input:N" member of Shelly.GetConfig) */
+static int apply_input_config(device_state_t *state, int input_id,
+                              const char *obj, int result_len) {
+  /* Extract the result substring for raw JSON storage */
+  char *result_json = strndup(obj, result_len);
+  if (!result_json) {
     return -1;
   }
 
-  struct mg_str json_str = mg_str(json);
+  pthread_rwlock_wrlock(&state->lock);
 
-  /* Get the params object */
-  int params_len = 0;
-  int params_pos = mg_json_get(json_str, "$.params", &params_len);
-  if (params_pos < 0 || params_len <= 0) {
+  input_config_t *inp = input_slot(state, input_id);
+  if (!inp) {
+    pthread_rwlock_unlock(&state->lock);
+    free(result_json);
     return -1;
   }
 
-  struct mg_str params_str = mg_str_n(json + params_pos, params_len);
-
-  /* Iterate through all possible switches to find which ones are in the
-   * notification */
-  int updated_count = 0;
-  for (int switch_id = 0; switch_id < MAX_SWITCHES; switch_id++) {
-    /* Build the key name: switch:N */
-    char key[32];
-    snprintf(key, sizeof(key), "$.switch:%d", switch_id);
+  /* Free old raw JSON if exists */
+  if (inp->raw_json) {
+    free(inp->raw_json);
+  }
 
-    /* Check if this switch is in the params */
-    int switch_data_len = 0;
-    int switch_data_pos = mg_json_get(params_str, key, &switch_data_len);
+  inp->raw_json = result_json;
+  inp->json_len = result_len;
 
-    if (switch_data_pos >= 0 && switch_data_len > 0) {
-      pthread_mutex_lock(&state->mutex);
-
-      switch_config_t *sw = device_state_get_switch(state, switch_id);
-      if (!sw || !sw->valid) {
-        pthread_mutex_unlock(&state->mutex);
-        continue;
-      }
-
-      /* Create substring for this switch's status */
-      struct mg_str switch_str =
-          mg_str_n(params_str.buf + switch_data_pos, switch_data_len);
-
-      time_t now = time(NULL);
-
-      /* Parse all status fields - same as device_state_update_switch_status but
-       * from switch_str */
-
-      /* Parse id */
-      double id_val = 0.0;
-      if (mg_json_get_num(switch_str, "$.id", &id_val)) {
-        int new_id = (int) id_val;
-        if (sw->status.id != new_id) {
-          sw->status.id = new_id;
-          sw->status.mtime_id = now;
-        }
-      }
-
-      /* Parse source */
-      char *source_str = mg_json_get_str(switch_str, "$.source");
-      if (source_str) {
-        if (strcmp(sw->status.source, source_str) != 0) {
-          strncpy(sw->status.source, source_str, sizeof(sw->status.source) - 1);
-          sw->status.source[sizeof(sw->status.source) - 1] = '\0';
-          sw->status.mtime_source = now;
-        }
-        free(source_str);
-      }
-
-      /* Parse output state */
-      bool output_val = false;
-      if (mg_json_get_bool(switch_str, "$.output", &output_val)) {
-        if (sw->status.output != output_val) {
-          sw->status.output = output_val;
-          sw->status.mtime_output = now;
-        }
-      }
-
-      /* Parse power */
-      double apower_val = 0.0;
-      if (mg_json_get_num(switch_str, "$.apower", &apower_val)) {
-        if (sw->status.apower != apower_val) {
-          sw->status.apower = apower_val;
-          sw->status.mtime_apower = now;
-        }
-      }
-
-      /* Parse voltage */
-      double voltage_val = 0.0;
-      if (mg_json_get_num(switch_str, "$.voltage", &voltage_val)) {
-        if (sw->status.voltage != voltage_val) {
-          sw->status.voltage = voltage_val;
-          sw->status.mtime_voltage = now;
-        }
-      }
-
-      /* Parse current */
-      double current_val = 0.0;
-      if (mg_json_get_num(switch_str, "$.current", &current_val)) {
-        if (sw->status.current != current_val) {
-          sw->status.current = current_val;
-          sw->status.mtime_current = now;
-        }
-      }
-
-      /* Parse frequency (optional) */
-      double freq_val = 0.0;
-      if (mg_json_get_num(switch_str, "$.freq", &freq_val)) {
-        if (sw->status.freq != freq_val) {
-          sw->status.freq = freq_val;
-          sw->status.mtime_freq = now;
-        }
-      }
-
-      /* Parse energy total (aenergy.total) */
-      double energy_total = 0.0;
-      if (mg_json_get_num(switch_str, "$.aenergy.total", &energy_total)) {
-        if (sw->status.energy_total != energy_total) {
-          sw->status.energy_total = energy_total;
-          sw->status.mtime_energy = now;
-        }
-      }
-
-      /* Parse returned energy total (ret_aenergy.total, optional) */
-      double ret_energy_total = 0.0;
-      if (mg_json_get_num(switch_str, "$.ret_aenergy.total",
-                          &ret_energy_total)) {
-        if (sw->status.ret_energy_total != ret_energy_total) {
-          sw->status.ret_energy_total = ret_energy_total;
-          sw->status.mtime_ret_energy = now;
-        }
-      }
-
-      /* Parse temperature */
-      double temp_c = 0.0;
-      double temp_f = 0.0;
-      if (mg_json_get_num(switch_str, "$.temperature.tC", &temp_c)) {
-        if (sw->status.temperature_c != temp_c) {
-          sw->status.temperature_c = temp_c;
-          sw->status.mtime_temperature = now;
-        }
-      }
-      if (mg_json_get_num(switch_str, "$.temperature.tF", &temp_f)) {
-        sw->status.temperature_f = temp_f;
-      }
-
-      /* Parse overtemperature flag */
-      sw->status.overtemperature = false;
-
-      sw->status.last_status_update = now;
-
-      printf(
-          "Switch %d status updated from notification: output=%s, power=%.1fW, "
-          "voltage=%.1fV, current=%.2fA, temp=%.1fC, energy=%.3fWh\n",
-          switch_id, sw->status.output ? "ON" : "OFF", sw->status.apower,
-          sw->status.voltage, sw->status.current, sw->status.temperature_c,
-          sw->status.energy_total);
-
-      pthread_mutex_unlock(&state->mutex);
-      updated_count++;
-    }
-  }
-
-  return updated_count > 0 ? 0 : -1;
-}
-
-/* ============================================================================
- * INPUT CONFIGURATION (Input.GetConfig / Input.SetConfig)
- * ============================================================================
- */
-
-input_config_t *device_state_get_input(device_state_t *state, int input_id) {
-  if (!state || input_id < 0 || input_id >= MAX_INPUTS) {
-    return NULL;
-  }
-  return &state->inputs.inputs[input_id];
-}
-
-int device_state_request_input_config(device_state_t *state,
-                                      request_queue_t *queue,
-                                      struct mg_connection *conn,
-                                      int input_id) {
-  if (!state || !queue || !conn || input_id < 0 || input_id >= MAX_INPUTS) {
-    return -1;
-  }
-
-  /* Build params: {"id": input_id} */
-  char params[64];
-  snprintf(params, sizeof(params), "{\"id\":%d}", input_id);
-
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    return -1;
-  }
-
-  /* Build JSON-RPC request */
-  char *request = jsonrpc_build_request("Input.GetConfig", req_id, params);
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Input.GetConfig request\n");
-    return -1;
-  }
-
-  /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Input.GetConfig to request queue\n");
-    free(request);
-    return -1;
-  }
-
-  printf("Requesting input %d configuration (ID: %d)...\n", input_id, req_id);
-
-  free(request);
-  return req_id;
-}
-
-int device_state_update_input_config(device_state_t *state, const char *json,
-                                     int input_id) {
-  if (!state || !json || input_id < 0 || input_id >= MAX_INPUTS) {
-    return -1;
-  }
-
-  /* Parse JSON response to extract result */
-  struct mg_str json_str = mg_str(json);
-
-  /* Check if this is an error response (e.g., input doesn't exist) */
-  char error_msg[256];
-  if (jsonrpc_is_error(json, error_msg, sizeof(error_msg))) {
-    /* Silently ignore - input probably doesn't exist on this device */
-    return -1;
-  }
-
-  pthread_mutex_lock(&state->mutex);
-
-  input_config_t *inp = device_state_get_input(state, input_id);
-  if (!inp) {
-    pthread_mutex_unlock(&state->mutex);
-    return -1;
-  }
-
-  /* Get result object */
-  int result_len = 0;
-  int result_pos = mg_json_get(json_str, "$.result", &result_len);
-  if (result_pos < 0 || result_len <= 0) {
-    fprintf(stderr, "Error: No result field in input %d config response\n",
-            input_id);
-    pthread_mutex_unlock(&state->mutex);
-    return -1;
-  }
-
-  /* Extract the result substring for raw JSON storage */
-  char *result_json = strndup(json + result_pos, result_len);
-  if (!result_json) {
-    pthread_mutex_unlock(&state->mutex);
-    return -1;
-  }
-
-  /* Free old raw JSON if exists */
-  if (inp->raw_json) {
-    free(inp->raw_json);
-  }
-
-  inp->raw_json = result_json;
-  inp->json_len = result_len;
-
-  /* Parse fields */
-  struct mg_str result_str = mg_str_n(json + result_pos, result_len);
+  /* Parse fields */
+  struct mg_str result_str = mg_str_n(obj, result_len);
 
   /* Parse id */
   double id_val = 0.0;
@@ -1996,18 +1771,14 @@ int device_state_update_input_config(device_state_t *state, const char *json,
   }
 
   /* Parse name */
-  char *name_str = mg_json_get_str(result_str, "$.name");
-  if (name_str) {
-    strncpy(inp->parsed.name, name_str, sizeof(inp->parsed.name) - 1);
-    inp->parsed.name[sizeof(inp->parsed.name) - 1] = '\0';
-    free(name_str);
-  } else {
+  if (!json_get_str_buf(result_str, "$.name", inp->parsed.name,
+                        sizeof(inp->parsed.name))) {
     inp->parsed.name[0] = '\0';
   }
 
   /* Parse type */
-  char *type_str = mg_json_get_str(result_str, "$.type");
-  if (type_str) {
+  char type_str[32];
+  if (json_get_str_buf(result_str, "$.type", type_str, sizeof(type_str))) {
     if (strcmp(type_str, "switch") == 0) {
       inp->parsed.type = INPUT_TYPE_SWITCH;
     } else if (strcmp(type_str, "button") == 0) {
@@ -2017,7 +1788,6 @@ int device_state_update_input_config(device_state_t *state, const char *json,
     } else {
       inp->parsed.type = INPUT_TYPE_UNKNOWN;
     }
-    free(type_str);
   }
 
   /* Parse enable */
@@ -2032,121 +1802,59 @@ int device_state_update_input_config(device_state_t *state, const char *json,
   inp->valid = 1;
   inp->last_update = time(NULL);
 
-  pthread_mutex_unlock(&state->mutex);
+  pthread_rwlock_unlock(&state->lock);
 
-  printf("Input %d config updated: name=\"%s\", type=%d, enable=%s\n", input_id,
-         inp->parsed.name, inp->parsed.type,
-         inp->parsed.enable ? "true" : "false");
+  log_debug(LOG_CAT_STATE,
+            "Input %d config updated: name=\"%s\", type=%d, enable=%s\n",
+            input_id, inp->parsed.name, inp->parsed.type,
+            inp->parsed.enable ? "true" : "false");
 
+  notify_change(state, STATE_CHANGE_INPUT_CONFIG, input_id, 0);
   return 0;
 }
 
-int device_state_get_input_config_str(device_state_t *state, int input_id,
-                                      char **output) {
-  if (!state || !output) {
-    return -1;
-  }
-
-  pthread_mutex_lock(&state->mutex);
-
-  input_config_t *inp = device_state_get_input(state, input_id);
-  if (!inp || !inp->valid || !inp->raw_json) {
-    pthread_mutex_unlock(&state->mutex);
+int device_state_update_input_config(device_state_t *state,
+                                     const jsonrpc_frame_t *response,
+                                     int input_id) {
+  if (!state || !response || input_id < 0 || input_id >= MAX_INPUTS) {
     return -1;
   }
 
-  *output = strdup(inp->raw_json);
-
-  pthread_mutex_unlock(&state->mutex);
-
-  return (*output != NULL) ? 0 : -1;
-}
-
-int device_state_set_input_config_from_json(const char *user_json,
-                                            request_queue_t *queue,
-                                            struct mg_connection *conn,
-                                            int input_id) {
-  if (!user_json || !queue || !conn || input_id < 0 || input_id >= MAX_INPUTS) {
+  /* Check if this is an error response (e.g., input doesn't exist) */
+  if (response->is_error) {
+    /* Silently ignore - input probably doesn't exist on this device */
     return -1;
   }
 
-  /* Validate that user_json is valid JSON */
-  struct mg_str json_str = mg_str(user_json);
-  int dummy_len = 0;
-  int validation = mg_json_get(json_str, "$", &dummy_len);
-  if (validation < 0) {
-    fprintf(stderr, "Error: Invalid JSON provided by user\n");
+  if (response->result_len == 0) {
+    log_error(LOG_CAT_STATE,
+              "Error: No result field in input %d config response\n", input_id);
     return -1;
   }
 
-  /* Build params: {"id": input_id, "config": {user_json}} */
-  size_t params_size = strlen(user_json) + 64;
-  char *params = malloc(params_size);
-  if (!params) {
-    fprintf(stderr, "Error: Failed to allocate params buffer\n");
-    return -1;
-  }
-  snprintf(params, params_size, "{\"id\":%d,\"config\":%s}", input_id,
-           user_json);
+  return apply_input_config(state, input_id, response->result,
+                            (int) response->result_len);
+}
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    free(params);
+int device_state_get_input_config_str(device_state_t *state, int input_id,
+                                      char **output) {
+  if (!state || !output) {
     return -1;
   }
 
-  /* Build JSON-RPC request */
-  char *request = jsonrpc_build_request("Input.SetConfig", req_id, params);
-  free(params);
-
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Input.SetConfig request\n");
-    return -1;
-  }
+  pthread_rwlock_rdlock(&state->lock);
 
-  /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Input.SetConfig to request queue\n");
-    free(request);
+  input_config_t *inp = device_state_get_input(state, input_id);
+  if (!inp || !inp->valid || !inp->raw_json) {
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
 
-  printf("Setting input %d configuration (ID: %d)...\n", input_id, req_id);
-
-  free(request);
-  return req_id;
-}
-
-int device_state_is_input_config_notification(const char *json, size_t len,
-                                              int input_id) {
-  if (!json || len == 0) {
-    return 0;
-  }
-
-  struct mg_str json_str = mg_str_n(json, len);
-
-  char *method = mg_json_get_str(json_str, "$.method");
-  int is_input_config_notif = 0;
-
-  if (method && strcmp(method, "NotifyEvent") == 0) {
-    char key[64];
-    snprintf(key, sizeof(key), "$.params.events[?(@.component=='input:%d')]",
-             input_id);
-
-    int event_len = 0;
-    if (mg_json_get(json_str, key, &event_len) >= 0) {
-      is_input_config_notif = 1;
-    }
-  }
+  *output = strdup(inp->raw_json);
 
-  if (method) {
-    free(method);
-  }
+  pthread_rwlock_unlock(&state->lock);
 
-  return is_input_config_notif;
+  return (*output != NULL) ? 0 : -1;
 }
 
 /* ============================================================================
@@ -2166,198 +1874,94 @@ int device_state_request_input_status(device_state_t *state,
   char params[64];
   snprintf(params, sizeof(params), "{\"id\":%d}", input_id);
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
+  /* Add to request queue */
+  request_desc_t desc = {.method = RESPONSE_TYPE_INPUT_GETSTATUS,
+                         .component_id = input_id};
+  int req_id = request_queue_add(queue, "Input.GetStatus", params, &desc);
   if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Input.GetStatus to request queue\n");
     return -1;
   }
 
-  /* Build JSON-RPC request */
-  char *request = jsonrpc_build_request("Input.GetStatus", req_id, params);
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Input.GetStatus request\n");
-    return -1;
-  }
+  log_debug(LOG_CAT_STATE, "Requesting input %d status (ID: %d)...\n", input_id,
+            req_id);
 
-  /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Input.GetStatus to request queue\n");
-    free(request);
-    return -1;
+  return req_id;
+}
+
+/* Apply an Input status object ({"id":0,"state":false}) in one pass. Returns
+ * the INPUT_FIELD_* bits that changed. Caller holds the state lock. */
+static unsigned int apply_input_status(input_config_t *inp,
+                                       struct mg_str obj, time_t now) {
+  struct mg_str key, val;
+  size_t ofs = 0;
+  unsigned int changed = 0;
+
+  while ((ofs = mg_json_next(obj, ofs, &key, &val)) > 0) {
+    double num = 0.0;
+    bool flag = false;
+
+    if (json_key_is(key, "id")) {
+      if (mg_json_get_num(val, "$", &num) && inp->status.id != (int) num) {
+        inp->status.id = (int) num;
+        inp->status.mtime_id = now;
+        changed |= INPUT_FIELD_ID;
+      }
+    } else if (json_key_is(key, "state")) {
+      if (mg_json_get_bool(val, "$", &flag) && inp->status.state != flag) {
+        inp->status.state = flag;
+        inp->status.mtime_state = now;
+        changed |= INPUT_FIELD_STATE;
+      }
+    }
   }
 
-  printf("Requesting input %d status (ID: %d)...\n", input_id, req_id);
+  if (changed) {
+    history_push_input(inp);
+  }
 
-  free(request);
-  return req_id;
+  inp->status.last_status_update = now;
+  return changed;
 }
 
-int device_state_update_input_status(device_state_t *state, const char *json,
+int device_state_update_input_status(device_state_t *state,
+                                     const jsonrpc_frame_t *response,
                                      int input_id) {
-  if (!state || !json || input_id < 0 || input_id >= MAX_INPUTS) {
+  if (!state || !response || input_id < 0 || input_id >= MAX_INPUTS) {
     return -1;
   }
 
   /* Check if this is an error response (e.g., input doesn't exist) */
-  char error_msg[256];
-  if (jsonrpc_is_error(json, error_msg, sizeof(error_msg))) {
+  if (response->is_error || response->result_len == 0) {
     /* Silently ignore - input probably doesn't exist on this device */
     return -1;
   }
 
-  struct mg_str json_str = mg_str(json);
+  struct mg_str result_str = frame_result(response);
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_wrlock(&state->lock);
 
   input_config_t *inp = device_state_get_input(state, input_id);
   if (!inp || !inp->valid) {
-    pthread_mutex_unlock(&state->mutex);
-    return -1;
-  }
-
-  /* Get result object */
-  int result_len = 0;
-  int result_pos = mg_json_get(json_str, "$.result", &result_len);
-  if (result_pos < 0 || result_len <= 0) {
-    pthread_mutex_unlock(&state->mutex);
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
 
-  struct mg_str result_str = mg_str_n(json + result_pos, result_len);
-
-  time_t now = time(NULL);
+  unsigned int changed = apply_input_status(inp, result_str, time(NULL));
 
-  /* Parse id */
-  double id_val = 0.0;
-  if (mg_json_get_num(result_str, "$.id", &id_val)) {
-    int new_id = (int) id_val;
-    if (inp->status.id != new_id) {
-      inp->status.id = new_id;
-      inp->status.mtime_id = now;
-    }
-  }
+  pthread_rwlock_unlock(&state->lock);
 
-  /* Parse state */
-  bool state_val = false;
-  if (mg_json_get_bool(result_str, "$.state", &state_val)) {
-    if (inp->status.state != state_val) {
-      inp->status.state = state_val;
-      inp->status.mtime_state = now;
-    }
+  if (changed) {
+    notify_change(state, STATE_CHANGE_INPUT_STATUS, input_id, changed);
   }
 
-  inp->status.last_status_update = now;
-
-  pthread_mutex_unlock(&state->mutex);
-
-  printf("Input %d status updated: state=%s\n", input_id,
-         inp->status.state ? "true" : "false");
+  log_debug(LOG_CAT_STATE, "Input %d status updated: state=%s\n", input_id,
+            inp->status.state ? "true" : "false");
 
   return 0;
 }
 
-int device_state_is_input_status_notification(const char *json, size_t len) {
-  if (!json || len == 0) {
-    return 0;
-  }
-
-  struct mg_str json_str = mg_str_n(json, len);
-  char *method = mg_json_get_str(json_str, "$.method");
-
-  int is_input_notif = 0;
-
-  if (method && strcmp(method, "NotifyStatus") == 0) {
-    /* Check if params contain input status - look in the raw JSON */
-    if (strstr(json, "\"input:") != NULL) {
-      is_input_notif = 1;
-    }
-  }
-
-  if (method) {
-    free(method);
-  }
-
-  return is_input_notif;
-}
-
-int device_state_update_input_status_from_notification(device_state_t *state,
-                                                       const char *json) {
-  if (!state || !json) {
-    return -1;
-  }
-
-  struct mg_str json_str = mg_str(json);
-
-  /* Get the params object */
-  int params_len = 0;
-  int params_pos = mg_json_get(json_str, "$.params", &params_len);
-  if (params_pos < 0 || params_len <= 0) {
-    return -1;
-  }
-
-  struct mg_str params_str = mg_str_n(json + params_pos, params_len);
-
-  /* Iterate through all possible inputs to find which ones are in the
-   * notification */
-  int updated_count = 0;
-  for (int input_id = 0; input_id < MAX_INPUTS; input_id++) {
-    /* Build the key name: input:N */
-    char key[32];
-    snprintf(key, sizeof(key), "$.input:%d", input_id);
-
-    /* Check if this input is in the params */
-    int input_data_len = 0;
-    int input_data_pos = mg_json_get(params_str, key, &input_data_len);
-
-    if (input_data_pos >= 0 && input_data_len > 0) {
-      pthread_mutex_lock(&state->mutex);
-
-      input_config_t *inp = device_state_get_input(state, input_id);
-      if (!inp || !inp->valid) {
-        pthread_mutex_unlock(&state->mutex);
-        continue;
-      }
-
-      /* Create substring for this input's status */
-      struct mg_str input_str =
-          mg_str_n(params_str.buf + input_data_pos, input_data_len);
-
-      time_t now = time(NULL);
-
-      /* Parse id */
-      double id_val = 0.0;
-      if (mg_json_get_num(input_str, "$.id", &id_val)) {
-        int new_id = (int) id_val;
-        if (inp->status.id != new_id) {
-          inp->status.id = new_id;
-          inp->status.mtime_id = now;
-        }
-      }
-
-      /* Parse state */
-      bool state_val = false;
-      if (mg_json_get_bool(input_str, "$.state", &state_val)) {
-        if (inp->status.state != state_val) {
-          inp->status.state = state_val;
-          inp->status.mtime_state = now;
-        }
-      }
-
-      inp->status.last_status_update = now;
-
-      printf("Input %d status updated from notification: state=%s\n", input_id,
-             inp->status.state ? "true" : "false");
-
-      pthread_mutex_unlock(&state->mutex);
-      updated_count++;
-    }
-  }
-
-  return updated_count > 0 ? 0 : -1;
-}
-
 /* ============================================================================
  * SCRIPT LISTING (Script.List)
  * ============================================================================
@@ -2370,71 +1974,52 @@ int device_state_request_script_list(device_state_t *state,
     return -1;
   }
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    return -1;
-  }
-
-  /* Build JSON-RPC request with correct ID */
-  char *request = jsonrpc_build_request("Script.List", req_id, NULL);
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Script.List request\n");
-    return -1;
-  }
-
   /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Script.List to request queue\n");
-    free(request);
+  request_desc_t desc = {.method = RESPONSE_TYPE_SCRIPT_LIST,
+                         .component_id = -1};
+  int req_id = request_queue_add(queue, "Script.List", NULL, &desc);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Script.List to request queue\n");
     return -1;
   }
 
-  printf("Requesting script list (ID: %d)...\n", req_id);
+  log_debug(LOG_CAT_SCRIPT, "Requesting script list (ID: %d)...\n", req_id);
 
   /* Request is queued and will be sent by ws_thread_func */
-  free(request);
   return req_id;
 }
 
-int device_state_update_script_list(device_state_t *state, const char *json) {
-  if (!state || !json) {
+int device_state_update_script_list(device_state_t *state,
+                                    const jsonrpc_frame_t *response) {
+  if (!state || !response) {
     return -1;
   }
 
-  pthread_mutex_lock(&state->mutex);
+  if (response->is_error || response->result_len == 0) {
+    log_error(LOG_CAT_SCRIPT, "Error: No result in Script.List response\n");
+    return -1;
+  }
 
-  /* Parse the response */
-  struct mg_str json_str = mg_str(json);
+  pthread_rwlock_wrlock(&state->lock);
 
-  /* Find the result object position and length */
-  int result_len = 0;
-  int result_pos = mg_json_get(json_str, "$.result", &result_len);
-
-  if (result_pos < 0) {
-    pthread_mutex_unlock(&state->mutex);
-    fprintf(stderr, "Error: No result in Script.List response\n");
-    return -1;
-  }
-
-  /* Create substring view of result object */
-  struct mg_str result = mg_str_n(json + result_pos, result_len);
+  struct mg_str result = frame_result(response);
 
   /* Find the scripts array position and length within result */
   int scripts_len = 0;
   int scripts_pos = mg_json_get(result, "$.scripts", &scripts_len);
 
   if (scripts_pos < 0) {
-    pthread_mutex_unlock(&state->mutex);
-    fprintf(stderr, "Error: No scripts array in Script.List response\n");
+    pthread_rwlock_unlock(&state->lock);
+    log_error(LOG_CAT_SCRIPT,
+              "Error: No scripts array in Script.List response\n");
     return -1;
   }
 
   /* Create substring view of scripts array */
   struct mg_str scripts_array = mg_str_n(result.buf + scripts_pos, scripts_len);
   int count = 0;
+  unsigned int listed = 0;
 
   for (int i = 0; i < MAX_SCRIPTS; i++) {
     char path[64];
@@ -2453,22 +2038,19 @@ int device_state_update_script_list(device_state_t *state, const char *json) {
 
     /* Get script name */
     snprintf(path, sizeof(path), "$[%d].name", i);
-    char *name = mg_json_get_str(scripts_array, path);
-    if (name) {
-      snprintf(state->scripts.scripts[script_id].name, MAX_SCRIPT_NAME, "%s",
-               name);
-      free(name);
-    }
+    json_get_str_buf(scripts_array, path,
+                     state->scripts.scripts[script_id].name, MAX_SCRIPT_NAME);
 
     /* Get enable flag */
     snprintf(path, sizeof(path), "$[%d].enable", i);
-    double enable_val = 0;
-    if (mg_json_get_num(scripts_array, path, &enable_val)) {
-      state->scripts.scripts[script_id].enable = (enable_val != 0);
+    bool enable_val = false;
+    if (mg_json_get_bool(scripts_array, path, &enable_val)) {
+      state->scripts.scripts[script_id].enable = enable_val;
     }
 
     state->scripts.scripts[script_id].id = script_id;
     state->scripts.scripts[script_id].valid = 1;
+    listed |= 1u << script_id;
 
     count++;
   }
@@ -2476,9 +2058,15 @@ int device_state_update_script_list(device_state_t *state, const char *json) {
   state->scripts.count = count;
   state->scripts.last_update = time(NULL);
 
-  printf("Script list updated: %d scripts found\n", count);
+  log_debug(LOG_CAT_SCRIPT, "Script list updated: %d scripts found\n", count);
+
+  pthread_rwlock_unlock(&state->lock);
 
-  pthread_mutex_unlock(&state->mutex);
+  for (int i = 0; i < MAX_SCRIPTS; i++) {
+    if (listed & (1u << i)) {
+      notify_change(state, STATE_CHANGE_SCRIPT, i, 0);
+    }
+  }
 
   return count;
 }
@@ -2488,120 +2076,290 @@ int device_state_update_script_list(device_state_t *state, const char *json) {
  * ============================================================================
  */
 
+/* Like device_state_get_switch(), this only locates the slot; the pointer is
+ * only meaningful while the caller holds the state lock (or is the thread
+ * that applies updates). */
 script_entry_t *device_state_get_script(device_state_t *state, int script_id) {
   if (!state || script_id < 0 || script_id >= MAX_SCRIPTS) {
     return NULL;
   }
 
-  pthread_mutex_lock(&state->mutex);
-
-  script_entry_t *result = NULL;
   for (int i = 0; i < MAX_SCRIPTS; i++) {
     if (state->scripts.scripts[i].id == script_id &&
         state->scripts.scripts[i].valid) {
-      result = &state->scripts.scripts[i];
-      break;
+      return &state->scripts.scripts[i];
     }
   }
 
-  pthread_mutex_unlock(&state->mutex);
-  return result;
+  return NULL;
 }
 
-int device_state_request_script_code(device_state_t *state,
-                                     request_queue_t *queue,
-                                     struct mg_connection *conn,
-                                     int script_id) {
-  if (!state || !queue || !conn || script_id < 0 || script_id >= MAX_SCRIPTS) {
-    return -1;
+/* Script retrieval is pipelined: the first Script.GetCode reply reveals the
+ * total size (data + left), after which the remaining chunks are requested
+ * by offset without waiting for each reply. Every script has its own
+ * assembly buffer, and all scripts share one in-flight window, so a sync of
+ * many scripts is bounded by bandwidth rather than by round trips.
+ *
+ * The device answers requests in order, so replies normally extend the
+ * contiguous prefix (fetch_received). A reply that does not (a short chunk,
+ * or one that overtook a lost reply) rewinds fetch_next to the gap; chunks
+ * already queued past it are discarded on arrival and fetched again. */
+
+/* Drop a retrieval's buffer once nothing is outstanding for it. Caller holds
+ * the state lock. */
+static void script_fetch_settle(script_entry_t *script) {
+  if (script->fetch_stale && script->fetch_inflight == 0) {
+    free(script->fetch_buf);
+    script->fetch_buf = NULL;
+    script->fetch_stale = 0;
   }
+}
 
-  pthread_mutex_lock(&state->mutex);
+/* Abandon the current retrieval; it restarts later if `retry` is set. Caller
+ * holds the state lock. */
+static void script_fetch_abort(script_entry_t *script, int retry) {
+  script->fetch_stale = 1;
+  if (retry) {
+    script->fetch_wanted = 1;
+  }
+  script_fetch_settle(script);
+}
 
-  /* If starting a new retrieval, initialize chunk state */
-  if (state->scripts.retrieving_id != script_id) {
-    /* Clean up any previous chunk buffer */
-    if (state->scripts.chunk_buffer) {
-      free(state->scripts.chunk_buffer);
-      state->scripts.chunk_buffer = NULL;
-    }
+/* Mark a script for retrieval. Code fetched so far may predate whatever
+ * prompted this (e.g. an upload), so a retrieval in progress is restarted
+ * rather than joined. Caller holds the state lock. */
+static void script_fetch_want(script_entry_t *script) {
+  script->fetch_wanted = 1;
+  if (script->fetch_buf) {
+    script_fetch_abort(script, 1);
+  }
+}
 
-    /* Allocate maximum script size buffer */
-    state->scripts.chunk_buffer = malloc(MAX_SCRIPT_CODE);
-    if (!state->scripts.chunk_buffer) {
-      pthread_mutex_unlock(&state->mutex);
-      fprintf(stderr, "Error: Failed to allocate script buffer\n");
-      return -1;
-    }
+/* Account for a GetCode reply or timeout. Caller holds the state lock. */
+static void script_fetch_retire(device_state_t *state, script_entry_t *script) {
+  if (script->fetch_inflight > 0) {
+    script->fetch_inflight--;
+  }
+  if (state->scripts.fetch_inflight > 0) {
+    state->scripts.fetch_inflight--;
+  }
+}
 
-    state->scripts.chunk_buffer[0] = '\0';
-    state->scripts.chunk_buffer_size = 0;
-    state->scripts.current_offset = 0;
-    state->scripts.retrieving_id = script_id;
+/* Completion callback for Script.GetCode: replies are applied by the
+ * response handler, only timeouts are handled here */
+static void script_code_done(int req_id, const request_desc_t *desc,
+                             const jsonrpc_frame_t *response) {
+  if (response) {
+    return;
   }
 
-  int offset = state->scripts.current_offset;
+  device_state_t *state = (device_state_t *) desc->done_data;
+  int script_id = desc->component_id;
+
+  pthread_rwlock_wrlock(&state->lock);
+  script_entry_t *script = &state->scripts.scripts[script_id];
+  script_fetch_retire(state, script);
+  script_fetch_abort(script, 0);
+  pthread_rwlock_unlock(&state->lock);
 
-  pthread_mutex_unlock(&state->mutex);
+  log_error(LOG_CAT_SCRIPT,
+            "Error: Script %d code request at offset %d timed out (ID: %d)\n",
+            script_id, desc->offset, req_id);
+}
 
-  /* Build params: {"id": script_id, "offset": offset} */
+/* Queue one Script.GetCode chunk request. Caller holds the state lock. */
+static int queue_script_chunk(device_state_t *state, request_queue_t *queue,
+                              script_entry_t *script, int offset, int len) {
+  /* Build params: {"id": script_id, "offset": offset, "len": len} */
   char params[128];
-  snprintf(params, sizeof(params), "{\"id\":%d,\"offset\":%d}", script_id,
-           offset);
+  snprintf(params, sizeof(params), "{\"id\":%d,\"offset\":%d,\"len\":%d}",
+           script->id, offset, len);
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
+  /* Add to request queue */
+  request_desc_t desc = {.method = RESPONSE_TYPE_SCRIPT_GETCODE,
+                         .component_id = script->id,
+                         .offset = offset,
+                         .length = len,
+                         .done_fn = script_code_done,
+                         .done_data = state,
+                         .lane = REQUEST_LANE_BULK};
+  int req_id = request_queue_add(queue, "Script.GetCode", params, &desc);
   if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Script.GetCode to request queue\n");
     return -1;
   }
 
-  /* Build JSON-RPC request with correct ID */
-  char *request = jsonrpc_build_request("Script.GetCode", req_id, params);
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Script.GetCode request\n");
+  script->fetch_inflight++;
+  state->scripts.fetch_inflight++;
+
+  log_debug(LOG_CAT_SCRIPT,
+            "Requesting script %d code at offset %d (ID: %d)...\n", script->id,
+            offset, req_id);
+
+  /* Request is queued and will be sent by ws_thread_func */
+  return req_id;
+}
+
+/* Issue the next request for one script, if it has one due. Returns 1 if a
+ * request was queued. Caller holds the state lock. */
+static int script_fetch_step(device_state_t *state, request_queue_t *queue,
+                             script_entry_t *script) {
+  /* Start a new retrieval once the previous one has fully drained */
+  if (!script->fetch_buf && script->fetch_wanted &&
+      script->fetch_inflight == 0) {
+    /* Sized to the code once the first reply tells its length */
+    script->fetch_buf = malloc(1);
+    if (!script->fetch_buf) {
+      log_error(LOG_CAT_SCRIPT, "Error: Failed to allocate script buffer\n");
+      return 0;
+    }
+    script->fetch_buf[0] = '\0';
+    script->fetch_size = -1;
+    script->fetch_next = 0;
+    script->fetch_received = 0;
+    script->fetch_chunk = SCRIPT_CHUNK_SIZE;
+    script->fetch_wanted = 0;
+    script->fetch_stale = 0;
+
+    /* Only the first chunk until its reply tells us the size */
+    if (queue_script_chunk(state, queue, script, 0, script->fetch_chunk) < 0) {
+      script_fetch_abort(script, 1);
+      return 0;
+    }
+    script->fetch_next = script->fetch_chunk;
+    return 1;
+  }
+
+  if (!script->fetch_buf || script->fetch_stale || script->fetch_size < 0 ||
+      script->fetch_next >= script->fetch_size) {
+    return 0;
+  }
+
+  int offset = script->fetch_next;
+  int len = script->fetch_size - offset;
+  if (len > script->fetch_chunk) {
+    len = script->fetch_chunk;
+  }
+
+  if (queue_script_chunk(state, queue, script, offset, len) < 0) {
+    return 0;
+  }
+  script->fetch_next = offset + len;
+  return 1;
+}
+
+int device_state_pump_script_code(device_state_t *state,
+                                  request_queue_t *queue) {
+  if (!state || !queue) {
     return -1;
   }
 
-  /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Script.GetCode to request queue\n");
-    free(request);
+  pthread_rwlock_wrlock(&state->lock);
+
+  /* Round-robin one request per script per pass, so every script's first
+   * chunk (and with it its size) is known early */
+  int progress = 1;
+  while (progress &&
+         state->scripts.fetch_inflight < state->scripts.fetch_window) {
+    progress = 0;
+    for (int i = 0; i < MAX_SCRIPTS &&
+                    state->scripts.fetch_inflight < state->scripts.fetch_window;
+         i++) {
+      script_entry_t *script = &state->scripts.scripts[i];
+      if (script->valid) {
+        progress |= script_fetch_step(state, queue, script);
+      }
+    }
+  }
+
+  int active = 0;
+  for (int i = 0; i < MAX_SCRIPTS; i++) {
+    script_entry_t *script = &state->scripts.scripts[i];
+    if (script->valid && (script->fetch_buf || script->fetch_wanted)) {
+      active++;
+    }
+  }
+
+  pthread_rwlock_unlock(&state->lock);
+
+  /* Every reply and timeout ends in a pump, so this is where open() calls
+   * waiting in device_state_acquire_script_code() re-check their script */
+  pthread_mutex_lock(&state->scripts.code_mutex);
+  state->scripts.code_gen++;
+  pthread_cond_broadcast(&state->scripts.code_cond);
+  pthread_mutex_unlock(&state->scripts.code_mutex);
+
+  return active;
+}
+
+void device_state_set_script_fetch_window(device_state_t *state, int window) {
+  if (!state || window < 1) {
+    return;
+  }
+
+  pthread_rwlock_wrlock(&state->lock);
+  state->scripts.fetch_window = window;
+  pthread_rwlock_unlock(&state->lock);
+}
+
+int device_state_request_script_code(device_state_t *state,
+                                     request_queue_t *queue,
+                                     struct mg_connection *conn,
+                                     int script_id) {
+  if (!state || !queue || !conn || script_id < 0 || script_id >= MAX_SCRIPTS) {
     return -1;
   }
 
-  printf("Requesting script %d code at offset %d (ID: %d)...\n", script_id,
-         offset, req_id);
+  pthread_rwlock_wrlock(&state->lock);
 
-  /* Request is queued and will be sent by ws_thread_func */
-  free(request);
-  return req_id;
+  script_fetch_want(&state->scripts.scripts[script_id]);
+
+  pthread_rwlock_unlock(&state->lock);
+
+  return device_state_pump_script_code(state, queue) < 0 ? -1 : 0;
 }
 
-int device_state_update_script_code(device_state_t *state, const char *json,
-                                    int script_id) {
-  if (!state || !json || script_id < 0 || script_id >= MAX_SCRIPTS) {
+int device_state_update_script_code(device_state_t *state,
+                                    const jsonrpc_frame_t *response,
+                                    const request_desc_t *desc) {
+  if (!state || !response || !desc || desc->component_id < 0 ||
+      desc->component_id >= MAX_SCRIPTS) {
     return -1;
   }
 
-  pthread_mutex_lock(&state->mutex);
+  int script_id = desc->component_id;
 
-  /* Parse the response */
-  struct mg_str json_str = mg_str(json);
+  pthread_rwlock_wrlock(&state->lock);
 
-  /* Find the result object position and length */
-  int result_len = 0;
-  int result_pos = mg_json_get(json_str, "$.result", &result_len);
+  script_entry_t *script = &state->scripts.scripts[script_id];
+  script_fetch_retire(state, script);
+
+  /* Reply to an abandoned retrieval */
+  if (!script->fetch_buf || script->fetch_stale) {
+    script_fetch_settle(script);
+    pthread_rwlock_unlock(&state->lock);
+    return 0;
+  }
+
+  /* Check if this is an error response (e.g. script deleted meanwhile) */
+  char error_msg[256];
+  if (jsonrpc_is_error(response, error_msg, sizeof(error_msg))) {
+    script_fetch_abort(script, 0);
+    pthread_rwlock_unlock(&state->lock);
+    log_error(LOG_CAT_SCRIPT, "Error getting script %d code: %s\n", script_id,
+              error_msg);
+    return -1;
+  }
 
-  if (result_pos < 0) {
-    pthread_mutex_unlock(&state->mutex);
-    fprintf(stderr, "Error: No result in Script.GetCode response\n");
+  if (response->result_len == 0) {
+    script_fetch_abort(script, 0);
+    pthread_rwlock_unlock(&state->lock);
+    log_error(LOG_CAT_SCRIPT, "Error: No result in Script.GetCode response\n");
     return -1;
   }
 
-  /* Create substring view of result object */
-  struct mg_str result = mg_str_n(json + result_pos, result_len);
+  struct mg_str result = frame_result(response);
 
   /* Extract code chunk (still needs allocation for JSON unescaping) */
   char *code_str = mg_json_get_str(result, "$.data");
@@ -2611,41 +2369,96 @@ int device_state_update_script_code(device_state_t *state, const char *json,
   int has_left = mg_json_get_num(result, "$.left", &left_val);
 
   if (!code_str) {
-    pthread_mutex_unlock(&state->mutex);
-    fprintf(stderr, "Error: No code data in Script.GetCode response\n");
+    script_fetch_abort(script, 0);
+    pthread_rwlock_unlock(&state->lock);
+    log_error(LOG_CAT_SCRIPT,
+              "Error: No code data in Script.GetCode response\n");
     return -1;
   }
 
-  size_t code_len = strlen(code_str);
+  int offset = desc->offset;
+  int code_len = (int) strlen(code_str);
+  int left = has_left ? (int) left_val : 0;
 
-  /* Check buffer overflow */
-  if (state->scripts.chunk_buffer_size + code_len >= MAX_SCRIPT_CODE) {
-    free(code_str);
-    pthread_mutex_unlock(&state->mutex);
-    fprintf(stderr, "Error: Script code exceeds maximum size\n");
-    return -1;
+  /* The first reply fixes the total size, and with it the buffer's: it
+   * becomes the script's code as is */
+  if (script->fetch_size < 0) {
+    script->fetch_size = offset + code_len + left;
+    if (script->fetch_size >= MAX_SCRIPT_CODE) {
+      free(code_str);
+      script_fetch_abort(script, 0);
+      pthread_rwlock_unlock(&state->lock);
+      log_error(LOG_CAT_SCRIPT, "Error: Script code exceeds maximum size\n");
+      return -1;
+    }
+
+    char *sized = realloc(script->fetch_buf, script->fetch_size + 1);
+    if (!sized) {
+      free(code_str);
+      script_fetch_abort(script, 0);
+      pthread_rwlock_unlock(&state->lock);
+      log_error(LOG_CAT_SCRIPT, "Error: Failed to allocate script buffer\n");
+      return -1;
+    }
+    script->fetch_buf = sized;
   }
 
-  /* Append chunk to buffer */
-  memcpy(state->scripts.chunk_buffer + state->scripts.chunk_buffer_size,
-         code_str, code_len);
-  state->scripts.chunk_buffer_size += code_len;
+  /* A different total means the script changed under us: start over */
+  if (offset + code_len + left != script->fetch_size) {
+    free(code_str);
+    script_fetch_abort(script, 1);
+    pthread_rwlock_unlock(&state->lock);
+    log_info(LOG_CAT_SCRIPT, "Script %d changed during retrieval, restarting\n",
+             script_id);
+    return 0;
+  }
 
-  /* Move null terminator */
-  state->scripts.chunk_buffer[state->scripts.chunk_buffer_size] = '\0';
+  if (offset == script->fetch_received) {
+    /* Extends the contiguous prefix: append chunk to buffer */
+    memcpy(script->fetch_buf + offset, code_str, code_len);
+    script->fetch_received += code_len;
+    script->fetch_buf[script->fetch_received] = '\0';
+
+    /* Device returned less than asked: ask for smaller chunks and refetch
+     * from the gap */
+    if (code_len < desc->length && left > 0) {
+      if (code_len == 0) {
+        free(code_str);
+        script_fetch_abort(script, 0);
+        pthread_rwlock_unlock(&state->lock);
+        log_error(LOG_CAT_SCRIPT, "Error: Empty script %d chunk at offset %d\n",
+                  script_id, offset);
+        return -1;
+      }
+      script->fetch_chunk = code_len;
+      script->fetch_next = script->fetch_received;
+    }
+  } else if (offset > script->fetch_received) {
+    /* Overtook the chunk we are waiting for; fetch it again later */
+    if (script->fetch_next > offset) {
+      script->fetch_next = offset;
+    }
+  }
+  /* offset < fetch_received: duplicate of a refetched chunk, nothing new */
 
-  state->scripts.current_offset += code_len;
+  int done = script->fetch_received == script->fetch_size;
 
-  int left = has_left ? (int) left_val : 0;
+  log_debug(LOG_CAT_SCRIPT,
+            "Received script %d chunk: %d bytes at offset %d, %d bytes left\n",
+            script_id, code_len, offset, left);
 
-  printf("Received script %d chunk: %zu bytes, %d bytes left\n", script_id,
-         code_len, left);
+  /* Never stall with nothing outstanding: if the chunk at the gap is not in
+   * flight any more, rewind to it */
+  if (!done && script->fetch_inflight == 0 &&
+      script->fetch_next > script->fetch_received) {
+    script->fetch_next = script->fetch_received;
+  }
 
   free(code_str);
-  pthread_mutex_unlock(&state->mutex);
+  pthread_rwlock_unlock(&state->lock);
 
-  /* Return positive value if more chunks needed, 0 if complete, -1 on error */
-  return left;
+  /* Return 1 if complete, 0 if more chunks needed, -1 on error */
+  return done;
 }
 
 int device_state_finalize_script_code(device_state_t *state, int script_id) {
@@ -2653,47 +2466,229 @@ int device_state_finalize_script_code(device_state_t *state, int script_id) {
     return -1;
   }
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_wrlock(&state->lock);
 
-  if (state->scripts.retrieving_id != script_id ||
-      !state->scripts.chunk_buffer) {
-    pthread_mutex_unlock(&state->mutex);
-    fprintf(stderr, "Error: No script retrieval in progress for script %d\n",
-            script_id);
+  script_entry_t *script = &state->scripts.scripts[script_id];
+  if (!script->fetch_buf || script->fetch_stale ||
+      script->fetch_received != script->fetch_size) {
+    pthread_rwlock_unlock(&state->lock);
+    log_error(LOG_CAT_SCRIPT,
+              "Error: No script retrieval in progress for script %d\n",
+              script_id);
     return -1;
   }
 
   /* Free old code if any */
-  if (state->scripts.scripts[script_id].code) {
-    free(state->scripts.scripts[script_id].code);
+  if (script->code) {
+    free(script->code);
   }
 
-  /* Move chunk buffer to script entry */
-  state->scripts.scripts[script_id].code = state->scripts.chunk_buffer;
-  state->scripts.scripts[script_id].id = script_id;
-  state->scripts.scripts[script_id].valid = 1;
-  state->scripts.scripts[script_id].modify_time = time(NULL);
+  /* Move chunk buffer to script entry. Replies still in flight for this
+   * retrieval (refetched chunks) are discarded when they arrive. */
+  script->code = script->fetch_buf;
+  script->code_size = script->fetch_size;
+  script->last_access = time(NULL);
+  script->id = script_id;
+  script->valid = 1;
+  script->modify_time = time(NULL);
 
   /* Reset chunk state */
-  state->scripts.chunk_buffer = NULL;
-  state->scripts.chunk_buffer_size = 0;
-  state->scripts.current_offset = 0;
-  state->scripts.retrieving_id = -1;
+  script->fetch_buf = NULL;
+  script->fetch_size = -1;
+  script->fetch_next = 0;
+  script->fetch_received = 0;
 
-  printf("Script %d code retrieval complete (%zu bytes)\n", script_id,
-         strlen(state->scripts.scripts[script_id].code));
+  log_debug(LOG_CAT_SCRIPT, "Script %d code retrieval complete (%zu bytes)\n",
+            script_id, strlen(script->code));
 
-  pthread_mutex_unlock(&state->mutex);
+  pthread_rwlock_unlock(&state->lock);
+
+  notify_change(state, STATE_CHANGE_SCRIPT, script_id, 0);
   return 0;
 }
 
+int device_state_restore_script_code(device_state_t *state, int script_id,
+                                     char *code) {
+  if (!state || !code || script_id < 0 || script_id >= MAX_SCRIPTS) {
+    free(code);
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&state->lock);
+
+  script_entry_t *script = &state->scripts.scripts[script_id];
+  if (!script->valid || script->code || script->fetch_buf) {
+    /* Unknown script, or the device already delivered its code */
+    pthread_rwlock_unlock(&state->lock);
+    free(code);
+    return -1;
+  }
+
+  script->code_size = (int) strlen(code);
+  script->last_access = time(NULL);
+
+  /* Lazy loading fetches on first open anyway; keep only the size so
+   * getattr has it and the open sees the device's current code */
+  if (state->scripts.lazy) {
+    free(code);
+  } else {
+    script->code = code;
+  }
+
+  pthread_rwlock_unlock(&state->lock);
+  return 0;
+}
+
+void device_state_set_script_loading(device_state_t *state, int lazy,
+                                     int evict_idle_sec) {
+  if (!state) {
+    return;
+  }
+
+  pthread_rwlock_wrlock(&state->lock);
+  state->scripts.lazy = lazy;
+  state->scripts.evict_idle_sec = evict_idle_sec > 0 ? evict_idle_sec : 0;
+  pthread_rwlock_unlock(&state->lock);
+}
+
+int device_state_acquire_script_code(device_state_t *state,
+                                     request_queue_t *queue,
+                                     struct mg_connection *conn, int script_id,
+                                     int *fetched) {
+  if (!state || script_id < 0 || script_id >= MAX_SCRIPTS) {
+    return -1;
+  }
+  if (fetched) {
+    *fetched = 0;
+  }
+
+  pthread_rwlock_wrlock(&state->lock);
+  script_entry_t *script = &state->scripts.scripts[script_id];
+
+  /* Pin the code first, so it cannot be evicted while we wait */
+  script->open_count++;
+  script->last_access = time(NULL);
+
+  /* Unknown scripts are left for open() to reject */
+  int resident = !script->valid || script->code != NULL;
+  pthread_rwlock_unlock(&state->lock);
+
+  if (resident) {
+    return 0;
+  }
+
+  if (fetched) {
+    *fetched = 1;
+  }
+
+  log_debug(LOG_CAT_SCRIPT, "Loading script %d code on open...\n", script_id);
+  if (device_state_request_script_code(state, queue, conn, script_id) < 0) {
+    device_state_release_script_code(state, script_id);
+    return -1;
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += SCRIPT_LOAD_TIMEOUT_SEC;
+
+  int ret = -1;
+  for (;;) {
+    /* Sample the generation before looking, so a fetch step that lands
+     * between the check and the wait is not missed */
+    pthread_mutex_lock(&state->scripts.code_mutex);
+    unsigned gen = state->scripts.code_gen;
+    pthread_mutex_unlock(&state->scripts.code_mutex);
+
+    pthread_rwlock_rdlock(&state->lock);
+    int loaded = script->code != NULL;
+    int failed = !loaded && !script->fetch_buf && !script->fetch_wanted;
+    pthread_rwlock_unlock(&state->lock);
+
+    if (loaded) {
+      ret = 0;
+      break;
+    }
+    if (failed) {
+      log_error(LOG_CAT_SCRIPT, "Error: Failed to load script %d code\n",
+                script_id);
+      break;
+    }
+
+    int timed_out = 0;
+    pthread_mutex_lock(&state->scripts.code_mutex);
+    while (state->scripts.code_gen == gen && !timed_out) {
+      timed_out = pthread_cond_timedwait(&state->scripts.code_cond,
+                                         &state->scripts.code_mutex,
+                                         &deadline) != 0;
+    }
+    pthread_mutex_unlock(&state->scripts.code_mutex);
+
+    if (timed_out) {
+      log_error(LOG_CAT_SCRIPT, "Error: Timed out loading script %d code\n",
+                script_id);
+      break;
+    }
+  }
+
+  if (ret < 0) {
+    device_state_release_script_code(state, script_id);
+  }
+  return ret;
+}
+
+void device_state_release_script_code(device_state_t *state, int script_id) {
+  if (!state || script_id < 0 || script_id >= MAX_SCRIPTS) {
+    return;
+  }
+
+  pthread_rwlock_wrlock(&state->lock);
+  script_entry_t *script = &state->scripts.scripts[script_id];
+  if (script->open_count > 0) {
+    script->open_count--;
+  }
+  script->last_access = time(NULL);
+  pthread_rwlock_unlock(&state->lock);
+}
+
+int device_state_evict_script_code(device_state_t *state) {
+  if (!state) {
+    return 0;
+  }
+
+  pthread_rwlock_wrlock(&state->lock);
+
+  int evicted = 0;
+  time_t now = time(NULL);
+
+  for (int i = 0; i < MAX_SCRIPTS && state->scripts.evict_idle_sec > 0; i++) {
+    script_entry_t *script = &state->scripts.scripts[i];
+
+    /* Only idle code that is not being transferred */
+    if (!script->code || script->open_count > 0 || script->fetch_buf ||
+        script->fetch_wanted || script->upload_esc || script->upload_pending ||
+        now - script->last_access < state->scripts.evict_idle_sec) {
+      continue;
+    }
+
+    free(script->code);
+    script->code = NULL;
+    evicted++;
+
+    log_debug(LOG_CAT_SCRIPT, "Script %d code evicted after %ld seconds idle\n",
+              script->id, (long) (now - script->last_access));
+  }
+
+  pthread_rwlock_unlock(&state->lock);
+  return evicted;
+}
+
 int device_state_get_script_code_str(device_state_t *state, int script_id,
                                      char **output) {
   if (!state || !output || script_id < 0 || script_id >= MAX_SCRIPTS) {
     return -1;
   }
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_rdlock(&state->lock);
 
   int slot = -1;
   for (int i = 0; i < MAX_SCRIPTS; i++) {
@@ -2705,13 +2700,13 @@ int device_state_get_script_code_str(device_state_t *state, int script_id,
   }
 
   if (slot == -1 || !state->scripts.scripts[slot].code) {
-    pthread_mutex_unlock(&state->mutex);
+    pthread_rwlock_unlock(&state->lock);
     return -1;
   }
 
   *output = strdup(state->scripts.scripts[slot].code);
 
-  pthread_mutex_unlock(&state->mutex);
+  pthread_rwlock_unlock(&state->lock);
 
   return (*output) ? 0 : -1;
 }
@@ -2757,6 +2752,340 @@ static char *json_escape_string(const char *str, size_t len) {
   return escaped;
 }
 
+/* Uploads are windowed: up to SCRIPT_UPLOAD_WINDOW Script.PutCode chunks per
+ * script are in flight, so a large script neither waits a round trip per
+ * chunk nor floods the queue ahead of other requests. The chunk size grows
+ * while replies come back within SCRIPT_UPLOAD_RTT_TARGET_MS and shrinks when
+ * they do not, or when a chunk fails.
+ *
+ * PutCode appends, so after a failed chunk the upload drains its window and
+ * then resumes from the failed offset, one chunk at a time from then on. If
+ * a later chunk was applied in the meantime, or the device reports a length
+ * other than what we have sent, the device copy is no longer a prefix of ours
+ * and the upload restarts from offset 0. */
+
+/* Take `want` code bytes of escaped text starting at esc_pos, never splitting
+ * an escape or a UTF-8 sequence. Returns the code bytes taken and stores the
+ * escaped length in *esc_len. */
+static int upload_take(const char *esc, int esc_pos, int want, int *esc_len) {
+  int i = esc_pos;
+  int taken = 0;
+
+  while (esc[i] && taken < want) {
+    i += (esc[i] == '\\') ? 2 : 1;
+    taken++;
+  }
+  while (esc[i] && ((unsigned char) esc[i] & 0xC0) == 0x80) {
+    i++;
+    taken++;
+  }
+
+  *esc_len = i - esc_pos;
+  return taken;
+}
+
+/* Start uploading `esc` (ownership passes to the script). Caller holds the
+ * state lock. */
+static void script_upload_begin(script_entry_t *script, char *esc) {
+  int esc_len = 0;
+
+  script->upload_esc = esc;
+  script->upload_len = upload_take(esc, 0, INT_MAX, &esc_len);
+  script->upload_next = 0;
+  script->upload_next_esc = 0;
+  script->upload_acked = 0;
+  script->upload_acked_esc = 0;
+  script->upload_chunk = SCRIPT_CHUNK_SIZE;
+  script->upload_window = SCRIPT_UPLOAD_WINDOW;
+  script->upload_recovering = 0;
+  script->upload_dirty = 0;
+  script->upload_retries = 0;
+  script->upload_stale = 0;
+  script->upload_srtt_ms = 0;
+  script->upload_sent_head = 0;
+
+  /* A retrieval in progress would mix old and new code */
+  if (script->fetch_buf) {
+    script_fetch_abort(script, 0);
+  }
+}
+
+/* Drop an abandoned upload once nothing is outstanding for it, and start the
+ * upload that replaced it. Caller holds the state lock. */
+static void script_upload_settle(script_entry_t *script) {
+  if (script->upload_inflight > 0) {
+    return;
+  }
+  if (script->upload_stale) {
+    free(script->upload_esc);
+    script->upload_esc = NULL;
+    script->upload_stale = 0;
+  }
+  if (!script->upload_esc && script->upload_pending) {
+    script_upload_begin(script, script->upload_pending);
+    script->upload_pending = NULL;
+  }
+}
+
+/* Finish an upload (successfully or not) and refresh the script from the
+ * device. Caller holds the state lock. */
+static void script_upload_finish(script_entry_t *script) {
+  free(script->upload_esc);
+  script->upload_esc = NULL;
+  script_fetch_want(script);
+}
+
+/* Account for one PutCode reply (ok, with the device's reported length or -1)
+ * or failure (error reply or timeout). Returns 1 if the upload completed, -1
+ * if it was given up, 0 otherwise. Caller holds the state lock. */
+static int script_upload_reply(script_entry_t *script,
+                               const request_desc_t *desc, int ok,
+                               int device_len) {
+  /* Replies arrive in order, so this one belongs to the oldest chunk */
+  double rtt_ms = 0;
+  if (script->upload_inflight > 0) {
+    rtt_ms = (double) (mg_millis() -
+                       script->upload_sent_ms[script->upload_sent_head]);
+    script->upload_sent_head =
+        (script->upload_sent_head + 1) % SCRIPT_UPLOAD_WINDOW;
+    script->upload_inflight--;
+  }
+
+  /* Reply to an abandoned upload */
+  if (!script->upload_esc || script->upload_stale) {
+    script_upload_settle(script);
+    return 0;
+  }
+
+  if (ok && !script->upload_recovering) {
+    if (desc->offset == script->upload_acked) {
+      int esc_len = 0;
+      upload_take(script->upload_esc, script->upload_acked_esc, desc->length,
+                  &esc_len);
+      script->upload_acked += desc->length;
+      script->upload_acked_esc += esc_len;
+
+      if (device_len < 0 || device_len == script->upload_acked) {
+        script->upload_retries = 0;
+        /* Adapt the chunk size to how quickly the device keeps up */
+        script->upload_srtt_ms =
+            script->upload_srtt_ms > 0
+                ? (7 * script->upload_srtt_ms + rtt_ms) / 8
+                : rtt_ms;
+        if (script->upload_srtt_ms > SCRIPT_UPLOAD_RTT_TARGET_MS) {
+          script->upload_chunk = script->upload_chunk * 3 / 4;
+        } else if (rtt_ms < SCRIPT_UPLOAD_RTT_TARGET_MS) {
+          script->upload_chunk += SCRIPT_UPLOAD_CHUNK_MIN;
+        }
+        if (script->upload_chunk < SCRIPT_UPLOAD_CHUNK_MIN) {
+          script->upload_chunk = SCRIPT_UPLOAD_CHUNK_MIN;
+        } else if (script->upload_chunk > SCRIPT_UPLOAD_CHUNK_MAX) {
+          script->upload_chunk = SCRIPT_UPLOAD_CHUNK_MAX;
+        }
+
+        log_debug(LOG_CAT_SCRIPT,
+                  "Script %d chunk uploaded: offset=%d, size=%d, rtt=%.0fms\n",
+                  script->id, desc->offset, desc->length, rtt_ms);
+
+        if (script->upload_acked == script->upload_len) {
+          script_upload_finish(script);
+          return 1;
+        }
+        return 0;
+      }
+
+      /* The device copy is not what we sent */
+      log_error(LOG_CAT_SCRIPT,
+                "Error: Script %d length on device is %d, expected %d\n",
+                script->id, device_len, script->upload_acked);
+      script->upload_dirty = 1;
+    }
+    ok = 0;
+  }
+
+  if (ok) {
+    /* A chunk past the failed one was applied */
+    script->upload_dirty = 1;
+  } else if (!script->upload_recovering) {
+    /* Stop sending and back off the chunk size */
+    script->upload_recovering = 1;
+    script->upload_retries++;
+    script->upload_window = 1;
+    script->upload_chunk /= 2;
+    if (script->upload_chunk < SCRIPT_UPLOAD_CHUNK_MIN) {
+      script->upload_chunk = SCRIPT_UPLOAD_CHUNK_MIN;
+    }
+  }
+
+  if (!script->upload_recovering || script->upload_inflight > 0) {
+    return 0;
+  }
+
+  /* Window drained: resume, restart, or give up */
+  if (script->upload_retries > SCRIPT_UPLOAD_RETRIES) {
+    log_error(LOG_CAT_SCRIPT,
+              "Error: Giving up uploading script %d after %d errors\n",
+              script->id, script->upload_retries);
+    script_upload_finish(script);
+    return -1;
+  }
+
+  if (script->upload_dirty) {
+    script->upload_acked = 0;
+    script->upload_acked_esc = 0;
+  }
+  script->upload_next = script->upload_acked;
+  script->upload_next_esc = script->upload_acked_esc;
+  script->upload_recovering = 0;
+  script->upload_dirty = 0;
+
+  log_info(LOG_CAT_SCRIPT,
+           "Retrying script %d upload from offset %d (chunk size %d)\n",
+           script->id, script->upload_next, script->upload_chunk);
+  return 0;
+}
+
+/* Completion callback for Script.PutCode: replies are applied by the
+ * response handler, only timeouts are handled here */
+static void script_upload_done(int req_id, const request_desc_t *desc,
+                               const jsonrpc_frame_t *response) {
+  if (response) {
+    return;
+  }
+
+  device_state_t *state = (device_state_t *) desc->done_data;
+
+  log_error(LOG_CAT_SCRIPT,
+            "Error: Script %d upload chunk at offset %d timed out (ID: %d)\n",
+            desc->component_id, desc->offset, req_id);
+
+  pthread_rwlock_wrlock(&state->lock);
+  script_upload_reply(&state->scripts.scripts[desc->component_id], desc, 0,
+                      -1);
+  pthread_rwlock_unlock(&state->lock);
+}
+
+/* Queue the next Script.PutCode chunk. Caller holds the state lock. */
+static int queue_upload_chunk(device_state_t *state, request_queue_t *queue,
+                              script_entry_t *script) {
+  int esc_len = 0;
+  int offset = script->upload_next;
+  int len = upload_take(script->upload_esc, script->upload_next_esc,
+                        script->upload_chunk, &esc_len);
+
+  /* Build params: {"id": script_id, "code": "...", "append": true/false}
+   * into the shared buffer */
+  size_t params_size = (size_t) esc_len + 128;
+  if (state->scripts.upload_buf_size < params_size) {
+    char *buf = realloc(state->scripts.upload_buf, params_size);
+    if (!buf) {
+      log_error(LOG_CAT_SCRIPT, "Error: Failed to allocate chunk buffer\n");
+      return -1;
+    }
+    state->scripts.upload_buf = buf;
+    state->scripts.upload_buf_size = params_size;
+  }
+
+  bool append = (offset > 0);
+  snprintf(state->scripts.upload_buf, state->scripts.upload_buf_size,
+           "{\"id\":%d,\"code\":\"%.*s\",\"append\":%s}", script->id,
+           esc_len, script->upload_esc + script->upload_next_esc,
+           append ? "true" : "false");
+
+  /* Add to request queue */
+  request_desc_t desc = {.method = RESPONSE_TYPE_SCRIPT_PUTCODE,
+                         .component_id = script->id,
+                         .offset = offset,
+                         .length = len,
+                         .done_fn = script_upload_done,
+                         .done_data = state,
+                         .lane = REQUEST_LANE_BULK};
+  int req_id = request_queue_add(queue, "Script.PutCode",
+                                 state->scripts.upload_buf, &desc);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Script.PutCode to request queue\n");
+    return -1;
+  }
+
+  int slot = (script->upload_sent_head + script->upload_inflight) %
+             SCRIPT_UPLOAD_WINDOW;
+  script->upload_sent_ms[slot] = mg_millis();
+  script->upload_inflight++;
+  script->upload_next += len;
+  script->upload_next_esc += esc_len;
+
+  log_debug(LOG_CAT_SCRIPT,
+            "  Chunk: offset=%d, size=%d, append=%s (req ID: %d)\n", offset,
+            len, append ? "true" : "false", req_id);
+
+  /* Request is queued and will be sent by ws_thread_func */
+  return req_id;
+}
+
+int device_state_pump_script_upload(device_state_t *state,
+                                    request_queue_t *queue) {
+  if (!state || !queue) {
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&state->lock);
+
+  int active = 0;
+  for (int i = 0; i < MAX_SCRIPTS; i++) {
+    script_entry_t *script = &state->scripts.scripts[i];
+
+    while (script->upload_esc && !script->upload_stale &&
+           !script->upload_recovering &&
+           script->upload_inflight < script->upload_window &&
+           script->upload_next < script->upload_len) {
+      if (queue_upload_chunk(state, queue, script) < 0) {
+        break;
+      }
+    }
+
+    if (script->upload_esc || script->upload_pending) {
+      active++;
+    }
+  }
+
+  pthread_rwlock_unlock(&state->lock);
+  return active;
+}
+
+int device_state_update_script_upload(device_state_t *state,
+                                      const jsonrpc_frame_t *response,
+                                      const request_desc_t *desc) {
+  if (!state || !response || !desc || desc->component_id < 0 ||
+      desc->component_id >= MAX_SCRIPTS) {
+    return -1;
+  }
+
+  int script_id = desc->component_id;
+
+  /* Check if response contains error */
+  char error_msg[256];
+  int ok = !jsonrpc_is_error(response, error_msg, sizeof(error_msg));
+  if (!ok) {
+    log_error(LOG_CAT_SCRIPT,
+              "Error uploading script %d chunk at offset %d: %s\n", script_id,
+              desc->offset, error_msg);
+  }
+
+  /* Total code length on the device after this chunk */
+  double len_val = -1;
+  if (ok && !mg_json_get_num(frame_result(response), "$.len", &len_val)) {
+    len_val = -1;
+  }
+
+  pthread_rwlock_wrlock(&state->lock);
+  int ret = script_upload_reply(&state->scripts.scripts[script_id], desc, ok,
+                                (int) len_val);
+  pthread_rwlock_unlock(&state->lock);
+
+  return ret;
+}
+
 int device_state_put_script_code(device_state_t *state, request_queue_t *queue,
                                  struct mg_connection *conn, int script_id,
                                  const char *code) {
@@ -2766,335 +3095,860 @@ int device_state_put_script_code(device_state_t *state, request_queue_t *queue,
   }
 
   size_t code_len = strlen(code);
-  size_t offset = 0;
-  int chunk_num = 0;
-  int last_req_id = -1;
-
-  printf("Uploading script %d to device (%zu bytes in chunks of %d)\n",
-         script_id, code_len, SCRIPT_CHUNK_SIZE);
-
-  while (offset < code_len) {
-    size_t chunk_size = (code_len - offset > SCRIPT_CHUNK_SIZE)
-                            ? SCRIPT_CHUNK_SIZE
-                            : (code_len - offset);
-
-    /* Extract chunk */
-    char *chunk = strndup(code + offset, chunk_size);
-    if (!chunk) {
-      fprintf(stderr, "Error: Failed to allocate chunk buffer\n");
-      return -1;
+
+  /* Escape the whole script for JSON once; chunks are cut from this */
+  char *esc = json_escape_string(code, code_len);
+  if (!esc) {
+    log_error(LOG_CAT_SCRIPT, "Error: Failed to escape script code\n");
+    return -1;
+  }
+
+  char *local = strdup(code);
+  if (!local) {
+    free(esc);
+    return -1;
+  }
+
+  log_info(LOG_CAT_SCRIPT,
+           "Uploading script %d to device (%zu bytes, up to %d chunks in "
+           "flight)\n",
+           script_id, code_len, SCRIPT_UPLOAD_WINDOW);
+
+  pthread_rwlock_wrlock(&state->lock);
+
+  script_entry_t *script = &state->scripts.scripts[script_id];
+
+  /* Supersede any upload in progress once its chunks have drained */
+  free(script->upload_pending);
+  script->upload_pending = esc;
+  if (script->upload_esc) {
+    script->upload_stale = 1;
+  }
+  script_upload_settle(script);
+
+  /* Update local script code right away; the device copy replaces it once
+   * the upload completes */
+  if (script->valid) {
+    free(script->code);
+    script->code = local;
+    script->code_size = (int) code_len;
+    script->modify_time = time(NULL);
+  } else {
+    free(local);
+  }
+
+  pthread_rwlock_unlock(&state->lock);
+
+  return device_state_pump_script_upload(state, queue) < 0 ? -1 : 0;
+}
+
+/* ============================================================================
+ * NOTIFICATIONS (NotifyStatus / NotifyFullStatus / NotifyEvent)
+ * ============================================================================
+ */
+
+/* Apply a Script status object ({"id":1,"running":true,"mem_used":...}) in
+ * one pass. Caller holds the state lock. */
+static void apply_script_status(script_entry_t *script, struct mg_str obj,
+                                time_t now) {
+  struct mg_str key, val;
+  size_t ofs = 0;
+
+  while ((ofs = mg_json_next(obj, ofs, &key, &val)) > 0) {
+    double num = 0.0;
+    bool flag = false;
+
+    if (json_key_is(key, "running")) {
+      /* Boolean on current firmware, numeric on some older builds */
+      if (mg_json_get_bool(val, "$", &flag)) {
+        script->running = flag;
+      } else if (mg_json_get_num(val, "$", &num)) {
+        script->running = (num != 0);
+      }
+    } else if (json_key_is(key, "mem_used")) {
+      if (mg_json_get_num(val, "$", &num)) {
+        script->mem_used = (int) num;
+      }
+    } else if (json_key_is(key, "mem_peak")) {
+      if (mg_json_get_num(val, "$", &num)) {
+        script->mem_peak = (int) num;
+      }
+    } else if (json_key_is(key, "errors")) {
+      /* Store errors as JSON array string */
+      char *errors = strndup(val.buf, val.len);
+      if (errors) {
+        free(script->errors);
+        script->errors = errors;
+
+        /* Log errors if present */
+        if (val.len > 2) { /* More than just "[]" */
+          log_info(LOG_CAT_SCRIPT, "Script %d errors: %s\n", script->id,
+                   errors);
+        }
+      }
     }
+  }
 
-    /* Escape the chunk for JSON */
-    char *escaped_chunk = json_escape_string(chunk, chunk_size);
-    free(chunk);
+  script->last_status_update = now;
+}
 
-    if (!escaped_chunk) {
-      fprintf(stderr, "Error: Failed to escape chunk\n");
-      return -1;
+/* Find `key` (with its quotes, as mg_json_next returns it) among the members
+ * of a JSON object */
+static int json_find_member(struct mg_str obj, struct mg_str key,
+                            struct mg_str *val) {
+  struct mg_str k, v;
+  size_t ofs = 0;
+
+  while ((ofs = mg_json_next(obj, ofs, &k, &v)) > 0) {
+    if (mg_strcmp(k, key) == 0) {
+      *val = v;
+      return 1;
     }
+  }
+  return 0;
+}
 
-    /* Build params: {"id": script_id, "code": "...", "append": true/false} */
-    bool append = (chunk_num > 0);
-    size_t params_size = strlen(escaped_chunk) + 256;
-    char *params = malloc(params_size);
-    if (!params) {
-      free(escaped_chunk);
-      return -1;
+/* Write `base` with the members of `delta` merged in: members present in both
+ * take the delta's value (objects are merged recursively), new ones are
+ * appended */
+static void json_merge_write(FILE *out, struct mg_str base,
+                             struct mg_str delta) {
+  struct mg_str key, val, dval;
+  size_t ofs = 0;
+  int first = 1;
+
+  fputc('{', out);
+  while ((ofs = mg_json_next(base, ofs, &key, &val)) > 0) {
+    fprintf(out, "%s%.*s:", first ? "" : ",", (int) key.len, key.buf);
+    first = 0;
+    if (!json_find_member(delta, key, &dval)) {
+      fwrite(val.buf, 1, val.len, out);
+    } else if (val.len > 0 && val.buf[0] == '{' && dval.len > 0 &&
+               dval.buf[0] == '{') {
+      json_merge_write(out, val, dval);
+    } else {
+      fwrite(dval.buf, 1, dval.len, out);
     }
+  }
+
+  ofs = 0;
+  while ((ofs = mg_json_next(delta, ofs, &key, &dval)) > 0) {
+    if (!json_find_member(base, key, &val)) {
+      fprintf(out, "%s%.*s:%.*s", first ? "" : ",", (int) key.len, key.buf,
+              (int) dval.len, dval.buf);
+      first = 0;
+    }
+  }
+  fputc('}', out);
+}
+
+/* Stored config JSON of the component `key` ("sys", "switch:0", ... quotes
+ * included), or NULL if none has been fetched. Caller holds the state lock. */
+static const char *stored_config_locked(device_state_t *state,
+                                        struct mg_str key) {
+  int switch_id = json_component_key_id(key, "switch", MAX_SWITCHES);
+  int input_id = json_component_key_id(key, "input", MAX_INPUTS);
+
+  if (json_key_is(key, "sys") && state->sys_config.valid) {
+    return state->sys_config.raw_json;
+  } else if (json_key_is(key, "mqtt") && state->mqtt_config.valid) {
+    return state->mqtt_config.raw_json;
+  } else if (switch_id >= 0) {
+    const switch_config_t *sw = state->switches.switches[switch_id];
+    return sw && sw->valid ? sw->raw_json : NULL;
+  } else if (input_id >= 0) {
+    const input_config_t *inp = state->inputs.inputs[input_id];
+    return inp && inp->valid ? inp->raw_json : NULL;
+  }
+  return NULL;
+}
 
-    snprintf(params, params_size, "{\"id\":%d,\"code\":\"%s\",\"append\":%s}",
-             script_id, escaped_chunk, append ? "true" : "false");
+/* Apply the new values a config_changed event carries for `key` ("sys",
+ * "switch:0", ...) on top of the stored config, as if it had been re-fetched.
+ * Returns 0 if applied, -1 if the component has no stored config to patch. */
+static int apply_config_delta(device_state_t *state, struct mg_str key,
+                              struct mg_str delta) {
+  int switch_id = json_component_key_id(key, "switch", MAX_SWITCHES);
+  int input_id = json_component_key_id(key, "input", MAX_INPUTS);
+  char *merged = NULL;
+  size_t merged_len = 0;
+  FILE *out = open_memstream(&merged, &merged_len);
+  if (!out) {
+    return -1;
+  }
 
-    free(escaped_chunk);
+  /* Merge against a consistent copy of the stored JSON */
+  pthread_rwlock_rdlock(&state->lock);
+  const char *stored = stored_config_locked(state, key);
+  if (stored) {
+    json_merge_write(out, mg_str(stored), delta);
+  }
+  pthread_rwlock_unlock(&state->lock);
 
-    /* Get next request ID */
-    int req_id = request_queue_peek_next_id(queue);
-    if (req_id < 0) {
-      free(params);
-      fprintf(stderr, "Error: Failed to get next request ID\n");
-      return -1;
+  fclose(out);
+  if (!stored) {
+    free(merged);
+    return -1;
+  }
+
+  int ret = -1;
+  if (json_key_is(key, "sys")) {
+    ret = apply_sys_config(state, merged, (int) merged_len);
+  } else if (json_key_is(key, "mqtt")) {
+    ret = apply_mqtt_config(state, merged, (int) merged_len);
+  } else if (switch_id >= 0) {
+    ret = apply_switch_config(state, switch_id, merged, (int) merged_len);
+  } else if (input_id >= 0) {
+    ret = apply_input_config(state, input_id, merged, (int) merged_len);
+  }
+
+  free(merged);
+  return ret;
+}
+
+/* Record a config_changed event for `key` ("sys", "mqtt", "switch:N",
+ * "input:N") in the notification result */
+static void note_config_changed(notification_result_t *result,
+                                struct mg_str key) {
+  int id;
+
+  if (json_key_is(key, "sys")) {
+    result->sys_config_changed = 1;
+  } else if (json_key_is(key, "mqtt")) {
+    result->mqtt_config_changed = 1;
+  } else if ((id = json_component_key_id(key, "switch", MAX_SWITCHES)) >= 0) {
+    result->switch_config_changed |= 1u << id;
+  } else if ((id = json_component_key_id(key, "input", MAX_INPUTS)) >= 0) {
+    result->input_config_changed |= 1u << id;
+  }
+}
+
+/* NotifyEvent: {"events":[{"component":"switch:0","event":"config_changed",
+ * ...}, ...]}. An event that carries the changed values ("config":{...}) is
+ * applied in place; otherwise the component is flagged for a refresh. Runs
+ * without the state lock. */
+static void apply_notify_event(device_state_t *state, struct mg_str params,
+                               notification_result_t *result) {
+  struct mg_str key, val;
+  size_t ofs = 0;
+
+  while ((ofs = mg_json_next(params, ofs, &key, &val)) > 0) {
+    if (!json_key_is(key, "events")) {
+      continue;
     }
 
-    /* Build JSON-RPC request with correct ID */
-    char *request = jsonrpc_build_request("Script.PutCode", req_id, params);
-    free(params);
+    struct mg_str event;
+    size_t eofs = 0;
+    while ((eofs = mg_json_next(val, eofs, NULL, &event)) > 0) {
+      struct mg_str ekey, eval;
+      struct mg_str component = mg_str_n(NULL, 0);
+      struct mg_str delta = mg_str_n(NULL, 0);
+      int config_changed = 0;
+      size_t fofs = 0;
+
+      while ((fofs = mg_json_next(event, fofs, &ekey, &eval)) > 0) {
+        if (json_key_is(ekey, "component") && eval.len >= 2 &&
+            eval.buf[0] == '"') {
+          /* Keep the quotes: the key parsers expect them */
+          component = eval;
+        } else if (json_key_is(ekey, "event")) {
+          config_changed = (mg_strcmp(eval, mg_str("\"config_changed\"")) == 0);
+        } else if (json_key_is(ekey, "config") && eval.len > 0 &&
+                   eval.buf[0] == '{') {
+          delta = eval;
+        }
+      }
 
-    if (!request) {
-      fprintf(stderr, "Error: Failed to build Script.PutCode request\n");
-      return -1;
+      if (!config_changed || component.len == 0) {
+        continue;
+      }
+      if (delta.len > 0 && apply_config_delta(state, component, delta) == 0) {
+        result->deltas_applied++;
+        continue;
+      }
+      note_config_changed(result, component);
     }
+  }
+}
 
-    /* Add to request queue */
-    int added_id = request_queue_add(queue, request);
-    if (added_id < 0) {
-      free(request);
-      fprintf(stderr, "Error: Failed to add Script.PutCode to request queue\n");
-      return -1;
+/* NotifyStatus / NotifyFullStatus params, or a Shelly.GetStatus result:
+ * {"ts":..., "switch:0":{...}, "input:0":{...}, "script:1":{...}, ...}.
+ * Caller holds the state lock. */
+static void apply_notify_status(device_state_t *state, struct mg_str params,
+                                notification_result_t *result) {
+  struct mg_str key, val;
+  size_t ofs = 0;
+  time_t now = time(NULL);
+  int id;
+
+  while ((ofs = mg_json_next(params, ofs, &key, &val)) > 0) {
+    if (json_key_is(key, "sys")) {
+      /* Only the revisions matter here: they tell whether cached config and
+       * schedules are still current */
+      double rev = 0.0;
+      if (mg_json_get_num(val, "$.cfg_rev", &rev)) {
+        state->device_cfg_rev = (int) rev;
+      }
+      if (mg_json_get_num(val, "$.schedule_rev", &rev)) {
+        state->device_schedule_rev = (int) rev;
+      }
+    } else if ((id = json_component_key_id(key, "switch", MAX_SWITCHES)) >=
+               0) {
+      switch_config_t *sw = device_state_get_switch(state, id);
+      if (!sw || !sw->valid) {
+        continue;
+      }
+
+      result->switch_status_changed[id] |= apply_switch_status(sw, val, now);
+      result->status_updates++;
+
+      log_debug(LOG_CAT_STATE,
+                "Switch %d status updated: output=%s, power=%.1fW, "
+                "voltage=%.1fV, current=%.2fA, temp=%.1fC, energy=%.3fWh\n",
+                id, sw->status.output ? "ON" : "OFF", sw->status.apower,
+                sw->status.voltage, sw->status.current,
+                sw->status.temperature_c, sw->status.energy_total);
+    } else if ((id = json_component_key_id(key, "input", MAX_INPUTS)) >= 0) {
+      input_config_t *inp = device_state_get_input(state, id);
+      if (!inp || !inp->valid) {
+        continue;
+      }
+
+      result->input_status_changed[id] |= apply_input_status(inp, val, now);
+      result->status_updates++;
+
+      log_debug(LOG_CAT_STATE, "Input %d status updated: state=%s\n", id,
+                inp->status.state ? "true" : "false");
+    } else if ((id = json_component_key_id(key, "script", MAX_SCRIPTS)) >=
+               0) {
+      script_entry_t *script = device_state_get_script(state, id);
+      if (!script) {
+        continue;
+      }
+
+      apply_script_status(script, val, now);
+      result->script_status_changed |= 1u << id;
+      result->status_updates++;
+
+      log_debug(LOG_CAT_STATE,
+                "Script %d status: running=%d, mem_used=%d, mem_peak=%d\n", id,
+                script->running, script->mem_used, script->mem_peak);
     }
+  }
+}
 
-    printf("  Chunk %d: offset=%zu, size=%zu, append=%s (req ID: %d)\n",
-           chunk_num, offset, chunk_size, append ? "true" : "false", req_id);
+/* Report the status fields apply_notify_status() changed (after unlock) */
+static void notify_status_changes(device_state_t *state,
+                                  const notification_result_t *result) {
+  for (int i = 0; i < MAX_SWITCHES; i++) {
+    if (result->switch_status_changed[i]) {
+      notify_change(state, STATE_CHANGE_SWITCH_STATUS, i,
+                    result->switch_status_changed[i]);
+    }
+  }
+  for (int i = 0; i < MAX_INPUTS; i++) {
+    if (result->input_status_changed[i]) {
+      notify_change(state, STATE_CHANGE_INPUT_STATUS, i,
+                    result->input_status_changed[i]);
+    }
+  }
+  for (int i = 0; i < MAX_SCRIPTS; i++) {
+    if (result->script_status_changed & (1u << i)) {
+      notify_change(state, STATE_CHANGE_SCRIPT_STATUS, i, 0);
+    }
+  }
+}
 
-    /* Request is queued and will be sent by ws_thread_func */
-    free(request);
-    last_req_id = req_id;
+int device_state_apply_notification(device_state_t *state,
+                                    const jsonrpc_frame_t *frame,
+                                    notification_result_t *result) {
+  if (!state || !frame || !result) {
+    return -1;
+  }
 
-    offset += chunk_size;
-    chunk_num++;
+  memset(result, 0, sizeof(*result));
 
-    /* Small delay between chunks to allow queue to process */
-    usleep(50000); /* 50ms */
+  if (frame->kind != JSONRPC_FRAME_NOTIFICATION || !frame->params) {
+    return -1;
   }
 
-  printf("Script %d upload complete: %d chunks sent\n", script_id, chunk_num);
+  struct mg_str params = mg_str_n(frame->params, frame->params_len);
 
-  /* Update local script code and track last upload request ID */
-  pthread_mutex_lock(&state->mutex);
+  if (jsonrpc_frame_method_is(frame, "NotifyStatus") ||
+      jsonrpc_frame_method_is(frame, "NotifyFullStatus")) {
+    /* One lock for the whole frame: readers see all of it or none */
+    pthread_rwlock_wrlock(&state->lock);
+    apply_notify_status(state, params, result);
+    pthread_rwlock_unlock(&state->lock);
+    notify_status_changes(state, result);
+  } else if (jsonrpc_frame_method_is(frame, "NotifyEvent")) {
+    apply_notify_event(state, params, result);
+  }
 
-  /* Find the script by ID */
-  int slot = -1;
-  for (int i = 0; i < MAX_SCRIPTS; i++) {
-    if (state->scripts.scripts[i].id == script_id &&
-        state->scripts.scripts[i].valid) {
-      slot = i;
-      break;
+  return 0;
+}
+
+/* ============================================================================
+ * CONFIG EDITS (Sys/MQTT/Switch/Input.SetConfig from user-written JSON)
+ * ============================================================================
+ */
+
+static int json_is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* Compare two JSON values regardless of formatting: objects member by member
+ * in any order, numbers by value, anything else token by token */
+static int json_values_equal(struct mg_str a, struct mg_str b) {
+  if (a.len > 0 && b.len > 0 && a.buf[0] == '{' && b.buf[0] == '{') {
+    struct mg_str key, val, other;
+    size_t ofs = 0;
+    int count = 0;
+
+    while ((ofs = mg_json_next(a, ofs, &key, &val)) > 0) {
+      if (!json_find_member(b, key, &other) || !json_values_equal(val, other)) {
+        return 0;
+      }
+      count++;
     }
+    ofs = 0;
+    while ((ofs = mg_json_next(b, ofs, NULL, NULL)) > 0) {
+      count--;
+    }
+    return count == 0;
+  }
+
+  double x, y;
+  if (mg_json_get_num(a, "$", &x) && mg_json_get_num(b, "$", &y)) {
+    return x == y;
   }
 
-  if (slot >= 0) {
-    if (state->scripts.scripts[slot].code) {
-      free(state->scripts.scripts[slot].code);
+  /* Same characters, except for whitespace outside strings */
+  size_t i = 0, j = 0;
+  int in_string = 0;
+  for (;;) {
+    if (!in_string) {
+      while (i < a.len && json_is_space(a.buf[i])) i++;
+      while (j < b.len && json_is_space(b.buf[j])) j++;
+    }
+    if (i == a.len || j == b.len) {
+      return i == a.len && j == b.len;
+    }
+
+    char c = a.buf[i++];
+    if (c != b.buf[j++]) {
+      return 0;
+    }
+    if (in_string && c == '\\') {
+      /* The escaped character can't end the string */
+      if (i == a.len || j == b.len || a.buf[i++] != b.buf[j++]) {
+        return 0;
+      }
+    } else if (c == '"') {
+      in_string = !in_string;
+    }
+  }
+}
+
+/* Write the members of `edited` that differ from `base` as an object, with
+ * nested objects reduced to their changed members. Members missing from
+ * `edited` are not written: SetConfig only sets keys, it never removes them.
+ * Returns the number of members written. */
+static int json_diff_write(FILE *out, struct mg_str base,
+                           struct mg_str edited) {
+  struct mg_str key, val, bval;
+  size_t ofs = 0;
+  int count = 0;
+
+  fputc('{', out);
+  while ((ofs = mg_json_next(edited, ofs, &key, &val)) > 0) {
+    int in_base = json_find_member(base, key, &bval);
+    if (in_base && json_values_equal(bval, val)) {
+      continue;
+    }
+
+    fprintf(out, "%s%.*s:", count ? "," : "", (int) key.len, key.buf);
+    count++;
+    if (in_base && bval.len > 0 && bval.buf[0] == '{' && val.len > 0 &&
+        val.buf[0] == '{') {
+      json_diff_write(out, bval, val);
+    } else {
+      fwrite(val.buf, 1, val.len, out);
     }
-    state->scripts.scripts[slot].code = strdup(code);
-    state->scripts.scripts[slot].modify_time = time(NULL);
-    state->scripts.scripts[slot].last_upload_req_id = last_req_id;
   }
+  fputc('}', out);
 
-  pthread_mutex_unlock(&state->mutex);
+  return count;
+}
+
+/* A SetConfig in flight, applied to the stored config once it succeeds */
+typedef struct {
+  device_state_t *state;
+  request_queue_t *queue;
+  struct mg_connection *conn;
+  char key[24]; /* Component key as in config_changed events, quotes included */
+  char *config; /* The "config" that was sent */
+} config_edit_t;
+
+/* Completion callback for a SetConfig sent from a user edit (also on
+ * timeout, or when a later save superseded it). The device accepted exactly
+ * what was sent, so it is merged into the stored config instead of fetching
+ * the whole config back; should the device adjust a value, its config_changed
+ * event corrects it. */
+static void config_edit_done(int req_id, const request_desc_t *desc,
+                             const jsonrpc_frame_t *response) {
+  (void) req_id;
+  config_edit_t *edit = (config_edit_t *) desc->done_data;
+
+  /* On error, timeout or when superseded the stored config is left as it
+   * was */
+  if (response && !jsonrpc_is_error(response, NULL, 0)) {
+    struct mg_str key = mg_str(edit->key);
+    if (apply_config_delta(edit->state, key, mg_str(edit->config)) == 0) {
+      log_debug(LOG_CAT_STATE, "Applied %.*s config edit locally\n",
+                (int) key.len - 2, key.buf + 1);
+    } else {
+      /* Nothing stored to patch: fetch it */
+      switch (desc->method) {
+        case RESPONSE_TYPE_SYS_SETCONFIG:
+          device_state_request_sys_config(edit->state, edit->queue,
+                                          edit->conn);
+          break;
+        case RESPONSE_TYPE_MQTT_SETCONFIG:
+          device_state_request_mqtt_config(edit->state, edit->queue,
+                                           edit->conn);
+          break;
+        case RESPONSE_TYPE_SWITCH_SETCONFIG:
+          device_state_request_switch_config(edit->state, edit->queue,
+                                             edit->conn, desc->component_id);
+          break;
+        case RESPONSE_TYPE_INPUT_SETCONFIG:
+          device_state_request_input_config(edit->state, edit->queue,
+                                            edit->conn, desc->component_id);
+          break;
+      }
+    }
+  }
+
+  free(edit->config);
+  free(edit);
+}
+
+/* Send `user_json` as the config of component `name` (id -1 if it has none)
+ * with `method`, reduced to the keys that differ from the stored config.
+ * Returns the request ID, 0 if nothing changed (no request is sent), or -1 on
+ * error. */
+static int set_config_from_json(device_state_t *state, request_queue_t *queue,
+                                struct mg_connection *conn,
+                                const char *user_json, const char *method,
+                                int type, const char *name, int id) {
+  if (!state || !user_json || !queue || !conn) {
+    return -1;
+  }
+
+  /* Validate that user_json is valid JSON */
+  int value_len = 0;
+  int value_ofs = mg_json_get(mg_str(user_json), "$", &value_len);
+  if (value_ofs < 0) {
+    log_error(LOG_CAT_STATE, "Error: Invalid JSON provided by user\n");
+    return -1;
+  }
+  struct mg_str edited = mg_str_n(user_json + value_ofs, (size_t) value_len);
+
+  config_edit_t *edit = calloc(1, sizeof(*edit));
+  if (!edit) {
+    log_error(LOG_CAT_STATE, "Error: Failed to allocate config edit\n");
+    return -1;
+  }
+  edit->state = state;
+  edit->queue = queue;
+  edit->conn = conn;
+  if (id >= 0) {
+    snprintf(edit->key, sizeof(edit->key), "\"%s:%d\"", name, id);
+  } else {
+    snprintf(edit->key, sizeof(edit->key), "\"%s\"", name);
+  }
+
+  size_t config_len = 0;
+  FILE *out = open_memstream(&edit->config, &config_len);
+  if (!out) {
+    free(edit);
+    return -1;
+  }
+
+  /* Diff against a consistent copy of the stored JSON; without one (or if the
+   * edit isn't an object) the document goes out as written */
+  int changed = -1;
+  pthread_rwlock_rdlock(&state->lock);
+  const char *stored = stored_config_locked(state, mg_str(edit->key));
+  if (stored && edited.buf[0] == '{') {
+    changed = json_diff_write(out, mg_str(stored), edited);
+  } else {
+    fputs(user_json, out);
+  }
+  pthread_rwlock_unlock(&state->lock);
+
+  if (fclose(out) != 0 || changed == 0) {
+    if (changed == 0) {
+      log_debug(LOG_CAT_STATE, "%s: no changes, nothing to send\n", method);
+    }
+    free(edit->config);
+    free(edit);
+    return changed == 0 ? 0 : -1;
+  }
+
+  /* Build params: {"id": id, "config": {...}} */
+  size_t params_size = config_len + 64;
+  char *params = malloc(params_size);
+  if (!params) {
+    log_error(LOG_CAT_STATE, "Error: Failed to allocate params buffer\n");
+    free(edit->config);
+    free(edit);
+    return -1;
+  }
+  if (id >= 0) {
+    snprintf(params, params_size, "{\"id\":%d,\"config\":%s}", id,
+             edit->config);
+  } else {
+    snprintf(params, params_size, "{\"config\":%s}", edit->config);
+  }
+
+  /* Add to request queue. A later save replaces it while it is queued: its
+   * diff is against the same stored config, so it covers this one too. */
+  request_desc_t desc = {.method = type,
+                         .component_id = id,
+                         .done_fn = config_edit_done,
+                         .done_data = edit,
+                         .coalesce = 1};
+  int req_id = request_queue_add(queue, method, params, &desc);
+  free(params);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC, "Error: Failed to add %s to request queue\n",
+              method);
+    free(edit->config);
+    free(edit);
+    return -1;
+  }
+
+  if (changed > 0) {
+    log_debug(LOG_CAT_STATE, "Sending %s with %d changed key(s) (ID: %d)...\n",
+              method, changed, req_id);
+  } else {
+    log_debug(LOG_CAT_STATE, "Sending %s from user edit (ID: %d)...\n", method,
+              req_id);
+  }
+
+  /* Request is queued and will be sent by ws_thread_func */
+  return req_id;
+}
+
+int device_state_set_sys_config_from_json(device_state_t *state,
+                                          const char *user_json,
+                                          request_queue_t *queue,
+                                          struct mg_connection *conn) {
+  return set_config_from_json(state, queue, conn, user_json, "Sys.SetConfig",
+                              RESPONSE_TYPE_SYS_SETCONFIG, "sys", -1);
+}
+
+int device_state_set_mqtt_config_from_json(device_state_t *state,
+                                           const char *user_json,
+                                           request_queue_t *queue,
+                                           struct mg_connection *conn) {
+  return set_config_from_json(state, queue, conn, user_json, "MQTT.SetConfig",
+                              RESPONSE_TYPE_MQTT_SETCONFIG, "mqtt", -1);
+}
+
+int device_state_set_switch_config_from_json(device_state_t *state,
+                                             const char *user_json,
+                                             request_queue_t *queue,
+                                             struct mg_connection *conn,
+                                             int switch_id) {
+  if (switch_id < 0 || switch_id >= MAX_SWITCHES) {
+    return -1;
+  }
+  return set_config_from_json(state, queue, conn, user_json,
+                              "Switch.SetConfig",
+                              RESPONSE_TYPE_SWITCH_SETCONFIG, "switch",
+                              switch_id);
+}
 
-  return last_req_id;
+int device_state_set_input_config_from_json(device_state_t *state,
+                                            const char *user_json,
+                                            request_queue_t *queue,
+                                            struct mg_connection *conn,
+                                            int input_id) {
+  if (input_id < 0 || input_id >= MAX_INPUTS) {
+    return -1;
+  }
+  return set_config_from_json(state, queue, conn, user_json, "Input.SetConfig",
+                              RESPONSE_TYPE_INPUT_SETCONFIG, "input", input_id);
 }
 
 /* ============================================================================
- * SCRIPT STATUS NOTIFICATIONS
+ * COMPONENT DISCOVERY (Shelly.GetConfig / Shelly.GetStatus)
  * ============================================================================
  */
 
-int device_state_is_script_status_notification(const char *json, size_t len) {
-  if (!json || len == 0) {
-    return 0;
+int device_state_request_device_config(device_state_t *state,
+                                       request_queue_t *queue,
+                                       struct mg_connection *conn) {
+  if (!state || !queue || !conn) {
+    return -1;
   }
 
-  struct mg_str json_str = mg_str_n(json, len);
-
-  /* Check for NotifyStatus notification */
-  char *method = mg_json_get_str(json_str, "$.method");
-
-  if (method) {
-    if (strstr(method, "NotifyStatus") != NULL) {
-      /* Check if params contain any script:N component */
-      char *params = mg_json_get_str(json_str, "$.params");
-      if (params) {
-        struct mg_str params_str = mg_str(params);
-
-        /* Check for script:0 through script:9 */
-        for (int i = 0; i < MAX_SCRIPTS; i++) {
-          char path[32];
-          snprintf(path, sizeof(path), "$.script:%d", i);
-
-          char *script_status = mg_json_get_str(params_str, path);
-          if (script_status) {
-            free(script_status);
-            free(params);
-            free(method);
-            return 1;
-          }
-        }
-        free(params);
-      }
-    }
-    free(method);
+  /* Add to request queue */
+  request_desc_t desc = {.method = RESPONSE_TYPE_SHELLY_GETCONFIG,
+                         .component_id = -1};
+  int req_id = request_queue_add(queue, "Shelly.GetConfig", NULL, &desc);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Shelly.GetConfig to request queue\n");
+    return -1;
   }
 
-  return 0;
+  log_debug(LOG_CAT_STATE, "Requesting device configuration (ID: %d)...\n",
+            req_id);
+
+  return req_id;
 }
 
-int device_state_update_script_status(device_state_t *state, const char *json,
-                                      size_t len) {
-  if (!state || !json || len == 0) {
+int device_state_update_device_config(device_state_t *state,
+                                      const jsonrpc_frame_t *response,
+                                      discovery_result_t *result) {
+  if (!state || !response || !result) {
     return -1;
   }
 
-  struct mg_str json_str = mg_str_n(json, len);
+  memset(result, 0, sizeof(*result));
 
-  /* Extract params from notification */
-  char *params = mg_json_get_str(json_str, "$.params");
-  if (!params) {
+  char error_msg[256];
+  if (jsonrpc_is_error(response, error_msg, sizeof(error_msg))) {
+    log_error(LOG_CAT_STATE, "Error getting device config: %s\n", error_msg);
     return -1;
   }
 
-  struct mg_str params_str = mg_str(params);
-  int updated_count = 0;
-
-  pthread_mutex_lock(&state->mutex);
+  if (response->result_len == 0) {
+    log_error(LOG_CAT_STATE,
+              "Error: No result field in device config response\n");
+    return -1;
+  }
 
-  /* Check each script slot for status updates */
-  for (int i = 0; i < MAX_SCRIPTS; i++) {
-    char path[64];
-    snprintf(path, sizeof(path), "$.script:%d", i);
+  /* One walk over {"sys":{...}, "mqtt":{...}, "switch:0":{...}, ...}; every
+   * member is stored as if it came from its own <Component>.GetConfig */
+  struct mg_str obj = frame_result(response);
+  struct mg_str key, val;
+  size_t ofs = 0;
+  int id;
 
-    char *script_status = mg_json_get_str(params_str, path);
-    if (!script_status) {
-      continue; /* No status for this script */
+  while ((ofs = mg_json_next(obj, ofs, &key, &val)) > 0) {
+    if (val.len == 0 || val.buf[0] != '{') {
+      continue;
     }
 
-    struct mg_str status_str = mg_str(script_status);
-
-    /* Extract running flag */
-    double running_val = 0;
-    if (mg_json_get_num(status_str, "$.running", &running_val)) {
-      state->scripts.scripts[i].running = (running_val != 0);
+    if (json_key_is(key, "sys")) {
+      if (apply_sys_config(state, val.buf, (int) val.len) == 0) {
+        result->has_sys = 1;
+      }
+    } else if (json_key_is(key, "mqtt")) {
+      if (apply_mqtt_config(state, val.buf, (int) val.len) == 0) {
+        result->has_mqtt = 1;
+      }
+    } else if ((id = json_component_key_id(key, "switch", MAX_SWITCHES)) >=
+               0) {
+      if (apply_switch_config(state, id, val.buf, (int) val.len) == 0) {
+        result->switches |= 1u << id;
+      }
+    } else if ((id = json_component_key_id(key, "input", MAX_INPUTS)) >= 0) {
+      if (apply_input_config(state, id, val.buf, (int) val.len) == 0) {
+        result->inputs |= 1u << id;
+      }
     }
+  }
 
-    /* Extract mem_used */
-    double mem_used_val = 0;
-    if (mg_json_get_num(status_str, "$.mem_used", &mem_used_val)) {
-      state->scripts.scripts[i].mem_used = (int) mem_used_val;
+  /* Components the device no longer reports (e.g. restored from a state
+   * cache taken before a profile change) drop out of the mount */
+  unsigned int gone_switches = 0, gone_inputs = 0;
+  pthread_rwlock_wrlock(&state->lock);
+  for (int i = 0; i < MAX_SWITCHES; i++) {
+    switch_config_t *sw = state->switches.switches[i];
+    if (!(result->switches & (1u << i)) && sw && sw->valid) {
+      sw->valid = 0;
+      gone_switches |= 1u << i;
     }
-
-    /* Extract mem_peak */
-    double mem_peak_val = 0;
-    if (mg_json_get_num(status_str, "$.mem_peak", &mem_peak_val)) {
-      state->scripts.scripts[i].mem_peak = (int) mem_peak_val;
+  }
+  for (int i = 0; i < MAX_INPUTS; i++) {
+    input_config_t *inp = state->inputs.inputs[i];
+    if (!(result->inputs & (1u << i)) && inp && inp->valid) {
+      inp->valid = 0;
+      gone_inputs |= 1u << i;
     }
+  }
+  pthread_rwlock_unlock(&state->lock);
 
-    /* Extract errors array */
-    char *errors_str = mg_json_get_str(status_str, "$.errors");
-    if (errors_str) {
-      /* Free old errors if any */
-      if (state->scripts.scripts[i].errors) {
-        free(state->scripts.scripts[i].errors);
-        state->scripts.scripts[i].errors = NULL;
-      }
-
-      /* Store errors as JSON array string */
-      state->scripts.scripts[i].errors = strdup(errors_str);
-
-      /* Log errors if present */
-      if (strlen(errors_str) > 2) { /* More than just "[]" */
-        printf("Script %d errors: %s\n", i, errors_str);
-      }
-
-      free(errors_str);
+  for (int i = 0; i < MAX_SWITCHES; i++) {
+    if (gone_switches & (1u << i)) {
+      notify_change(state, STATE_CHANGE_SWITCH_CONFIG, i, 0);
+    }
+  }
+  for (int i = 0; i < MAX_INPUTS; i++) {
+    if (gone_inputs & (1u << i)) {
+      notify_change(state, STATE_CHANGE_INPUT_CONFIG, i, 0);
     }
-
-    state->scripts.scripts[i].last_status_update = time(NULL);
-
-    printf("Script %d status: running=%d, mem_used=%d, mem_peak=%d\n", i,
-           state->scripts.scripts[i].running,
-           state->scripts.scripts[i].mem_used,
-           state->scripts.scripts[i].mem_peak);
-
-    free(script_status);
-    updated_count++;
   }
 
-  pthread_mutex_unlock(&state->mutex);
-  free(params);
-
-  return updated_count;
+  return 0;
 }
 
-/* ============================================================================
- * NOTIFICATION UTILITIES
- * ============================================================================
- */
-
-int device_state_is_component_notification(const char *json, size_t len,
-                                           const char *component) {
-  if (!json || len == 0 || !component) {
-    return 0;
+int device_state_request_device_status(device_state_t *state,
+                                       request_queue_t *queue,
+                                       struct mg_connection *conn) {
+  if (!state || !queue || !conn) {
+    return -1;
   }
 
-  struct mg_str json_str = mg_str_n(json, len);
-
-  /* Check for NotifyEvent notifications */
-  char *method = mg_json_get_str(json_str, "$.method");
-
-  if (method) {
-    if (strcmp(method, "NotifyEvent") == 0) {
-      /* Parse NotifyEvent format:
-       * {"method":"NotifyEvent","params":{"events":[{"component":"mqtt","event":"config_changed"}]}}
-       */
-
-      /* Get the events array */
-      int events_len = 0;
-      int events_pos = mg_json_get(json_str, "$.params.events", &events_len);
-
-      if (events_pos >= 0 && events_len > 0) {
-        /* Extract events array as string */
-        struct mg_str events_str = mg_str_n(json + events_pos, events_len);
+  /* Add to request queue */
+  request_desc_t desc = {.method = RESPONSE_TYPE_SHELLY_GETSTATUS,
+                         .component_id = -1};
+  int req_id = request_queue_add(queue, "Shelly.GetStatus", NULL, &desc);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Shelly.GetStatus to request queue\n");
+    return -1;
+  }
 
-        /* Iterate through events array looking for config_changed events */
-        /* Format: [{"component":"mqtt","event":"config_changed",...},...]  */
-        for (int i = 0;; i++) {
-          char path[32];
-          snprintf(path, sizeof(path), "$[%d]", i);
+  log_debug(LOG_CAT_STATE, "Requesting device status (ID: %d)...\n", req_id);
 
-          int event_len = 0;
-          int event_pos = mg_json_get(events_str, path, &event_len);
+  return req_id;
+}
 
-          if (event_pos < 0) {
-            /* No more events */
-            break;
-          }
+int device_state_update_device_status(device_state_t *state,
+                                      const jsonrpc_frame_t *response) {
+  if (!state || !response) {
+    return -1;
+  }
 
-          /* Check this event */
-          struct mg_str event_str =
-              mg_str_n(json + events_pos + event_pos, event_len);
+  char error_msg[256];
+  if (jsonrpc_is_error(response, error_msg, sizeof(error_msg))) {
+    log_error(LOG_CAT_STATE, "Error getting device status: %s\n", error_msg);
+    return -1;
+  }
 
-          char *comp = mg_json_get_str(event_str, "$.component");
-          char *event_type = mg_json_get_str(event_str, "$.event");
+  if (response->result_len == 0) {
+    log_error(LOG_CAT_STATE,
+              "Error: No result field in device status response\n");
+    return -1;
+  }
 
-          if (comp && event_type) {
-            if (strcmp(comp, component) == 0 &&
-                strcmp(event_type, "config_changed") == 0) {
-              free(comp);
-              free(event_type);
-              free(method);
-              return 1;
-            }
-          }
+  /* Same shape as NotifyFullStatus params */
+  notification_result_t applied;
+  memset(&applied, 0, sizeof(applied));
 
-          if (comp) free(comp);
-          if (event_type) free(event_type);
-        }
-      }
-    }
-    /* Also check for legacy NotifyStatus format for backwards compatibility */
-    else if (strstr(method, "NotifyStatus") != NULL) {
-      /* Check if params contain the specified component directly */
-      char *params = mg_json_get_str(json_str, "$.params");
-      if (params) {
-        char path[128];
-        snprintf(path, sizeof(path), "$.%s", component);
-
-        struct mg_str params_str = mg_str(params);
-        char *comp_field = mg_json_get_str(params_str, path);
-        if (comp_field) {
-          free(comp_field);
-          free(params);
-          free(method);
-          return 1;
-        }
-        free(params);
-      }
-    }
-    free(method);
-  }
+  pthread_rwlock_wrlock(&state->lock);
+  apply_notify_status(state, frame_result(response), &applied);
+  pthread_rwlock_unlock(&state->lock);
+  notify_status_changes(state, &applied);
 
-  return 0;
+  return applied.status_updates;
 }
 
 /* ============================================================================
@@ -3103,6 +3957,22 @@ int device_state_is_component_notification(const char *json, size_t len,
  * ============================================================================
  */
 
+/* Free the calls of every listed schedule; the entry array is kept for the
+ * next list. Caller holds the write lock. */
+static void schedules_clear(device_state_t *state) {
+  for (int i = 0; i < state->schedules.count; i++) {
+    schedule_entry_t *sched = &state->schedules.schedules[i];
+    for (int j = 0; j < sched->call_count; j++) {
+      free(sched->calls[j].params_json);
+    }
+    free(sched->calls);
+    sched->calls = NULL;
+    sched->call_count = 0;
+    sched->valid = 0;
+  }
+  state->schedules.count = 0;
+}
+
 schedule_entry_t *device_state_get_schedule(device_state_t *state,
                                             int schedule_id) {
   if (!state || schedule_id < 0) {
@@ -3110,7 +3980,7 @@ schedule_entry_t *device_state_get_schedule(device_state_t *state,
   }
 
   /* Find schedule with matching ID */
-  for (int i = 0; i < MAX_SCHEDULES; i++) {
+  for (int i = 0; i < state->schedules.count; i++) {
     if (state->schedules.schedules[i].valid &&
         state->schedules.schedules[i].id == schedule_id) {
       return &state->schedules.schedules[i];
@@ -3120,6 +3990,24 @@ schedule_entry_t *device_state_get_schedule(device_state_t *state,
   return NULL;
 }
 
+/* Queue a Schedule.List request */
+static int queue_schedule_list(request_queue_t *queue) {
+  /* Add to request queue */
+  request_desc_t desc = {.method = RESPONSE_TYPE_SCHEDULE_LIST,
+                         .component_id = -1,
+                         .lane = REQUEST_LANE_BULK};
+  int req_id = request_queue_add(queue, "Schedule.List", NULL, &desc);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Schedule.List to request queue\n");
+    return -1;
+  }
+
+  log_debug(LOG_CAT_STATE, "Requesting schedule list (ID: %d)...\n", req_id);
+
+  return req_id;
+}
+
 int device_state_request_schedule_list(device_state_t *state,
                                        request_queue_t *queue,
                                        struct mg_connection *conn) {
@@ -3127,90 +4015,151 @@ int device_state_request_schedule_list(device_state_t *state,
     return -1;
   }
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    return -1;
+  return queue_schedule_list(queue);
+}
+
+/* Open a schedule operation batch, or join the one in progress */
+static void schedule_ops_hold(device_state_t *state, request_queue_t *queue) {
+  pthread_rwlock_wrlock(&state->lock);
+  schedules_state_t *schedules = &state->schedules;
+  if (schedules->ops_pending == 0) {
+    schedules->ops_failed = 0;
+    schedules->ops_rev = schedules->rev;
+  }
+  schedules->ops_pending++;
+  schedules->ops_queue = queue;
+  pthread_rwlock_unlock(&state->lock);
+}
+
+/* Drop a reference to the batch. When it was the last one, fetch the list
+ * once - unless it already reflects the batch, which happens when a refresh
+ * triggered elsewhere got there first. */
+static void schedule_ops_release(device_state_t *state) {
+  pthread_rwlock_wrlock(&state->lock);
+  schedules_state_t *schedules = &state->schedules;
+  int refresh = 0;
+  if (schedules->ops_pending > 0 && --schedules->ops_pending == 0) {
+    refresh = schedules->ops_failed > 0 ||
+              schedules->ops_rev != schedules->rev;
   }
+  request_queue_t *queue = schedules->ops_queue;
+  pthread_rwlock_unlock(&state->lock);
 
-  /* Build JSON-RPC request - Schedule.List takes no params */
-  char *request = jsonrpc_build_request("Schedule.List", req_id, NULL);
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Schedule.List request\n");
-    return -1;
+  if (refresh && queue) {
+    log_debug(LOG_CAT_STATE, "Schedule changes done, refreshing list...\n");
+    queue_schedule_list(queue);
   }
+}
 
-  /* Add to request queue */
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Schedule.List to request queue\n");
-    free(request);
-    return -1;
+/* Completion callback for Schedule.Create/Update/Delete (also on timeout) */
+static void schedule_op_done(int req_id, const request_desc_t *desc,
+                             const jsonrpc_frame_t *response) {
+  (void) req_id;
+  device_state_t *state = (device_state_t *) desc->done_data;
+
+  double rev = -1.0;
+  int ok = response && !jsonrpc_is_error(response, NULL, 0) &&
+           mg_json_get_num(frame_result(response), "$.rev", &rev);
+
+  pthread_rwlock_wrlock(&state->lock);
+  if (!ok) {
+    state->schedules.ops_failed++;
+  } else if ((int) rev > state->schedules.ops_rev) {
+    state->schedules.ops_rev = (int) rev;
   }
+  pthread_rwlock_unlock(&state->lock);
 
-  printf("Requesting schedule list (ID: %d)...\n", req_id);
+  schedule_ops_release(state);
+}
 
-  free(request);
+/* Queue a schedule operation as part of the current batch */
+static int queue_schedule_op(device_state_t *state, request_queue_t *queue,
+                             const char *rpc_method, const char *params,
+                             int method, int id) {
+  schedule_ops_hold(state, queue);
+
+  request_desc_t desc = {.method = method,
+                         .component_id = id,
+                         .done_fn = schedule_op_done,
+                         .done_data = state,
+                         .lane = REQUEST_LANE_BULK};
+  int req_id = request_queue_add(queue, rpc_method, params, &desc);
+  if (req_id < 0) {
+    schedule_ops_release(state);
+  }
   return req_id;
 }
 
-int device_state_update_schedule_list(device_state_t *state, const char *json) {
-  if (!state || !json) {
+int device_state_update_schedule_list(device_state_t *state,
+                                      const jsonrpc_frame_t *response) {
+  if (!state || !response) {
     return -1;
   }
 
   /* Check if this is an error response */
   char error_msg[256];
-  if (jsonrpc_is_error(json, error_msg, sizeof(error_msg))) {
-    fprintf(stderr, "Error getting schedule list: %s\n", error_msg);
+  if (jsonrpc_is_error(response, error_msg, sizeof(error_msg))) {
+    log_error(LOG_CAT_STATE, "Error getting schedule list: %s\n", error_msg);
     return -1;
   }
 
-  struct mg_str json_str = mg_str(json);
+  struct mg_str result = frame_result(response);
 
-  pthread_mutex_lock(&state->mutex);
+  pthread_rwlock_wrlock(&state->lock);
 
   /* Clear existing schedules */
-  for (int i = 0; i < MAX_SCHEDULES; i++) {
-    for (int j = 0; j < MAX_SCHEDULE_CALLS; j++) {
-      if (state->schedules.schedules[i].calls[j].params_json) {
-        free(state->schedules.schedules[i].calls[j].params_json);
-        state->schedules.schedules[i].calls[j].params_json = NULL;
-      }
-    }
-    state->schedules.schedules[i].valid = 0;
-  }
-  state->schedules.count = 0;
+  schedules_clear(state);
+  state->schedules.gen++;
 
   /* Get revision number */
   double rev_val = 0.0;
-  if (mg_json_get_num(json_str, "$.result.rev", &rev_val)) {
+  if (mg_json_get_num(result, "$.rev", &rev_val)) {
     state->schedules.rev = (int) rev_val;
   }
 
   /* Parse jobs array */
   int jobs_len = 0;
-  int jobs_pos = mg_json_get(json_str, "$.result.jobs", &jobs_len);
+  int jobs_pos = mg_json_get(result, "$.jobs", &jobs_len);
   if (jobs_pos < 0 || jobs_len <= 0) {
     /* No jobs - this is valid, just means no schedules */
-    pthread_mutex_unlock(&state->mutex);
-    printf("No schedules found on device\n");
+    pthread_rwlock_unlock(&state->lock);
+    notify_change(state, STATE_CHANGE_SCHEDULES, 0, 0);
+    log_debug(LOG_CAT_STATE, "No schedules found on device\n");
     return 0;
   }
 
-  struct mg_str jobs_str = mg_str_n(json + jobs_pos, jobs_len);
+  struct mg_str jobs_str = mg_str_n(result.buf + jobs_pos, jobs_len);
+  struct mg_str key, val;
+
+  /* Size the list to the jobs reported; a list that fits reuses the array */
+  int jobs = 0;
+  for (int ofs = 0; (ofs = mg_json_next(jobs_str, ofs, &key, &val)) > 0;) {
+    jobs++;
+  }
+  if (jobs > MAX_SCHEDULES) {
+    jobs = MAX_SCHEDULES;
+  }
+  if (jobs > state->schedules.capacity) {
+    schedule_entry_t *entries =
+        realloc(state->schedules.schedules, jobs * sizeof(*entries));
+    if (!entries) {
+      pthread_rwlock_unlock(&state->lock);
+      log_error(LOG_CAT_STATE, "Error: Out of memory for %d schedules\n", jobs);
+      notify_change(state, STATE_CHANGE_SCHEDULES, 0, 0);
+      return -1;
+    }
+    state->schedules.schedules = entries;
+    state->schedules.capacity = jobs;
+  }
 
   /* Iterate through jobs array */
   int schedule_count = 0;
   int offset = 0;
-  struct mg_str key, val;
-  while ((offset = mg_json_next(jobs_str, offset, &key, &val)) > 0) {
-    if (schedule_count >= MAX_SCHEDULES) {
-      break;
-    }
-
+  while (schedule_count < jobs &&
+         (offset = mg_json_next(jobs_str, offset, &key, &val)) > 0) {
     schedule_entry_t *sched = &state->schedules.schedules[schedule_count];
+    memset(sched, 0, sizeof(*sched));
+    sched->id = -1;
 
     /* Parse schedule fields from val */
     double id_val = 0.0;
@@ -3220,12 +4169,8 @@ int device_state_update_schedule_list(device_state_t *state, const char *json) {
 
     mg_json_get_bool(val, "$.enable", &sched->enable);
 
-    char *timespec_str = mg_json_get_str(val, "$.timespec");
-    if (timespec_str) {
-      strncpy(sched->timespec, timespec_str, sizeof(sched->timespec) - 1);
-      sched->timespec[sizeof(sched->timespec) - 1] = '\0';
-      free(timespec_str);
-    }
+    json_get_str_buf(val, "$.timespec", sched->timespec,
+                     sizeof(sched->timespec));
 
     /* Parse calls array */
     int calls_len = 0;
@@ -3234,22 +4179,28 @@ int device_state_update_schedule_list(device_state_t *state, const char *json) {
       struct mg_str calls_str = mg_str_n(val.buf + calls_pos, calls_len);
       int call_offset = 0;
       struct mg_str call_key, call_val;
-      int call_count = 0;
-
+      int calls = 0;
       while ((call_offset = mg_json_next(calls_str, call_offset, &call_key,
                                          &call_val)) > 0) {
-        if (call_count >= MAX_SCHEDULE_CALLS) {
-          break;
-        }
+        calls++;
+      }
+      if (calls > MAX_SCHEDULE_CALLS) {
+        calls = MAX_SCHEDULE_CALLS;
+      }
+      sched->calls = calls > 0 ? calloc(calls, sizeof(*sched->calls)) : NULL;
+      if (!sched->calls) {
+        calls = 0;
+      }
 
+      int call_count = 0;
+      call_offset = 0;
+      while (call_count < calls &&
+             (call_offset = mg_json_next(calls_str, call_offset, &call_key,
+                                         &call_val)) > 0) {
         schedule_call_t *call = &sched->calls[call_count];
 
-        char *method_str = mg_json_get_str(call_val, "$.method");
-        if (method_str) {
-          strncpy(call->method, method_str, sizeof(call->method) - 1);
-          call->method[sizeof(call->method) - 1] = '\0';
-          free(method_str);
-        }
+        json_get_str_buf(call_val, "$.method", call->method,
+                         sizeof(call->method));
 
         /* Get params as raw JSON string */
         int params_len = 0;
@@ -3270,24 +4221,24 @@ int device_state_update_schedule_list(device_state_t *state, const char *json) {
   state->schedules.count = schedule_count;
   state->schedules.last_update = time(NULL);
 
-  pthread_mutex_unlock(&state->mutex);
+  pthread_rwlock_unlock(&state->lock);
 
-  printf("Loaded %d schedules (rev: %d)\n", schedule_count,
-         state->schedules.rev);
+  log_debug(LOG_CAT_STATE, "Loaded %d schedules (rev: %d)\n", schedule_count,
+            state->schedules.rev);
 
+  notify_change(state, STATE_CHANGE_SCHEDULES, 0, 0);
   return schedule_count;
 }
 
-int device_state_get_crontab_str(device_state_t *state, char **output) {
+int device_state_get_crontab_str_locked(device_state_t *state,
+                                        char **output) {
   if (!state || !output) {
     return -1;
   }
 
-  pthread_mutex_lock(&state->mutex);
-
   /* Estimate buffer size: header + entries */
   size_t buf_size = 256; /* Header */
-  for (int i = 0; i < MAX_SCHEDULES; i++) {
+  for (int i = 0; i < state->schedules.count; i++) {
     if (state->schedules.schedules[i].valid) {
       /* Each schedule: comment + timespec + calls */
       buf_size += 128; /* Comment line */
@@ -3299,7 +4250,6 @@ int device_state_get_crontab_str(device_state_t *state, char **output) {
 
   char *buf = malloc(buf_size);
   if (!buf) {
-    pthread_mutex_unlock(&state->mutex);
     return -1;
   }
 
@@ -3313,7 +4263,7 @@ int device_state_get_crontab_str(device_state_t *state, char **output) {
                   state->schedules.rev);
 
   /* Write each schedule */
-  for (int i = 0; i < MAX_SCHEDULES; i++) {
+  for (int i = 0; i < state->schedules.count; i++) {
     schedule_entry_t *sched = &state->schedules.schedules[i];
     if (!sched->valid) {
       continue;
@@ -3346,87 +4296,134 @@ int device_state_get_crontab_str(device_state_t *state, char **output) {
     pos += snprintf(buf + pos, buf_size - pos, "\n");
   }
 
-  pthread_mutex_unlock(&state->mutex);
-
   *output = buf;
   return 0;
 }
 
-int device_state_create_schedule(device_state_t *state, request_queue_t *queue,
-                                 struct mg_connection *conn, bool enable,
-                                 const char *timespec, const char *method,
-                                 const char *params) {
-  if (!state || !queue || !conn || !timespec || !method) {
+int device_state_get_crontab_view_locked(device_state_t *state,
+                                         const char **data, size_t *len) {
+  if (!state || !data || !len) {
     return -1;
   }
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    return -1;
+  /* gen only moves under the exclusive lock, so a rendering made for the
+   * current gen cannot be replaced while our caller holds the lock */
+  schedules_state_t *schedules = &state->schedules;
+  pthread_mutex_lock(&schedules->crontab_mutex);
+  if (!schedules->crontab || schedules->crontab_gen != schedules->gen) {
+    char *content = NULL;
+    if (device_state_get_crontab_str_locked(state, &content) != 0 ||
+        !content) {
+      pthread_mutex_unlock(&schedules->crontab_mutex);
+      return -1;
+    }
+    free(schedules->crontab);
+    schedules->crontab = content;
+    schedules->crontab_len = strlen(content);
+    schedules->crontab_gen = schedules->gen;
   }
+  *data = schedules->crontab;
+  *len = schedules->crontab_len;
+  pthread_mutex_unlock(&schedules->crontab_mutex);
 
-  /* Build params JSON */
-  size_t params_size = 512 + (params ? strlen(params) : 0);
-  char *rpc_params = malloc(params_size);
-  if (!rpc_params) {
+  return 0;
+}
+
+int device_state_get_crontab_str(device_state_t *state, char **output) {
+  if (!state || !output) {
     return -1;
   }
 
-  if (params && strlen(params) > 0) {
-    snprintf(rpc_params, params_size,
-             "{\"enable\":%s,\"timespec\":\"%s\",\"calls\":[{\"method\":\"%s\","
-             "\"params\":%s}]}",
-             enable ? "true" : "false", timespec, method, params);
-  } else {
-    snprintf(
-        rpc_params, params_size,
-        "{\"enable\":%s,\"timespec\":\"%s\",\"calls\":[{\"method\":\"%s\"}]"
-        "}",
-        enable ? "true" : "false", timespec, method);
+  pthread_rwlock_rdlock(&state->lock);
+  int ret = device_state_get_crontab_str_locked(state, output);
+  pthread_rwlock_unlock(&state->lock);
+
+  return ret;
+}
+
+/* Room for the "calls" member of `calls` */
+static size_t schedule_calls_size(const schedule_call_t *calls,
+                                  int call_count) {
+  size_t size = 16;
+  for (int i = 0; i < call_count; i++) {
+    size += strlen(calls[i].method) + 32;
+    if (calls[i].params_json) {
+      size += strlen(calls[i].params_json);
+    }
   }
+  return size;
+}
 
-  char *request = jsonrpc_build_request("Schedule.Create", req_id, rpc_params);
-  free(rpc_params);
+/* Write `calls` as a ,"calls":[...] member at `pos`. Returns the new end. */
+static size_t schedule_calls_write(char *buf, size_t size, size_t pos,
+                                   const schedule_call_t *calls,
+                                   int call_count) {
+  pos += snprintf(buf + pos, size - pos, ",\"calls\":[");
+  for (int i = 0; i < call_count; i++) {
+    const char *sep = i > 0 ? "," : "";
+    if (calls[i].params_json && strlen(calls[i].params_json) > 0) {
+      pos += snprintf(buf + pos, size - pos,
+                      "%s{\"method\":\"%s\",\"params\":%s}", sep,
+                      calls[i].method, calls[i].params_json);
+    } else {
+      pos += snprintf(buf + pos, size - pos, "%s{\"method\":\"%s\"}", sep,
+                      calls[i].method);
+    }
+  }
+  pos += snprintf(buf + pos, size - pos, "]");
+  return pos;
+}
+
+int device_state_create_schedule(device_state_t *state, request_queue_t *queue,
+                                 struct mg_connection *conn, bool enable,
+                                 const char *timespec,
+                                 const schedule_call_t *calls,
+                                 int call_count) {
+  if (!state || !queue || !conn || !timespec || !calls || call_count <= 0) {
+    return -1;
+  }
 
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Schedule.Create request\n");
+  /* Build params JSON */
+  size_t params_size = 128 + strlen(timespec) +
+                       schedule_calls_size(calls, call_count);
+  char *rpc_params = malloc(params_size);
+  if (!rpc_params) {
     return -1;
   }
 
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Schedule.Create to request queue\n");
-    free(request);
+  size_t pos = snprintf(rpc_params, params_size,
+                        "{\"enable\":%s,\"timespec\":\"%s\"",
+                        enable ? "true" : "false", timespec);
+  pos = schedule_calls_write(rpc_params, params_size, pos, calls, call_count);
+  snprintf(rpc_params + pos, params_size - pos, "}");
+
+  int req_id = queue_schedule_op(state, queue, "Schedule.Create", rpc_params,
+                                 RESPONSE_TYPE_SCHEDULE_CREATE, -1);
+  free(rpc_params);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Schedule.Create to request queue\n");
     return -1;
   }
 
-  printf("Creating schedule: %s %s (ID: %d)...\n", timespec, method, req_id);
+  log_debug(LOG_CAT_STATE, "Creating schedule: %s %s (ID: %d)...\n", timespec,
+            calls[0].method, req_id);
 
-  free(request);
   return req_id;
 }
 
 int device_state_update_schedule(device_state_t *state, request_queue_t *queue,
                                  struct mg_connection *conn, int schedule_id,
                                  bool enable, const char *timespec,
-                                 const char *method, const char *params) {
+                                 const schedule_call_t *calls,
+                                 int call_count) {
   if (!state || !queue || !conn || schedule_id < 0) {
     return -1;
   }
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    return -1;
-  }
-
   /* Build params JSON - only include fields that are being updated */
-  size_t params_size = 512 + (params ? strlen(params) : 0) +
-                       (timespec ? strlen(timespec) : 0) +
-                       (method ? strlen(method) : 0);
+  size_t params_size = 128 + (timespec ? strlen(timespec) : 0) +
+                       (calls ? schedule_calls_size(calls, call_count) : 0);
   char *rpc_params = malloc(params_size);
   if (!rpc_params) {
     return -1;
@@ -3443,37 +4440,25 @@ int device_state_update_schedule(device_state_t *state, request_queue_t *queue,
                     timespec);
   }
 
-  if (method) {
-    if (params && strlen(params) > 0) {
-      pos += snprintf(rpc_params + pos, params_size - pos,
-                      ",\"calls\":[{\"method\":\"%s\",\"params\":%s}]", method,
-                      params);
-    } else {
-      pos += snprintf(rpc_params + pos, params_size - pos,
-                      ",\"calls\":[{\"method\":\"%s\"}]", method);
-    }
+  if (calls && call_count > 0) {
+    pos = schedule_calls_write(rpc_params, params_size, pos, calls,
+                               call_count);
   }
 
   pos += snprintf(rpc_params + pos, params_size - pos, "}");
 
-  char *request = jsonrpc_build_request("Schedule.Update", req_id, rpc_params);
+  int req_id = queue_schedule_op(state, queue, "Schedule.Update", rpc_params,
+                                 RESPONSE_TYPE_SCHEDULE_UPDATE, schedule_id);
   free(rpc_params);
-
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Schedule.Update request\n");
-    return -1;
-  }
-
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Schedule.Update to request queue\n");
-    free(request);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Schedule.Update to request queue\n");
     return -1;
   }
 
-  printf("Updating schedule %d (ID: %d)...\n", schedule_id, req_id);
+  log_debug(LOG_CAT_STATE, "Updating schedule %d (ID: %d)...\n", schedule_id,
+            req_id);
 
-  free(request);
   return req_id;
 }
 
@@ -3483,46 +4468,35 @@ int device_state_delete_schedule(device_state_t *state, request_queue_t *queue,
     return -1;
   }
 
-  /* Get next request ID */
-  int req_id = request_queue_peek_next_id(queue);
-  if (req_id < 0) {
-    fprintf(stderr, "Error: Failed to get next request ID\n");
-    return -1;
-  }
-
   /* Build params JSON */
   char rpc_params[64];
   snprintf(rpc_params, sizeof(rpc_params), "{\"id\":%d}", schedule_id);
 
-  char *request = jsonrpc_build_request("Schedule.Delete", req_id, rpc_params);
-  if (!request) {
-    fprintf(stderr, "Error: Failed to build Schedule.Delete request\n");
-    return -1;
-  }
-
-  int added_id = request_queue_add(queue, request);
-  if (added_id < 0) {
-    fprintf(stderr, "Error: Failed to add Schedule.Delete to request queue\n");
-    free(request);
+  int req_id = queue_schedule_op(state, queue, "Schedule.Delete", rpc_params,
+                                 RESPONSE_TYPE_SCHEDULE_DELETE, schedule_id);
+  if (req_id < 0) {
+    log_error(LOG_CAT_RPC,
+              "Error: Failed to add Schedule.Delete to request queue\n");
     return -1;
   }
 
-  printf("Deleting schedule %d (ID: %d)...\n", schedule_id, req_id);
+  log_debug(LOG_CAT_STATE, "Deleting schedule %d (ID: %d)...\n", schedule_id,
+            req_id);
 
-  free(request);
   return req_id;
 }
 
-/* Parsed schedule entry from crontab content */
+/* Parsed schedule entry from crontab content: one line per call, folded
+ * together by parsed_schedule_continue() */
 typedef struct {
   int id;      /* Schedule ID from "# id:N" comment, or -1 for new */
   bool enable; /* Enabled (no #! prefix) or disabled (#! prefix) */
   char timespec[MAX_SCHEDULE_TIMESPEC];
-  char method[MAX_SCHEDULE_METHOD];
-  char *params; /* JSON params or NULL */
+  schedule_call_t calls[MAX_SCHEDULE_CALLS]; /* params_json NULL if none */
+  int call_count;
 } parsed_schedule_t;
 
-/* Parse a single crontab line into a parsed schedule entry.
+/* Parse a single crontab line into a parsed schedule entry with one call.
  * Returns 1 if a schedule entry was parsed, 0 if skipped (comment/empty),
  * -1 on error. */
 static int parse_crontab_line(const char *line, size_t len,
@@ -3622,12 +4596,13 @@ static int parse_crontab_line(const char *line, size_t len,
          line[pos] != '\n') {
     pos++;
   }
+  schedule_call_t *call = &parsed->calls[0];
   size_t method_len = pos - method_start;
-  if (method_len == 0 || method_len >= sizeof(parsed->method)) {
+  if (method_len == 0 || method_len >= sizeof(call->method)) {
     return -1;
   }
-  memcpy(parsed->method, line + method_start, method_len);
-  parsed->method[method_len] = '\0';
+  memcpy(call->method, line + method_start, method_len);
+  call->method[method_len] = '\0';
 
   /* Skip whitespace before params */
   while (pos < len && (line[pos] == ' ' || line[pos] == '\t')) {
@@ -3635,7 +4610,7 @@ static int parse_crontab_line(const char *line, size_t len,
   }
 
   /* Parse params (rest of line until newline) */
-  parsed->params = NULL;
+  call->params_json = NULL;
   if (pos < len && line[pos] != '\n') {
     size_t params_start = pos;
     while (pos < len && line[pos] != '\n') {
@@ -3648,9 +4623,10 @@ static int parse_crontab_line(const char *line, size_t len,
       params_len--;
     }
     if (params_len > 0) {
-      parsed->params = strndup(line + params_start, params_len);
+      call->params_json = strndup(line + params_start, params_len);
     }
   }
+  parsed->call_count = 1;
 
   /* Reset current_id after using it */
   *current_id = -1;
@@ -3658,6 +4634,49 @@ static int parse_crontab_line(const char *line, size_t len,
   return 1;
 }
 
+/* Fold the one-call line `line` into the schedule `prev` of the line before
+ * it if it is a further call of that schedule: the crontab has one line per
+ * call and the "# id:N" comment only above the first. A line continues a
+ * schedule if it repeats its id, or has none and directly follows one with
+ * an id, and has the same timespec and enable. Returns whether it was
+ * folded (the call then belongs to `prev`). */
+static bool parsed_schedule_continue(parsed_schedule_t *prev,
+                                     parsed_schedule_t *line, bool adjacent) {
+  if (prev->id < 0 || prev->call_count >= MAX_SCHEDULE_CALLS ||
+      (line->id >= 0 ? line->id != prev->id : !adjacent) ||
+      prev->enable != line->enable ||
+      strcmp(prev->timespec, line->timespec) != 0) {
+    return false;
+  }
+
+  prev->calls[prev->call_count++] = line->calls[0];
+  line->calls[0].params_json = NULL;
+  line->call_count = 0;
+  return true;
+}
+
+/* Whether a parsed schedule says what an existing schedule already does:
+ * same timespec, enable and calls, in order */
+static bool schedule_matches(const schedule_entry_t *existing,
+                             const parsed_schedule_t *p) {
+  if (existing->enable != p->enable ||
+      strcmp(existing->timespec, p->timespec) != 0 ||
+      existing->call_count != p->call_count) {
+    return false;
+  }
+
+  for (int i = 0; i < p->call_count; i++) {
+    const schedule_call_t *a = &existing->calls[i];
+    const schedule_call_t *b = &p->calls[i];
+    if (strcmp(a->method, b->method) != 0 ||
+        strcmp(a->params_json ? a->params_json : "",
+               b->params_json ? b->params_json : "") != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
 int device_state_sync_crontab(device_state_t *state, request_queue_t *queue,
                               struct mg_connection *conn, const char *content,
                               size_t content_len) {
@@ -3669,11 +4688,12 @@ int device_state_sync_crontab(device_state_t *state, request_queue_t *queue,
   parsed_schedule_t parsed_schedules[MAX_SCHEDULES];
   int parsed_count = 0;
   int current_id = -1;
+  bool adjacent = false; /* The last line was a schedule line */
 
   const char *line_start = content;
   const char *content_end = content + content_len;
 
-  while (line_start < content_end && parsed_count < MAX_SCHEDULES) {
+  while (line_start < content_end) {
     /* Find end of line */
     const char *line_end = line_start;
     while (line_end < content_end && *line_end != '\n') {
@@ -3681,17 +4701,28 @@ int device_state_sync_crontab(device_state_t *state, request_queue_t *queue,
     }
 
     size_t line_len = line_end - line_start;
-    parsed_schedule_t *parsed = &parsed_schedules[parsed_count];
-    memset(parsed, 0, sizeof(*parsed));
+    parsed_schedule_t parsed;
+    memset(&parsed, 0, sizeof(parsed));
 
-    int result = parse_crontab_line(line_start, line_len, parsed, &current_id);
+    int result = parse_crontab_line(line_start, line_len, &parsed, &current_id);
     if (result == 1) {
-      parsed_count++;
+      if (parsed_count > 0 &&
+          parsed_schedule_continue(&parsed_schedules[parsed_count - 1],
+                                   &parsed, adjacent)) {
+        /* Further call of the schedule above */
+      } else if (parsed_count < MAX_SCHEDULES) {
+        parsed_schedules[parsed_count++] = parsed;
+      } else {
+        free(parsed.calls[0].params_json);
+        break;
+      }
     } else if (result < 0) {
-      fprintf(stderr, "Warning: Failed to parse crontab line: '%.*s'\n",
-              (int) line_len, line_start);
+      log_warn(LOG_CAT_STATE, "Warning: Failed to parse crontab line: '%.*s'\n",
+               (int) line_len, line_start);
     }
 
+    adjacent = result == 1;
+
     /* Move to next line */
     line_start = line_end;
     if (line_start < content_end && *line_start == '\n') {
@@ -3699,101 +4730,117 @@ int device_state_sync_crontab(device_state_t *state, request_queue_t *queue,
     }
   }
 
-  printf("Parsed %d schedules from crontab\n", parsed_count);
+  log_debug(LOG_CAT_STATE, "Parsed %d schedules from crontab\n", parsed_count);
 
-  /* Track which existing schedules are still present */
-  bool existing_seen[MAX_SCHEDULES] = {false};
-  int ops_queued = 0;
-
-  /* Process parsed schedules: create or update */
-  for (int i = 0; i < parsed_count; i++) {
-    parsed_schedule_t *p = &parsed_schedules[i];
+  /* Plan the change set under the read lock: which line maps onto which
+   * existing schedule, and which schedules are gone */
+  int target[MAX_SCHEDULES];      /* Schedule ID per line, -1 to create */
+  bool changed[MAX_SCHEDULES];    /* Line differs from its schedule */
+  int delete_ids[MAX_SCHEDULES];
+  int delete_count = 0;
+  bool claimed[MAX_SCHEDULES] = {false}; /* Existing slots matched */
+  int slot_of[MAX_SCHEDULES];            /* Matched slot per line, -1 */
 
-    if (p->id >= 0) {
-      /* Schedule has ID - find and update existing */
-      schedule_entry_t *existing = device_state_get_schedule(state, p->id);
-      if (existing) {
-        /* Mark as seen */
-        for (int j = 0; j < MAX_SCHEDULES; j++) {
-          if (state->schedules.schedules[j].valid &&
-              state->schedules.schedules[j].id == p->id) {
-            existing_seen[j] = true;
-            break;
-          }
-        }
+  pthread_rwlock_rdlock(&state->lock);
+  schedule_entry_t *slots = state->schedules.schedules;
+  int slot_count = state->schedules.count;
 
-        /* Check if update is needed */
-        bool needs_update = false;
-        if (existing->enable != p->enable) {
-          needs_update = true;
-        }
-        if (strcmp(existing->timespec, p->timespec) != 0) {
-          needs_update = true;
-        }
-        if (existing->call_count > 0) {
-          if (strcmp(existing->calls[0].method, p->method) != 0) {
-            needs_update = true;
-          }
-          const char *existing_params = existing->calls[0].params_json
-                                            ? existing->calls[0].params_json
-                                            : "";
-          const char *new_params = p->params ? p->params : "";
-          if (strcmp(existing_params, new_params) != 0) {
-            needs_update = true;
-          }
-        } else {
-          needs_update = true;
-        }
+  /* 1. "# id:N" lines claim schedule N */
+  for (int i = 0; i < parsed_count; i++) {
+    slot_of[i] = -1;
+    if (parsed_schedules[i].id < 0) {
+      continue;
+    }
+    for (int j = 0; j < slot_count; j++) {
+      if (slots[j].valid && !claimed[j] &&
+          slots[j].id == parsed_schedules[i].id) {
+        claimed[j] = true;
+        slot_of[i] = j;
+        break;
+      }
+    }
+    if (slot_of[i] < 0) {
+      log_warn(LOG_CAT_STATE,
+               "Warning: Schedule ID %d not found on device, matching by "
+               "content\n",
+               parsed_schedules[i].id);
+    }
+  }
 
-        if (needs_update) {
-          int ret =
-              device_state_update_schedule(state, queue, conn, p->id, p->enable,
-                                           p->timespec, p->method, p->params);
-          if (ret >= 0) {
-            ops_queued++;
-          }
-        }
-      } else {
-        fprintf(stderr,
-                "Warning: Schedule ID %d not found on device, skipping "
-                "(cannot create with specific ID)\n",
-                p->id);
+  /* 2. Other lines claim an unclaimed schedule with the same content, so
+   * moving lines or dropping their id comments costs nothing */
+  for (int i = 0; i < parsed_count; i++) {
+    for (int j = 0; j < slot_count && slot_of[i] < 0; j++) {
+      if (slots[j].valid && !claimed[j] &&
+          schedule_matches(&slots[j], &parsed_schedules[i])) {
+        claimed[j] = true;
+        slot_of[i] = j;
       }
-    } else {
-      /* No ID - create new schedule */
-      int ret = device_state_create_schedule(state, queue, conn, p->enable,
-                                             p->timespec, p->method, p->params);
-      if (ret >= 0) {
-        printf("Creating schedule (ID: %d)...\n", ret);
-        ops_queued++;
+    }
+  }
+
+  /* 3. Pair the remaining new lines with schedules that are gone: one
+   * Update instead of a Delete and a Create */
+  for (int i = 0; i < parsed_count; i++) {
+    for (int j = 0; j < slot_count && slot_of[i] < 0; j++) {
+      if (slots[j].valid && !claimed[j]) {
+        claimed[j] = true;
+        slot_of[i] = j;
       }
     }
+  }
+
+  for (int i = 0; i < parsed_count; i++) {
+    int j = slot_of[i];
+    target[i] = j >= 0 ? slots[j].id : -1;
+    changed[i] = j < 0 || !schedule_matches(&slots[j], &parsed_schedules[i]);
+  }
+  for (int j = 0; j < slot_count; j++) {
+    if (slots[j].valid && !claimed[j]) {
+      delete_ids[delete_count++] = slots[j].id;
+    }
+  }
+  pthread_rwlock_unlock(&state->lock);
+
+  /* Queue the change set as one batch; the list is refreshed once it has
+   * completed */
+  int ops_queued = 0;
+  schedule_ops_hold(state, queue);
+
+  for (int i = 0; i < parsed_count; i++) {
+    parsed_schedule_t *p = &parsed_schedules[i];
+
+    int ret = -1; /* Unchanged lines need no request */
+    if (target[i] < 0) {
+      ret = device_state_create_schedule(state, queue, conn, p->enable,
+                                         p->timespec, p->calls,
+                                         p->call_count);
+    } else if (changed[i]) {
+      ret = device_state_update_schedule(state, queue, conn, target[i],
+                                         p->enable, p->timespec, p->calls,
+                                         p->call_count);
+    }
+    if (ret >= 0) {
+      ops_queued++;
+    }
 
     /* Free allocated params */
-    if (p->params) {
-      free(p->params);
-      p->params = NULL;
+    for (int c = 0; c < p->call_count; c++) {
+      free(p->calls[c].params_json);
+      p->calls[c].params_json = NULL;
     }
   }
 
   /* Delete schedules that were removed from crontab */
-  pthread_mutex_lock(&state->mutex);
-  for (int i = 0; i < MAX_SCHEDULES; i++) {
-    if (state->schedules.schedules[i].valid && !existing_seen[i]) {
-      int sched_id = state->schedules.schedules[i].id;
-      pthread_mutex_unlock(&state->mutex);
-
-      int ret = device_state_delete_schedule(state, queue, conn, sched_id);
-      if (ret >= 0) {
-        ops_queued++;
-      }
-
-      pthread_mutex_lock(&state->mutex);
+  for (int i = 0; i < delete_count; i++) {
+    if (device_state_delete_schedule(state, queue, conn, delete_ids[i]) >= 0) {
+      ops_queued++;
     }
   }
-  pthread_mutex_unlock(&state->mutex);
 
-  printf("Queued %d schedule operations\n", ops_queued);
+  schedule_ops_release(state);
+
+  log_info(LOG_CAT_STATE, "Queued %d schedule operations\n", ops_queued);
 
   return ops_queued;
 }
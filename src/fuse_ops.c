@@ -11,14 +11,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include "../include/device_state.h"
+#include "../include/log.h"
+#include "../include/metrics.h"
 #include "../include/mongoose.h"
+#include "../include/stats.h"
 
 /*
  * macOS/FUSE compatibility layer
@@ -27,22 +32,48 @@
 #if FUSE_USE_VERSION < 30
 /* For older FUSE versions (macOS with macFUSE/FUSE-T) */
 #define SHUSE_READDIR_FLAGS_PARAM
+#define SHUSE_READDIR_FLAGS_ARG
 #define SHUSE_READDIR_UNUSED_FLAGS
 /* fuse_fill_dir_t has 4 args in FUSE2: buf, name, stbuf, off */
 #define FUSE_FILL_DIR(filler, buf, name) filler(buf, name, NULL, 0)
+/* fuse_loop_mt takes only the handle in FUSE2 */
+#define SHUSE_FUSE_LOOP_MT(f) fuse_loop_mt(f)
 #else
 /* FUSE3 (Linux) has the flags parameter */
 #define SHUSE_READDIR_FLAGS_PARAM , enum fuse_readdir_flags flags
+#define SHUSE_READDIR_FLAGS_ARG , flags
 #define SHUSE_READDIR_UNUSED_FLAGS (void) flags;
 /* fuse_fill_dir_t has 5 args in FUSE3: buf, name, stbuf, off, flags */
 #define FUSE_FILL_DIR(filler, buf, name) filler(buf, name, NULL, 0, 0)
+/* FUSE3 (API 31) fuse_loop_mt takes a clone_fd flag */
+#define SHUSE_FUSE_LOOP_MT(f) fuse_loop_mt(f, 0)
 #endif
 
-/* Global FUSE context */
-static fuse_context_data_t g_fuse_ctx = {0};
+/* Mounted devices (fuse_ops_add_device). Named devices each have a /<name>
+ * directory and the mount root lists them; an unnamed device is the root. */
+static fuse_context_data_t **g_devices = NULL;
+static int g_device_count = 0;
+static int g_named = 0;
 
-/* Global FUSE handle for fuse_exit() */
+/* Global FUSE handle for fuse_exit() and cache invalidation. The mutex keeps
+ * the WebSocket thread from invalidating through a handle being destroyed. */
 static struct fuse *g_fuse_handle = NULL;
+static pthread_mutex_t g_fuse_handle_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Let the kernel cache attributes, lookups and file pages; entries are
+ * invalidated explicitly when the device state behind them changes */
+static int g_kernel_cache = 0;
+
+/* Attribute/entry timeout used with kernel caching, in seconds. Long, since
+ * correctness comes from invalidation rather than expiry. */
+#define SHUSE_KERNEL_CACHE_TIMEOUT 3600.0
+
+/* Run the multi-threaded FUSE loop (default) or the single-threaded one */
+static int g_fuse_multithreaded = 1;
+
+/* Keep writes made while a device is disconnected, to send on reconnect,
+ * rather than refuse them */
+static int g_offline_writes_kept = 0;
 
 /* Write buffer for file modifications */
 typedef struct {
@@ -51,19 +82,46 @@ typedef struct {
   size_t capacity;
 } write_buffer_t;
 
-/* File handle context for tracking writes */
-typedef struct {
+struct vnode;
+
+/* File handle context for tracking writes and poll() state */
+typedef struct shuse_file_handle {
+  fuse_context_data_t *ctx; /* Device the file belongs to */
+  struct fuse_group *group; /* Group it was opened through, if any */
   write_buffer_t *buffer;
-  int script_id; /* For script files, -1 otherwise */
-  int switch_id; /* For switch config files, -1 otherwise */
-  int input_id;  /* For input config files, -1 otherwise */
+  const struct vnode *node; /* File opened */
+  int id;                   /* Its component id, -1 if none */
+
+  /* Pollable files: set when the value changes, cleared when it is read
+   * from the start; `ph` is the kernel's pending poll, if any */
+  int changed;
+  struct fuse_pollhandle *ph;
+  struct shuse_file_handle *poll_next; /* In g_poll_handles */
+
+  /* Snapshot files: contents rendered at the last read from offset 0 */
+  char *snapshot;
+  size_t snapshot_len;
+  pthread_mutex_t snapshot_lock;
 } file_handle_t;
 
-/* Helper function to get FUSE context */
-static fuse_context_data_t *get_fuse_ctx(void) {
-  return &g_fuse_ctx;
+/* Open handles of pollable files, for waking them on changes */
+static file_handle_t *g_poll_handles = NULL;
+static pthread_mutex_t g_poll_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Device whose state this is, for node callbacks that only get the state */
+static fuse_context_data_t *state_device(device_state_t *state) {
+  for (int i = 0; i < g_device_count; i++) {
+    if (g_devices[i]->dev_state == state) {
+      return g_devices[i];
+    }
+  }
+  return NULL;
 }
 
+/* Write buffers start at the size of the content they are opened with, or
+ * this much when opened empty, and grow with the writes */
+#define WRITE_BUFFER_MIN 256
+
 /* Create write buffer */
 static write_buffer_t *write_buffer_create(size_t initial_capacity) {
   write_buffer_t *buf = malloc(sizeof(write_buffer_t));
@@ -115,1147 +173,2444 @@ static int write_buffer_ensure_capacity(write_buffer_t *buf, size_t needed) {
   return 0;
 }
 
-/* Parse script ID from filename (e.g., "script_0.js" -> 0) */
-static int parse_script_id(const char *name) {
-  if (strncmp(name, "script_", 7) != 0) {
-    return -1;
-  }
+/* ============================================================================
+ * VIRTUAL NODE TABLE
+ * ============================================================================
+ *
+ * Every file and directory of the mount is described once by a static node.
+ * Directories list their children; nodes that exist once per component
+ * (switch_N_config.json, /proc/switch/N, script_N.js) carry a name pattern
+ * with a single '#' standing for the component id. A path is resolved by
+ * walking the tree one component at a time, and the FUSE operations then
+ * work from the node's callbacks instead of matching the path themselves.
+ */
 
-  const char *num_str = name + 7;
-  char *endptr;
-  long id = strtol(num_str, &endptr, 10);
+/* Rendered file contents: points into device state, at `owned` or at `buf` */
+typedef struct {
+  const char *data;
+  size_t len;
+  char *owned;  /* Heap buffer to free after use, if any */
+  char buf[64]; /* Room for short proc values */
+} node_data_t;
+
+/* Node flags */
+#define NODE_BUFFERED 0x01     /* Writes collect in a buffer sent on flush */
+#define NODE_TRUNC_EMPTY 0x02  /* O_TRUNC opens start with an empty buffer */
+#define NODE_SCRIPT 0x04       /* Script code is acquired for each open */
+#define NODE_KEEP_CACHE 0x08   /* Page cache may be kept across opens (-k) */
+#define NODE_POLL 0x10         /* poll() reports changes of the value */
+#define NODE_SNAPSHOT 0x20     /* Reads from offset 0 take a fresh snapshot */
+#define NODE_TEXT 0x40         /* Field value is a string (quoted in JSON) */
+
+/* Bit for a state_change_t in vnode_t.changes */
+#define CHANGE(what) (1u << (what))
+
+typedef struct vnode vnode_t;
+
+struct vnode {
+  /* Entry name; with id_max > 0 a pattern in which '#' is an id < id_max */
+  const char *name;
+  int id_max;
+  mode_t mode; /* S_IFDIR or S_IFREG plus permission bits */
+  unsigned int flags;
+  const vnode_t *const *children; /* NULL-terminated; directories only */
+
+  /* Whether the node exists for this id; NULL means always */
+  int (*present)(device_state_t *state, int id);
+  /* File contents (0 or -errno); also gives the size and the initial write
+   * buffer unless `size`/`fixed_size` say otherwise */
+  int (*render)(device_state_t *state, const vnode_t *node, int id,
+                node_data_t *out);
+  off_t (*size)(device_state_t *state, int id);
+  off_t fixed_size;
+  time_t (*mtime)(device_state_t *state, const vnode_t *node, int id);
+
+  /* Unbuffered write, acted on immediately (returns bytes or -errno) */
+  int (*write)(fuse_context_data_t *ctx, int id, const char *buf,
+               size_t size);
+  /* Send a buffered write to the device (0 or -errno) */
+  int (*flush)(fuse_context_data_t *ctx, const vnode_t *node, int id,
+               write_buffer_t *wbuf);
+
+  /* Kernel cache invalidation: CHANGE() bits of the state changes that
+   * affect this node, and for status changes the fields it shows */
+  unsigned int changes;
+  unsigned int fields;
+};
 
-  if (endptr == num_str || (*endptr != '\0' && strcmp(endptr, ".js") != 0)) {
-    return -1;
+/* Release node_data_t contents */
+static void node_data_free(node_data_t *data) {
+  free(data->owned);
+  data->owned = NULL;
+}
+
+/* Copy out of a rendered buffer at the given offset */
+static int copy_out(const char *data, size_t len, char *buf, size_t size,
+                    off_t offset) {
+  if (offset >= (off_t) len) {
+    return 0;
   }
 
-  if (id < 0 || id >= MAX_SCRIPTS) {
-    return -1;
+  if (offset + size > len) {
+    size = len - offset;
   }
 
-  return (int) id;
+  memcpy(buf, data + offset, size);
+  return size;
 }
 
-/* Parse switch ID from filename (e.g., "switch_0_config.json" -> 0) */
-static int parse_switch_id(const char *name) {
-  if (strncmp(name, "switch_", 7) != 0) {
-    return -1;
+/* ----------------------------------------------------------------------------
+ * Presence checks
+ * ----------------------------------------------------------------------------
+ */
+
+static int switch_present(device_state_t *state, int id) {
+  switch_config_t *sw = device_state_get_switch(state, id);
+  return sw && sw->valid;
+}
+
+static int input_present(device_state_t *state, int id) {
+  input_config_t *inp = device_state_get_input(state, id);
+  return inp && inp->valid;
+}
+
+static int script_present(device_state_t *state, int id) {
+  script_entry_t *script = device_state_get_script(state, id);
+  return script && script->valid;
+}
+
+static int metrics_present(device_state_t *state, int id) {
+  (void) id;
+  fuse_context_data_t *dev = state_device(state);
+  return dev && dev->metrics;
+}
+
+/* ----------------------------------------------------------------------------
+ * Config files
+ * ----------------------------------------------------------------------------
+ */
+
+static int sys_config_render(device_state_t *state, const vnode_t *node,
+                             int id, node_data_t *out) {
+  (void) node;
+  (void) id;
+  if (!state->sys_config.valid || !state->sys_config.raw_json) {
+    return -ENOENT;
   }
+  out->data = state->sys_config.raw_json;
+  out->len = state->sys_config.json_len;
+  return 0;
+}
 
-  const char *num_str = name + 7;
-  char *endptr;
-  long id = strtol(num_str, &endptr, 10);
+static time_t sys_config_mtime(device_state_t *state, const vnode_t *node,
+                               int id) {
+  (void) node;
+  (void) id;
+  return state->sys_config.last_update;
+}
 
-  if (endptr == num_str || strcmp(endptr, "_config.json") != 0) {
-    return -1;
+static int mqtt_config_render(device_state_t *state, const vnode_t *node,
+                              int id, node_data_t *out) {
+  (void) node;
+  (void) id;
+  if (!state->mqtt_config.valid || !state->mqtt_config.raw_json) {
+    return -ENOENT;
   }
+  out->data = state->mqtt_config.raw_json;
+  out->len = state->mqtt_config.json_len;
+  return 0;
+}
 
-  if (id < 0 || id >= MAX_SWITCHES) {
-    return -1;
+static time_t mqtt_config_mtime(device_state_t *state, const vnode_t *node,
+                                int id) {
+  (void) node;
+  (void) id;
+  return state->mqtt_config.last_update;
+}
+
+static int switch_config_render(device_state_t *state, const vnode_t *node,
+                                int id, node_data_t *out) {
+  (void) node;
+  switch_config_t *sw = device_state_get_switch(state, id);
+  if (!sw || !sw->valid || !sw->raw_json) {
+    return -ENOENT;
   }
+  out->data = sw->raw_json;
+  out->len = sw->json_len;
+  return 0;
+}
 
-  return (int) id;
+static time_t switch_config_mtime(device_state_t *state, const vnode_t *node,
+                                  int id) {
+  (void) node;
+  return device_state_get_switch(state, id)->last_update;
 }
 
-/* Parse input ID from filename (e.g., "input_0_config.json" -> 0) */
-static int parse_input_id(const char *name) {
-  if (strncmp(name, "input_", 6) != 0) {
-    return -1;
+static int input_config_render(device_state_t *state, const vnode_t *node,
+                               int id, node_data_t *out) {
+  (void) node;
+  input_config_t *inp = device_state_get_input(state, id);
+  if (!inp || !inp->valid || !inp->raw_json) {
+    return -ENOENT;
   }
+  out->data = inp->raw_json;
+  out->len = inp->json_len;
+  return 0;
+}
 
-  const char *num_str = name + 6;
-  char *endptr;
-  long id = strtol(num_str, &endptr, 10);
+static time_t input_config_mtime(device_state_t *state, const vnode_t *node,
+                                 int id) {
+  (void) node;
+  return device_state_get_input(state, id)->last_update;
+}
 
-  if (endptr == num_str || strcmp(endptr, "_config.json") != 0) {
-    return -1;
+/* ----------------------------------------------------------------------------
+ * Crontab and scripts
+ * ----------------------------------------------------------------------------
+ */
+
+/* Served from the cached rendering: re-reads, chunked reads and getattr
+ * only copy out of it until the schedule list changes */
+static int crontab_render(device_state_t *state, const vnode_t *node, int id,
+                          node_data_t *out) {
+  (void) node;
+  (void) id;
+  if (device_state_get_crontab_view_locked(state, &out->data, &out->len) !=
+      0) {
+    return -EIO;
   }
+  return 0;
+}
 
-  if (id < 0 || id >= MAX_INPUTS) {
-    return -1;
+static time_t crontab_mtime(device_state_t *state, const vnode_t *node,
+                            int id) {
+  (void) node;
+  (void) id;
+  return state->schedules.last_update;
+}
+
+static int script_render(device_state_t *state, const vnode_t *node, int id,
+                         node_data_t *out) {
+  (void) node;
+  script_entry_t *script = device_state_get_script(state, id);
+  if (!script || !script->valid || !script->code) {
+    return -ENOENT;
   }
+  out->data = script->code;
+  out->len = strlen(script->code);
+  return 0;
+}
 
-  return (int) id;
+static off_t script_size(device_state_t *state, int id) {
+  script_entry_t *script = device_state_get_script(state, id);
+  if (script->code) {
+    return strlen(script->code);
+  }
+  /* Not loaded (lazy mode) or evicted: last known size */
+  return script->code_size;
 }
 
-/* Get file attributes */
-static int shuse_getattr(const char *path, struct stat *stbuf,
-                         struct fuse_file_info *fi) {
-  (void) fi;
+static time_t script_mtime(device_state_t *state, const vnode_t *node,
+                           int id) {
+  (void) node;
+  return device_state_get_script(state, id)->modify_time;
+}
 
-  fuse_context_data_t *ctx = get_fuse_ctx();
-  memset(stbuf, 0, sizeof(struct stat));
+/* ----------------------------------------------------------------------------
+ * proc files
+ * ----------------------------------------------------------------------------
+ */
 
-  /* Get FUSE context for ownership */
-  struct fuse_context *fuse_ctx = fuse_get_context();
+static int switch_field_render(device_state_t *state, const vnode_t *node,
+                               int id, node_data_t *out) {
+  const switch_config_t *sw = device_state_get_switch(state, id);
+  char *buf = out->buf;
+  size_t size = sizeof(out->buf);
+
+  switch (node->fields) {
+    case SWITCH_FIELD_OUTPUT:
+      snprintf(buf, size, "%s\n", sw->status.output ? "true" : "false");
+      break;
+    case SWITCH_FIELD_ID:
+      snprintf(buf, size, "%d\n", sw->status.id);
+      break;
+    case SWITCH_FIELD_SOURCE:
+      snprintf(buf, size, "%s\n", sw->status.source);
+      break;
+    case SWITCH_FIELD_APOWER:
+      snprintf(buf, size, "%.1f\n", sw->status.apower);
+      break;
+    case SWITCH_FIELD_VOLTAGE:
+      snprintf(buf, size, "%.1f\n", sw->status.voltage);
+      break;
+    case SWITCH_FIELD_CURRENT:
+      snprintf(buf, size, "%.3f\n", sw->status.current);
+      break;
+    case SWITCH_FIELD_FREQ:
+      snprintf(buf, size, "%.1f\n", sw->status.freq);
+      break;
+    case SWITCH_FIELD_ENERGY:
+      snprintf(buf, size, "%.3f\n", sw->status.energy_total);
+      break;
+    case SWITCH_FIELD_RET_ENERGY:
+      snprintf(buf, size, "%.3f\n", sw->status.ret_energy_total);
+      break;
+    case SWITCH_FIELD_TEMPERATURE:
+      snprintf(buf, size, "%.1f\n", sw->status.temperature_c);
+      break;
+    default:
+      return -ENOENT;
+  }
 
-  /* Root directory */
-  if (strcmp(path, "/") == 0) {
-    stbuf->st_mode = S_IFDIR | 0755;
-    stbuf->st_nlink = 2;
-    stbuf->st_uid = fuse_ctx->uid;
-    stbuf->st_gid = fuse_ctx->gid;
-    return 0;
+  out->data = buf;
+  out->len = strlen(buf);
+  return 0;
+}
+
+static time_t switch_field_mtime(device_state_t *state, const vnode_t *node,
+                                 int id) {
+  const switch_config_t *sw = device_state_get_switch(state, id);
+
+  switch (node->fields) {
+    case SWITCH_FIELD_OUTPUT:
+      return sw->status.mtime_output;
+    case SWITCH_FIELD_ID:
+      return sw->status.mtime_id;
+    case SWITCH_FIELD_SOURCE:
+      return sw->status.mtime_source;
+    case SWITCH_FIELD_APOWER:
+      return sw->status.mtime_apower;
+    case SWITCH_FIELD_VOLTAGE:
+      return sw->status.mtime_voltage;
+    case SWITCH_FIELD_CURRENT:
+      return sw->status.mtime_current;
+    case SWITCH_FIELD_FREQ:
+      return sw->status.mtime_freq;
+    case SWITCH_FIELD_ENERGY:
+      return sw->status.mtime_energy;
+    case SWITCH_FIELD_RET_ENERGY:
+      return sw->status.mtime_ret_energy;
+    case SWITCH_FIELD_TEMPERATURE:
+      return sw->status.mtime_temperature;
   }
+  return 0;
+}
 
-  /* scripts directory */
-  if (strcmp(path, "/scripts") == 0) {
-    stbuf->st_mode = S_IFDIR | 0755;
-    stbuf->st_nlink = 2;
-    stbuf->st_uid = fuse_ctx->uid;
-    stbuf->st_gid = fuse_ctx->gid;
-    return 0;
+static int input_field_render(device_state_t *state, const vnode_t *node,
+                              int id, node_data_t *out) {
+  const input_config_t *inp = device_state_get_input(state, id);
+
+  switch (node->fields) {
+    case INPUT_FIELD_ID:
+      snprintf(out->buf, sizeof(out->buf), "%d\n", inp->status.id);
+      break;
+    case INPUT_FIELD_STATE:
+      snprintf(out->buf, sizeof(out->buf), "%s\n",
+               inp->status.state ? "true" : "false");
+      break;
+    default:
+      return -ENOENT;
   }
 
-  /* proc directory */
-  if (strcmp(path, "/proc") == 0) {
-    stbuf->st_mode = S_IFDIR | 0755;
-    stbuf->st_nlink = 2;
-    stbuf->st_uid = fuse_ctx->uid;
-    stbuf->st_gid = fuse_ctx->gid;
-    return 0;
+  out->data = out->buf;
+  out->len = strlen(out->buf);
+  return 0;
+}
+
+static time_t input_field_mtime(device_state_t *state, const vnode_t *node,
+                                int id) {
+  const input_config_t *inp = device_state_get_input(state, id);
+  return node->fields == INPUT_FIELD_STATE ? inp->status.mtime_state
+                                           : inp->status.mtime_id;
+}
+
+/* History files exist once a history depth has been set */
+static int switch_history_present(device_state_t *state, int id) {
+  return switch_present(state, id) &&
+         device_state_get_switch(state, id)->history.records;
+}
+
+static int input_history_present(device_state_t *state, int id) {
+  return input_present(state, id) &&
+         device_state_get_input(state, id)->history.records;
+}
+
+static int switch_history_render(device_state_t *state, const vnode_t *node,
+                                 int id, node_data_t *out) {
+  (void) node;
+  char *csv = NULL;
+  if (device_state_get_switch_history_csv_locked(state, id, &csv) != 0) {
+    return -EIO;
   }
+  out->owned = csv;
+  out->data = csv;
+  out->len = strlen(csv);
+  return 0;
+}
 
-  /* proc/switch directory */
-  if (strcmp(path, "/proc/switch") == 0) {
-    stbuf->st_mode = S_IFDIR | 0755;
-    stbuf->st_nlink = 2;
-    stbuf->st_uid = fuse_ctx->uid;
-    stbuf->st_gid = fuse_ctx->gid;
-    return 0;
+static int input_history_render(device_state_t *state, const vnode_t *node,
+                                int id, node_data_t *out) {
+  (void) node;
+  char *csv = NULL;
+  if (device_state_get_input_history_csv_locked(state, id, &csv) != 0) {
+    return -EIO;
   }
+  out->owned = csv;
+  out->data = csv;
+  out->len = strlen(csv);
+  return 0;
+}
 
-  /* Check for proc/switch/N directories */
-  if (strncmp(path, "/proc/switch/", 13) == 0) {
-    const char *remainder = path + 13;
-    char *endptr;
-    long switch_id = strtol(remainder, &endptr, 10);
-
-    if (endptr != remainder && switch_id >= 0 && switch_id < MAX_SWITCHES) {
-      switch_config_t *sw =
-          device_state_get_switch(ctx->dev_state, (int) switch_id);
-
-      /* Check if it's the directory itself or a file within it */
-      if (*endptr == '\0') {
-        /* It's the directory /proc/switch/N */
-        if (sw && sw->valid) {
-          stbuf->st_mode = S_IFDIR | 0755;
-          stbuf->st_nlink = 2;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          return 0;
-        }
-      } else if (strcmp(endptr, "/output") == 0) {
-        /* output file - read/write */
-        if (sw && sw->valid) {
-          stbuf->st_mode = S_IFREG | 0664;
-          stbuf->st_nlink = 1;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          stbuf->st_size = 6; /* "true\n" or "false\n" */
-          stbuf->st_mtime = sw->status.mtime_output;
-          return 0;
-        }
-      } else if (strcmp(endptr, "/id") == 0) {
-        if (sw && sw->valid) {
-          stbuf->st_mode = S_IFREG | 0444;
-          stbuf->st_nlink = 1;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          stbuf->st_size = 32;
-          stbuf->st_mtime = sw->status.mtime_id;
-          return 0;
-        }
-      } else if (strcmp(endptr, "/source") == 0) {
-        if (sw && sw->valid) {
-          stbuf->st_mode = S_IFREG | 0444;
-          stbuf->st_nlink = 1;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          stbuf->st_size = 32;
-          stbuf->st_mtime = sw->status.mtime_source;
-          return 0;
-        }
-      } else if (strcmp(endptr, "/apower") == 0) {
-        if (sw && sw->valid) {
-          stbuf->st_mode = S_IFREG | 0444;
-          stbuf->st_nlink = 1;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          stbuf->st_size = 32;
-          stbuf->st_mtime = sw->status.mtime_apower;
-          return 0;
-        }
-      } else if (strcmp(endptr, "/voltage") == 0) {
-        if (sw && sw->valid) {
-          stbuf->st_mode = S_IFREG | 0444;
-          stbuf->st_nlink = 1;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          stbuf->st_size = 32;
-          stbuf->st_mtime = sw->status.mtime_voltage;
-          return 0;
-        }
-      } else if (strcmp(endptr, "/current") == 0) {
-        if (sw && sw->valid) {
-          stbuf->st_mode = S_IFREG | 0444;
-          stbuf->st_nlink = 1;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          stbuf->st_size = 32;
-          stbuf->st_mtime = sw->status.mtime_current;
-          return 0;
-        }
-      } else if (strcmp(endptr, "/freq") == 0) {
-        if (sw && sw->valid) {
-          stbuf->st_mode = S_IFREG | 0444;
-          stbuf->st_nlink = 1;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          stbuf->st_size = 32;
-          stbuf->st_mtime = sw->status.mtime_freq;
-          return 0;
-        }
-      } else if (strcmp(endptr, "/energy") == 0) {
-        if (sw && sw->valid) {
-          stbuf->st_mode = S_IFREG | 0444;
-          stbuf->st_nlink = 1;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          stbuf->st_size = 32;
-          stbuf->st_mtime = sw->status.mtime_energy;
-          return 0;
-        }
-      } else if (strcmp(endptr, "/ret_energy") == 0) {
-        if (sw && sw->valid) {
-          stbuf->st_mode = S_IFREG | 0444;
-          stbuf->st_nlink = 1;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          stbuf->st_size = 32;
-          stbuf->st_mtime = sw->status.mtime_ret_energy;
-          return 0;
-        }
-      } else if (strcmp(endptr, "/temperature") == 0) {
-        if (sw && sw->valid) {
-          stbuf->st_mode = S_IFREG | 0444;
-          stbuf->st_nlink = 1;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          stbuf->st_size = 32;
-          stbuf->st_mtime = sw->status.mtime_temperature;
-          return 0;
-        }
-      }
-    }
+/* Whole-component files (history, status.json) change with any update */
+static time_t switch_status_mtime(device_state_t *state, const vnode_t *node,
+                                  int id) {
+  (void) node;
+  return device_state_get_switch(state, id)->status.last_status_update;
+}
+
+static time_t input_status_mtime(device_state_t *state, const vnode_t *node,
+                                 int id) {
+  (void) node;
+  return device_state_get_input(state, id)->status.last_status_update;
+}
+
+/* proc/switch/N/output writes - immediate action, no buffering */
+static int switch_output_write(fuse_context_data_t *ctx, int id,
+                               const char *buf, size_t size) {
+  if (size == 0) {
+    return -EINVAL;
   }
 
-  /* proc/input directory */
-  if (strcmp(path, "/proc/input") == 0) {
-    stbuf->st_mode = S_IFDIR | 0755;
-    stbuf->st_nlink = 2;
-    stbuf->st_uid = fuse_ctx->uid;
-    stbuf->st_gid = fuse_ctx->gid;
-    return 0;
+  /* Parse the input - accept "true"/"false" or "1"/"0" */
+  bool turn_on = false;
+  if (size >= 4 && strncmp(buf, "true", 4) == 0) {
+    turn_on = true;
+  } else if (buf[0] == '1') {
+    turn_on = true;
   }
 
-  /* Check for proc/input/N directories */
-  if (strncmp(path, "/proc/input/", 12) == 0) {
-    const char *remainder = path + 12;
-    char *endptr;
-    long input_id = strtol(remainder, &endptr, 10);
-
-    if (endptr != remainder && input_id >= 0 && input_id < MAX_INPUTS) {
-      input_config_t *inp =
-          device_state_get_input(ctx->dev_state, (int) input_id);
-
-      /* Check if it's the directory itself or a file within it */
-      if (*endptr == '\0') {
-        /* It's the directory /proc/input/N */
-        if (inp && inp->valid) {
-          stbuf->st_mode = S_IFDIR | 0755;
-          stbuf->st_nlink = 2;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          return 0;
-        }
-      } else if (strcmp(endptr, "/id") == 0) {
-        if (inp && inp->valid) {
-          stbuf->st_mode = S_IFREG | 0444;
-          stbuf->st_nlink = 1;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          stbuf->st_size = 32;
-          stbuf->st_mtime = inp->status.mtime_id;
-          return 0;
-        }
-      } else if (strcmp(endptr, "/state") == 0) {
-        if (inp && inp->valid) {
-          stbuf->st_mode = S_IFREG | 0444;
-          stbuf->st_nlink = 1;
-          stbuf->st_uid = fuse_ctx->uid;
-          stbuf->st_gid = fuse_ctx->gid;
-          stbuf->st_size = 6; /* "true\n" or "false\n" */
-          stbuf->st_mtime = inp->status.mtime_state;
-          return 0;
-        }
-      }
-    }
+  /* Send Switch.Set command to device */
+  int req_id = device_state_set_switch(ctx->dev_state, ctx->req_queue,
+                                       ctx->conn, id, turn_on);
+  if (req_id < 0) {
+    log_error(LOG_CAT_FUSE, "Failed to set switch %d state\n", id);
+    return -EIO;
   }
 
-  /* sys_config.json */
-  if (strcmp(path, "/sys_config.json") == 0) {
-    stbuf->st_mode = S_IFREG | 0644;
-    stbuf->st_nlink = 1;
-    stbuf->st_uid = fuse_ctx->uid;
-    stbuf->st_gid = fuse_ctx->gid;
-    if (ctx->dev_state->sys_config.valid &&
-        ctx->dev_state->sys_config.raw_json) {
-      stbuf->st_size = ctx->dev_state->sys_config.json_len;
-      stbuf->st_mtime = ctx->dev_state->sys_config.last_update;
-    } else {
-      stbuf->st_size = 0;
-    }
-    return 0;
+  /* Request status update immediately after */
+  device_state_request_switch_status(ctx->dev_state, ctx->req_queue,
+                                     ctx->conn, id);
+
+  return size;
+}
+
+/* /metrics: a copy of the cached exposition, re-rendered only after the
+ * device state changed */
+static int metrics_render(device_state_t *state, const vnode_t *node, int id,
+                          node_data_t *out) {
+  (void) node;
+  (void) id;
+  fuse_context_data_t *dev = state_device(state);
+  char *buf = NULL;
+  size_t len = 0;
+  if (!dev || !dev->metrics ||
+      metrics_get_locked(dev->metrics, state, &buf, &len) != 0) {
+    return -ENOMEM;
   }
+  out->owned = buf;
+  out->data = buf;
+  out->len = len;
+  return 0;
+}
 
-  /* mqtt_config.json */
-  if (strcmp(path, "/mqtt_config.json") == 0) {
-    stbuf->st_mode = S_IFREG | 0664; /* Read/write for owner and group */
-    stbuf->st_nlink = 1;
-    stbuf->st_uid = fuse_ctx->uid;
-    stbuf->st_gid = fuse_ctx->gid;
-    if (ctx->dev_state->mqtt_config.valid &&
-        ctx->dev_state->mqtt_config.raw_json) {
-      stbuf->st_size = ctx->dev_state->mqtt_config.json_len;
-      stbuf->st_mtime = ctx->dev_state->mqtt_config.last_update;
-    } else {
-      stbuf->st_size = 0;
-    }
-    return 0;
+/* ----------------------------------------------------------------------------
+ * Flushing buffered writes
+ * ----------------------------------------------------------------------------
+ */
+
+/* Node name for an id, e.g. "switch_0_config.json" */
+static void node_name(const vnode_t *node, int id, char *buf, size_t size) {
+  const char *hash = node->id_max > 0 ? strchr(node->name, '#') : NULL;
+  if (!hash) {
+    snprintf(buf, size, "%s", node->name);
+    return;
   }
+  snprintf(buf, size, "%.*s%d%s", (int) (hash - node->name), node->name, id,
+           hash + 1);
+}
 
-  /* crontab file */
-  if (strcmp(path, "/crontab") == 0) {
-    stbuf->st_mode = S_IFREG | 0644;
-    stbuf->st_nlink = 1;
-    stbuf->st_uid = fuse_ctx->uid;
-    stbuf->st_gid = fuse_ctx->gid;
+/* Validate a config file's JSON before it is sent */
+static int check_config_json(const char *name, write_buffer_t *wbuf) {
+  log_debug(LOG_CAT_FUSE, "Flushing %s to device (%zu bytes)\n", name,
+            wbuf->size);
 
-    /* Calculate size by generating content */
-    char *content = NULL;
-    if (device_state_get_crontab_str(ctx->dev_state, &content) == 0 &&
-        content) {
-      stbuf->st_size = strlen(content);
-      stbuf->st_mtime = ctx->dev_state->schedules.last_update;
-      free(content);
-    } else {
-      stbuf->st_size = 0;
-    }
-    return 0;
+  struct mg_str json_str = mg_str_n(wbuf->data, wbuf->size);
+  int dummy_len = 0;
+  if (mg_json_get(json_str, "$", &dummy_len) < 0) {
+    log_error(LOG_CAT_FUSE, "Error: Invalid JSON in %s\n", name);
+    return -EINVAL;
   }
+  return 0;
+}
 
-  /* Check for switch config files (switch_N_config.json) */
-  if (strncmp(path, "/switch_", 8) == 0) {
-    const char *filename = path + 1;
-    int switch_id = parse_switch_id(filename);
-
-    if (switch_id >= 0) {
-      switch_config_t *sw = device_state_get_switch(ctx->dev_state, switch_id);
-      if (sw && sw->valid) {
-        stbuf->st_mode = S_IFREG | 0664; /* Read/write for owner and group */
-        stbuf->st_nlink = 1;
-        stbuf->st_uid = fuse_ctx->uid;
-        stbuf->st_gid = fuse_ctx->gid;
-        if (sw->raw_json) {
-          stbuf->st_size = sw->json_len;
-        } else {
-          stbuf->st_size = 0;
-        }
-        stbuf->st_mtime = sw->last_update;
-        return 0;
-      }
-    }
+/* Send the keys of a config file that differ from the stored config, without
+ * updating local state yet. Once the device accepts them they are merged into
+ * the stored config; on an error response local state remains unchanged
+ * (preserves original content). A file saved without changes sends nothing. */
+static int flush_config(fuse_context_data_t *ctx, const vnode_t *node, int id,
+                        write_buffer_t *wbuf,
+                        int (*send)(fuse_context_data_t *ctx, int id,
+                                    const char *json)) {
+  char name[64];
+  node_name(node, id, name, sizeof(name));
+
+  int ret = check_config_json(name, wbuf);
+  if (ret != 0) {
+    return ret;
   }
 
-  /* Check for input config files (input_N_config.json) */
-  if (strncmp(path, "/input_", 7) == 0) {
-    const char *filename = path + 1;
-    int input_id = parse_input_id(filename);
-
-    if (input_id >= 0) {
-      input_config_t *inp = device_state_get_input(ctx->dev_state, input_id);
-      if (inp && inp->valid) {
-        stbuf->st_mode = S_IFREG | 0664; /* Read/write for owner and group */
-        stbuf->st_nlink = 1;
-        stbuf->st_uid = fuse_ctx->uid;
-        stbuf->st_gid = fuse_ctx->gid;
-        if (inp->raw_json) {
-          stbuf->st_size = inp->json_len;
-        } else {
-          stbuf->st_size = 0;
-        }
-        stbuf->st_mtime = inp->last_update;
-        return 0;
-      }
-    }
+  if (!ctx->conn) {
+    log_error(LOG_CAT_FUSE, "Error: Not connected to device\n");
+    return -EIO;
   }
 
-  /* Check for script files in /scripts/ directory */
-  if (strncmp(path, "/scripts/", 9) == 0) {
-    const char *filename = path + 9;
-    int script_id = parse_script_id(filename);
-
-    if (script_id >= 0) {
-      script_entry_t *script =
-          device_state_get_script(ctx->dev_state, script_id);
-      if (script && script->valid) {
-        stbuf->st_mode = S_IFREG | 0664; /* Read/write for owner and group */
-        stbuf->st_nlink = 1;
-        stbuf->st_uid = fuse_ctx->uid;
-        stbuf->st_gid = fuse_ctx->gid;
-        if (script->code) {
-          stbuf->st_size = strlen(script->code);
-        } else {
-          stbuf->st_size = 0;
-        }
-        stbuf->st_mtime = script->modify_time;
-        return 0;
-      }
-    }
+  ret = send(ctx, id, wbuf->data);
+  if (ret < 0) {
+    log_error(LOG_CAT_FUSE, "Error: Failed to send %s to device\n", name);
+    return -EIO;
+  }
+  if (ret == 0) {
+    log_debug(LOG_CAT_FUSE, "%s unchanged, not sent\n", name);
+    return 0;
   }
+  log_debug(LOG_CAT_FUSE, "%s write queued (request ID: %d)\n", name, ret);
+  log_debug(LOG_CAT_FUSE, "Waiting for device response...\n");
+  return 0;
+}
 
-  return -ENOENT;
+static int send_sys_config(fuse_context_data_t *ctx, int id,
+                           const char *json) {
+  (void) id;
+  return device_state_set_sys_config_from_json(ctx->dev_state, json,
+                                               ctx->req_queue, ctx->conn);
 }
 
-/* Read directory contents */
-static int shuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                         off_t offset,
-                         struct fuse_file_info *fi SHUSE_READDIR_FLAGS_PARAM) {
-  (void) offset;
-  (void) fi;
-  SHUSE_READDIR_UNUSED_FLAGS
+static int send_mqtt_config(fuse_context_data_t *ctx, int id,
+                            const char *json) {
+  (void) id;
+  return device_state_set_mqtt_config_from_json(ctx->dev_state, json,
+                                                ctx->req_queue, ctx->conn);
+}
 
-  fuse_context_data_t *ctx = get_fuse_ctx();
+static int send_switch_config(fuse_context_data_t *ctx, int id,
+                              const char *json) {
+  return device_state_set_switch_config_from_json(
+      ctx->dev_state, json, ctx->req_queue, ctx->conn, id);
+}
 
-  /* Root directory */
-  if (strcmp(path, "/") == 0) {
-    FUSE_FILL_DIR(filler, buf, ".");
-    FUSE_FILL_DIR(filler, buf, "..");
-    FUSE_FILL_DIR(filler, buf, "scripts");
-    FUSE_FILL_DIR(filler, buf, "proc");
-    FUSE_FILL_DIR(filler, buf, "sys_config.json");
-    FUSE_FILL_DIR(filler, buf, "mqtt_config.json");
-    FUSE_FILL_DIR(filler, buf, "crontab");
-
-    /* List all valid switch config files */
-    for (int i = 0; i < MAX_SWITCHES; i++) {
-      switch_config_t *sw = device_state_get_switch(ctx->dev_state, i);
-      if (sw && sw->valid) {
-        char filename[64];
-        snprintf(filename, sizeof(filename), "switch_%d_config.json", i);
-        FUSE_FILL_DIR(filler, buf, filename);
-      }
-    }
+static int send_input_config(fuse_context_data_t *ctx, int id,
+                             const char *json) {
+  return device_state_set_input_config_from_json(ctx->dev_state, json,
+                                                 ctx->req_queue, ctx->conn, id);
+}
 
-    /* List all valid input config files */
-    for (int i = 0; i < MAX_INPUTS; i++) {
-      input_config_t *inp = device_state_get_input(ctx->dev_state, i);
-      if (inp && inp->valid) {
-        char filename[64];
-        snprintf(filename, sizeof(filename), "input_%d_config.json", i);
-        FUSE_FILL_DIR(filler, buf, filename);
-      }
-    }
-    return 0;
-  }
+static int flush_sys_config(fuse_context_data_t *ctx, const vnode_t *node,
+                            int id, write_buffer_t *wbuf) {
+  return flush_config(ctx, node, id, wbuf, send_sys_config);
+}
 
-  /* proc directory */
-  if (strcmp(path, "/proc") == 0) {
-    FUSE_FILL_DIR(filler, buf, ".");
-    FUSE_FILL_DIR(filler, buf, "..");
-    FUSE_FILL_DIR(filler, buf, "switch");
-    FUSE_FILL_DIR(filler, buf, "input");
-    return 0;
-  }
+static int flush_mqtt_config(fuse_context_data_t *ctx, const vnode_t *node,
+                             int id, write_buffer_t *wbuf) {
+  return flush_config(ctx, node, id, wbuf, send_mqtt_config);
+}
 
-  /* proc/switch directory */
-  if (strcmp(path, "/proc/switch") == 0) {
-    FUSE_FILL_DIR(filler, buf, ".");
-    FUSE_FILL_DIR(filler, buf, "..");
+static int flush_switch_config(fuse_context_data_t *ctx, const vnode_t *node,
+                               int id, write_buffer_t *wbuf) {
+  return flush_config(ctx, node, id, wbuf, send_switch_config);
+}
 
-    /* List all valid switch directories */
-    for (int i = 0; i < MAX_SWITCHES; i++) {
-      switch_config_t *sw = device_state_get_switch(ctx->dev_state, i);
-      if (sw && sw->valid) {
-        char dirname[8];
-        snprintf(dirname, sizeof(dirname), "%d", i);
-        FUSE_FILL_DIR(filler, buf, dirname);
-      }
+static int flush_input_config(fuse_context_data_t *ctx, const vnode_t *node,
+                              int id, write_buffer_t *wbuf) {
+  return flush_config(ctx, node, id, wbuf, send_input_config);
+}
+
+static int flush_script(fuse_context_data_t *ctx, const vnode_t *node, int id,
+                        write_buffer_t *wbuf) {
+  (void) node;
+  log_debug(LOG_CAT_FUSE, "Flushing script %d to device (%zu bytes)\n", id,
+            wbuf->size);
+
+  /* Start a windowed chunked upload; it completes in the background */
+  if (ctx->conn) {
+    int ret = device_state_put_script_code(ctx->dev_state, ctx->req_queue,
+                                           ctx->conn, id, wbuf->data);
+    if (ret < 0) {
+      log_error(LOG_CAT_FUSE, "Error: Failed to send script %d to device\n",
+                id);
+      return -EIO;
     }
-    return 0;
+    log_debug(LOG_CAT_FUSE, "Script %d upload queued\n", id);
   }
+  return 0;
+}
 
-  /* proc/switch/N directories */
-  if (strncmp(path, "/proc/switch/", 13) == 0) {
-    const char *remainder = path + 13;
-    char *endptr;
-    long switch_id = strtol(remainder, &endptr, 10);
-
-    if (endptr != remainder && *endptr == '\0' && switch_id >= 0 &&
-        switch_id < MAX_SWITCHES) {
-      switch_config_t *sw =
-          device_state_get_switch(ctx->dev_state, (int) switch_id);
-      if (sw && sw->valid) {
-        FUSE_FILL_DIR(filler, buf, ".");
-        FUSE_FILL_DIR(filler, buf, "..");
-        FUSE_FILL_DIR(filler, buf, "output");
-        FUSE_FILL_DIR(filler, buf, "id");
-        FUSE_FILL_DIR(filler, buf, "source");
-        FUSE_FILL_DIR(filler, buf, "apower");
-        FUSE_FILL_DIR(filler, buf, "voltage");
-        FUSE_FILL_DIR(filler, buf, "current");
-        FUSE_FILL_DIR(filler, buf, "freq");
-        FUSE_FILL_DIR(filler, buf, "energy");
-        FUSE_FILL_DIR(filler, buf, "ret_energy");
-        FUSE_FILL_DIR(filler, buf, "temperature");
-        return 0;
-      }
-    }
+static int flush_crontab(fuse_context_data_t *ctx, const vnode_t *node,
+                         int id, write_buffer_t *wbuf) {
+  (void) node;
+  (void) id;
+  log_debug(LOG_CAT_FUSE, "Flushing crontab to device (%zu bytes)\n",
+            wbuf->size);
+
+  if (!ctx->conn) {
+    log_error(LOG_CAT_FUSE, "Error: Not connected to device\n");
+    return -EIO;
   }
 
-  /* proc/input directory */
-  if (strcmp(path, "/proc/input") == 0) {
-    FUSE_FILL_DIR(filler, buf, ".");
-    FUSE_FILL_DIR(filler, buf, "..");
+  int ret = device_state_sync_crontab(ctx->dev_state, ctx->req_queue,
+                                      ctx->conn, wbuf->data, wbuf->size);
+  if (ret < 0) {
+    log_error(LOG_CAT_FUSE, "Error: Failed to sync crontab to device\n");
+    return -EIO;
+  }
+  if (ret > 0) {
+    log_debug(LOG_CAT_FUSE, "crontab write queued (%d operations)\n", ret);
+    log_debug(LOG_CAT_FUSE, "Waiting for device response...\n");
+  } else {
+    log_debug(LOG_CAT_FUSE, "crontab unchanged, no operations needed\n");
+  }
+  return 0;
+}
 
-    /* List all valid input directories */
-    for (int i = 0; i < MAX_INPUTS; i++) {
-      input_config_t *inp = device_state_get_input(ctx->dev_state, i);
-      if (inp && inp->valid) {
-        char dirname[8];
-        snprintf(dirname, sizeof(dirname), "%d", i);
-        FUSE_FILL_DIR(filler, buf, dirname);
-      }
-    }
-    return 0;
+/* ----------------------------------------------------------------------------
+ * Writes while disconnected
+ * ----------------------------------------------------------------------------
+ *
+ * While a device is disconnected its last known state stays readable, and
+ * writes are refused with EROFS; with fuse_ops_set_offline_writes() they are
+ * kept instead, the last one per file, and sent once it reconnects.
+ */
+
+typedef struct offline_write {
+  fuse_context_data_t *ctx;
+  const vnode_t *node;
+  int id;
+  char *data; /* What was written, NUL-terminated */
+  size_t size;
+  struct offline_write *next;
+} offline_write_t;
+
+static offline_write_t *g_offline_writes = NULL;
+static pthread_mutex_t g_offline_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Keep a write to send on reconnect, replacing an earlier one to the same
+ * file. Returns 0 or -ENOMEM. */
+static int offline_write_keep(fuse_context_data_t *ctx, const vnode_t *node,
+                              int id, const char *data, size_t size) {
+  char *copy = malloc(size + 1);
+  if (!copy) {
+    return -ENOMEM;
   }
+  memcpy(copy, data, size);
+  copy[size] = '\0';
 
-  /* proc/input/N directories */
-  if (strncmp(path, "/proc/input/", 12) == 0) {
-    const char *remainder = path + 12;
-    char *endptr;
-    long input_id = strtol(remainder, &endptr, 10);
-
-    if (endptr != remainder && *endptr == '\0' && input_id >= 0 &&
-        input_id < MAX_INPUTS) {
-      input_config_t *inp =
-          device_state_get_input(ctx->dev_state, (int) input_id);
-      if (inp && inp->valid) {
-        FUSE_FILL_DIR(filler, buf, ".");
-        FUSE_FILL_DIR(filler, buf, "..");
-        FUSE_FILL_DIR(filler, buf, "id");
-        FUSE_FILL_DIR(filler, buf, "state");
-        return 0;
-      }
-    }
+  pthread_mutex_lock(&g_offline_mutex);
+  offline_write_t *w = g_offline_writes;
+  while (w && (w->ctx != ctx || w->node != node || w->id != id)) {
+    w = w->next;
+  }
+  if (!w && (w = calloc(1, sizeof(*w))) != NULL) {
+    w->ctx = ctx;
+    w->node = node;
+    w->id = id;
+    w->next = g_offline_writes;
+    g_offline_writes = w;
   }
+  if (w) {
+    free(w->data);
+    w->data = copy;
+    w->size = size;
+  }
+  pthread_mutex_unlock(&g_offline_mutex);
 
-  /* scripts directory */
-  if (strcmp(path, "/scripts") == 0) {
-    FUSE_FILL_DIR(filler, buf, ".");
-    FUSE_FILL_DIR(filler, buf, "..");
+  if (!w) {
+    free(copy);
+    return -ENOMEM;
+  }
 
-    /* List all valid scripts */
-    for (int i = 0; i < MAX_SCRIPTS; i++) {
-      script_entry_t *script = device_state_get_script(ctx->dev_state, i);
-      if (script && script->valid) {
-        char filename[64];
-        snprintf(filename, sizeof(filename), "script_%d.js", i);
-        FUSE_FILL_DIR(filler, buf, filename);
-      }
+  char name[64];
+  node_name(node, id, name, sizeof(name));
+  log_info(LOG_CAT_FUSE,
+           "Not connected: %s write kept until the device reconnects\n", name);
+  return 0;
+}
+
+/* Send a write to the device: flush `wbuf` for buffered files, or hand
+ * `buf` to the immediate write. Returns what those return, or the outcome
+ * of keeping or refusing the write while disconnected. */
+static int node_send(fuse_context_data_t *ctx, const vnode_t *node, int id,
+                     write_buffer_t *wbuf, const char *buf, size_t size) {
+  if (!ctx->conn) {
+    if (!g_offline_writes_kept) {
+      return -EROFS;
     }
-    return 0;
+    int ret = wbuf ? offline_write_keep(ctx, node, id, wbuf->data, wbuf->size)
+                   : offline_write_keep(ctx, node, id, buf, size);
+    if (ret != 0) {
+      return ret;
+    }
+    return wbuf ? 0 : (int) size;
   }
 
-  return -ENOENT;
+  return wbuf ? node->flush(ctx, node, id, wbuf)
+              : node->write(ctx, id, buf, size);
 }
 
-/* Open file */
-static int shuse_open(const char *path, struct fuse_file_info *fi) {
-  fuse_context_data_t *ctx = get_fuse_ctx();
+/* ----------------------------------------------------------------------------
+ * The tree
+ * ----------------------------------------------------------------------------
+ */
 
-  /* Check if it's a config file */
-  if (strcmp(path, "/sys_config.json") == 0) {
-    if (!ctx->dev_state->sys_config.valid) {
-      return -ENOENT;
-    }
+/* A /proc/switch/N field file; `wr` handles writes for the writable ones */
+#define SWITCH_FIELD_NODE(var, fname, field, fl, perm, sz, wr)            \
+  static const vnode_t var = {                                            \
+      .name = fname,                                                      \
+      .mode = S_IFREG | (perm),                                           \
+      .flags = NODE_POLL | (fl),                                          \
+      .present = switch_present,                                          \
+      .render = switch_field_render,                                      \
+      .fixed_size = (sz),                                                 \
+      .mtime = switch_field_mtime,                                        \
+      .write = (wr),                                                      \
+      .changes = CHANGE(STATE_CHANGE_SWITCH_STATUS) |                     \
+                 CHANGE(STATE_CHANGE_SWITCH_CONFIG),                      \
+      .fields = (field),                                                  \
+  }
+
+/* A /proc/input/N field file */
+#define INPUT_FIELD_NODE(var, fname, field, sz)                           \
+  static const vnode_t var = {                                            \
+      .name = fname,                                                      \
+      .mode = S_IFREG | 0444,                                             \
+      .flags = NODE_POLL,                                                 \
+      .present = input_present,                                           \
+      .render = input_field_render,                                       \
+      .fixed_size = (sz),                                                 \
+      .mtime = input_field_mtime,                                         \
+      .changes = CHANGE(STATE_CHANGE_INPUT_STATUS) |                      \
+                 CHANGE(STATE_CHANGE_INPUT_CONFIG),                       \
+      .fields = (field),                                                  \
+  }
+
+/* Field file sizes are upper bounds ("true\n"/"false\n" for booleans) */
+SWITCH_FIELD_NODE(s_switch_output, "output", SWITCH_FIELD_OUTPUT, 0, 0664, 6,
+                  switch_output_write);
+SWITCH_FIELD_NODE(s_switch_id, "id", SWITCH_FIELD_ID, 0, 0444, 32, NULL);
+SWITCH_FIELD_NODE(s_switch_source, "source", SWITCH_FIELD_SOURCE, NODE_TEXT,
+                  0444, 32, NULL);
+SWITCH_FIELD_NODE(s_switch_apower, "apower", SWITCH_FIELD_APOWER, 0, 0444, 32,
+                  NULL);
+SWITCH_FIELD_NODE(s_switch_voltage, "voltage", SWITCH_FIELD_VOLTAGE, 0, 0444,
+                  32, NULL);
+SWITCH_FIELD_NODE(s_switch_current, "current", SWITCH_FIELD_CURRENT, 0, 0444,
+                  32, NULL);
+SWITCH_FIELD_NODE(s_switch_freq, "freq", SWITCH_FIELD_FREQ, 0, 0444, 32, NULL);
+SWITCH_FIELD_NODE(s_switch_energy, "energy", SWITCH_FIELD_ENERGY, 0, 0444, 32,
+                  NULL);
+SWITCH_FIELD_NODE(s_switch_ret_energy, "ret_energy", SWITCH_FIELD_RET_ENERGY,
+                  0, 0444, 32, NULL);
+SWITCH_FIELD_NODE(s_switch_temperature, "temperature",
+                  SWITCH_FIELD_TEMPERATURE, 0, 0444, 32, NULL);
+
+INPUT_FIELD_NODE(s_input_id, "id", INPUT_FIELD_ID, 32);
+INPUT_FIELD_NODE(s_input_state, "state", INPUT_FIELD_STATE, 6);
+
+/* Aggregate status renderers, defined after the tree they walk */
+static int switch_status_json_render(device_state_t *state,
+                                     const vnode_t *node, int id,
+                                     node_data_t *out);
+static int input_status_json_render(device_state_t *state, const vnode_t *node,
+                                    int id, node_data_t *out);
+static int proc_status_json_render(device_state_t *state, const vnode_t *node,
+                                   int id, node_data_t *out);
+static int proc_status_flat_render(device_state_t *state, const vnode_t *node,
+                                   int id, node_data_t *out);
+static time_t proc_status_mtime(device_state_t *state, const vnode_t *node,
+                                int id);
+
+/* All status fields of one component in a single read */
+static const vnode_t s_switch_status_json = {
+    .name = "status.json",
+    .mode = S_IFREG | 0444,
+    .flags = NODE_POLL | NODE_SNAPSHOT,
+    .present = switch_present,
+    .render = switch_status_json_render,
+    .mtime = switch_status_mtime,
+    .changes = CHANGE(STATE_CHANGE_SWITCH_STATUS) |
+               CHANGE(STATE_CHANGE_SWITCH_CONFIG),
+};
 
-    /* If opening for writing, allocate a write buffer */
-    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
-      write_buffer_t *buf = write_buffer_create(MAX_CONFIG_SIZE);
-      if (!buf) {
-        return -ENOMEM;
-      }
+static const vnode_t s_input_status_json = {
+    .name = "status.json",
+    .mode = S_IFREG | 0444,
+    .flags = NODE_POLL | NODE_SNAPSHOT,
+    .present = input_present,
+    .render = input_status_json_render,
+    .mtime = input_status_mtime,
+    .changes = CHANGE(STATE_CHANGE_INPUT_STATUS) |
+               CHANGE(STATE_CHANGE_INPUT_CONFIG),
+};
 
-      /* Copy current config to buffer for modification */
-      if (ctx->dev_state->sys_config.raw_json) {
-        size_t len = ctx->dev_state->sys_config.json_len;
-        if (write_buffer_ensure_capacity(buf, len + 1) == 0) {
-          memcpy(buf->data, ctx->dev_state->sys_config.raw_json, len);
-          buf->data[len] = '\0';
-          buf->size = len;
-        }
-      }
+/* Status history as CSV; pollable, waking on every recorded update */
+static const vnode_t s_switch_history = {
+    .name = "history",
+    .mode = S_IFREG | 0444,
+    .flags = NODE_POLL,
+    .present = switch_history_present,
+    .render = switch_history_render,
+    .mtime = switch_status_mtime,
+    .changes = CHANGE(STATE_CHANGE_SWITCH_STATUS) |
+               CHANGE(STATE_CHANGE_SWITCH_CONFIG),
+};
 
-      file_handle_t *fh = malloc(sizeof(file_handle_t));
-      if (!fh) {
-        write_buffer_destroy(buf);
-        return -ENOMEM;
+static const vnode_t s_input_history = {
+    .name = "history",
+    .mode = S_IFREG | 0444,
+    .flags = NODE_POLL,
+    .present = input_history_present,
+    .render = input_history_render,
+    .mtime = input_status_mtime,
+    .changes = CHANGE(STATE_CHANGE_INPUT_STATUS) |
+               CHANGE(STATE_CHANGE_INPUT_CONFIG),
+};
+
+static const vnode_t *const s_switch_dir_children[] = {
+    &s_switch_output,
+    &s_switch_id,
+    &s_switch_source,
+    &s_switch_apower,
+    &s_switch_voltage,
+    &s_switch_current,
+    &s_switch_freq,
+    &s_switch_energy,
+    &s_switch_ret_energy,
+    &s_switch_temperature,
+    &s_switch_status_json,
+    &s_switch_history,
+    NULL,
+};
+
+static const vnode_t s_switch_dir = {
+    .name = "#",
+    .id_max = MAX_SWITCHES,
+    .mode = S_IFDIR | 0755,
+    .children = s_switch_dir_children,
+    .present = switch_present,
+    .changes = CHANGE(STATE_CHANGE_SWITCH_CONFIG),
+};
+
+static const vnode_t *const s_input_dir_children[] = {
+    &s_input_id,
+    &s_input_state,
+    &s_input_status_json,
+    &s_input_history,
+    NULL,
+};
+
+static const vnode_t s_input_dir = {
+    .name = "#",
+    .id_max = MAX_INPUTS,
+    .mode = S_IFDIR | 0755,
+    .children = s_input_dir_children,
+    .present = input_present,
+    .changes = CHANGE(STATE_CHANGE_INPUT_CONFIG),
+};
+
+static const vnode_t *const s_proc_switch_children[] = {&s_switch_dir, NULL};
+static const vnode_t *const s_proc_input_children[] = {&s_input_dir, NULL};
+
+static const vnode_t s_proc_switch = {
+    .name = "switch",
+    .mode = S_IFDIR | 0755,
+    .children = s_proc_switch_children,
+};
+
+static const vnode_t s_proc_input = {
+    .name = "input",
+    .mode = S_IFDIR | 0755,
+    .children = s_proc_input_children,
+};
+
+/* Every switch and input at once, as JSON and as flat "key value" lines */
+#define ALL_STATUS_CHANGES                                                   \
+  (CHANGE(STATE_CHANGE_SWITCH_STATUS) | CHANGE(STATE_CHANGE_SWITCH_CONFIG) | \
+   CHANGE(STATE_CHANGE_INPUT_STATUS) | CHANGE(STATE_CHANGE_INPUT_CONFIG))
+
+static const vnode_t s_proc_status_json = {
+    .name = "status.json",
+    .mode = S_IFREG | 0444,
+    .flags = NODE_POLL | NODE_SNAPSHOT,
+    .render = proc_status_json_render,
+    .mtime = proc_status_mtime,
+    .changes = ALL_STATUS_CHANGES,
+};
+
+static const vnode_t s_proc_status_flat = {
+    .name = "status",
+    .mode = S_IFREG | 0444,
+    .flags = NODE_POLL | NODE_SNAPSHOT,
+    .render = proc_status_flat_render,
+    .mtime = proc_status_mtime,
+    .changes = ALL_STATUS_CHANGES,
+};
+
+static const vnode_t *const s_proc_children[] = {
+    &s_proc_switch,
+    &s_proc_input,
+    &s_proc_status_json,
+    &s_proc_status_flat,
+    NULL,
+};
+
+static const vnode_t s_proc = {
+    .name = "proc",
+    .mode = S_IFDIR | 0755,
+    .children = s_proc_children,
+};
+
+static const vnode_t s_script_file = {
+    .name = "script_#.js",
+    .id_max = MAX_SCRIPTS,
+    .mode = S_IFREG | 0664,
+    .flags = NODE_BUFFERED | NODE_SCRIPT | NODE_KEEP_CACHE,
+    .present = script_present,
+    .render = script_render,
+    .size = script_size,
+    .mtime = script_mtime,
+    .flush = flush_script,
+    .changes = CHANGE(STATE_CHANGE_SCRIPT),
+};
+
+static const vnode_t *const s_scripts_children[] = {&s_script_file, NULL};
+
+static const vnode_t s_scripts = {
+    .name = "scripts",
+    .mode = S_IFDIR | 0755,
+    .children = s_scripts_children,
+};
+
+static const vnode_t s_sys_config_file = {
+    .name = "sys_config.json",
+    .mode = S_IFREG | 0644,
+    .flags = NODE_BUFFERED | NODE_KEEP_CACHE,
+    .render = sys_config_render,
+    .mtime = sys_config_mtime,
+    .flush = flush_sys_config,
+    .changes = CHANGE(STATE_CHANGE_SYS_CONFIG),
+};
+
+static const vnode_t s_mqtt_config_file = {
+    .name = "mqtt_config.json",
+    .mode = S_IFREG | 0664,
+    .flags = NODE_BUFFERED | NODE_KEEP_CACHE,
+    .render = mqtt_config_render,
+    .mtime = mqtt_config_mtime,
+    .flush = flush_mqtt_config,
+    .changes = CHANGE(STATE_CHANGE_MQTT_CONFIG),
+};
+
+static const vnode_t s_crontab_file = {
+    .name = "crontab",
+    .mode = S_IFREG | 0644,
+    .flags = NODE_BUFFERED | NODE_TRUNC_EMPTY | NODE_KEEP_CACHE,
+    .render = crontab_render,
+    .mtime = crontab_mtime,
+    .flush = flush_crontab,
+    .changes = CHANGE(STATE_CHANGE_SCHEDULES),
+};
+
+static const vnode_t s_switch_config_file = {
+    .name = "switch_#_config.json",
+    .id_max = MAX_SWITCHES,
+    .mode = S_IFREG | 0664,
+    .flags = NODE_BUFFERED | NODE_KEEP_CACHE,
+    .present = switch_present,
+    .render = switch_config_render,
+    .mtime = switch_config_mtime,
+    .flush = flush_switch_config,
+    .changes = CHANGE(STATE_CHANGE_SWITCH_CONFIG),
+};
+
+static const vnode_t s_input_config_file = {
+    .name = "input_#_config.json",
+    .id_max = MAX_INPUTS,
+    .mode = S_IFREG | 0664,
+    .flags = NODE_BUFFERED | NODE_KEEP_CACHE,
+    .present = input_present,
+    .render = input_config_render,
+    .mtime = input_config_mtime,
+    .flush = flush_input_config,
+    .changes = CHANGE(STATE_CHANGE_INPUT_CONFIG),
+};
+
+/* Every switch, input and script metric in OpenMetrics format */
+static const vnode_t s_metrics_file = {
+    .name = "metrics",
+    .mode = S_IFREG | 0444,
+    .flags = NODE_POLL | NODE_SNAPSHOT,
+    .present = metrics_present,
+    .render = metrics_render,
+    .mtime = proc_status_mtime,
+    .changes = ALL_STATUS_CHANGES | CHANGE(STATE_CHANGE_SCRIPT) |
+               CHANGE(STATE_CHANGE_SCRIPT_STATUS),
+};
+
+/* Root entries, in readdir order */
+static const vnode_t *const s_root_children[] = {
+    &s_scripts,
+    &s_proc,
+    &s_sys_config_file,
+    &s_mqtt_config_file,
+    &s_crontab_file,
+    &s_switch_config_file,
+    &s_input_config_file,
+    &s_metrics_file,
+    NULL,
+};
+
+static const vnode_t s_root = {
+    .name = "",
+    .mode = S_IFDIR | 0755,
+    .children = s_root_children,
+};
+
+/* ----------------------------------------------------------------------------
+ * Aggregate status files
+ * ----------------------------------------------------------------------------
+ *
+ * Built from the field files of a component directory, so every field added
+ * there shows up here too. The whole file is rendered in one go under the
+ * state lock, so the values are coherent with each other.
+ */
+
+/* Write the field files of one component directory, as JSON members or as
+ * "<prefix><name> <value>" lines */
+static void write_fields(FILE *out, device_state_t *state,
+                         const vnode_t *dir, int id, int json,
+                         const char *prefix) {
+  int first = 1;
+  for (int i = 0; dir->children[i]; i++) {
+    const vnode_t *field = dir->children[i];
+    node_data_t data = {0};
+    if (field->fields == 0 ||
+        field->render(state, field, id, &data) != 0) {
+      continue;
+    }
+
+    /* Field files end in a newline */
+    int len = (int) data.len;
+    if (len > 0 && data.data[len - 1] == '\n') {
+      len--;
+    }
+
+    if (!json) {
+      fprintf(out, "%s%s %.*s\n", prefix, field->name, len, data.data);
+    } else if (field->flags & NODE_TEXT) {
+      char text[64];
+      snprintf(text, sizeof(text), "%.*s", len, data.data);
+      char *esc = mg_mprintf("%m", MG_ESC(text));
+      fprintf(out, "%s\"%s\":%s", first ? "" : ",", field->name,
+              esc ? esc : "\"\"");
+      free(esc);
+      first = 0;
+    } else {
+      fprintf(out, "%s\"%s\":%.*s", first ? "" : ",", field->name, len,
+              data.data);
+      first = 0;
+    }
+    node_data_free(&data);
+  }
+}
+
+typedef void (*fill_fn)(FILE *out, device_state_t *state, int id);
+
+/* Render a file through a memstream */
+static int render_to(node_data_t *out, fill_fn fill, device_state_t *state,
+                     int id) {
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *mem = open_memstream(&buf, &len);
+  if (!mem) {
+    return -ENOMEM;
+  }
+
+  fill(mem, state, id);
+  if (fclose(mem) != 0) {
+    free(buf);
+    return -EIO;
+  }
+
+  out->owned = buf;
+  out->data = buf;
+  out->len = len;
+  return 0;
+}
+
+static void fill_switch_status_json(FILE *out, device_state_t *state,
+                                    int id) {
+  fputc('{', out);
+  write_fields(out, state, &s_switch_dir, id, 1, "");
+  fputs("}\n", out);
+}
+
+static void fill_input_status_json(FILE *out, device_state_t *state, int id) {
+  fputc('{', out);
+  write_fields(out, state, &s_input_dir, id, 1, "");
+  fputs("}\n", out);
+}
+
+/* {"switch:0":{...},"input:0":{...}}, keyed like Shelly.GetStatus */
+static void fill_proc_status_json(FILE *out, device_state_t *state, int id) {
+  (void) id;
+  int first = 1;
+  fputc('{', out);
+  for (int i = 0; i < MAX_SWITCHES; i++) {
+    if (switch_present(state, i)) {
+      fprintf(out, "%s\"switch:%d\":{", first ? "" : ",", i);
+      write_fields(out, state, &s_switch_dir, i, 1, "");
+      fputc('}', out);
+      first = 0;
+    }
+  }
+  for (int i = 0; i < MAX_INPUTS; i++) {
+    if (input_present(state, i)) {
+      fprintf(out, "%s\"input:%d\":{", first ? "" : ",", i);
+      write_fields(out, state, &s_input_dir, i, 1, "");
+      fputc('}', out);
+      first = 0;
+    }
+  }
+  fputs("}\n", out);
+}
+
+/* switch.0.apower 12.5 */
+static void fill_proc_status_flat(FILE *out, device_state_t *state, int id) {
+  (void) id;
+  char prefix[32];
+  for (int i = 0; i < MAX_SWITCHES; i++) {
+    if (switch_present(state, i)) {
+      snprintf(prefix, sizeof(prefix), "switch.%d.", i);
+      write_fields(out, state, &s_switch_dir, i, 0, prefix);
+    }
+  }
+  for (int i = 0; i < MAX_INPUTS; i++) {
+    if (input_present(state, i)) {
+      snprintf(prefix, sizeof(prefix), "input.%d.", i);
+      write_fields(out, state, &s_input_dir, i, 0, prefix);
+    }
+  }
+}
+
+static int switch_status_json_render(device_state_t *state,
+                                     const vnode_t *node, int id,
+                                     node_data_t *out) {
+  (void) node;
+  return render_to(out, fill_switch_status_json, state, id);
+}
+
+static int input_status_json_render(device_state_t *state, const vnode_t *node,
+                                    int id, node_data_t *out) {
+  (void) node;
+  return render_to(out, fill_input_status_json, state, id);
+}
+
+static int proc_status_json_render(device_state_t *state, const vnode_t *node,
+                                   int id, node_data_t *out) {
+  (void) node;
+  return render_to(out, fill_proc_status_json, state, id);
+}
+
+static int proc_status_flat_render(device_state_t *state, const vnode_t *node,
+                                   int id, node_data_t *out) {
+  (void) node;
+  return render_to(out, fill_proc_status_flat, state, id);
+}
+
+/* Time of the most recent status update of any component */
+static time_t proc_status_mtime(device_state_t *state, const vnode_t *node,
+                                int id) {
+  (void) node;
+  (void) id;
+  time_t latest = 0;
+  for (int i = 0; i < MAX_SWITCHES; i++) {
+    switch_config_t *sw = device_state_get_switch(state, i);
+    if (sw && sw->valid && sw->status.last_status_update > latest) {
+      latest = sw->status.last_status_update;
+    }
+  }
+  for (int i = 0; i < MAX_INPUTS; i++) {
+    input_config_t *inp = device_state_get_input(state, i);
+    if (inp && inp->valid && inp->status.last_status_update > latest) {
+      latest = inp->status.last_status_update;
+    }
+  }
+  return latest;
+}
+
+/* ----------------------------------------------------------------------------
+ * Path resolution
+ * ----------------------------------------------------------------------------
+ */
+
+/* Match one path component against a node name, taking the id from a '#'
+ * pattern. Returns 1 on a match. */
+static int node_match(const vnode_t *node, const char *comp, size_t len,
+                      int *id) {
+  const char *hash = node->id_max > 0 ? strchr(node->name, '#') : NULL;
+  if (!hash) {
+    return strlen(node->name) == len && memcmp(node->name, comp, len) == 0;
+  }
+
+  size_t prefix_len = (size_t) (hash - node->name);
+  size_t suffix_len = strlen(hash + 1);
+  if (len <= prefix_len + suffix_len ||
+      memcmp(comp, node->name, prefix_len) != 0 ||
+      memcmp(comp + len - suffix_len, hash + 1, suffix_len) != 0) {
+    return 0;
+  }
+
+  /* Decimal id between prefix and suffix */
+  long value = 0;
+  for (size_t i = prefix_len; i < len - suffix_len; i++) {
+    if (comp[i] < '0' || comp[i] > '9') {
+      return 0;
+    }
+    value = value * 10 + (comp[i] - '0');
+    if (value >= node->id_max) {
+      return 0;
+    }
+  }
+
+  *id = (int) value;
+  return 1;
+}
+
+/* Resolve a path to its node and component id (-1 if none). Only the shape
+ * of the path is checked; whether the component exists is up to
+ * node_present(). */
+static const vnode_t *resolve_path(const char *path, int *id) {
+  const vnode_t *node = &s_root;
+  *id = -1;
+
+  while (*path == '/') {
+    path++;
+  }
+
+  while (*path) {
+    const char *end = strchr(path, '/');
+    size_t len = end ? (size_t) (end - path) : strlen(path);
+
+    const vnode_t *next = NULL;
+    for (int i = 0; node->children && node->children[i]; i++) {
+      if (node_match(node->children[i], path, len, id)) {
+        next = node->children[i];
+        break;
       }
-      fh->buffer = buf;
-      fh->script_id = -1;
-      fh->switch_id = -1;
-      fh->input_id = -1;
+    }
+    if (!next) {
+      return NULL;
+    }
+    node = next;
 
-      fi->fh = (uint64_t) (uintptr_t) fh;
+    path += len;
+    while (*path == '/') {
+      path++;
     }
+  }
+
+  return node;
+}
+
+/* Whether a state change affects what a node shows. Config changes (including
+ * a component appearing or going away) cover all of the component's files,
+ * status changes only the files of the fields that changed. */
+static int node_affected(const vnode_t *node, state_change_t what,
+                         unsigned int fields) {
+  return (node->changes & CHANGE(what)) &&
+         (fields == 0 || node->fields == 0 || (node->fields & fields));
+}
+
+/* Whether a resolved node exists in the device's current state (caller
+ * holds the state lock) */
+static int node_present(fuse_context_data_t *ctx, const vnode_t *node,
+                        int id) {
+  return !node->present || node->present(ctx->dev_state, id);
+}
+
+/* Whether a path is the mount root listing the named devices */
+static int is_device_list(const char *path) {
+  if (!g_named) {
     return 0;
   }
+  while (*path == '/') {
+    path++;
+  }
+  return *path == '\0';
+}
 
-  if (strcmp(path, "/mqtt_config.json") == 0) {
-    if (!ctx->dev_state->mqtt_config.valid) {
-      return -ENOENT;
+/* Find the device a path belongs to and the path within its tree (`sub`).
+ * Returns NULL if no device has that name. */
+static fuse_context_data_t *path_device(const char *path, const char **sub) {
+  if (!g_named) {
+    *sub = path;
+    return g_device_count > 0 ? g_devices[0] : NULL;
+  }
+
+  while (*path == '/') {
+    path++;
+  }
+  size_t len = strcspn(path, "/");
+  for (int i = 0; i < g_device_count; i++) {
+    const char *name = g_devices[i]->name;
+    if (strlen(name) == len && memcmp(name, path, len) == 0) {
+      *sub = path + len;
+      return g_devices[i];
     }
+  }
+  return NULL;
+}
+
+/* ============================================================================
+ * DEVICE GROUPS
+ * ============================================================================
+ *
+ * A group directory, /@<group>, holds the writable files of the device tree:
+ * configs, the crontab, scripts and switch outputs. A write to one of them is
+ * applied to every member device that has the file, each on its own request
+ * queue, so the requests to all members go out together and a write to the
+ * whole group takes about one device round trip. Reading the file instead
+ * gives the outcome of its last write, one "<device> <result>" line per
+ * member, which follows the member's requests as they are answered.
+ */
+
+/* Outcome of a group write on one member */
+typedef enum {
+  GROUP_RESULT_NONE,      /* Not written through the group yet */
+  GROUP_RESULT_ABSENT,    /* The member has no such file */
+  GROUP_RESULT_QUEUED,    /* Requests queued or sent, not all answered */
+  GROUP_RESULT_UNCHANGED, /* Nothing needed sending */
+  GROUP_RESULT_OK,        /* Every request answered without error */
+  GROUP_RESULT_FAILED,    /* Not sent, or a request failed */
+  GROUP_RESULT_OFFLINE,   /* Kept until the member reconnects */
+} group_result_state_t;
+
+static const char *const s_group_result_names[] = {
+    "none", "absent", "queued", "unchanged", "ok", "failed", "offline",
+};
+
+typedef struct {
+  group_result_state_t state;
+  /* IDs of the requests the write queued on the member, recorded by
+   * group_request_added() as they are queued (under g_group_ids_mutex).
+   * Requests other threads queue meanwhile are not among them. */
+  int *ids;
+  int id_count;
+  int id_capacity;
+  int ids_lost; /* An ID could not be recorded (out of memory) */
+  int sending;  /* The write has not queued all of its requests yet */
+  int answered;
+  char detail[96]; /* Why it failed */
+} group_result_t;
+
+/* Outcome of the last write to one file of a group */
+typedef struct group_write {
+  const vnode_t *node;
+  int id;
+  time_t time;
+  group_result_t *results; /* One per member */
+  struct group_write *next;
+} group_write_t;
+
+typedef struct fuse_group {
+  char *name; /* Directory name, "@<group>" */
+  fuse_context_data_t **members;
+  int member_count;
+  group_write_t *writes;
+  pthread_mutex_t apply_mutex; /* One write to the group at a time */
+} fuse_group_t;
+
+static fuse_group_t **g_groups = NULL;
+static int g_group_count = 0;
+
+/* Guards the group results. Results waiting for answers are counted, so
+ * the retire hook returns at once while no group write is in progress. */
+static pthread_mutex_t g_group_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_group_queued = 0;
+
+/* Guards the ID lists of results. The add hook takes it with a member's
+ * queue mutex held, itself under the state lock at times, so nothing else
+ * is locked while holding it. */
+static pthread_mutex_t g_group_ids_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The result whose requests the calling thread is queueing, if any */
+static _Thread_local group_result_t *t_group_sending = NULL;
+
+/* Find the group a path belongs to and the path within its tree (`sub`).
+ * Returns NULL if the path is not in a group directory. */
+static fuse_group_t *path_group(const char *path, const char **sub) {
+  while (*path == '/') {
+    path++;
+  }
+  if (*path != '@') {
+    return NULL;
+  }
 
-    /* If opening for writing, allocate a write buffer */
-    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
-      write_buffer_t *buf = write_buffer_create(MAX_CONFIG_SIZE);
-      if (!buf) {
-        return -ENOMEM;
+  size_t len = strcspn(path, "/");
+  for (int i = 0; i < g_group_count; i++) {
+    const char *name = g_groups[i]->name;
+    if (strlen(name) == len && memcmp(name, path, len) == 0) {
+      *sub = path + len;
+      return g_groups[i];
+    }
+  }
+  return NULL;
+}
+
+/* Whether a node belongs in group directories: a writable file, or a
+ * directory with writable files below it */
+static int group_writable(const vnode_t *node) {
+  if (!S_ISDIR(node->mode)) {
+    return node->flush || node->write;
+  }
+  for (int i = 0; node->children[i]; i++) {
+    if (group_writable(node->children[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Whether a node is in a group: writable, and present on some member */
+static int group_node_present(fuse_group_t *group, const vnode_t *node,
+                              int id) {
+  if (!group_writable(node)) {
+    return 0;
+  }
+  for (int i = 0; i < group->member_count; i++) {
+    fuse_context_data_t *ctx = group->members[i];
+    device_state_read_lock(ctx->dev_state);
+    int present = node_present(ctx, node, id);
+    device_state_read_unlock(ctx->dev_state);
+    if (present) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* The results of the last write to a file (caller holds g_group_mutex).
+ * With `create`, a file not written yet gets a blank record; returns NULL
+ * if there is none or out of memory. */
+static group_write_t *group_write_find(fuse_group_t *group,
+                                       const vnode_t *node, int id,
+                                       int create) {
+  for (group_write_t *w = group->writes; w; w = w->next) {
+    if (w->node == node && w->id == id) {
+      return w;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+
+  group_write_t *w = calloc(1, sizeof(*w));
+  if (!w) {
+    return NULL;
+  }
+  w->results = calloc(group->member_count, sizeof(*w->results));
+  if (!w->results) {
+    free(w);
+    return NULL;
+  }
+  w->node = node;
+  w->id = id;
+  w->next = group->writes;
+  group->writes = w;
+  return w;
+}
+
+/* Mark a result failed (caller holds g_group_mutex) */
+static void group_result_fail(group_result_t *r, const char *detail) {
+  if (r->state == GROUP_RESULT_QUEUED) {
+    g_group_queued--;
+  }
+  r->state = GROUP_RESULT_FAILED;
+  snprintf(r->detail, sizeof(r->detail), "%s", detail);
+}
+
+/* Settle a queued result once all of its requests have been answered
+ * (caller holds g_group_mutex) */
+static void group_result_settle(group_result_t *r) {
+  /* Once the write is done sending, nothing adds to the IDs any more */
+  if (r->state != GROUP_RESULT_QUEUED || r->sending ||
+      r->answered < r->id_count) {
+    return;
+  }
+  r->state = r->id_count == 0 ? GROUP_RESULT_UNCHANGED : GROUP_RESULT_OK;
+  g_group_queued--;
+}
+
+/* Whether `req_id` is one of the requests of a result (caller holds
+ * g_group_mutex) */
+static int group_result_has(group_result_t *r, int req_id) {
+  int found = 0;
+  pthread_mutex_lock(&g_group_ids_mutex);
+  for (int i = 0; i < r->id_count && !found; i++) {
+    found = r->ids[i] == req_id;
+  }
+  pthread_mutex_unlock(&g_group_ids_mutex);
+  return found;
+}
+
+/* Add hook of member devices: record the requests a group write queues */
+static void group_request_added(void *user_data, int req_id) {
+  (void) user_data;
+  group_result_t *r = t_group_sending;
+  if (!r) {
+    return;
+  }
+
+  pthread_mutex_lock(&g_group_ids_mutex);
+  if (r->id_count == r->id_capacity) {
+    int capacity = r->id_capacity ? r->id_capacity * 2 : 4;
+    int *ids = realloc(r->ids, capacity * sizeof(*ids));
+    if (ids) {
+      r->ids = ids;
+      r->id_capacity = capacity;
+    }
+  }
+  if (r->id_count < r->id_capacity) {
+    r->ids[r->id_count++] = req_id;
+  } else {
+    r->ids_lost = 1;
+  }
+  pthread_mutex_unlock(&g_group_ids_mutex);
+}
+
+/* Retire hook of member devices: count the answers to group writes. A
+ * superseded request counts as answered, its change being carried by the
+ * coalescing request that replaced it. */
+static void group_request_retired(void *user_data, int req_id,
+                                  int superseded_by,
+                                  const jsonrpc_frame_t *response) {
+  fuse_context_data_t *ctx = (fuse_context_data_t *) user_data;
+
+  pthread_mutex_lock(&g_group_mutex);
+  for (int g = 0; g_group_queued > 0 && g < g_group_count; g++) {
+    fuse_group_t *group = g_groups[g];
+    for (int m = 0; m < group->member_count; m++) {
+      if (group->members[m] != ctx) {
+        continue;
       }
+      for (group_write_t *w = group->writes; w; w = w->next) {
+        group_result_t *r = &w->results[m];
+        if (r->state != GROUP_RESULT_QUEUED || !group_result_has(r, req_id)) {
+          continue;
+        }
 
-      /* Copy current config to buffer for modification */
-      if (ctx->dev_state->mqtt_config.raw_json) {
-        size_t len = ctx->dev_state->mqtt_config.json_len;
-        if (write_buffer_ensure_capacity(buf, len + 1) == 0) {
-          memcpy(buf->data, ctx->dev_state->mqtt_config.raw_json, len);
-          buf->data[len] = '\0';
-          buf->size = len;
+        r->answered++;
+        char error[96];
+        if (!response && !superseded_by) {
+          group_result_fail(r, "no response");
+        } else if (response &&
+                   jsonrpc_is_error(response, error, sizeof(error))) {
+          group_result_fail(r, error);
+        } else {
+          group_result_settle(r);
         }
       }
+    }
+  }
+  pthread_mutex_unlock(&g_group_mutex);
+}
+
+/* Apply a write to every member that has the file: flush `wbuf` for
+ * buffered files, or hand `buf` to the file's immediate write. Members are
+ * only queued for, not waited on. Returns 0, or -EIO if the write could not
+ * be queued on some member (its result says why). */
+static int group_apply(fuse_group_t *group, const vnode_t *node, int id,
+                       write_buffer_t *wbuf, const char *buf, size_t size) {
+  pthread_mutex_lock(&group->apply_mutex);
+
+  pthread_mutex_lock(&g_group_mutex);
+  group_write_t *w = group_write_find(group, node, id, 1);
+  if (w) {
+    w->time = time(NULL);
+    for (int m = 0; m < group->member_count; m++) {
+      if (w->results[m].state == GROUP_RESULT_QUEUED) {
+        g_group_queued--;
+      }
+      free(w->results[m].ids);
+      memset(&w->results[m], 0, sizeof(w->results[m]));
+    }
+  }
+  pthread_mutex_unlock(&g_group_mutex);
+  if (!w) {
+    pthread_mutex_unlock(&group->apply_mutex);
+    return -ENOMEM;
+  }
+
+  int failed = 0;
+  for (int m = 0; m < group->member_count; m++) {
+    fuse_context_data_t *ctx = group->members[m];
+    group_result_t *r = &w->results[m];
+
+    device_state_read_lock(ctx->dev_state);
+    int present = node_present(ctx, node, id);
+    device_state_read_unlock(ctx->dev_state);
+
+    pthread_mutex_lock(&g_group_mutex);
+    int send = 0;
+    if (!ctx->conn && !g_offline_writes_kept) {
+      group_result_fail(r, "not connected");
+      failed = 1;
+    } else if (!present) {
+      r->state = GROUP_RESULT_ABSENT;
+    } else if (!ctx->conn) {
+      r->state = GROUP_RESULT_OFFLINE;
+      send = 1;
+    } else {
+      r->state = GROUP_RESULT_QUEUED;
+      r->sending = 1;
+      g_group_queued++;
+      send = 1;
+    }
+    pthread_mutex_unlock(&g_group_mutex);
+    if (!send) {
+      continue;
+    }
+
+    t_group_sending = r->sending ? r : NULL;
+    int ret = node_send(ctx, node, id, wbuf, buf, size);
+    t_group_sending = NULL;
+
+    pthread_mutex_lock(&g_group_mutex);
+    r->sending = 0;
+    if (ret < 0) {
+      group_result_fail(r, strerror(-ret));
+      failed = 1;
+    } else if (r->ids_lost) {
+      group_result_fail(r, "out of memory");
+      failed = 1;
+    } else {
+      group_result_settle(r);
+    }
+    pthread_mutex_unlock(&g_group_mutex);
+  }
+
+  pthread_mutex_unlock(&group->apply_mutex);
+  return failed ? -EIO : 0;
+}
+
+/* Whether a member is still uploading a script the group wrote */
+static int group_script_uploading(fuse_context_data_t *ctx, int id) {
+  device_state_read_lock(ctx->dev_state);
+  script_entry_t *script = device_state_get_script(ctx->dev_state, id);
+  int uploading = script && (script->upload_esc || script->upload_pending);
+  device_state_read_unlock(ctx->dev_state);
+  return uploading;
+}
+
+/* Render the results of the last write to a group file. A script counts
+ * as written once its first chunks are answered; members that are still
+ * sending the rest show "uploading". */
+static int group_render(fuse_group_t *group, const vnode_t *node, int id,
+                        node_data_t *out) {
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *mem = open_memstream(&buf, &len);
+  if (!mem) {
+    return -ENOMEM;
+  }
+
+  pthread_mutex_lock(&g_group_mutex);
+  group_write_t *w = group_write_find(group, node, id, 0);
+  for (int m = 0; m < group->member_count; m++) {
+    fuse_context_data_t *ctx = group->members[m];
+    group_result_t *r = w ? &w->results[m] : NULL;
+    group_result_state_t state = r ? r->state : GROUP_RESULT_NONE;
+
+    const char *name = s_group_result_names[state];
+    if ((node->flags & NODE_SCRIPT) &&
+        (state == GROUP_RESULT_QUEUED || state == GROUP_RESULT_OK) &&
+        group_script_uploading(ctx, id)) {
+      name = "uploading";
+    }
+    if (state == GROUP_RESULT_FAILED) {
+      fprintf(mem, "%s %s: %s\n", ctx->name, name, r->detail);
+    } else {
+      fprintf(mem, "%s %s\n", ctx->name, name);
+    }
+  }
+  pthread_mutex_unlock(&g_group_mutex);
+
+  if (fclose(mem) != 0) {
+    free(buf);
+    return -EIO;
+  }
+
+  out->owned = buf;
+  out->data = buf;
+  out->len = len;
+  return 0;
+}
+
+/* When a group file was last written through the group */
+static time_t group_mtime(fuse_group_t *group, const vnode_t *node, int id) {
+  pthread_mutex_lock(&g_group_mutex);
+  group_write_t *w = group_write_find(group, node, id, 0);
+  time_t mtime = w ? w->time : 0;
+  pthread_mutex_unlock(&g_group_mutex);
+  return mtime;
+}
+
+/* getattr() for a group directory or file */
+static int group_getattr(fuse_group_t *group, const char *path,
+                         struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+
+  int id;
+  const vnode_t *node = resolve_path(path, &id);
+  if (!node || !group_node_present(group, node, id)) {
+    return -ENOENT;
+  }
+
+  struct fuse_context *fuse_ctx = fuse_get_context();
+  stbuf->st_mode = node->mode;
+  stbuf->st_uid = fuse_ctx->uid;
+  stbuf->st_gid = fuse_ctx->gid;
+
+  if (S_ISDIR(node->mode)) {
+    stbuf->st_nlink = 2;
+    return 0;
+  }
+
+  stbuf->st_nlink = 1;
+  node_data_t data = {0};
+  if (group_render(group, node, id, &data) == 0) {
+    stbuf->st_size = data.len;
+  }
+  node_data_free(&data);
+  stbuf->st_mtime = group_mtime(group, node, id);
+
+  return 0;
+}
+
+/* readdir() for a group directory: the entries some member has */
+static int group_readdir(fuse_group_t *group, const char *path, void *buf,
+                         fuse_fill_dir_t filler) {
+  int id;
+  const vnode_t *dir = resolve_path(path, &id);
+  if (!dir || !S_ISDIR(dir->mode) || !group_node_present(group, dir, id)) {
+    return -ENOENT;
+  }
+
+  FUSE_FILL_DIR(filler, buf, ".");
+  FUSE_FILL_DIR(filler, buf, "..");
+
+  for (int i = 0; dir->children[i]; i++) {
+    const vnode_t *child = dir->children[i];
+    char name[64];
+
+    if (child->id_max == 0) {
+      if (group_node_present(group, child, id)) {
+        FUSE_FILL_DIR(filler, buf, child->name);
+      }
+      continue;
+    }
+
+    for (int j = 0; j < child->id_max; j++) {
+      if (group_node_present(group, child, j)) {
+        node_name(child, j, name, sizeof(name));
+        FUSE_FILL_DIR(filler, buf, name);
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* open() for a group file. Writes start from an empty buffer, holding only
+ * what is to be applied to every member; reads always see the current
+ * results. */
+static int group_open(fuse_group_t *group, const char *path,
+                      struct fuse_file_info *fi) {
+  int id;
+  const vnode_t *node = resolve_path(path, &id);
+  if (!node || S_ISDIR(node->mode) || !group_node_present(group, node, id)) {
+    return -ENOENT;
+  }
+
+  file_handle_t *fh = calloc(1, sizeof(file_handle_t));
+  if (!fh) {
+    return -ENOMEM;
+  }
+  if ((node->flags & NODE_BUFFERED) && (fi->flags & O_ACCMODE) != O_RDONLY) {
+    fh->buffer = write_buffer_create(WRITE_BUFFER_MIN);
+    if (!fh->buffer) {
+      free(fh);
+      return -ENOMEM;
+    }
+  }
+  fh->group = group;
+  fh->node = node;
+  fh->id = id;
+
+  fi->direct_io = 1;
+  fi->fh = (uint64_t) (uintptr_t) fh;
+  return 0;
+}
+
+/* ============================================================================
+ * RUNTIME STATISTICS
+ * ============================================================================
+ *
+ * /.shusefs, beside the devices (or the device tree of a single device),
+ * serves the counters of stats.h: /.shusefs/stats as text and
+ * /.shusefs/stats.json as JSON. Device names never start with '.', so the
+ * directory cannot hide one. Each open renders the values once, and reads of
+ * that handle page through the copy.
+ */
+
+#define STATS_DIR "/.shusefs"
+
+enum { STATS_PATH_NONE, STATS_PATH_DIR, STATS_PATH_TEXT, STATS_PATH_JSON };
+
+/* Node of the open statistics files, which keep their rendering in the
+ * handle's snapshot */
+static const vnode_t s_stats_file = {.name = "stats", .mode = S_IFREG | 0444};
+
+/* Which statistics path `path` is (STATS_PATH_*) */
+static int stats_path(const char *path) {
+  size_t len = strlen(STATS_DIR);
+  if (strncmp(path, STATS_DIR, len) != 0) {
+    return STATS_PATH_NONE;
+  }
+  path += len;
+  if (strcmp(path, "") == 0 || strcmp(path, "/") == 0) {
+    return STATS_PATH_DIR;
+  }
+  if (strcmp(path, "/stats") == 0) {
+    return STATS_PATH_TEXT;
+  }
+  if (strcmp(path, "/stats.json") == 0) {
+    return STATS_PATH_JSON;
+  }
+  return STATS_PATH_NONE;
+}
+
+/* Render the statistics with the queue depths of every device */
+static int stats_file_render(int which, char **out, size_t *len) {
+  stats_source_t *sources =
+      calloc(g_device_count > 0 ? g_device_count : 1, sizeof(*sources));
+  if (!sources) {
+    return -ENOMEM;
+  }
+  for (int i = 0; i < g_device_count; i++) {
+    sources[i].name = g_devices[i]->name;
+    sources[i].queue = g_devices[i]->req_queue;
+  }
+
+  int ret = stats_render(which == STATS_PATH_JSON, sources, g_device_count,
+                         out, len);
+  free(sources);
+  return ret == 0 ? 0 : -ENOMEM;
+}
+
+static int stats_getattr(int which, struct stat *stbuf) {
+  struct fuse_context *fuse_ctx = fuse_get_context();
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_uid = fuse_ctx->uid;
+  stbuf->st_gid = fuse_ctx->gid;
+
+  if (which == STATS_PATH_DIR) {
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2;
+    return 0;
+  }
+
+  /* The size of a rendering now; reads bypass the page cache so a later,
+   * longer rendering is still read to its end */
+  char *text;
+  size_t len;
+  int ret = stats_file_render(which, &text, &len);
+  if (ret != 0) {
+    return ret;
+  }
+  free(text);
+
+  stbuf->st_mode = s_stats_file.mode;
+  stbuf->st_nlink = 1;
+  stbuf->st_size = len;
+  stbuf->st_mtime = time(NULL);
+  return 0;
+}
+
+static int stats_readdir(int which, void *buf, fuse_fill_dir_t filler) {
+  if (which != STATS_PATH_DIR) {
+    return -ENOTDIR;
+  }
+  FUSE_FILL_DIR(filler, buf, ".");
+  FUSE_FILL_DIR(filler, buf, "..");
+  FUSE_FILL_DIR(filler, buf, "stats");
+  FUSE_FILL_DIR(filler, buf, "stats.json");
+  return 0;
+}
+
+static int stats_open(int which, struct fuse_file_info *fi) {
+  if (which == STATS_PATH_DIR) {
+    return -ENOENT;
+  }
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    return -EACCES;
+  }
+
+  file_handle_t *fh = calloc(1, sizeof(file_handle_t));
+  if (!fh) {
+    return -ENOMEM;
+  }
+  int ret = stats_file_render(which, &fh->snapshot, &fh->snapshot_len);
+  if (ret != 0) {
+    free(fh);
+    return ret;
+  }
+  fh->node = &s_stats_file;
+  fh->id = -1;
+
+  fi->direct_io = 1;
+  fi->fh = (uint64_t) (uintptr_t) fh;
+  return 0;
+}
+
+/* ============================================================================
+ * FUSE OPERATIONS
+ * ============================================================================
+ */
+
+/* Get file attributes (caller holds the state lock in shared mode) */
+static int shuse_getattr_locked(fuse_context_data_t *ctx, const char *path,
+                                struct stat *stbuf,
+                                struct fuse_file_info *fi) {
+  (void) fi;
+
+  memset(stbuf, 0, sizeof(struct stat));
+
+  int id;
+  const vnode_t *node = resolve_path(path, &id);
+  if (!node || !node_present(ctx, node, id)) {
+    return -ENOENT;
+  }
+
+  /* Get FUSE context for ownership */
+  struct fuse_context *fuse_ctx = fuse_get_context();
+  stbuf->st_mode = node->mode;
+  stbuf->st_uid = fuse_ctx->uid;
+  stbuf->st_gid = fuse_ctx->gid;
+
+  if (S_ISDIR(node->mode)) {
+    stbuf->st_nlink = 2;
+    return 0;
+  }
+
+  stbuf->st_nlink = 1;
+  if (node->fixed_size > 0) {
+    stbuf->st_size = node->fixed_size;
+  } else if (node->size) {
+    stbuf->st_size = node->size(ctx->dev_state, id);
+  } else {
+    node_data_t data = {0};
+    if (node->render(ctx->dev_state, node, id, &data) == 0) {
+      stbuf->st_size = data.len;
+    }
+    node_data_free(&data);
+  }
+  stbuf->st_mtime = node->mtime(ctx->dev_state, node, id);
+
+  return 0;
+}
+
+/* Read directory contents (caller holds the state lock in shared mode) */
+static int shuse_readdir_locked(fuse_context_data_t *ctx, const char *path,
+                                void *buf, fuse_fill_dir_t filler) {
+  int id;
+  const vnode_t *dir = resolve_path(path, &id);
+  if (!dir || !S_ISDIR(dir->mode) || !node_present(ctx, dir, id)) {
+    return -ENOENT;
+  }
+
+  FUSE_FILL_DIR(filler, buf, ".");
+  FUSE_FILL_DIR(filler, buf, "..");
+
+  for (int i = 0; dir->children[i]; i++) {
+    const vnode_t *child = dir->children[i];
+    char name[64];
+
+    if (child->id_max == 0) {
+      /* Children of a per-component directory share its id */
+      if (node_present(ctx, child, id)) {
+        FUSE_FILL_DIR(filler, buf, child->name);
+      }
+      continue;
+    }
 
-      file_handle_t *fh = malloc(sizeof(file_handle_t));
-      if (!fh) {
-        write_buffer_destroy(buf);
-        return -ENOMEM;
+    /* One entry per component that exists */
+    for (int j = 0; j < child->id_max; j++) {
+      if (node_present(ctx, child, j)) {
+        node_name(child, j, name, sizeof(name));
+        FUSE_FILL_DIR(filler, buf, name);
       }
-      fh->buffer = buf;
-      fh->script_id = -1;
-      fh->switch_id = -1;
-      fh->input_id = -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Open file (caller holds the state lock in shared mode) */
+static int shuse_open_locked(fuse_context_data_t *ctx, const vnode_t *node,
+                             int id, struct fuse_file_info *fi) {
+  if (S_ISDIR(node->mode) || !node_present(ctx, node, id)) {
+    return -ENOENT;
+  }
+
+  /* Disconnected, the last known state is served read-only */
+  if ((fi->flags & O_ACCMODE) != O_RDONLY && !ctx->conn &&
+      !g_offline_writes_kept) {
+    return -EROFS;
+  }
+
+  /* Files without a write buffer act on writes immediately (or are
+   * read-only) */
+  if (!(node->flags & NODE_BUFFERED) || (fi->flags & O_ACCMODE) == O_RDONLY) {
+    return 0;
+  }
+
+  /* Opening for writing: copy current content to a write buffer of its size
+   * for modification, but NOT for O_TRUNC on files that honour it (user
+   * wants to replace the entire file) */
+  node_data_t data = {0};
+  int copy = !((node->flags & NODE_TRUNC_EMPTY) && (fi->flags & O_TRUNC)) &&
+             node->render(ctx->dev_state, node, id, &data) == 0;
+  write_buffer_t *buf =
+      write_buffer_create(copy ? data.len + 1 : WRITE_BUFFER_MIN);
+  if (!buf) {
+    node_data_free(&data);
+    return -ENOMEM;
+  }
+  if (copy) {
+    memcpy(buf->data, data.data, data.len);
+    buf->data[data.len] = '\0';
+    buf->size = data.len;
+  }
+  node_data_free(&data);
+
+  file_handle_t *fh = calloc(1, sizeof(file_handle_t));
+  if (!fh) {
+    write_buffer_destroy(buf);
+    return -ENOMEM;
+  }
+  fh->ctx = ctx;
+  fh->buffer = buf;
+  fh->node = node;
+  fh->id = id;
+
+  fi->fh = (uint64_t) (uintptr_t) fh;
+  return 0;
+}
+
+/* Read file contents (caller holds the state lock in shared mode) */
+static int shuse_read_locked(fuse_context_data_t *ctx, const char *path,
+                             char *buf, size_t size, off_t offset) {
+  int id;
+  const vnode_t *node = resolve_path(path, &id);
+  if (!node || S_ISDIR(node->mode) || !node_present(ctx, node, id)) {
+    return -ENOENT;
+  }
+
+  node_data_t data = {0};
+  int ret = node->render(ctx->dev_state, node, id, &data);
+  if (ret == 0) {
+    ret = copy_out(data.data, data.len, buf, size, offset);
+  }
+  node_data_free(&data);
+
+  return ret;
+}
+
+/*
+ * Read-side entry points. These run concurrently on the FUSE worker threads
+ * and only copy data out of device state, so they share the state lock:
+ * readers never wait on each other, and the WebSocket thread only waits for
+ * in-flight copies to finish before applying an update.
+ */
+static int shuse_getattr(const char *path, struct stat *stbuf,
+                         struct fuse_file_info *fi) {
+  int which = stats_path(path);
+  if (which != STATS_PATH_NONE) {
+    return stats_getattr(which, stbuf);
+  }
+
+  if (is_device_list(path)) {
+    struct fuse_context *fuse_ctx = fuse_get_context();
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = S_IFDIR | 0755;
+    stbuf->st_nlink = 2;
+    stbuf->st_uid = fuse_ctx->uid;
+    stbuf->st_gid = fuse_ctx->gid;
+    return 0;
+  }
+
+  const char *sub;
+  fuse_group_t *group = path_group(path, &sub);
+  if (group) {
+    return group_getattr(group, sub, stbuf);
+  }
 
-      fi->fh = (uint64_t) (uintptr_t) fh;
-    }
-    return 0;
+  fuse_context_data_t *ctx = path_device(path, &sub);
+  if (!ctx) {
+    return -ENOENT;
   }
 
-  /* crontab file */
-  if (strcmp(path, "/crontab") == 0) {
-    /* If opening for writing, allocate a write buffer */
-    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
-      write_buffer_t *buf = write_buffer_create(MAX_CONFIG_SIZE);
-      if (!buf) {
-        return -ENOMEM;
-      }
+  device_state_read_lock(ctx->dev_state);
+  int ret = shuse_getattr_locked(ctx, sub, stbuf, fi);
+  device_state_read_unlock(ctx->dev_state);
 
-      /* Copy current crontab content to buffer for modification,
-       * but NOT if O_TRUNC is set (user wants to replace entire file) */
-      if (!(fi->flags & O_TRUNC)) {
-        char *content = NULL;
-        if (device_state_get_crontab_str(ctx->dev_state, &content) == 0 &&
-            content) {
-          size_t len = strlen(content);
-          if (write_buffer_ensure_capacity(buf, len + 1) == 0) {
-            memcpy(buf->data, content, len);
-            buf->data[len] = '\0';
-            buf->size = len;
-          }
-          free(content);
-        }
-      }
+  return ret;
+}
 
-      file_handle_t *fh = malloc(sizeof(file_handle_t));
-      if (!fh) {
-        write_buffer_destroy(buf);
-        return -ENOMEM;
-      }
-      fh->buffer = buf;
-      fh->script_id = -1;
-      fh->switch_id = -1;
-      fh->input_id = -1;
+static int shuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset,
+                         struct fuse_file_info *fi SHUSE_READDIR_FLAGS_PARAM) {
+  (void) offset;
+  (void) fi;
+  SHUSE_READDIR_UNUSED_FLAGS
 
-      fi->fh = (uint64_t) (uintptr_t) fh;
-    }
-    return 0;
+  int which = stats_path(path);
+  if (which != STATS_PATH_NONE) {
+    return stats_readdir(which, buf, filler);
   }
 
-  /* Check if it's a switch config file */
-  if (strncmp(path, "/switch_", 8) == 0) {
-    const char *filename = path + 1;
-    int switch_id = parse_switch_id(filename);
-
-    if (switch_id >= 0) {
-      switch_config_t *sw = device_state_get_switch(ctx->dev_state, switch_id);
-      if (sw && sw->valid) {
-        /* If opening for writing, allocate a write buffer */
-        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
-          write_buffer_t *buf = write_buffer_create(MAX_CONFIG_SIZE);
-          if (!buf) {
-            return -ENOMEM;
-          }
-
-          /* Copy current config to buffer for modification */
-          if (sw->raw_json) {
-            size_t len = sw->json_len;
-            if (write_buffer_ensure_capacity(buf, len + 1) == 0) {
-              memcpy(buf->data, sw->raw_json, len);
-              buf->data[len] = '\0';
-              buf->size = len;
-            }
-          }
-
-          file_handle_t *fh = malloc(sizeof(file_handle_t));
-          if (!fh) {
-            write_buffer_destroy(buf);
-            return -ENOMEM;
-          }
-          fh->buffer = buf;
-          fh->script_id = -1;
-          fh->switch_id = switch_id;
-          fh->input_id = -1;
-
-          fi->fh = (uint64_t) (uintptr_t) fh;
-        }
-        return 0;
-      }
+  if (is_device_list(path)) {
+    FUSE_FILL_DIR(filler, buf, ".");
+    FUSE_FILL_DIR(filler, buf, "..");
+    FUSE_FILL_DIR(filler, buf, STATS_DIR + 1);
+    for (int i = 0; i < g_device_count; i++) {
+      FUSE_FILL_DIR(filler, buf, g_devices[i]->name);
     }
-  }
-
-  /* Check if it's an input config file */
-  if (strncmp(path, "/input_", 7) == 0) {
-    const char *filename = path + 1;
-    int input_id = parse_input_id(filename);
-
-    if (input_id >= 0) {
-      input_config_t *inp = device_state_get_input(ctx->dev_state, input_id);
-      if (inp && inp->valid) {
-        /* If opening for writing, allocate a write buffer */
-        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
-          write_buffer_t *buf = write_buffer_create(MAX_CONFIG_SIZE);
-          if (!buf) {
-            return -ENOMEM;
-          }
-
-          /* Copy current config to buffer for modification */
-          if (inp->raw_json) {
-            size_t len = inp->json_len;
-            if (write_buffer_ensure_capacity(buf, len + 1) == 0) {
-              memcpy(buf->data, inp->raw_json, len);
-              buf->data[len] = '\0';
-              buf->size = len;
-            }
-          }
-
-          file_handle_t *fh = malloc(sizeof(file_handle_t));
-          if (!fh) {
-            write_buffer_destroy(buf);
-            return -ENOMEM;
-          }
-          fh->buffer = buf;
-          fh->script_id = -1;
-          fh->switch_id = -1;
-          fh->input_id = input_id;
-
-          fi->fh = (uint64_t) (uintptr_t) fh;
-        }
-        return 0;
-      }
+    for (int i = 0; i < g_group_count; i++) {
+      FUSE_FILL_DIR(filler, buf, g_groups[i]->name);
     }
+    return 0;
   }
 
-  /* Check if it's a script file */
-  if (strncmp(path, "/scripts/", 9) == 0) {
-    const char *filename = path + 9;
-    int script_id = parse_script_id(filename);
-
-    if (script_id >= 0) {
-      script_entry_t *script =
-          device_state_get_script(ctx->dev_state, script_id);
-      if (script && script->valid) {
-        /* If opening for writing, allocate a write buffer */
-        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
-          write_buffer_t *buf = write_buffer_create(MAX_SCRIPT_CODE);
-          if (!buf) {
-            return -ENOMEM;
-          }
-
-          /* Copy current script code to buffer for modification */
-          if (script->code) {
-            size_t len = strlen(script->code);
-            if (write_buffer_ensure_capacity(buf, len + 1) == 0) {
-              memcpy(buf->data, script->code, len);
-              buf->data[len] = '\0';
-              buf->size = len;
-            }
-          }
-
-          file_handle_t *fh = malloc(sizeof(file_handle_t));
-          if (!fh) {
-            write_buffer_destroy(buf);
-            return -ENOMEM;
-          }
-          fh->buffer = buf;
-          fh->script_id = script_id;
-          fh->switch_id = -1;
-          fh->input_id = -1;
-
-          fi->fh = (uint64_t) (uintptr_t) fh;
-        }
-        return 0;
-      }
-    }
+  const char *sub;
+  fuse_group_t *group = path_group(path, &sub);
+  if (group) {
+    return group_readdir(group, sub, buf, filler);
   }
 
-  /* Check if it's a proc switch file */
-  if (strncmp(path, "/proc/switch/", 13) == 0) {
-    const char *remainder = path + 13;
-    char *endptr;
-    long switch_id = strtol(remainder, &endptr, 10);
-
-    if (endptr != remainder && switch_id >= 0 && switch_id < MAX_SWITCHES) {
-      /* Check for valid proc file names */
-      if (strcmp(endptr, "/output") == 0 || strcmp(endptr, "/id") == 0 ||
-          strcmp(endptr, "/source") == 0 || strcmp(endptr, "/apower") == 0 ||
-          strcmp(endptr, "/voltage") == 0 || strcmp(endptr, "/current") == 0 ||
-          strcmp(endptr, "/freq") == 0 || strcmp(endptr, "/energy") == 0 ||
-          strcmp(endptr, "/ret_energy") == 0 ||
-          strcmp(endptr, "/temperature") == 0) {
-        switch_config_t *sw =
-            device_state_get_switch(ctx->dev_state, (int) switch_id);
-        if (sw && sw->valid) {
-          /* Proc files don't need write buffers - writes are handled
-           * immediately */
-          return 0;
-        }
-      }
-    }
+  fuse_context_data_t *ctx = path_device(path, &sub);
+  if (!ctx) {
+    return -ENOENT;
   }
 
-  /* Check if it's a proc input file */
-  if (strncmp(path, "/proc/input/", 12) == 0) {
-    const char *remainder = path + 12;
-    char *endptr;
-    long input_id = strtol(remainder, &endptr, 10);
-
-    if (endptr != remainder && input_id >= 0 && input_id < MAX_INPUTS) {
-      /* Check for valid proc file names */
-      if (strcmp(endptr, "/id") == 0 || strcmp(endptr, "/state") == 0) {
-        input_config_t *inp =
-            device_state_get_input(ctx->dev_state, (int) input_id);
-        if (inp && inp->valid) {
-          /* Proc files don't need write buffers - reads only */
-          return 0;
-        }
-      }
-    }
+  device_state_read_lock(ctx->dev_state);
+  int ret = shuse_readdir_locked(ctx, sub, buf, filler);
+  device_state_read_unlock(ctx->dev_state);
+
+  /* A single device's tree is the mount root */
+  if (ret == 0 && strcmp(path, "/") == 0) {
+    FUSE_FILL_DIR(filler, buf, STATS_DIR + 1);
   }
 
-  return -ENOENT;
+  return ret;
 }
 
-/* Read file contents */
-static int shuse_read(const char *path, char *buf, size_t size, off_t offset,
-                      struct fuse_file_info *fi) {
-  (void) fi;
+/*
+ * poll() on /proc value files. Like sysfs attributes, a pollable file is
+ * always readable, and additionally reports POLLPRI once its value has
+ * changed since it was last read from the start. A reader blocks in
+ * poll(POLLPRI) (or select() on exceptfds), wakes when the device reports a
+ * new value, and re-reads with pread(fd, buf, n, 0).
+ */
 
-  fuse_context_data_t *ctx = get_fuse_ctx();
+/* Give a pollable file its own handle and track it for change wakeups */
+static int poll_handle_open(fuse_context_data_t *ctx, const vnode_t *node,
+                            int id, struct fuse_file_info *fi) {
+  file_handle_t *fh = calloc(1, sizeof(file_handle_t));
+  if (!fh) {
+    return -ENOMEM;
+  }
+  fh->ctx = ctx;
+  fh->node = node;
+  fh->id = id;
+  if (node->flags & NODE_SNAPSHOT) {
+    pthread_mutex_init(&fh->snapshot_lock, NULL);
+  }
 
-  /* Read sys_config.json */
-  if (strcmp(path, "/sys_config.json") == 0) {
-    if (!ctx->dev_state->sys_config.valid ||
-        !ctx->dev_state->sys_config.raw_json) {
-      return -ENOENT;
-    }
+  pthread_mutex_lock(&g_poll_mutex);
+  fh->poll_next = g_poll_handles;
+  g_poll_handles = fh;
+  pthread_mutex_unlock(&g_poll_mutex);
 
-    size_t len = ctx->dev_state->sys_config.json_len;
-    if (offset >= (off_t) len) {
-      return 0;
-    }
+  /* Every read must reach us to see the current value */
+  fi->direct_io = 1;
+  fi->fh = (uint64_t) (uintptr_t) fh;
+  return 0;
+}
 
-    if (offset + size > len) {
-      size = len - offset;
+/* Stop tracking a pollable file's handle */
+static void poll_handle_close(file_handle_t *fh) {
+  pthread_mutex_lock(&g_poll_mutex);
+  for (file_handle_t **p = &g_poll_handles; *p; p = &(*p)->poll_next) {
+    if (*p == fh) {
+      *p = fh->poll_next;
+      break;
     }
-
-    memcpy(buf, ctx->dev_state->sys_config.raw_json + offset, size);
-    return size;
   }
+  if (fh->ph) {
+    fuse_pollhandle_destroy(fh->ph);
+    fh->ph = NULL;
+  }
+  pthread_mutex_unlock(&g_poll_mutex);
 
-  /* Read mqtt_config.json */
-  if (strcmp(path, "/mqtt_config.json") == 0) {
-    if (!ctx->dev_state->mqtt_config.valid ||
-        !ctx->dev_state->mqtt_config.raw_json) {
-      return -ENOENT;
-    }
+  if (fh->node->flags & NODE_SNAPSHOT) {
+    free(fh->snapshot);
+    fh->snapshot = NULL;
+    pthread_mutex_destroy(&fh->snapshot_lock);
+  }
+}
 
-    size_t len = ctx->dev_state->mqtt_config.json_len;
-    if (offset >= (off_t) len) {
-      return 0;
+/* Mark the device's open handles of files affected by a change and wake
+ * their pending polls. Files without an id (the /proc aggregates) follow
+ * every component. */
+static void poll_wake_change(fuse_context_data_t *ctx, state_change_t what,
+                             int id, unsigned int fields) {
+  pthread_mutex_lock(&g_poll_mutex);
+  for (file_handle_t *fh = g_poll_handles; fh; fh = fh->poll_next) {
+    if (fh->ctx != ctx || (fh->id >= 0 && fh->id != id) ||
+        !node_affected(fh->node, what, fields)) {
+      continue;
     }
-
-    if (offset + size > len) {
-      size = len - offset;
+    fh->changed = 1;
+    if (fh->ph) {
+      fuse_notify_poll(fh->ph);
+      fuse_pollhandle_destroy(fh->ph);
+      fh->ph = NULL;
     }
-
-    memcpy(buf, ctx->dev_state->mqtt_config.raw_json + offset, size);
-    return size;
   }
+  pthread_mutex_unlock(&g_poll_mutex);
+}
 
-  /* Read crontab */
-  if (strcmp(path, "/crontab") == 0) {
-    char *content = NULL;
-    if (device_state_get_crontab_str(ctx->dev_state, &content) != 0 ||
-        !content) {
-      return -EIO;
-    }
+static int shuse_poll(const char *path, struct fuse_file_info *fi,
+                      struct fuse_pollhandle *ph, unsigned *reventsp) {
+  (void) path;
 
-    size_t len = strlen(content);
-    if (offset >= (off_t) len) {
-      free(content);
-      return 0;
+  file_handle_t *fh = (file_handle_t *) (uintptr_t) fi->fh;
+  if (!fh || fh->group || !(fh->node->flags & NODE_POLL)) {
+    /* Everything else is always ready and never changes under poll */
+    if (ph) {
+      fuse_pollhandle_destroy(ph);
     }
+    *reventsp = POLLIN | POLLRDNORM;
+    return 0;
+  }
 
-    if (offset + size > len) {
-      size = len - offset;
+  pthread_mutex_lock(&g_poll_mutex);
+  /* Keep the newest poll handle; the kernel asks again after a wakeup */
+  if (ph) {
+    if (fh->ph) {
+      fuse_pollhandle_destroy(fh->ph);
     }
-
-    memcpy(buf, content + offset, size);
-    free(content);
-    return size;
+    fh->ph = ph;
   }
+  *reventsp = POLLIN | POLLRDNORM | (fh->changed ? POLLPRI : 0);
+  pthread_mutex_unlock(&g_poll_mutex);
 
-  /* Read switch config file */
-  if (strncmp(path, "/switch_", 8) == 0) {
-    const char *filename = path + 1;
-    int switch_id = parse_switch_id(filename);
+  return 0;
+}
 
-    if (switch_id >= 0) {
-      switch_config_t *sw = device_state_get_switch(ctx->dev_state, switch_id);
-      if (sw && sw->valid && sw->raw_json) {
-        size_t len = sw->json_len;
-        if (offset >= (off_t) len) {
-          return 0;
-        }
+static int shuse_open(const char *path, struct fuse_file_info *fi) {
+  int which = stats_path(path);
+  if (which != STATS_PATH_NONE) {
+    return stats_open(which, fi);
+  }
 
-        if (offset + size > len) {
-          size = len - offset;
-        }
+  const char *sub;
+  fuse_group_t *group = path_group(path, &sub);
+  if (group) {
+    return group_open(group, sub, fi);
+  }
 
-        memcpy(buf, sw->raw_json + offset, size);
-        return size;
-      }
-    }
+  fuse_context_data_t *ctx = path_device(path, &sub);
+  if (!ctx) {
+    return -ENOENT;
   }
 
-  /* Read script file */
-  if (strncmp(path, "/scripts/", 9) == 0) {
-    const char *filename = path + 9;
-    int script_id = parse_script_id(filename);
+  int id;
+  const vnode_t *node = resolve_path(sub, &id);
+  if (!node) {
+    return -ENOENT;
+  }
 
-    if (script_id >= 0) {
-      script_entry_t *script =
-          device_state_get_script(ctx->dev_state, script_id);
-      if (script && script->valid && script->code) {
-        size_t len = strlen(script->code);
-        if (offset >= (off_t) len) {
-          return 0;
-        }
+  /* Script code may not be resident yet (lazy loading or eviction): fetch
+   * it before taking the read lock, which the fetch itself needs */
+  int is_script = (node->flags & NODE_SCRIPT) != 0;
+  int fetched = 0;
+  if (is_script &&
+      device_state_acquire_script_code(ctx->dev_state, ctx->req_queue,
+                                       ctx->conn, id, &fetched) != 0) {
+    return -EIO;
+  }
 
-        if (offset + size > len) {
-          size = len - offset;
-        }
+  device_state_read_lock(ctx->dev_state);
+  int ret = shuse_open_locked(ctx, node, id, fi);
+  device_state_read_unlock(ctx->dev_state);
 
-        memcpy(buf, script->code + offset, size);
-        return size;
-      }
+  if (is_script) {
+    if (ret != 0) {
+      device_state_release_script_code(ctx->dev_state, id);
+    } else if (fetched) {
+      /* The kernel may have cached the size from before the code was
+       * loaded; read through to us instead */
+      fi->direct_io = 1;
     }
   }
 
-  /* Read proc/switch/N/ files */
-  if (strncmp(path, "/proc/switch/", 13) == 0) {
-    const char *remainder = path + 13;
-    char *endptr;
-    long switch_id = strtol(remainder, &endptr, 10);
-
-    if (endptr != remainder && switch_id >= 0 && switch_id < MAX_SWITCHES) {
-      switch_config_t *sw =
-          device_state_get_switch(ctx->dev_state, (int) switch_id);
-      if (sw && sw->valid) {
-        char value_str[64];
-        value_str[0] = '\0';
-
-        /* Determine which file is being read */
-        if (strcmp(endptr, "/output") == 0) {
-          snprintf(value_str, sizeof(value_str), "%s\n",
-                   sw->status.output ? "true" : "false");
-        } else if (strcmp(endptr, "/id") == 0) {
-          snprintf(value_str, sizeof(value_str), "%d\n", sw->status.id);
-        } else if (strcmp(endptr, "/source") == 0) {
-          snprintf(value_str, sizeof(value_str), "%s\n", sw->status.source);
-        } else if (strcmp(endptr, "/apower") == 0) {
-          snprintf(value_str, sizeof(value_str), "%.1f\n", sw->status.apower);
-        } else if (strcmp(endptr, "/voltage") == 0) {
-          snprintf(value_str, sizeof(value_str), "%.1f\n", sw->status.voltage);
-        } else if (strcmp(endptr, "/current") == 0) {
-          snprintf(value_str, sizeof(value_str), "%.3f\n", sw->status.current);
-        } else if (strcmp(endptr, "/freq") == 0) {
-          snprintf(value_str, sizeof(value_str), "%.1f\n", sw->status.freq);
-        } else if (strcmp(endptr, "/energy") == 0) {
-          snprintf(value_str, sizeof(value_str), "%.3f\n",
-                   sw->status.energy_total);
-        } else if (strcmp(endptr, "/ret_energy") == 0) {
-          snprintf(value_str, sizeof(value_str), "%.3f\n",
-                   sw->status.ret_energy_total);
-        } else if (strcmp(endptr, "/temperature") == 0) {
-          snprintf(value_str, sizeof(value_str), "%.1f\n",
-                   sw->status.temperature_c);
-        } else {
-          return -ENOENT;
-        }
+  /* Keep the page cache across opens for files rendered from config,
+   * scripts and schedules: they are invalidated when their state changes.
+   * /proc values change too often for cached pages to be worth keeping. */
+  if (ret == 0 && g_kernel_cache && !fi->direct_io &&
+      (node->flags & NODE_KEEP_CACHE)) {
+    fi->keep_cache = 1;
+  }
 
-        size_t len = strlen(value_str);
-        if (offset >= (off_t) len) {
-          return 0;
-        }
+  if (ret == 0 && (node->flags & NODE_POLL)) {
+    ret = poll_handle_open(ctx, node, id, fi);
+  }
 
-        if (offset + size > len) {
-          size = len - offset;
-        }
+  return ret;
+}
 
-        memcpy(buf, value_str + offset, size);
-        return size;
+/* Read a snapshot file. The contents are rendered once per pass, when a
+ * read starts at offset 0 (or the handle has no snapshot yet), and the rest
+ * of the pass is served from that copy: a reader using small buffers gets
+ * one coherent set of values even if updates land between its reads. */
+static int snapshot_read(file_handle_t *fh, char *buf, size_t size,
+                         off_t offset) {
+  fuse_context_data_t *ctx = fh->ctx;
+  int ret = 0;
+
+  pthread_mutex_lock(&fh->snapshot_lock);
+  if (offset == 0 || !fh->snapshot) {
+    node_data_t data = {0};
+    device_state_read_lock(ctx->dev_state);
+    if (!node_present(ctx, fh->node, fh->id)) {
+      ret = -ENOENT;
+    } else {
+      ret = fh->node->render(ctx->dev_state, fh->node, fh->id, &data);
+    }
+    device_state_read_unlock(ctx->dev_state);
+
+    if (ret == 0) {
+      /* Keep a heap rendering as it is; copy the ones in data.buf */
+      char *copy = data.owned;
+      if (copy) {
+        data.owned = NULL;
+      } else if ((copy = malloc(data.len + 1)) != NULL) {
+        memcpy(copy, data.data, data.len);
+      }
+      if (copy) {
+        free(fh->snapshot);
+        fh->snapshot = copy;
+        fh->snapshot_len = data.len;
+      } else {
+        ret = -ENOMEM;
       }
     }
+    node_data_free(&data);
   }
 
-  /* Read input config file */
-  if (strncmp(path, "/input_", 7) == 0) {
-    const char *filename = path + 1;
-    int input_id = parse_input_id(filename);
-
-    if (input_id >= 0) {
-      input_config_t *inp = device_state_get_input(ctx->dev_state, input_id);
-      if (inp && inp->valid && inp->raw_json) {
-        size_t len = inp->json_len;
-        if (offset >= (off_t) len) {
-          return 0;
-        }
+  if (ret == 0) {
+    ret = copy_out(fh->snapshot, fh->snapshot_len, buf, size, offset);
+  }
+  pthread_mutex_unlock(&fh->snapshot_lock);
 
-        if (offset + size > len) {
-          size = len - offset;
-        }
+  return ret;
+}
 
-        memcpy(buf, inp->raw_json + offset, size);
-        return size;
-      }
+static int shuse_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+  file_handle_t *fh = (file_handle_t *) (uintptr_t) fi->fh;
+  if (fh && fh->group) {
+    node_data_t data = {0};
+    int ret = group_render(fh->group, fh->node, fh->id, &data);
+    if (ret == 0) {
+      ret = copy_out(data.data, data.len, buf, size, offset);
     }
+    node_data_free(&data);
+    return ret;
   }
 
-  /* Read proc/input/N/ files */
-  if (strncmp(path, "/proc/input/", 12) == 0) {
-    const char *remainder = path + 12;
-    char *endptr;
-    long input_id = strtol(remainder, &endptr, 10);
-
-    if (endptr != remainder && input_id >= 0 && input_id < MAX_INPUTS) {
-      input_config_t *inp =
-          device_state_get_input(ctx->dev_state, (int) input_id);
-      if (inp && inp->valid) {
-        char value_str[64];
-        value_str[0] = '\0';
-
-        /* Determine which file is being read */
-        if (strcmp(endptr, "/id") == 0) {
-          snprintf(value_str, sizeof(value_str), "%d\n", inp->status.id);
-        } else if (strcmp(endptr, "/state") == 0) {
-          snprintf(value_str, sizeof(value_str), "%s\n",
-                   inp->status.state ? "true" : "false");
-        } else {
-          return -ENOENT;
-        }
+  if (fh && fh->node == &s_stats_file) {
+    return copy_out(fh->snapshot, fh->snapshot_len, buf, size, offset);
+  }
 
-        size_t len = strlen(value_str);
-        if (offset >= (off_t) len) {
-          return 0;
-        }
+  /* Re-reading a pollable file from the start consumes its change */
+  if (fh && (fh->node->flags & NODE_POLL) && offset == 0) {
+    pthread_mutex_lock(&g_poll_mutex);
+    fh->changed = 0;
+    pthread_mutex_unlock(&g_poll_mutex);
+  }
 
-        if (offset + size > len) {
-          size = len - offset;
-        }
+  if (fh && (fh->node->flags & NODE_SNAPSHOT)) {
+    return snapshot_read(fh, buf, size, offset);
+  }
 
-        memcpy(buf, value_str + offset, size);
-        return size;
-      }
-    }
+  const char *sub;
+  fuse_context_data_t *ctx = path_device(path, &sub);
+  if (!ctx) {
+    return -ENOENT;
   }
 
-  return -ENOENT;
+  device_state_read_lock(ctx->dev_state);
+  int ret = shuse_read_locked(ctx, sub, buf, size, offset);
+  device_state_read_unlock(ctx->dev_state);
+
+  return ret;
 }
 
 /* Write file contents */
 static int shuse_write(const char *path, const char *buf, size_t size,
                        off_t offset, struct fuse_file_info *fi) {
-  fuse_context_data_t *ctx = get_fuse_ctx();
-
-  /* Handle proc/switch/N/output file writes - immediate action, no buffering */
-  if (strncmp(path, "/proc/switch/", 13) == 0) {
-    const char *remainder = path + 13;
-    char *endptr;
-    long switch_id = strtol(remainder, &endptr, 10);
-
-    if (endptr != remainder && strcmp(endptr, "/output") == 0 &&
-        switch_id >= 0 && switch_id < MAX_SWITCHES) {
-      switch_config_t *sw =
-          device_state_get_switch(ctx->dev_state, (int) switch_id);
-      if (sw && sw->valid) {
-        /* Parse the input - accept "true"/"false" or "1"/"0" */
-        if (size > 0) {
-          bool turn_on = false;
-          if (size >= 4 && strncmp(buf, "true", 4) == 0) {
-            turn_on = true;
-          } else if (size >= 1 && buf[0] == '1') {
-            turn_on = true;
-          }
-
-          /* Send Switch.Set command to device */
-          int req_id =
-              device_state_set_switch(ctx->dev_state, ctx->req_queue, ctx->conn,
-                                      (int) switch_id, turn_on);
-          if (req_id < 0) {
-            fprintf(stderr, "Failed to set switch %d state\n", (int) switch_id);
-            return -EIO;
-          }
-
-          /* Request status update immediately after */
-          device_state_request_switch_status(ctx->dev_state, ctx->req_queue,
-                                             ctx->conn, (int) switch_id);
-
-          return size;
-        }
-        return -EINVAL;
-      }
-      return -ENOENT;
-    }
+  const char *sub;
+  fuse_group_t *group = path_group(path, &sub);
+  fuse_context_data_t *ctx = group ? NULL : path_device(path, &sub);
+  if (!group && !ctx) {
+    return -ENOENT;
+  }
+
+  /* Files with an immediate action (proc/switch/N/output) bypass buffering */
+  int id;
+  const vnode_t *node = resolve_path(sub, &id);
+  if (node && node->write && group) {
+    int ret = group_apply(group, node, id, NULL, buf, size);
+    return ret == 0 ? (int) size : ret;
+  }
+  if (node && node->write) {
+    device_state_read_lock(ctx->dev_state);
+    int present = node_present(ctx, node, id);
+    device_state_read_unlock(ctx->dev_state);
+
+    return present ? node_send(ctx, node, id, NULL, buf, size) : -ENOENT;
   }
 
   file_handle_t *fh = (file_handle_t *) (uintptr_t) fi->fh;
@@ -1290,8 +2645,6 @@ static int shuse_write(const char *path, const char *buf, size_t size,
 /* Truncate file */
 static int shuse_truncate(const char *path, off_t size,
                           struct fuse_file_info *fi) {
-  (void) path;
-
   if (fi && fi->fh) {
     file_handle_t *fh = (file_handle_t *) (uintptr_t) fi->fh;
     if (fh && fh->buffer) {
@@ -1313,20 +2666,13 @@ static int shuse_truncate(const char *path, off_t size,
     return 0;
   }
 
-  /* For files opened read-only */
-  if (strcmp(path, "/sys_config.json") == 0) {
-    return 0;
-  }
-
-  if (strcmp(path, "/mqtt_config.json") == 0) {
-    return 0;
-  }
-
-  if (strcmp(path, "/crontab") == 0) {
-    return 0;
-  }
-
-  if (strncmp(path, "/scripts/", 9) == 0) {
+  /* For files opened read-only: the content is replaced on flush */
+  const char *sub;
+  int id;
+  const vnode_t *node = path_group(path, &sub) || path_device(path, &sub)
+                            ? resolve_path(sub, &id)
+                            : NULL;
+  if (node && (node->flags & NODE_BUFFERED)) {
     return 0;
   }
 
@@ -1335,324 +2681,337 @@ static int shuse_truncate(const char *path, off_t size,
 
 /* Flush file - sync data to device */
 static int shuse_flush(const char *path, struct fuse_file_info *fi) {
-  fuse_context_data_t *ctx = get_fuse_ctx();
+  (void) path;
 
   if (!fi || !fi->fh) {
     return 0;
   }
 
   file_handle_t *fh = (file_handle_t *) (uintptr_t) fi->fh;
-  if (!fh || !fh->buffer) {
+  if (!fh || !fh->buffer || fh->buffer->size == 0) {
     return 0;
   }
 
-  write_buffer_t *wbuf = fh->buffer;
+  if (fh->group) {
+    return group_apply(fh->group, fh->node, fh->id, fh->buffer, NULL, 0);
+  }
+  return node_send(fh->ctx, fh->node, fh->id, fh->buffer, NULL, 0);
+}
 
-  /* Flush sys_config.json */
-  if (strcmp(path, "/sys_config.json") == 0) {
-    if (wbuf->size > 0) {
-      printf("Flushing sys_config.json to device (%zu bytes)\n", wbuf->size);
-
-      /* Validate JSON before sending */
-      struct mg_str json_str = mg_str_n(wbuf->data, wbuf->size);
-      int dummy_len = 0;
-      if (mg_json_get(json_str, "$", &dummy_len) < 0) {
-        fprintf(stderr, "Error: Invalid JSON in sys_config.json\n");
-        return -EINVAL;
-      }
+/* Release file - cleanup */
+static int shuse_release(const char *path, struct fuse_file_info *fi) {
+  const char *sub;
+  fuse_context_data_t *ctx = path_device(path, &sub);
+  int id;
+  const vnode_t *node = ctx ? resolve_path(sub, &id) : NULL;
+  if (node && (node->flags & NODE_SCRIPT)) {
+    device_state_release_script_code(ctx->dev_state, id);
+  }
 
-      /* Send to device without updating local state yet.
-       * On success response, auto-refresh will update state with canonical
-       * device data. On error response, local state remains unchanged
-       * (preserves original content). */
-      if (ctx->conn) {
-        int ret = device_state_set_sys_config_from_json(
-            wbuf->data, ctx->req_queue, ctx->conn);
-        if (ret < 0) {
-          fprintf(stderr, "Error: Failed to send sys_config to device\n");
-          return -EIO;
-        }
-        printf("sys_config.json write queued (request ID: %d)\n", ret);
-        printf("Waiting for device response...\n");
-      } else {
-        fprintf(stderr, "Error: Not connected to device\n");
-        return -EIO;
+  if (fi && fi->fh) {
+    file_handle_t *fh = (file_handle_t *) (uintptr_t) fi->fh;
+    if (fh) {
+      if (!fh->group && (fh->node->flags & NODE_POLL)) {
+        poll_handle_close(fh);
+      }
+      if (fh->node == &s_stats_file) {
+        free(fh->snapshot);
       }
+      if (fh->buffer) {
+        write_buffer_destroy(fh->buffer);
+      }
+      free(fh);
     }
-    return 0;
+    fi->fh = 0;
   }
 
-  /* Flush mqtt_config.json */
-  if (strcmp(path, "/mqtt_config.json") == 0) {
-    if (wbuf->size > 0) {
-      printf("Flushing mqtt_config.json to device (%zu bytes)\n", wbuf->size);
+  return 0;
+}
 
-      /* Validate JSON before sending */
-      struct mg_str json_str = mg_str_n(wbuf->data, wbuf->size);
-      int dummy_len = 0;
-      if (mg_json_get(json_str, "$", &dummy_len) < 0) {
-        fprintf(stderr, "Error: Invalid JSON in mqtt_config.json\n");
-        return -EINVAL;
-      }
+/* ============================================================================
+ * KERNEL CACHE INVALIDATION
+ * ============================================================================
+ */
 
-      /* Send to device without updating local state yet.
-       * On success response, auto-refresh will update state with canonical
-       * device data. On error response, local state remains unchanged
-       * (preserves original content). */
-      if (ctx->conn) {
-        int ret = device_state_set_mqtt_config_from_json(
-            wbuf->data, ctx->req_queue, ctx->conn);
-        if (ret < 0) {
-          fprintf(stderr, "Error: Failed to send mqtt_config to device\n");
-          return -EIO;
-        }
-        printf("mqtt_config.json write queued (request ID: %d)\n", ret);
-        printf("Waiting for device response...\n");
-      } else {
-        fprintf(stderr, "Error: Not connected to device\n");
-        return -EIO;
-      }
-    }
-    return 0;
+/* Drop the kernel's cached attributes and pages for one path. Paths the
+ * kernel has not looked up yet are simply not found. */
+static void invalidate_path(const char *path) {
+  pthread_mutex_lock(&g_fuse_handle_mutex);
+  if (g_fuse_handle) {
+    fuse_invalidate_path(g_fuse_handle, path);
   }
+  pthread_mutex_unlock(&g_fuse_handle_mutex);
+}
 
-  /* Flush switch config files */
-  if (strncmp(path, "/switch_", 8) == 0) {
-    if (fh->switch_id >= 0 && wbuf->size > 0) {
-      printf("Flushing switch_%d_config.json to device (%zu bytes)\n",
-             fh->switch_id, wbuf->size);
+/* Invalidate every node under `dir` (whose path is in `path`) affected by a
+ * state change. Per-component nodes are only visited for the changed id, and
+ * not at all for a change without one (id < 0). */
+static void invalidate_nodes(const vnode_t *dir, char *path, size_t size,
+                             size_t path_len, state_change_t what, int id,
+                             unsigned int fields) {
+  for (int i = 0; dir->children[i]; i++) {
+    const vnode_t *child = dir->children[i];
+    if (child->id_max > 0 && id < 0) {
+      continue;
+    }
 
-      /* Validate JSON before sending */
-      struct mg_str json_str = mg_str_n(wbuf->data, wbuf->size);
-      int dummy_len = 0;
-      if (mg_json_get(json_str, "$", &dummy_len) < 0) {
-        fprintf(stderr, "Error: Invalid JSON in switch_%d_config.json\n",
-                fh->switch_id);
-        return -EINVAL;
-      }
+    size_t len = path_len;
+    path[len++] = '/';
+    node_name(child, id, path + len, size - len);
 
-      /* Send to device without updating local state yet.
-       * On success response, auto-refresh will update state with canonical
-       * device data. On error response, local state remains unchanged
-       * (preserves original content). */
-      if (ctx->conn) {
-        int ret = device_state_set_switch_config_from_json(
-            wbuf->data, ctx->req_queue, ctx->conn, fh->switch_id);
-        if (ret < 0) {
-          fprintf(stderr, "Error: Failed to send switch_%d_config to device\n",
-                  fh->switch_id);
-          return -EIO;
-        }
-        printf("switch_%d_config.json write queued (request ID: %d)\n",
-               fh->switch_id, ret);
-        printf("Waiting for device response...\n");
-      } else {
-        fprintf(stderr, "Error: Not connected to device\n");
-        return -EIO;
-      }
+    if (node_affected(child, what, fields)) {
+      invalidate_path(path);
     }
-    return 0;
+    if (child->children) {
+      invalidate_nodes(child, path, size, strlen(path), what, id, fields);
+    }
+    path[path_len] = '\0';
   }
+}
 
-  /* Flush input config files */
-  if (strncmp(path, "/input_", 7) == 0) {
-    if (fh->input_id >= 0 && wbuf->size > 0) {
-      printf("Flushing input_%d_config.json to device (%zu bytes)\n",
-             fh->input_id, wbuf->size);
+/* Device state change hook (`user_data` is the device's context): wake
+ * pollers of the changed files and, with kernel caching, invalidate the files
+ * rendered from the changed part of the state. Runs on the WebSocket thread
+ * after the state lock has been released. */
+static void fuse_state_changed(void *user_data, state_change_t what, int id,
+                               unsigned int fields) {
+  fuse_context_data_t *ctx = (fuse_context_data_t *) user_data;
 
-      /* Validate JSON before sending */
-      struct mg_str json_str = mg_str_n(wbuf->data, wbuf->size);
-      int dummy_len = 0;
-      if (mg_json_get(json_str, "$", &dummy_len) < 0) {
-        fprintf(stderr, "Error: Invalid JSON in input_%d_config.json\n",
-                fh->input_id);
-        return -EINVAL;
-      }
+  poll_wake_change(ctx, what, id, fields);
 
-      /* Send to device without updating local state yet.
-       * On success response, auto-refresh will update state with canonical
-       * device data. On error response, local state remains unchanged
-       * (preserves original content). */
-      if (ctx->conn) {
-        int ret = device_state_set_input_config_from_json(
-            wbuf->data, ctx->req_queue, ctx->conn, fh->input_id);
-        if (ret < 0) {
-          fprintf(stderr, "Error: Failed to send input_%d_config to device\n",
-                  fh->input_id);
-          return -EIO;
-        }
-        printf("input_%d_config.json write queued (request ID: %d)\n",
-               fh->input_id, ret);
-        printf("Waiting for device response...\n");
-      } else {
-        fprintf(stderr, "Error: Not connected to device\n");
-        return -EIO;
-      }
+  if (g_kernel_cache) {
+    char path[192] = "";
+    if (ctx->name) {
+      snprintf(path, sizeof(path), "/%s", ctx->name);
     }
-    return 0;
+    invalidate_nodes(&s_root, path, sizeof(path), strlen(path), what, id,
+                     fields);
   }
+}
 
-  /* Flush script files */
-  if (strncmp(path, "/scripts/", 9) == 0) {
-    if (fh->script_id >= 0 && wbuf->size > 0) {
-      printf("Flushing script %d to device (%zu bytes)\n", fh->script_id,
-             wbuf->size);
-
-      /* Send to device in chunks */
-      if (ctx->conn) {
-        int ret =
-            device_state_put_script_code(ctx->dev_state, ctx->req_queue,
-                                         ctx->conn, fh->script_id, wbuf->data);
-        if (ret < 0) {
-          fprintf(stderr, "Error: Failed to send script %d to device\n",
-                  fh->script_id);
-          return -EIO;
-        }
-        printf("Script %d synced to device (last request ID: %d)\n",
-               fh->script_id, ret);
-      }
-    }
-    return 0;
+#if FUSE_USE_VERSION >= 30
+/* Filesystem init: set the kernel cache timeouts */
+static void *shuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+  (void) conn;
+
+  if (g_kernel_cache) {
+    cfg->attr_timeout = SHUSE_KERNEL_CACHE_TIMEOUT;
+    cfg->entry_timeout = SHUSE_KERNEL_CACHE_TIMEOUT;
+    /* Components can appear at any time; never cache a failed lookup */
+    cfg->negative_timeout = 0;
   }
 
-  /* Flush crontab */
-  if (strcmp(path, "/crontab") == 0) {
-    if (wbuf->size > 0) {
-      printf("Flushing crontab to device (%zu bytes)\n", wbuf->size);
+  return NULL;
+}
+#endif
 
-      if (ctx->conn) {
-        int ret = device_state_sync_crontab(ctx->dev_state, ctx->req_queue,
-                                            ctx->conn, wbuf->data, wbuf->size);
-        if (ret < 0) {
-          fprintf(stderr, "Error: Failed to sync crontab to device\n");
-          return -EIO;
-        }
-        if (ret > 0) {
-          printf("crontab write queued (%d operations)\n", ret);
-          printf("Waiting for device response...\n");
-        } else {
-          printf("crontab unchanged, no operations needed\n");
-        }
-      } else {
-        fprintf(stderr, "Error: Not connected to device\n");
-        return -EIO;
-      }
-    }
-    return 0;
+/* Every operation is counted and timed for /.shusefs/stats: timed_<op>
+ * wraps shuse_<op> */
+#define TIMED_OP(op, which, params, args) \
+  static int timed_##op params {          \
+    uint64_t start = stats_now();         \
+    int ret = shuse_##op args;            \
+    stats_fuse_op(which, start);          \
+    return ret;                           \
+  }
+
+TIMED_OP(getattr, STATS_FUSE_GETATTR,
+         (const char *path, struct stat *stbuf, struct fuse_file_info *fi),
+         (path, stbuf, fi))
+TIMED_OP(readdir, STATS_FUSE_READDIR,
+         (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+          struct fuse_file_info *fi SHUSE_READDIR_FLAGS_PARAM),
+         (path, buf, filler, offset, fi SHUSE_READDIR_FLAGS_ARG))
+TIMED_OP(open, STATS_FUSE_OPEN, (const char *path, struct fuse_file_info *fi),
+         (path, fi))
+TIMED_OP(read, STATS_FUSE_READ,
+         (const char *path, char *buf, size_t size, off_t offset,
+          struct fuse_file_info *fi),
+         (path, buf, size, offset, fi))
+TIMED_OP(write, STATS_FUSE_WRITE,
+         (const char *path, const char *buf, size_t size, off_t offset,
+          struct fuse_file_info *fi),
+         (path, buf, size, offset, fi))
+TIMED_OP(truncate, STATS_FUSE_TRUNCATE,
+         (const char *path, off_t size, struct fuse_file_info *fi),
+         (path, size, fi))
+TIMED_OP(flush, STATS_FUSE_FLUSH, (const char *path, struct fuse_file_info *fi),
+         (path, fi))
+TIMED_OP(release, STATS_FUSE_RELEASE,
+         (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED_OP(poll, STATS_FUSE_POLL,
+         (const char *path, struct fuse_file_info *fi,
+          struct fuse_pollhandle *ph, unsigned *reventsp),
+         (path, fi, ph, reventsp))
+
+/* FUSE operations structure */
+static struct fuse_operations shuse_oper = {
+#if FUSE_USE_VERSION >= 30
+    .init = shuse_init,
+#endif
+    .getattr = timed_getattr,
+    .readdir = timed_readdir,
+    .open = timed_open,
+    .read = timed_read,
+    .write = timed_write,
+    .truncate = timed_truncate,
+    .flush = timed_flush,
+    .release = timed_release,
+    .poll = timed_poll,
+};
+
+/* Add a device to the mount */
+fuse_context_data_t *fuse_ops_add_device(const char *name,
+                                         device_state_t *dev_state,
+                                         request_queue_t *req_queue,
+                                         metrics_cache_t *metrics) {
+  if (!dev_state || !req_queue) {
+    return NULL;
   }
 
-  return 0;
-}
+  /* One device at the root, or any number of named ones */
+  if (g_device_count > 0 && (!name || !g_named)) {
+    log_error(LOG_CAT_MAIN, "Error: Only named devices can share a mount\n");
+    return NULL;
+  }
 
-/* Release file - cleanup */
-static int shuse_release(const char *path, struct fuse_file_info *fi) {
-  /* Release sys_config.json */
-  if (strcmp(path, "/sys_config.json") == 0) {
-    if (fi && fi->fh) {
-      file_handle_t *fh = (file_handle_t *) (uintptr_t) fi->fh;
-      if (fh) {
-        if (fh->buffer) {
-          write_buffer_destroy(fh->buffer);
-        }
-        free(fh);
-      }
-      fi->fh = 0;
-    }
-    return 0;
+  fuse_context_data_t **devices =
+      realloc(g_devices, (g_device_count + 1) * sizeof(*devices));
+  if (!devices) {
+    return NULL;
   }
+  g_devices = devices;
 
-  /* Release mqtt_config.json */
-  if (strcmp(path, "/mqtt_config.json") == 0) {
-    if (fi && fi->fh) {
-      file_handle_t *fh = (file_handle_t *) (uintptr_t) fi->fh;
-      if (fh) {
-        if (fh->buffer) {
-          write_buffer_destroy(fh->buffer);
-        }
-        free(fh);
-      }
-      fi->fh = 0;
-    }
-    return 0;
+  fuse_context_data_t *ctx = calloc(1, sizeof(*ctx));
+  if (!ctx) {
+    return NULL;
   }
+  ctx->name = name;
+  ctx->dev_state = dev_state;
+  ctx->req_queue = req_queue;
+  ctx->metrics = metrics;
 
-  /* Release crontab */
-  if (strcmp(path, "/crontab") == 0) {
-    if (fi && fi->fh) {
-      file_handle_t *fh = (file_handle_t *) (uintptr_t) fi->fh;
-      if (fh) {
-        if (fh->buffer) {
-          write_buffer_destroy(fh->buffer);
-        }
-        free(fh);
-      }
-      fi->fh = 0;
-    }
-    return 0;
+  g_devices[g_device_count++] = ctx;
+  g_named = name != NULL;
+  return ctx;
+}
+
+/* Add a group directory of named devices */
+int fuse_ops_add_group(const char *name, fuse_context_data_t *const *members,
+                       int member_count) {
+  if (!name || !members || member_count < 0 || !g_named) {
+    return -1;
   }
 
-  /* Release switch config files */
-  if (strncmp(path, "/switch_", 8) == 0) {
-    if (fi && fi->fh) {
-      file_handle_t *fh = (file_handle_t *) (uintptr_t) fi->fh;
-      if (fh) {
-        if (fh->buffer) {
-          write_buffer_destroy(fh->buffer);
-        }
-        free(fh);
-      }
-      fi->fh = 0;
-    }
-    return 0;
+  fuse_group_t **groups =
+      realloc(g_groups, (g_group_count + 1) * sizeof(*groups));
+  if (!groups) {
+    return -1;
   }
+  g_groups = groups;
 
-  /* Release script files */
-  if (strncmp(path, "/scripts/", 9) == 0) {
-    if (fi && fi->fh) {
-      file_handle_t *fh = (file_handle_t *) (uintptr_t) fi->fh;
-      if (fh) {
-        if (fh->buffer) {
-          write_buffer_destroy(fh->buffer);
-        }
-        free(fh);
-      }
-      fi->fh = 0;
-    }
-    return 0;
+  fuse_group_t *group = calloc(1, sizeof(*group));
+  if (!group) {
+    return -1;
+  }
+  size_t name_size = strlen(name) + 2;
+  group->name = malloc(name_size);
+  group->members = malloc((member_count + 1) * sizeof(*group->members));
+  if (!group->name || !group->members) {
+    free(group->name);
+    free(group->members);
+    free(group);
+    return -1;
+  }
+  snprintf(group->name, name_size, "@%s", name);
+  memcpy(group->members, members, member_count * sizeof(*members));
+  group->member_count = member_count;
+  pthread_mutex_init(&group->apply_mutex, NULL);
+
+  /* Follow the answers to the requests group writes queue on members */
+  for (int i = 0; i < member_count; i++) {
+    request_queue_set_add_hook(members[i]->req_queue, group_request_added,
+                               members[i]);
+    request_queue_set_retire_hook(members[i]->req_queue,
+                                  group_request_retired, members[i]);
   }
 
+  g_groups[g_group_count++] = group;
   return 0;
 }
 
-/* FUSE operations structure */
-static struct fuse_operations shuse_oper = {
-    .getattr = shuse_getattr,
-    .readdir = shuse_readdir,
-    .open = shuse_open,
-    .read = shuse_read,
-    .write = shuse_write,
-    .truncate = shuse_truncate,
-    .flush = shuse_flush,
-    .release = shuse_release,
-};
+/* Update connection pointer in a device's FUSE context */
+void fuse_ops_update_conn(fuse_context_data_t *dev,
+                          struct mg_connection *conn) {
+  if (dev) {
+    dev->conn = conn;
+  }
+}
 
-/* Initialize FUSE operations with device state */
-int fuse_ops_init(device_state_t *dev_state, request_queue_t *req_queue,
-                  struct mg_connection *conn) {
-  if (!dev_state || !req_queue) {
-    return -1;
+/* Keep or refuse writes made while a device is disconnected */
+void fuse_ops_set_offline_writes(int keep) {
+  g_offline_writes_kept = keep ? 1 : 0;
+}
+
+/* Send the writes kept while a device was disconnected */
+void fuse_ops_send_offline_writes(fuse_context_data_t *dev) {
+  /* Take the device's writes off the list; new ones go straight out */
+  offline_write_t *writes = NULL;
+  pthread_mutex_lock(&g_offline_mutex);
+  for (offline_write_t **p = &g_offline_writes; *p;) {
+    offline_write_t *w = *p;
+    if (w->ctx == dev) {
+      *p = w->next;
+      w->next = writes;
+      writes = w;
+    } else {
+      p = &w->next;
+    }
   }
+  pthread_mutex_unlock(&g_offline_mutex);
 
-  g_fuse_ctx.dev_state = dev_state;
-  g_fuse_ctx.req_queue = req_queue;
-  g_fuse_ctx.conn = conn;
+  while (writes) {
+    offline_write_t *w = writes;
+    writes = w->next;
 
-  return 0;
+    device_state_read_lock(dev->dev_state);
+    int present = node_present(dev, w->node, w->id);
+    device_state_read_unlock(dev->dev_state);
+
+    char name[64];
+    node_name(w->node, w->id, name, sizeof(name));
+    if (!present) {
+      log_info(LOG_CAT_FUSE, "%s is gone, dropping the write kept for it\n",
+               name);
+    } else {
+      log_info(LOG_CAT_FUSE, "Sending %s write kept while disconnected\n",
+               name);
+      write_buffer_t wbuf = {w->data, w->size, w->size + 1};
+      node_send(dev, w->node, w->id, w->node->write ? NULL : &wbuf, w->data,
+                w->size);
+    }
+
+    free(w->data);
+    free(w);
+  }
+}
+
+/* Select multi-threaded or single-threaded FUSE loop */
+void fuse_ops_set_multithreaded(int enable) {
+  g_fuse_multithreaded = enable ? 1 : 0;
 }
 
-/* Update connection pointer in FUSE context */
-void fuse_ops_update_conn(struct mg_connection *conn) {
-  g_fuse_ctx.conn = conn;
+/* Enable or disable kernel attribute and page caching */
+void fuse_ops_set_kernel_cache(int enable) {
+#if FUSE_USE_VERSION >= 30
+  g_kernel_cache = enable ? 1 : 0;
+#else
+  if (enable) {
+    log_warn(LOG_CAT_MAIN,
+             "Warning: Kernel caching needs FUSE 3 path invalidation; "
+             "ignoring\n");
+  }
+#endif
 }
 
 /* Get FUSE operations structure */
@@ -1677,9 +3036,12 @@ static void *fuse_thread_func(void *arg) {
    */
   struct fuse_args args = FUSE_ARGS_INIT(fuse_argc - 1, fuse_argv);
 
-  g_fuse_handle = fuse_new(&args, &shuse_oper, sizeof(shuse_oper), NULL);
+  struct fuse *handle = fuse_new(&args, &shuse_oper, sizeof(shuse_oper), NULL);
+  pthread_mutex_lock(&g_fuse_handle_mutex);
+  g_fuse_handle = handle;
+  pthread_mutex_unlock(&g_fuse_handle_mutex);
   if (!g_fuse_handle) {
-    fprintf(stderr, "Error: Failed to create FUSE handle\n");
+    log_error(LOG_CAT_MAIN, "Error: Failed to create FUSE handle\n");
     for (int i = 0; fuse_argv[i] != NULL; i++) {
       free(fuse_argv[i]);
     }
@@ -1689,10 +3051,12 @@ static void *fuse_thread_func(void *arg) {
 
   /* Mount the filesystem */
   if (fuse_mount(g_fuse_handle, mountpoint) != 0) {
-    fprintf(stderr, "Error: Failed to mount FUSE filesystem at %s\n",
-            mountpoint);
+    log_error(LOG_CAT_MAIN, "Error: Failed to mount FUSE filesystem at %s\n",
+              mountpoint);
+    pthread_mutex_lock(&g_fuse_handle_mutex);
     fuse_destroy(g_fuse_handle);
     g_fuse_handle = NULL;
+    pthread_mutex_unlock(&g_fuse_handle_mutex);
     for (int i = 0; fuse_argv[i] != NULL; i++) {
       free(fuse_argv[i]);
     }
@@ -1700,17 +3064,26 @@ static void *fuse_thread_func(void *arg) {
     return (void *) (long) -1;
   }
 
-  printf("FUSE filesystem mounted at %s\n", mountpoint);
+  log_info(LOG_CAT_MAIN, "FUSE filesystem mounted at %s\n", mountpoint);
 
-  /* Run FUSE event loop (single-threaded) */
-  int ret = fuse_loop(g_fuse_handle);
+  /* Run FUSE event loop */
+  int ret;
+  if (g_fuse_multithreaded) {
+    log_info(LOG_CAT_MAIN, "Running multi-threaded FUSE loop\n");
+    ret = SHUSE_FUSE_LOOP_MT(g_fuse_handle);
+  } else {
+    log_info(LOG_CAT_MAIN, "Running single-threaded FUSE loop\n");
+    ret = fuse_loop(g_fuse_handle);
+  }
 
-  printf("FUSE loop exited with code %d\n", ret);
+  log_info(LOG_CAT_MAIN, "FUSE loop exited with code %d\n", ret);
 
   /* Cleanup */
+  pthread_mutex_lock(&g_fuse_handle_mutex);
   fuse_unmount(g_fuse_handle);
   fuse_destroy(g_fuse_handle);
   g_fuse_handle = NULL;
+  pthread_mutex_unlock(&g_fuse_handle_mutex);
 
   /* Free argv */
   for (int i = 0; fuse_argv[i] != NULL; i++) {
@@ -1722,16 +3095,15 @@ static void *fuse_thread_func(void *arg) {
 }
 
 /* Start FUSE in a separate thread */
-int fuse_start(const char *mountpoint, device_state_t *dev_state,
-               request_queue_t *req_queue, struct mg_connection **conn_ptr,
-               pthread_t *fuse_thread) {
-  if (!mountpoint || !dev_state || !req_queue || !fuse_thread) {
+int fuse_start(const char *mountpoint, pthread_t *fuse_thread) {
+  if (!mountpoint || !fuse_thread || g_device_count == 0) {
     return -1;
   }
 
-  /* Initialize FUSE context */
-  if (fuse_ops_init(dev_state, req_queue, *conn_ptr) != 0) {
-    return -1;
+  /* Wake pollers and invalidate kernel caches as device state changes */
+  for (int i = 0; i < g_device_count; i++) {
+    device_state_set_change_hook(g_devices[i]->dev_state, fuse_state_changed,
+                                 g_devices[i]);
   }
 
   /* Receive pre-built FUSE arguments from caller */
@@ -1754,7 +3126,7 @@ void fuse_stop(const char *mountpoint) {
 
   /* Signal FUSE loop to exit */
   if (g_fuse_handle) {
-    printf("Signaling FUSE to exit...\n");
+    log_info(LOG_CAT_MAIN, "Signaling FUSE to exit...\n");
     fuse_exit(g_fuse_handle);
   }
 }
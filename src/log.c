@@ -0,0 +1,345 @@
+#include "../include/log.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/mongoose.h"
+#include "../include/stats.h"
+
+log_level_t g_log_level[LOG_CAT_COUNT] = {
+    [LOG_CAT_MAIN] = LOG_LEVEL_INFO,  [LOG_CAT_CONN] = LOG_LEVEL_INFO,
+    [LOG_CAT_RPC] = LOG_LEVEL_INFO,   [LOG_CAT_STATE] = LOG_LEVEL_INFO,
+    [LOG_CAT_SCRIPT] = LOG_LEVEL_INFO, [LOG_CAT_FUSE] = LOG_LEVEL_INFO,
+    [LOG_CAT_CACHE] = LOG_LEVEL_INFO, [LOG_CAT_WS] = LOG_LEVEL_INFO,
+};
+
+static const char *const s_level_names[LOG_LEVEL_COUNT] = {
+    [LOG_LEVEL_ERROR] = "error",
+    [LOG_LEVEL_WARN] = "warn",
+    [LOG_LEVEL_INFO] = "info",
+    [LOG_LEVEL_DEBUG] = "debug",
+};
+
+static const char *const s_category_names[LOG_CAT_COUNT] = {
+    [LOG_CAT_MAIN] = "main",   [LOG_CAT_CONN] = "conn",
+    [LOG_CAT_RPC] = "rpc",     [LOG_CAT_STATE] = "state",
+    [LOG_CAT_SCRIPT] = "script", [LOG_CAT_FUSE] = "fuse",
+    [LOG_CAT_CACHE] = "cache", [LOG_CAT_WS] = "ws",
+};
+
+/* ============================================================================
+ * RING BUFFER
+ * ============================================================================
+ *
+ * A bounded multi-producer queue of fixed-size slots (Vyukov's): a producer
+ * claims the slot at `tail` with a compare-and-swap, formats its record into
+ * it and publishes it by advancing the slot's sequence number; the writer
+ * thread, the only consumer, takes slots in order from `head`. A full ring
+ * drops the record rather than wait, and the writer reports how many were
+ * dropped.
+ */
+
+#define LOG_RING_SLOTS 512 /* Power of two */
+
+typedef struct {
+  size_t seq; /* == position when free, position + 1 when published */
+  int to_err; /* Record goes to stderr */
+  size_t len;
+  char text[LOG_RECORD_MAX];
+} log_slot_t;
+
+/* The slots stay allocated once made: after log_stop() a thread may still
+ * be filling one it claimed before. `g_ring` points at them while the writer
+ * thread runs. */
+static log_slot_t *g_slots = NULL;
+static log_slot_t *g_ring = NULL;
+static size_t g_tail = 0; /* Next position to claim */
+static size_t g_head = 0; /* Next position to write out (writer) */
+static unsigned long g_dropped = 0;
+
+/* Waking the writer: it sets `g_waiting` before sleeping in poll() on the
+ * pipe, and the producer that sees it set writes a byte (never blocking:
+ * the pipe is non-blocking, and one byte is enough) */
+static int g_wake_pipe[2] = {-1, -1};
+static int g_waiting = 0;
+static int g_stopping = 0;
+static pthread_t g_writer;
+
+static int ring_available(void) {
+  log_slot_t *slot = &g_ring[g_head & (LOG_RING_SLOTS - 1)];
+  return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == g_head + 1;
+}
+
+/* Claim a slot, or NULL if the ring is full */
+static log_slot_t *ring_claim(size_t *pos) {
+  size_t tail = __atomic_load_n(&g_tail, __ATOMIC_RELAXED);
+  for (;;) {
+    log_slot_t *slot = &g_ring[tail & (LOG_RING_SLOTS - 1)];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq == tail) {
+      if (__atomic_compare_exchange_n(&g_tail, &tail, tail + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *pos = tail;
+        return slot;
+      }
+    } else if ((long) (seq - tail) < 0) {
+      return NULL;
+    } else {
+      tail = __atomic_load_n(&g_tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void ring_publish(log_slot_t *slot, size_t pos) {
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+  /* Pairs with the fence in writer_sleep(): either the writer sees the
+   * record, or we see it waiting */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&g_waiting, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&g_waiting, 0, __ATOMIC_RELAXED)) {
+    char byte = 0;
+    ssize_t n = write(g_wake_pipe[1], &byte, 1);
+    (void) n;
+  }
+}
+
+/* ============================================================================
+ * WRITER THREAD
+ * ============================================================================
+ */
+
+/* Write out every published record. Returns how many there were. */
+static int ring_drain(void) {
+  int written = 0;
+  FILE *last = NULL;
+  while (ring_available()) {
+    log_slot_t *slot = &g_ring[g_head & (LOG_RING_SLOTS - 1)];
+    FILE *out = slot->to_err ? stderr : stdout;
+    /* Keep the order of records across the two streams */
+    if (last && out != last) {
+      fflush(last);
+    }
+    last = out;
+    fwrite(slot->text, 1, slot->len, out);
+    __atomic_store_n(&slot->seq, g_head + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+    g_head++;
+    written++;
+  }
+
+  unsigned long dropped = __atomic_exchange_n(&g_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped > 0) {
+    fprintf(stderr, "Warning: %lu log records dropped (log buffer full)\n",
+            dropped);
+    stats_add(STATS_LOG_DROPPED, dropped);
+  }
+
+  if (written > 0 || dropped > 0) {
+    fflush(stdout);
+    fflush(stderr);
+  }
+  return written;
+}
+
+/* Wait until a producer publishes a record (or log_stop() is called) */
+static void writer_sleep(void) {
+  __atomic_store_n(&g_waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (ring_available() || __atomic_load_n(&g_stopping, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&g_waiting, 0, __ATOMIC_RELAXED);
+    return;
+  }
+
+  struct pollfd pfd = {.fd = g_wake_pipe[0], .events = POLLIN};
+  if (poll(&pfd, 1, -1) > 0) {
+    char buf[64];
+    while (read(g_wake_pipe[0], buf, sizeof(buf)) > 0) {
+    }
+  }
+}
+
+static void *writer_thread_func(void *arg) {
+  (void) arg;
+
+  while (!__atomic_load_n(&g_stopping, __ATOMIC_ACQUIRE)) {
+    if (ring_drain() == 0) {
+      writer_sleep();
+    }
+  }
+  ring_drain();
+  return NULL;
+}
+
+/* ============================================================================
+ * MONGOOSE LOG
+ * ============================================================================
+ *
+ * Mongoose prints its log a character at a time; collect each line and log
+ * it as a record. Its own level (mg_log_set()) follows the "ws" category,
+ * so every line that arrives here is wanted.
+ */
+
+static _Thread_local char t_mg_line[LOG_RECORD_MAX];
+static _Thread_local size_t t_mg_len = 0;
+
+static void mg_log_char(char c, void *param) {
+  (void) param;
+
+  t_mg_line[t_mg_len++] = c;
+  if (c == '\n' || t_mg_len == sizeof(t_mg_line) - 1) {
+    t_mg_line[t_mg_len] = '\0';
+    log_write(LOG_LEVEL_INFO, LOG_CAT_WS, "%s", t_mg_line);
+    t_mg_len = 0;
+  }
+}
+
+/* ============================================================================
+ * PUBLIC API
+ * ============================================================================
+ */
+
+static int parse_level(const char *name, size_t len, log_level_t *level) {
+  for (int i = 0; i < LOG_LEVEL_COUNT; i++) {
+    if (strlen(s_level_names[i]) == len &&
+        strncmp(s_level_names[i], name, len) == 0) {
+      *level = (log_level_t) i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int log_configure(const char *spec) {
+  if (!spec) {
+    return -1;
+  }
+
+  while (*spec) {
+    size_t len = strcspn(spec, ",");
+    const char *eq = memchr(spec, '=', len);
+    log_level_t level;
+
+    if (!eq) {
+      if (parse_level(spec, len, &level) != 0) {
+        return -1;
+      }
+      for (int i = 0; i < LOG_CAT_COUNT; i++) {
+        g_log_level[i] = level;
+      }
+    } else {
+      size_t cat_len = (size_t) (eq - spec);
+      int cat = 0;
+      while (cat < LOG_CAT_COUNT &&
+             (strlen(s_category_names[cat]) != cat_len ||
+              strncmp(s_category_names[cat], spec, cat_len) != 0)) {
+        cat++;
+      }
+      if (cat == LOG_CAT_COUNT ||
+          parse_level(eq + 1, len - cat_len - 1, &level) != 0) {
+        return -1;
+      }
+      g_log_level[cat] = level;
+    }
+
+    spec += len;
+    if (*spec == ',') {
+      spec++;
+    }
+  }
+
+  return 0;
+}
+
+int log_start(void) {
+  static const int mg_levels[LOG_LEVEL_COUNT] = {
+      [LOG_LEVEL_ERROR] = MG_LL_ERROR,
+      [LOG_LEVEL_WARN] = MG_LL_ERROR,
+      [LOG_LEVEL_INFO] = MG_LL_INFO,
+      [LOG_LEVEL_DEBUG] = MG_LL_DEBUG,
+  };
+  mg_log_set(mg_levels[g_log_level[LOG_CAT_WS]]);
+  mg_log_set_fn(mg_log_char, NULL);
+
+  /* Once only: the slots of an earlier run may still be in use */
+  if (g_slots) {
+    return g_ring ? 0 : -1;
+  }
+
+  g_slots = calloc(LOG_RING_SLOTS, sizeof(log_slot_t));
+  if (!g_slots) {
+    return -1;
+  }
+  for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+    g_slots[i].seq = i;
+  }
+
+  if (pipe(g_wake_pipe) != 0) {
+    return -1;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(g_wake_pipe[i], F_SETFL, fcntl(g_wake_pipe[i], F_GETFL) | O_NONBLOCK);
+  }
+
+  __atomic_store_n(&g_ring, g_slots, __ATOMIC_RELEASE);
+  if (pthread_create(&g_writer, NULL, writer_thread_func, NULL) != 0) {
+    __atomic_store_n(&g_ring, NULL, __ATOMIC_RELEASE);
+    return -1;
+  }
+
+  return 0;
+}
+
+void log_stop(void) {
+  if (!__atomic_load_n(&g_ring, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  __atomic_store_n(&g_stopping, 1, __ATOMIC_RELEASE);
+  char byte = 0;
+  ssize_t n = write(g_wake_pipe[1], &byte, 1);
+  (void) n;
+  pthread_join(g_writer, NULL);
+
+  /* Later records are written directly */
+  __atomic_store_n(&g_ring, NULL, __ATOMIC_RELEASE);
+}
+
+void log_write(log_level_t level, log_category_t cat, const char *fmt, ...) {
+  (void) cat;
+  int to_err = level <= LOG_LEVEL_WARN;
+  va_list ap;
+
+  log_slot_t *ring = __atomic_load_n(&g_ring, __ATOMIC_ACQUIRE);
+  if (!ring) {
+    va_start(ap, fmt);
+    vfprintf(to_err ? stderr : stdout, fmt, ap);
+    va_end(ap);
+    return;
+  }
+
+  size_t pos;
+  log_slot_t *slot = ring_claim(&pos);
+  if (!slot) {
+    __atomic_fetch_add(&g_dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  va_start(ap, fmt);
+  int len = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+  va_end(ap);
+  if (len < 0) {
+    len = 0;
+  } else if ((size_t) len >= sizeof(slot->text)) {
+    /* Cut, keeping the line ending */
+    len = sizeof(slot->text) - 1;
+    memcpy(slot->text + len - 4, "...\n", 4);
+  }
+
+  slot->len = (size_t) len;
+  slot->to_err = to_err;
+  ring_publish(slot, pos);
+}
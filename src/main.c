@@ -1,507 +1,982 @@
-#include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#include "../include/device_list.h"
 #include "../include/device_state.h"
 #include "../include/fuse_ops.h"
+#include "../include/log.h"
+#include "../include/metrics.h"
 #include "../include/mongoose.h"
 #include "../include/request_queue.h"
+#include "../include/state_cache.h"
+#include "../include/stats.h"
 
-#define WS_URL_MAX 256
+#define WS_URL_MAX DEVICE_URL_MAX
 
+/* Poll timeout of the event loop. Queued requests wake the loop immediately
+ * via mg_wakeup(), so this only paces timeout housekeeping. */
+#define WS_POLL_INTERVAL_MS 1000
+#define TIMEOUT_CLEANUP_INTERVAL_SEC 10
+
+/* Reconnect backoff: the delay doubles from MIN to MAX with every failed
+ * attempt, and starts over once a connection has stayed up for STABLE. Each
+ * delay is drawn from its upper half, so devices that dropped together do
+ * not all come back at the same moment. */
+#define RECONNECT_MIN_MS 1000
+#define RECONNECT_MAX_MS 60000
+#define RECONNECT_STABLE_MS 30000
+
+struct ws_app;
+
+/* One device: its connection, request queue and state */
 struct ws_context {
+  struct ws_app *app;
+  const char *name; /* Directory under the mountpoint, NULL if at its root */
   char url[WS_URL_MAX];
-  struct mg_mgr *mgr;
+  struct mg_mgr *mgr; /* The event loop shared by all devices */
   struct mg_connection *conn;
+  /* Mongoose ID of conn, 0 while not connected. Read by ws_wakeup() on the
+   * queuing threads, so accessed atomically; a non-zero value also means
+   * the event loop is initialized. */
+  unsigned long conn_id;
   request_queue_t *req_queue;
   device_state_t *dev_state;
+  fuse_context_data_t *fuse_dev; /* The device in the mount */
   int connected;
   int error;
+
+  /* Reconnecting: current backoff, when the next attempt is due (0: none
+   * pending), and when the current connection opened */
+  int backoff_ms;
+  uint64_t reconnect_at;
+  uint64_t connected_at;
+
+  /* State cache (-c): snapshot file, empty if disabled */
+  char cache_path[PATH_MAX];
+  int cache_dirty; /* Cached state changed since the last save */
+  /* State came from the cache or an earlier connection and awaits
+   * revalidation */
+  int warm_start;
+
+  /* Metrics render cache, shared by /metrics and the HTTP listener (-m) */
+  metrics_cache_t metrics;
+};
+
+/* The process: one event loop and one mount serving every device */
+struct ws_app {
+  struct ws_context *devices;
+  int device_count;
+  int named; /* Devices come from -f and are mounted under /<name> */
+  /* Initialized and freed by the event loop thread; its address is handed
+   * to the devices before any other thread starts */
+  struct mg_mgr mgr;
   int fuse_started;
   char *mountpoint;
-  pthread_t *fuse_thread;
+  const char *metrics_url; /* Listen URL for -m, NULL if disabled */
+};
+
+/* Command line settings applied to every device */
+struct device_options {
+  int fetch_window;
+  int lazy_scripts;
+  int evict_idle_sec;
+  const char *cache_dir;
+  int history_depth;
+  int debounce_ms;
 };
 
+static void ws_event_handler(struct mg_connection *c, int ev, void *ev_data);
+
 static int s_signo = 0;
-static struct ws_context *g_ctx = NULL;
+static struct ws_app *g_app = NULL;
 
 static void signal_handler(int signo) {
   s_signo = signo;
 
   /* Unmount FUSE if it was started, so the FUSE thread can exit */
-  if (g_ctx && g_ctx->fuse_started && g_ctx->mountpoint) {
-    printf("\nReceived signal %d, unmounting FUSE...\n", signo);
-    fuse_stop(g_ctx->mountpoint);
+  if (g_app && g_app->fuse_started && g_app->mountpoint) {
+    log_info(LOG_CAT_MAIN, "\nReceived signal %d, unmounting FUSE...\n", signo);
+    fuse_stop(g_app->mountpoint);
   }
 }
 
-static void handle_unsolicited_message(const char *msg, size_t len,
-                                       void *user_data) {
+/* Request queue hook: runs on whichever thread queued the request and pokes
+ * the event loop out of mg_mgr_poll() so the request is sent right away */
+static void ws_wakeup(void *user_data) {
   struct ws_context *ctx = (struct ws_context *) user_data;
 
+  unsigned long conn_id = __atomic_load_n(&ctx->conn_id, __ATOMIC_ACQUIRE);
+  if (conn_id != 0) {
+    mg_wakeup(ctx->mgr, conn_id, "", 0);
+  }
+}
+
+/* Send every queued request over the WebSocket (event loop thread only) */
+static void ws_send_queued(struct ws_context *ctx) {
+  if (!ctx->conn || !ctx->connected) {
+    return;
+  }
+
+  char *request_data = NULL;
+  int req_id = 0;
+
+  while (request_queue_get_next_to_send(ctx->req_queue, &request_data,
+                                        &req_id) == 0) {
+    if (request_data) {
+      /* Send the request over WebSocket */
+      if (jsonrpc_send_request(ctx->conn, request_data) == 0) {
+        /* Mark as sent (transitions to PENDING state) */
+        request_queue_mark_sent(ctx->req_queue, req_id);
+      } else {
+        log_error(LOG_CAT_RPC, "Error: Failed to send request ID %d\n", req_id);
+        break; /* Stop trying to send more if one fails */
+      }
+    }
+  }
+}
+
+static void handle_unsolicited_message(struct ws_context *ctx,
+                                       const jsonrpc_frame_t *frame) {
+  /* Status deltas, and config changes that carry their values, are applied
+   * in place; other config changes come back as flags */
+  notification_result_t result;
+  uint64_t start = stats_now();
+  int ret = device_state_apply_notification(ctx->dev_state, frame, &result);
+  stats_notification(stats_now() - start);
+  if (ret != 0) {
+    return;
+  }
+
+  if (result.deltas_applied > 0 && ctx->cache_path[0]) {
+    ctx->cache_dirty = 1;
+  }
+
   /* Check if this is a system configuration change notification */
-  if (device_state_is_sys_config_notification(msg, len)) {
-    printf("System configuration changed, refreshing...\n");
+  if (result.sys_config_changed) {
+    log_info(LOG_CAT_STATE, "System configuration changed, refreshing...\n");
     /* Request updated configuration from device */
     device_state_request_sys_config(ctx->dev_state, ctx->req_queue, ctx->conn);
   }
 
   /* Check if this is an MQTT configuration change notification */
-  if (device_state_is_mqtt_config_notification(msg, len)) {
-    printf("MQTT configuration changed, refreshing...\n");
+  if (result.mqtt_config_changed) {
+    log_info(LOG_CAT_STATE, "MQTT configuration changed, refreshing...\n");
     /* Request updated configuration from device */
     device_state_request_mqtt_config(ctx->dev_state, ctx->req_queue, ctx->conn);
   }
 
-  /* Check if this is a switch configuration change notification */
-  if (device_state_is_switch_config_notification(msg, len, -1)) {
-    /* For now, refresh all switches when any switch changes
-     * TODO: Extract specific switch ID from notification and refresh only that
-     * switch */
-    printf("Switch configuration changed, refreshing all switches...\n");
-    for (int i = 0; i < MAX_SWITCHES; i++) {
-      switch_config_t *sw = device_state_get_switch(ctx->dev_state, i);
-      if (sw && sw->valid) {
-        device_state_request_switch_config(ctx->dev_state, ctx->req_queue,
-                                           ctx->conn, i);
+  /* Config change events name the component, so refresh just those */
+  for (int i = 0; i < MAX_SWITCHES; i++) {
+    if (result.switch_config_changed & (1u << i)) {
+      log_info(LOG_CAT_STATE,
+               "Switch %d configuration changed, refreshing...\n", i);
+      device_state_request_switch_config(ctx->dev_state, ctx->req_queue,
+                                         ctx->conn, i);
+    }
+  }
+
+  for (int i = 0; i < MAX_INPUTS; i++) {
+    if (result.input_config_changed & (1u << i)) {
+      log_info(LOG_CAT_STATE, "Input %d configuration changed, refreshing...\n",
+               i);
+      device_state_request_input_config(ctx->dev_state, ctx->req_queue,
+                                        ctx->conn, i);
+    }
+  }
+}
+
+/* ============================================================================
+ * RESPONSE HANDLERS
+ * ============================================================================
+ */
+
+/* Applies one response to device state. `desc` is the descriptor the request
+ * was queued with, `msg` the classified response, whose spans point into the
+ * WebSocket receive buffer for the duration of the call. */
+typedef void (*response_handler_t)(struct ws_context *ctx, int msg_id,
+                                   const request_desc_t *desc,
+                                   const jsonrpc_frame_t *msg);
+
+static void on_sys_getconfig(struct ws_context *ctx, int msg_id,
+                             const request_desc_t *desc,
+                             const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  (void) desc;
+  device_state_update_sys_config(ctx->dev_state, msg);
+}
+
+static void on_sys_setconfig(struct ws_context *ctx, int msg_id,
+                             const request_desc_t *desc,
+                             const jsonrpc_frame_t *msg) {
+  (void) ctx;
+  (void) msg_id;
+  (void) desc;
+
+  /* Check if response contains error */
+  char error_msg[256];
+  if (jsonrpc_is_error(msg, error_msg, sizeof(error_msg))) {
+    log_error(LOG_CAT_STATE, "Error setting system configuration: %s\n",
+              error_msg);
+    log_error(LOG_CAT_STATE, "Original configuration preserved.\n");
+  } else {
+    /* The sent keys are merged into the stored config on completion */
+    log_debug(LOG_CAT_STATE, "System configuration set successfully\n");
+  }
+}
+
+static void on_mqtt_getconfig(struct ws_context *ctx, int msg_id,
+                              const request_desc_t *desc,
+                              const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  (void) desc;
+  device_state_update_mqtt_config(ctx->dev_state, msg);
+}
+
+static void on_mqtt_setconfig(struct ws_context *ctx, int msg_id,
+                              const request_desc_t *desc,
+                              const jsonrpc_frame_t *msg) {
+  (void) ctx;
+  (void) msg_id;
+  (void) desc;
+
+  /* Check if response contains error */
+  char error_msg[256];
+  if (jsonrpc_is_error(msg, error_msg, sizeof(error_msg))) {
+    log_error(LOG_CAT_STATE, "Error setting MQTT configuration: %s\n",
+              error_msg);
+    log_error(LOG_CAT_STATE, "Original configuration preserved.\n");
+  } else {
+    /* The sent keys are merged into the stored config on completion */
+    log_debug(LOG_CAT_STATE, "MQTT configuration set successfully\n");
+  }
+}
+
+static void on_switch_getconfig(struct ws_context *ctx, int msg_id,
+                                const request_desc_t *desc,
+                                const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  if (desc->component_id >= 0) {
+    device_state_update_switch_config(ctx->dev_state, msg,
+                                      desc->component_id);
+  }
+}
+
+static void on_switch_setconfig(struct ws_context *ctx, int msg_id,
+                                const request_desc_t *desc,
+                                const jsonrpc_frame_t *msg) {
+  (void) ctx;
+  (void) msg_id;
+  int switch_id = desc->component_id;
+  if (switch_id < 0) {
+    return;
+  }
+
+  /* Check if response contains error */
+  char error_msg[256];
+  if (jsonrpc_is_error(msg, error_msg, sizeof(error_msg))) {
+    log_error(LOG_CAT_STATE, "Error setting switch %d configuration: %s\n",
+              switch_id, error_msg);
+    log_error(LOG_CAT_STATE, "Original configuration preserved.\n");
+  } else {
+    /* The sent keys are merged into the stored config on completion */
+    log_debug(LOG_CAT_STATE, "Switch %d configuration set successfully\n",
+              switch_id);
+  }
+}
+
+static void on_switch_set(struct ws_context *ctx, int msg_id,
+                          const request_desc_t *desc,
+                          const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  int switch_id = desc->component_id;
+  if (switch_id < 0) {
+    return;
+  }
+
+  /* Check if response contains error */
+  char error_msg[256];
+  if (jsonrpc_is_error(msg, error_msg, sizeof(error_msg))) {
+    log_error(LOG_CAT_STATE, "Error setting switch %d state: %s\n", switch_id,
+              error_msg);
+  } else {
+    log_debug(LOG_CAT_STATE, "Switch %d state set successfully\n", switch_id);
+    /* Response contains the current switch status, update it */
+    device_state_update_switch_status(ctx->dev_state, msg, switch_id);
+  }
+}
+
+static void on_switch_getstatus(struct ws_context *ctx, int msg_id,
+                                const request_desc_t *desc,
+                                const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  if (desc->component_id >= 0) {
+    device_state_update_switch_status(ctx->dev_state, msg,
+                                      desc->component_id);
+  }
+}
+
+static void on_input_getconfig(struct ws_context *ctx, int msg_id,
+                               const request_desc_t *desc,
+                               const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  if (desc->component_id >= 0) {
+    device_state_update_input_config(ctx->dev_state, msg, desc->component_id);
+  }
+}
+
+static void on_input_setconfig(struct ws_context *ctx, int msg_id,
+                               const request_desc_t *desc,
+                               const jsonrpc_frame_t *msg) {
+  (void) ctx;
+  (void) msg_id;
+  int input_id = desc->component_id;
+  if (input_id < 0) {
+    return;
+  }
+
+  /* Check if response contains error */
+  char error_msg[256];
+  if (jsonrpc_is_error(msg, error_msg, sizeof(error_msg))) {
+    log_error(LOG_CAT_STATE, "Error setting input %d configuration: %s\n",
+              input_id, error_msg);
+    log_error(LOG_CAT_STATE, "Original configuration preserved.\n");
+  } else {
+    /* The sent keys are merged into the stored config on completion */
+    log_debug(LOG_CAT_STATE, "Input %d configuration set successfully\n",
+              input_id);
+  }
+}
+
+static void on_input_getstatus(struct ws_context *ctx, int msg_id,
+                               const request_desc_t *desc,
+                               const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  if (desc->component_id >= 0) {
+    device_state_update_input_status(ctx->dev_state, msg, desc->component_id);
+  }
+}
+
+static void on_script_list(struct ws_context *ctx, int msg_id,
+                           const request_desc_t *desc,
+                           const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  (void) desc;
+
+  /* Update script list and request code for all scripts; chunks are
+   * pipelined within the fetch window. In lazy mode code is fetched when a
+   * script is first opened instead. */
+  int script_count = device_state_update_script_list(ctx->dev_state, msg);
+  if (script_count > 0 && ctx->dev_state->scripts.lazy) {
+    log_info(LOG_CAT_SCRIPT,
+             "Found %d scripts, code will be loaded on first open\n",
+             script_count);
+  } else if (script_count > 0) {
+    log_info(LOG_CAT_SCRIPT, "Found %d scripts, requesting code...\n",
+             script_count);
+    for (int i = 0; i < MAX_SCRIPTS; i++) {
+      script_entry_t *script = device_state_get_script(ctx->dev_state, i);
+      if (script && script->valid) {
+        device_state_request_script_code(ctx->dev_state, ctx->req_queue,
+                                         ctx->conn, i);
       }
     }
   }
+}
+
+static void on_script_getcode(struct ws_context *ctx, int msg_id,
+                              const request_desc_t *desc,
+                              const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  int script_id = desc->component_id;
+  if (script_id < 0) {
+    return;
+  }
+
+  /* Apply this chunk; 1 means the script is complete */
+  int complete = device_state_update_script_code(ctx->dev_state, msg, desc);
+  if (complete == 1) {
+    device_state_finalize_script_code(ctx->dev_state, script_id);
+  }
+  /* < 0 means error, already logged */
+
+  /* Refill the fetch window with whatever chunks are due next */
+  int active = device_state_pump_script_code(ctx->dev_state, ctx->req_queue);
+  if (complete == 1 && active == 0) {
+    log_info(LOG_CAT_SCRIPT, "All script code retrieved successfully\n");
+  }
+}
+
+static void on_script_putcode(struct ws_context *ctx, int msg_id,
+                              const request_desc_t *desc,
+                              const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  int script_id = desc->component_id;
+  if (script_id < 0) {
+    return;
+  }
+
+  /* Apply the chunk acknowledgement (errors are logged and retried) */
+  int ret = device_state_update_script_upload(ctx->dev_state, msg, desc);
+  if (ret == 1) {
+    log_info(LOG_CAT_SCRIPT,
+             "Script %d upload complete, refreshing from device...\n",
+             script_id);
+  } else if (ret < 0) {
+    log_error(LOG_CAT_SCRIPT,
+              "Script %d upload failed, restoring from device...\n", script_id);
+  }
+
+  /* Keep the upload window full; on completion or failure the script is
+   * re-requested to get the canonical version from the device */
+  device_state_pump_script_upload(ctx->dev_state, ctx->req_queue);
+  device_state_pump_script_code(ctx->dev_state, ctx->req_queue);
+}
+
+static void on_schedule_list(struct ws_context *ctx, int msg_id,
+                             const request_desc_t *desc,
+                             const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  (void) desc;
+
+  int schedule_count = device_state_update_schedule_list(ctx->dev_state, msg);
+  if (schedule_count >= 0) {
+    log_info(LOG_CAT_STATE, "Loaded %d schedules\n", schedule_count);
+  }
+}
+
+/* Schedule.Create / Schedule.Update / Schedule.Delete */
+static void on_schedule_modified(struct ws_context *ctx, int msg_id,
+                                 const request_desc_t *desc,
+                                 const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  (void) desc;
+
+  (void) ctx;
+
+  /* The list is refreshed once the whole batch has completed (see
+   * device_state_sync_crontab()) */
+  char error_msg[256];
+  if (jsonrpc_is_error(msg, error_msg, sizeof(error_msg))) {
+    log_error(LOG_CAT_STATE, "Schedule operation failed: %s\n", error_msg);
+  } else {
+    log_debug(LOG_CAT_STATE, "Schedule modified\n");
+  }
+}
+
+/* Fallback for firmware without Shelly.GetConfig: fetch sys and mqtt, and
+ * probe the common switch/input IDs one by one. Most Shelly devices have 1-4
+ * switches and 0-4 inputs. */
+static void request_components_individually(struct ws_context *ctx) {
+  device_state_request_sys_config(ctx->dev_state, ctx->req_queue, ctx->conn);
+  device_state_request_mqtt_config(ctx->dev_state, ctx->req_queue, ctx->conn);
+
+  for (int i = 0; i < 4; i++) {
+    device_state_request_switch_config(ctx->dev_state, ctx->req_queue,
+                                       ctx->conn, i);
+    device_state_request_switch_status(ctx->dev_state, ctx->req_queue,
+                                       ctx->conn, i);
+  }
+
+  for (int i = 0; i < 4; i++) {
+    device_state_request_input_config(ctx->dev_state, ctx->req_queue,
+                                      ctx->conn, i);
+    device_state_request_input_status(ctx->dev_state, ctx->req_queue,
+                                      ctx->conn, i);
+  }
+}
+
+static void on_shelly_getconfig(struct ws_context *ctx, int msg_id,
+                                const request_desc_t *desc,
+                                const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  (void) desc;
+
+  discovery_result_t found;
+  if (device_state_update_device_config(ctx->dev_state, msg, &found) != 0) {
+    log_info(LOG_CAT_STATE,
+             "Shelly.GetConfig unavailable, probing components...\n");
+    request_components_individually(ctx);
+    return;
+  }
+
+  int switches = 0, inputs = 0;
+  for (int i = 0; i < MAX_SWITCHES; i++) {
+    switches += (found.switches >> i) & 1u;
+  }
+  for (int i = 0; i < MAX_INPUTS; i++) {
+    inputs += (found.inputs >> i) & 1u;
+  }
+  log_info(LOG_CAT_STATE, "Discovered %d switches and %d inputs\n", switches,
+           inputs);
 
-  /* Check if this is a script status notification */
-  if (device_state_is_script_status_notification(msg, len)) {
-    /* Update script runtime status */
-    device_state_update_script_status(ctx->dev_state, msg, len);
+  /* Every device has these, but fetch them directly if missing */
+  if (!found.has_sys) {
+    device_state_request_sys_config(ctx->dev_state, ctx->req_queue, ctx->conn);
+  }
+  if (!found.has_mqtt) {
+    device_state_request_mqtt_config(ctx->dev_state, ctx->req_queue,
+                                     ctx->conn);
   }
+}
 
-  /* Check if this is a switch status notification */
-  if (device_state_is_switch_status_notification(msg, len)) {
-    /* Update switch status directly from notification */
-    device_state_update_switch_status_from_notification(ctx->dev_state, msg);
+/* First status after a warm start: fetch again only what the device's
+ * revisions say has changed since the cache was written */
+static void revalidate_cached_state(struct ws_context *ctx, int have_status) {
+  device_state_t *state = ctx->dev_state;
+  ctx->warm_start = 0;
+
+  int cached_cfg_rev = state->sys_config.parsed.cfg_rev;
+  if (!have_status || state->device_cfg_rev < 0 ||
+      state->device_cfg_rev != cached_cfg_rev) {
+    log_info(LOG_CAT_STATE,
+             "Config revision changed (cached %d, device %d), refreshing...\n",
+             cached_cfg_rev, state->device_cfg_rev);
+    device_state_request_device_config(state, ctx->req_queue, ctx->conn);
+    /* Again, for components the new config adds */
+    device_state_request_device_status(state, ctx->req_queue, ctx->conn);
+  } else {
+    log_debug(LOG_CAT_STATE, "Cached configuration is current (cfg_rev %d)\n",
+              cached_cfg_rev);
   }
 
-  /* Check if this is an input status notification */
-  if (device_state_is_input_status_notification(msg, len)) {
-    /* Update input status directly from notification */
-    device_state_update_input_status_from_notification(ctx->dev_state, msg);
+  if (!have_status || state->device_schedule_rev < 0 ||
+      state->device_schedule_rev != state->schedules.rev) {
+    device_state_request_schedule_list(state, ctx->req_queue, ctx->conn);
+  } else {
+    log_debug(LOG_CAT_STATE, "Cached schedules are current (rev %d)\n",
+              state->schedules.rev);
   }
 }
 
+static void on_shelly_getstatus(struct ws_context *ctx, int msg_id,
+                                const request_desc_t *desc,
+                                const jsonrpc_frame_t *msg) {
+  (void) msg_id;
+  (void) desc;
+
+  int applied = device_state_update_device_status(ctx->dev_state, msg);
+  if (ctx->warm_start) {
+    revalidate_cached_state(ctx, applied >= 0);
+  }
+  if (applied >= 0) {
+    return;
+  }
+
+  /* Without Shelly.GetStatus, ask each discovered component. Components
+   * probed by the Shelly.GetConfig fallback request their own status. */
+  for (int i = 0; i < MAX_SWITCHES; i++) {
+    switch_config_t *sw = device_state_get_switch(ctx->dev_state, i);
+    if (sw && sw->valid) {
+      device_state_request_switch_status(ctx->dev_state, ctx->req_queue,
+                                         ctx->conn, i);
+    }
+  }
+  for (int i = 0; i < MAX_INPUTS; i++) {
+    input_config_t *inp = device_state_get_input(ctx->dev_state, i);
+    if (inp && inp->valid) {
+      device_state_request_input_status(ctx->dev_state, ctx->req_queue,
+                                        ctx->conn, i);
+    }
+  }
+}
+
+/* Per-method response handlers, indexed by request_desc_t.method. Methods
+ * without an entry (Script.Create/Delete, other calls) need no state
+ * update. */
+static const response_handler_t s_response_handlers[RESPONSE_TYPE_COUNT] = {
+    [RESPONSE_TYPE_SYS_GETCONFIG] = on_sys_getconfig,
+    [RESPONSE_TYPE_SYS_SETCONFIG] = on_sys_setconfig,
+    [RESPONSE_TYPE_MQTT_GETCONFIG] = on_mqtt_getconfig,
+    [RESPONSE_TYPE_MQTT_SETCONFIG] = on_mqtt_setconfig,
+    [RESPONSE_TYPE_SWITCH_GETCONFIG] = on_switch_getconfig,
+    [RESPONSE_TYPE_SWITCH_SETCONFIG] = on_switch_setconfig,
+    [RESPONSE_TYPE_SWITCH_SET] = on_switch_set,
+    [RESPONSE_TYPE_SWITCH_GETSTATUS] = on_switch_getstatus,
+    [RESPONSE_TYPE_INPUT_GETCONFIG] = on_input_getconfig,
+    [RESPONSE_TYPE_INPUT_SETCONFIG] = on_input_setconfig,
+    [RESPONSE_TYPE_INPUT_GETSTATUS] = on_input_getstatus,
+    [RESPONSE_TYPE_SCRIPT_LIST] = on_script_list,
+    [RESPONSE_TYPE_SCRIPT_GETCODE] = on_script_getcode,
+    [RESPONSE_TYPE_SCRIPT_PUTCODE] = on_script_putcode,
+    [RESPONSE_TYPE_SCHEDULE_LIST] = on_schedule_list,
+    [RESPONSE_TYPE_SCHEDULE_CREATE] = on_schedule_modified,
+    [RESPONSE_TYPE_SCHEDULE_UPDATE] = on_schedule_modified,
+    [RESPONSE_TYPE_SCHEDULE_DELETE] = on_schedule_modified,
+    [RESPONSE_TYPE_SHELLY_GETCONFIG] = on_shelly_getconfig,
+    [RESPONSE_TYPE_SHELLY_GETSTATUS] = on_shelly_getstatus,
+};
+
+/* Responses that change what the state cache holds (configs, script list
+ * and code, schedules; not live status) */
+static int response_changes_cache(int method) {
+  switch (method) {
+    case RESPONSE_TYPE_SYS_GETCONFIG:
+    case RESPONSE_TYPE_MQTT_GETCONFIG:
+    case RESPONSE_TYPE_SWITCH_GETCONFIG:
+    case RESPONSE_TYPE_INPUT_GETCONFIG:
+    case RESPONSE_TYPE_SYS_SETCONFIG:
+    case RESPONSE_TYPE_MQTT_SETCONFIG:
+    case RESPONSE_TYPE_SWITCH_SETCONFIG:
+    case RESPONSE_TYPE_INPUT_SETCONFIG:
+    case RESPONSE_TYPE_SHELLY_GETCONFIG:
+    case RESPONSE_TYPE_SCRIPT_LIST:
+    case RESPONSE_TYPE_SCRIPT_GETCODE:
+    case RESPONSE_TYPE_SCHEDULE_LIST: return 1;
+    default: return 0;
+  }
+}
+
+/* Write the state cache if anything it holds has changed */
+static void save_state_cache(struct ws_context *ctx) {
+  if (!ctx->cache_path[0] || !ctx->cache_dirty) {
+    return;
+  }
+  if (state_cache_save(ctx->dev_state, ctx->cache_path) == 0) {
+    ctx->cache_dirty = 0;
+  }
+}
+
+/* Plan the next connection attempt, one backoff delay from now */
+static void schedule_reconnect(struct ws_context *ctx) {
+  if (ctx->backoff_ms < RECONNECT_MIN_MS) {
+    ctx->backoff_ms = RECONNECT_MIN_MS;
+  }
+
+  uint32_t jitter = 0;
+  mg_random(&jitter, sizeof(jitter));
+  int delay_ms = ctx->backoff_ms / 2 + (int) (jitter % (ctx->backoff_ms / 2));
+  ctx->reconnect_at = mg_millis() + (uint64_t) delay_ms;
+  log_info(LOG_CAT_CONN, "Reconnecting to %s in %.1f s\n", ctx->url,
+           delay_ms / 1000.0);
+
+  ctx->backoff_ms *= 2;
+  if (ctx->backoff_ms > RECONNECT_MAX_MS) {
+    ctx->backoff_ms = RECONNECT_MAX_MS;
+  }
+}
+
+/* Open the WebSocket connection to a device. Returns 0 if the attempt is
+ * under way, -1 if it could not be started. */
+static int device_connect(struct ws_context *ctx) {
+  ctx->reconnect_at = 0;
+  log_info(LOG_CAT_CONN, "Connecting to %s\n", ctx->url);
+  ctx->conn = mg_ws_connect(ctx->mgr, ctx->url, ws_event_handler, ctx, NULL);
+  if (!ctx->conn) {
+    log_error(LOG_CAT_CONN,
+              "Error: Failed to create WebSocket connection to %s\n", ctx->url);
+    ctx->error = 1;
+    return -1;
+  }
+  return 0;
+}
+
 static void ws_event_handler(struct mg_connection *c, int ev, void *ev_data) {
   struct ws_context *ctx = (struct ws_context *) c->fn_data;
 
   switch (ev) {
     case MG_EV_ERROR:
-      fprintf(stderr, "Error: %s\n", (char *) ev_data);
+      log_error(LOG_CAT_CONN, "Error: %s: %s\n", ctx->url, (char *) ev_data);
       ctx->error = 1;
       ctx->connected = 0;
       break;
 
     case MG_EV_WS_OPEN:
-      printf("WebSocket connection established to %s\n", ctx->url);
+      log_info(LOG_CAT_CONN, "WebSocket connection established to %s\n",
+               ctx->url);
       ctx->connected = 1;
       ctx->error = 0;
       ctx->conn = c;
+      __atomic_store_n(&ctx->conn_id, c->id, __ATOMIC_RELEASE);
+      ctx->connected_at = mg_millis();
+      stats_add(STATS_CONNECTS, 1);
 
       /* Update FUSE context with connection pointer */
-      if (ctx->fuse_started) {
-        fuse_ops_update_conn(c);
+      fuse_ops_update_conn(ctx->fuse_dev, c);
+
+      if (ctx->warm_start) {
+        /* State came from the cache or the last connection: the status
+         * carries the revisions that tell whether configs and schedules
+         * must be fetched again */
+        log_info(LOG_CAT_CONN, "Revalidating cached device state...\n");
+        device_state_request_device_status(ctx->dev_state, ctx->req_queue, c);
+        device_state_request_script_list(ctx->dev_state, ctx->req_queue, c);
+        fuse_ops_send_offline_writes(ctx->fuse_dev);
+        ws_send_queued(ctx);
+        break;
       }
 
-      /* Request initial device configuration state */
-      printf("Requesting initial device configuration...\n");
-      device_state_request_sys_config(ctx->dev_state, ctx->req_queue, c);
-      device_state_request_mqtt_config(ctx->dev_state, ctx->req_queue, c);
+      /* Request initial device state. Shelly.GetConfig/GetStatus cover every
+       * component in two calls; the device answers in order, so the config
+       * (which marks components valid) lands before the status. */
+      log_info(LOG_CAT_CONN, "Requesting initial device configuration...\n");
+      device_state_request_device_config(ctx->dev_state, ctx->req_queue, c);
+      device_state_request_device_status(ctx->dev_state, ctx->req_queue, c);
       device_state_request_script_list(ctx->dev_state, ctx->req_queue, c);
       device_state_request_schedule_list(ctx->dev_state, ctx->req_queue, c);
+      fuse_ops_send_offline_writes(ctx->fuse_dev);
+      ws_send_queued(ctx);
+      break;
 
-      /* Request switch configurations for common switch IDs
-       * Most Shelly devices have 1-4 switches, but we'll try 0-3 */
-      for (int i = 0; i < 4; i++) {
-        device_state_request_switch_config(ctx->dev_state, ctx->req_queue, c,
-                                           i);
-        /* Also request initial switch status */
-        device_state_request_switch_status(ctx->dev_state, ctx->req_queue, c,
-                                           i);
-      }
-
-      /* Request input configurations for common input IDs
-       * Most Shelly devices have 0-3 inputs */
-      for (int i = 0; i < 4; i++) {
-        device_state_request_input_config(ctx->dev_state, ctx->req_queue, c, i);
-        /* Also request initial input status */
-        device_state_request_input_status(ctx->dev_state, ctx->req_queue, c, i);
-      }
+    case MG_EV_WAKEUP:
+      /* A request was queued from another thread */
+      ws_send_queued(ctx);
       break;
 
     case MG_EV_WS_MSG: {
       struct mg_ws_message *wm = (struct mg_ws_message *) ev_data;
-
-      /* Parse the JSON-RPC message */
-      int msg_id = jsonrpc_parse_id(wm->data.buf, wm->data.len);
-      int is_response = jsonrpc_is_response(wm->data.buf, wm->data.len);
-
-      if (msg_id >= 0 && is_response) {
-        /* This is a response to a previous request */
-        char *msg_copy = strndup(wm->data.buf, wm->data.len);
-
-        /* Determine response type and update appropriate device state */
-        const char *request_data =
-            request_queue_get_request_data(ctx->req_queue, msg_id);
-        if (request_data) {
-          response_type_t resp_type =
-              device_state_get_response_type(request_data);
-
-          switch (resp_type) {
-            case RESPONSE_TYPE_SYS_GETCONFIG:
-              device_state_update_sys_config(ctx->dev_state, msg_copy);
-              break;
-
-            case RESPONSE_TYPE_SYS_SETCONFIG: {
-              /* Check if response contains error */
-              char error_msg[256];
-              if (jsonrpc_is_error(msg_copy, error_msg, sizeof(error_msg))) {
-                fprintf(stderr, "Error setting system configuration: %s\n",
-                        error_msg);
-                fprintf(stderr, "Original configuration preserved.\n");
-              } else {
-                printf("System configuration set successfully\n");
-                /* Re-request config to get updated state from device */
-                device_state_request_sys_config(ctx->dev_state, ctx->req_queue,
-                                                ctx->conn);
-              }
-            } break;
-
-            case RESPONSE_TYPE_MQTT_GETCONFIG:
-              device_state_update_mqtt_config(ctx->dev_state, msg_copy);
-              break;
-
-            case RESPONSE_TYPE_MQTT_SETCONFIG: {
-              /* Check if response contains error */
-              char error_msg[256];
-              if (jsonrpc_is_error(msg_copy, error_msg, sizeof(error_msg))) {
-                fprintf(stderr, "Error setting MQTT configuration: %s\n",
-                        error_msg);
-                fprintf(stderr, "Original configuration preserved.\n");
-              } else {
-                printf("MQTT configuration set successfully\n");
-                /* Re-request config to get updated state from device */
-                device_state_request_mqtt_config(ctx->dev_state, ctx->req_queue,
-                                                 ctx->conn);
-              }
-            } break;
-
-            case RESPONSE_TYPE_SWITCH_GETCONFIG: {
-              /* Extract switch ID from original request */
-              int switch_id = device_state_extract_switch_id(request_data);
-              if (switch_id >= 0) {
-                device_state_update_switch_config(ctx->dev_state, msg_copy,
-                                                  switch_id);
-              }
-            } break;
-
-            case RESPONSE_TYPE_SWITCH_SETCONFIG: {
-              /* Extract switch ID from original request */
-              int switch_id = device_state_extract_switch_id(request_data);
-              if (switch_id >= 0) {
-                /* Check if response contains error */
-                char error_msg[256];
-                if (jsonrpc_is_error(msg_copy, error_msg, sizeof(error_msg))) {
-                  fprintf(stderr, "Error setting switch %d configuration: %s\n",
-                          switch_id, error_msg);
-                  fprintf(stderr, "Original configuration preserved.\n");
-                } else {
-                  printf("Switch %d configuration set successfully\n",
-                         switch_id);
-                  /* Re-request config to get updated state from device */
-                  device_state_request_switch_config(
-                      ctx->dev_state, ctx->req_queue, ctx->conn, switch_id);
-                }
-              }
-            } break;
-
-            case RESPONSE_TYPE_SCRIPT_GETCODE: {
-              /* Extract script ID from original request */
-              int script_id = device_state_extract_script_id(request_data);
-              if (script_id >= 0) {
-                /* Update with this chunk and get bytes left */
-                int left = device_state_update_script_code(ctx->dev_state,
-                                                           msg_copy, script_id);
-
-                if (left > 0) {
-                  /* More chunks needed, request next chunk */
-                  device_state_request_script_code(
-                      ctx->dev_state, ctx->req_queue, ctx->conn, script_id);
-                } else if (left == 0) {
-                  /* Complete, finalize the script */
-                  device_state_finalize_script_code(ctx->dev_state, script_id);
-
-                  /* Request next script if any */
-                  int found_next = 0;
-                  for (int i = script_id + 1; i < MAX_SCRIPTS; i++) {
-                    script_entry_t *script =
-                        device_state_get_script(ctx->dev_state, i);
-                    if (script && script->valid && !script->code) {
-                      device_state_request_script_code(
-                          ctx->dev_state, ctx->req_queue, ctx->conn, i);
-                      found_next = 1;
-                      break;
-                    }
-                  }
-                  if (!found_next) {
-                    printf("All script code retrieved successfully\n");
-                  }
-                }
-                /* left < 0 means error, already logged */
-              }
-            } break;
-
-            case RESPONSE_TYPE_SCRIPT_LIST: {
-              /* Update script list and request code for first script only */
-              int script_count =
-                  device_state_update_script_list(ctx->dev_state, msg_copy);
-              if (script_count > 0) {
-                printf("Found %d scripts, requesting code sequentially...\n",
-                       script_count);
-                /* Request code for first script only - others will be requested
-                 * after completion */
-                for (int i = 0; i < MAX_SCRIPTS; i++) {
-                  script_entry_t *script =
-                      device_state_get_script(ctx->dev_state, i);
-                  if (script && script->valid) {
-                    device_state_request_script_code(
-                        ctx->dev_state, ctx->req_queue, ctx->conn, i);
-                    break; /* Only request first script */
-                  }
-                }
-              }
-            } break;
-
-            case RESPONSE_TYPE_SCRIPT_PUTCODE: {
-              /* Extract script ID from original request */
-              int script_id = device_state_extract_script_id(request_data);
-              if (script_id >= 0) {
-                /* Check if response contains error */
-                char error_msg[256];
-                if (jsonrpc_is_error(msg_copy, error_msg, sizeof(error_msg))) {
-                  fprintf(stderr, "Error uploading script %d chunk: %s\n",
-                          script_id, error_msg);
-                } else {
-                  printf("Script %d chunk uploaded successfully\n", script_id);
-
-                  /* Check if this is the last chunk by comparing with stored
-                   * request ID */
-                  script_entry_t *script =
-                      device_state_get_script(ctx->dev_state, script_id);
-                  if (script && script->last_upload_req_id == msg_id) {
-                    printf(
-                        "Script %d upload complete, refreshing from "
-                        "device...\n",
-                        script_id);
-                    /* Re-request script code to get canonical version from
-                     * device
-                     */
-                    device_state_request_script_code(
-                        ctx->dev_state, ctx->req_queue, ctx->conn, script_id);
-                  }
-                }
-              }
-            } break;
-
-            case RESPONSE_TYPE_SWITCH_SET: {
-              /* Extract switch ID from original request */
-              int switch_id = device_state_extract_switch_id(request_data);
-              if (switch_id >= 0) {
-                /* Check if response contains error */
-                char error_msg[256];
-                if (jsonrpc_is_error(msg_copy, error_msg, sizeof(error_msg))) {
-                  fprintf(stderr, "Error setting switch %d state: %s\n",
-                          switch_id, error_msg);
-                } else {
-                  printf("Switch %d state set successfully\n", switch_id);
-                  /* Response contains the current switch status, update it */
-                  device_state_update_switch_status(ctx->dev_state, msg_copy,
-                                                    switch_id);
-                }
-              }
-            } break;
-
-            case RESPONSE_TYPE_SWITCH_GETSTATUS: {
-              /* Extract switch ID from original request */
-              int switch_id = device_state_extract_switch_id(request_data);
-              if (switch_id >= 0) {
-                device_state_update_switch_status(ctx->dev_state, msg_copy,
-                                                  switch_id);
-              }
-            } break;
-
-            case RESPONSE_TYPE_INPUT_GETCONFIG: {
-              /* Extract input ID from original request */
-              int input_id = device_state_extract_input_id(request_data);
-              if (input_id >= 0) {
-                device_state_update_input_config(ctx->dev_state, msg_copy,
-                                                 input_id);
-              }
-            } break;
-
-            case RESPONSE_TYPE_INPUT_SETCONFIG: {
-              /* Extract input ID from original request */
-              int input_id = device_state_extract_input_id(request_data);
-              if (input_id >= 0) {
-                /* Check if response contains error */
-                char error_msg[256];
-                if (jsonrpc_is_error(msg_copy, error_msg, sizeof(error_msg))) {
-                  fprintf(stderr, "Error setting input %d configuration: %s\n",
-                          input_id, error_msg);
-                  fprintf(stderr, "Original configuration preserved.\n");
-                } else {
-                  printf("Input %d configuration set successfully\n", input_id);
-                  /* Re-request config to get updated state from device */
-                  device_state_request_input_config(
-                      ctx->dev_state, ctx->req_queue, ctx->conn, input_id);
-                }
-              }
-            } break;
-
-            case RESPONSE_TYPE_INPUT_GETSTATUS: {
-              /* Extract input ID from original request */
-              int input_id = device_state_extract_input_id(request_data);
-              if (input_id >= 0) {
-                device_state_update_input_status(ctx->dev_state, msg_copy,
-                                                 input_id);
-              }
-            } break;
-
-            case RESPONSE_TYPE_SCRIPT_CREATE:
-            case RESPONSE_TYPE_SCRIPT_DELETE:
-              /* Script operations - to be implemented */
-              break;
-
-            case RESPONSE_TYPE_SCHEDULE_LIST: {
-              int schedule_count =
-                  device_state_update_schedule_list(ctx->dev_state, msg_copy);
-              if (schedule_count >= 0) {
-                printf("Loaded %d schedules\n", schedule_count);
-              }
-            } break;
-
-            case RESPONSE_TYPE_SCHEDULE_CREATE:
-            case RESPONSE_TYPE_SCHEDULE_UPDATE:
-            case RESPONSE_TYPE_SCHEDULE_DELETE: {
-              /* Check for errors */
-              char error_msg[256];
-              if (jsonrpc_is_error(msg_copy, error_msg, sizeof(error_msg))) {
-                fprintf(stderr, "Schedule operation failed: %s\n", error_msg);
-              } else {
-                printf("Schedule modified, refreshing list...\n");
-              }
-              /* Refresh the schedule list regardless */
-              device_state_request_schedule_list(ctx->dev_state, ctx->req_queue,
-                                                 ctx->conn);
-            } break;
-
-            case RESPONSE_TYPE_OTHER:
-              /* Handle other response types here */
-              break;
-
-            case RESPONSE_TYPE_UNKNOWN:
-              /* Unknown response type, no state update */
-              break;
-
-            default:
-              /* Unreachable: all enum values handled above */
-              assert(0 && "Unreachable: unknown response type");
-              break;
+      stats_add(STATS_FRAMES_RECEIVED, 1);
+      stats_add(STATS_BYTES_RECEIVED, wm->data.len);
+
+      /* Classify the frame in a single pass over its top-level members */
+      jsonrpc_frame_t frame;
+      jsonrpc_classify_frame(wm->data.buf, wm->data.len, &frame);
+
+      if (frame.kind == JSONRPC_FRAME_RESPONSE && frame.id >= 0) {
+        int msg_id = frame.id;
+
+        /* This is a response to a previous request. It is handed on as the
+         * classified frame: handlers and updaters parse the spans in place
+         * and copy out only what they keep. */
+        /* Dispatch on what we asked for, recorded when the request was
+         * queued */
+        request_desc_t desc;
+        if (request_queue_get_desc(ctx->req_queue, msg_id, &desc) == 0 &&
+            desc.method > RESPONSE_TYPE_UNKNOWN &&
+            desc.method < RESPONSE_TYPE_COUNT &&
+            s_response_handlers[desc.method]) {
+          s_response_handlers[desc.method](ctx, msg_id, &desc, &frame);
+          if (ctx->cache_path[0] && response_changes_cache(desc.method)) {
+            ctx->cache_dirty = 1;
           }
         }
 
-        if (request_queue_handle_response(ctx->req_queue, msg_id, msg_copy) !=
+        /* Retire the request and run its completion callback, if any */
+        if (request_queue_handle_response(ctx->req_queue, msg_id, &frame) !=
             0) {
-          fprintf(stderr,
-                  "Warning: Received response for unknown request ID %d\n",
-                  msg_id);
-          free(msg_copy);
+          log_warn(LOG_CAT_RPC,
+                   "Warning: Received response for unknown request ID %d\n",
+                   msg_id);
         }
-      } else {
+      } else if (frame.kind == JSONRPC_FRAME_NOTIFICATION) {
         /* This is an unsolicited message (notification) */
-        handle_unsolicited_message(wm->data.buf, wm->data.len, ctx);
+        handle_unsolicited_message(ctx, &frame);
       }
     } break;
 
-    case MG_EV_CLOSE:
-      if (ctx->connected) {
-        printf("WebSocket connection closed\n");
+    case MG_EV_CLOSE: {
+      int was_connected = ctx->connected;
+      if (was_connected) {
+        log_info(LOG_CAT_CONN, "WebSocket connection to %s closed\n", ctx->url);
+        stats_add(STATS_DISCONNECTS, 1);
       }
       ctx->connected = 0;
-      break;
+      ctx->conn = NULL;
+      __atomic_store_n(&ctx->conn_id, 0, __ATOMIC_RELEASE);
+      fuse_ops_update_conn(ctx->fuse_dev, NULL);
+
+      /* Requests sent on this connection will not be answered. The state
+       * stays mounted as it was; once reconnected, only what the device's
+       * revisions say has changed is fetched again. */
+      request_queue_fail_pending(ctx->req_queue);
+      if (ctx->dev_state->sys_config.parsed.cfg_rev >= 0) {
+        ctx->warm_start = 1;
+      }
+
+      if (s_signo == 0) {
+        if (was_connected &&
+            mg_millis() - ctx->connected_at >= RECONNECT_STABLE_MS) {
+          ctx->backoff_ms = RECONNECT_MIN_MS;
+        }
+        schedule_reconnect(ctx);
+      }
+    } break;
 
     default: break;
   }
 }
 
+/* Device of a metrics URI: "/metrics" for a single device, "/<name>/metrics"
+ * with -f. NULL if there is none. */
+static struct ws_context *metrics_device(struct ws_app *app,
+                                         struct mg_str uri) {
+  if (!app->named) {
+    return mg_match(uri, mg_str("/metrics"), NULL) ? &app->devices[0] : NULL;
+  }
+
+  struct mg_str caps[2];
+  if (!mg_match(uri, mg_str("/*/metrics"), caps)) {
+    return NULL;
+  }
+  for (int i = 0; i < app->device_count; i++) {
+    if (mg_strcmp(caps[0], mg_str(app->devices[i].name)) == 0) {
+      return &app->devices[i];
+    }
+  }
+  return NULL;
+}
+
+/* HTTP listener (-m): GET /metrics for Prometheus, without going through the
+ * mount. Runs on the event loop thread, sharing the cache with /metrics. */
+static void metrics_http_handler(struct mg_connection *c, int ev,
+                                 void *ev_data) {
+  if (ev != MG_EV_HTTP_MSG) {
+    return;
+  }
+
+  struct ws_app *app = (struct ws_app *) c->fn_data;
+  struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+  struct ws_context *ctx = metrics_device(app, hm->uri);
+  if (!ctx) {
+    mg_http_reply(c, 404, "", "Not found\n");
+    return;
+  }
+
+  char *buf = NULL;
+  size_t len = 0;
+  device_state_read_lock(ctx->dev_state);
+  int ret = metrics_get_locked(&ctx->metrics, ctx->dev_state, &buf, &len);
+  device_state_read_unlock(ctx->dev_state);
+  if (ret != 0) {
+    mg_http_reply(c, 500, "", "Cannot render metrics\n");
+    return;
+  }
+
+  mg_printf(c,
+            "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+            "Content-Length: %lu\r\n\r\n",
+            METRICS_CONTENT_TYPE, (unsigned long) len);
+  mg_send(c, buf, len);
+  free(buf);
+}
+
+/* Periodic upkeep of one device (event loop thread) */
+static void device_housekeeping(struct ws_context *ctx) {
+  request_queue_cleanup_timeouts(ctx->req_queue);
+  /* Resume script transfers held back by chunks that timed out */
+  device_state_pump_script_upload(ctx->dev_state, ctx->req_queue);
+  device_state_pump_script_code(ctx->dev_state, ctx->req_queue);
+  /* Drop script code nobody has used for a while (-e) */
+  device_state_evict_script_code(ctx->dev_state);
+  /* Persist config/script/schedule changes (-c) */
+  save_state_cache(ctx);
+}
+
+/* The event loop: one mongoose manager drives the connections to every
+ * device, so a mount of many devices still runs on this single thread */
 static void *ws_thread_func(void *arg) {
-  struct ws_context *ctx = (struct ws_context *) arg;
+  struct ws_app *app = (struct ws_app *) arg;
 
-  printf("Starting WebSocket thread for %s\n", ctx->url);
+  log_info(LOG_CAT_CONN, "Starting WebSocket thread for %d device%s\n",
+           app->device_count, app->device_count == 1 ? "" : "s");
 
-  ctx->mgr = malloc(sizeof(struct mg_mgr));
-  if (!ctx->mgr) {
-    fprintf(stderr, "Error: Failed to allocate memory for mongoose manager\n");
-    ctx->error = 1;
-    return NULL;
+  mg_mgr_init(&app->mgr);
+
+  /* Let request_queue_add() interrupt mg_mgr_poll() from the FUSE thread */
+  if (!mg_wakeup_init(&app->mgr)) {
+    log_warn(LOG_CAT_CONN,
+             "Warning: Failed to init event loop wakeup, queued requests will "
+             "be sent on the next poll\n");
   }
 
-  mg_mgr_init(ctx->mgr);
+  if (app->metrics_url) {
+    if (mg_http_listen(&app->mgr, app->metrics_url, metrics_http_handler,
+                       app)) {
+      log_info(LOG_CAT_MAIN, "Serving metrics on %s%s/metrics\n",
+               app->metrics_url, app->named ? "/<device>" : "");
+    } else {
+      log_warn(LOG_CAT_MAIN,
+               "Warning: Cannot listen on %s, metrics only in the mount\n",
+               app->metrics_url);
+    }
+  }
 
-  ctx->conn = mg_ws_connect(ctx->mgr, ctx->url, ws_event_handler, ctx, NULL);
-  if (!ctx->conn) {
-    fprintf(stderr, "Error: Failed to create WebSocket connection to %s\n",
-            ctx->url);
-    ctx->error = 1;
-    mg_mgr_free(ctx->mgr);
-    free(ctx->mgr);
+  int connecting = 0;
+  for (int i = 0; i < app->device_count; i++) {
+    struct ws_context *ctx = &app->devices[i];
+    request_queue_set_notify(ctx->req_queue, ws_wakeup, ctx);
+
+    if (device_connect(ctx) != 0) {
+      /* Not a device that is down but an unusable URL: give up on it */
+      request_queue_set_notify(ctx->req_queue, NULL, NULL);
+      continue;
+    }
+    connecting++;
+  }
+
+  if (connecting == 0) {
+    mg_mgr_free(&app->mgr);
     return NULL;
   }
 
-  int cleanup_counter = 0;
+  time_t last_cleanup = time(NULL);
   while (s_signo == 0) {
-    mg_mgr_poll(ctx->mgr, 1000);
-
-    /* Check for queued requests and send them */
-    if (ctx->conn && ctx->connected) {
-      char *request_data = NULL;
-      int req_id = 0;
-
-      while (request_queue_get_next_to_send(ctx->req_queue, &request_data,
-                                            &req_id) == 0) {
-        if (request_data) {
-          /* Send the request over WebSocket */
-          if (jsonrpc_send_request(ctx->conn, request_data) == 0) {
-            /* Mark as sent (transitions to PENDING state) */
-            request_queue_mark_sent(ctx->req_queue, req_id);
-          } else {
-            fprintf(stderr, "Error: Failed to send request ID %d\n", req_id);
-            break; /* Stop trying to send more if one fails */
-          }
+    /* Wake up in time for requests held back by the debounce window (-D)
+     * and for reconnection attempts */
+    int timeout_ms = WS_POLL_INTERVAL_MS;
+    uint64_t now_ms = mg_millis();
+    for (int i = 0; i < app->device_count; i++) {
+      struct ws_context *ctx = &app->devices[i];
+      int due_ms = request_queue_next_due_ms(ctx->req_queue);
+      if (ctx->reconnect_at) {
+        int reconnect_ms = ctx->reconnect_at > now_ms
+                               ? (int) (ctx->reconnect_at - now_ms)
+                               : 0;
+        if (due_ms < 0 || reconnect_ms < due_ms) {
+          due_ms = reconnect_ms;
         }
       }
+      if (due_ms >= 0 && due_ms < timeout_ms) {
+        timeout_ms = due_ms;
+      }
+    }
+    mg_mgr_poll(&app->mgr, timeout_ms);
+
+    /* Reconnect devices whose backoff has run out */
+    now_ms = mg_millis();
+    for (int i = 0; i < app->device_count; i++) {
+      struct ws_context *ctx = &app->devices[i];
+      if (!ctx->reconnect_at || now_ms < ctx->reconnect_at) {
+        continue;
+      }
+      stats_add(STATS_RECONNECT_ATTEMPTS, 1);
+      if (device_connect(ctx) != 0) {
+        schedule_reconnect(ctx);
+      }
     }
 
-    /* Periodically clean up timed-out requests (every 10 seconds) */
-    if (++cleanup_counter >= 10) {
-      request_queue_cleanup_timeouts(ctx->req_queue);
-      cleanup_counter = 0;
+    /* Send anything queued by our own event handlers during this poll */
+    for (int i = 0; i < app->device_count; i++) {
+      ws_send_queued(&app->devices[i]);
+    }
+
+    /* Periodically clean up timed-out requests */
+    time_t now = time(NULL);
+    if (now - last_cleanup >= TIMEOUT_CLEANUP_INTERVAL_SEC) {
+      for (int i = 0; i < app->device_count; i++) {
+        device_housekeeping(&app->devices[i]);
+      }
+      last_cleanup = now;
     }
   }
 
-  printf("Shutting down WebSocket connection...\n");
-  mg_mgr_free(ctx->mgr);
-  free(ctx->mgr);
-  ctx->mgr = NULL;
-  ctx->conn = NULL;
+  log_info(LOG_CAT_CONN, "Shutting down WebSocket connections...\n");
+  for (int i = 0; i < app->device_count; i++) {
+    struct ws_context *ctx = &app->devices[i];
+    save_state_cache(ctx);
+    request_queue_set_notify(ctx->req_queue, NULL, NULL);
+    __atomic_store_n(&ctx->conn_id, 0, __ATOMIC_RELEASE);
+  }
+  mg_mgr_free(&app->mgr);
+  for (int i = 0; i < app->device_count; i++) {
+    app->devices[i].conn = NULL;
+  }
 
   return NULL;
 }
@@ -510,7 +985,54 @@ static void print_usage(const char *prog_name) {
   printf(
       "Shelly FUSE Filesystem - Mount Shelly Gen2+ devices as a "
       "filesystem\n\n");
-  printf("Usage: %s <device_url> <mountpoint>\n\n", prog_name);
+  printf(
+      "Usage: %s [-s] [-k] [-w N] [-l] [-e SEC] [-c DIR] [-H N] [-m URL] "
+      "[-D MS] [-q] [-v SPEC] <device_url> <mountpoint>\n"
+      "       %s [options] -f FILE <mountpoint>\n\n",
+      prog_name, prog_name);
+  printf("Options:\n");
+  printf("  -s           Run the FUSE loop single-threaded\n");
+  printf(
+      "  -k           Let the kernel cache attributes and file contents "
+      "until\n"
+      "               the device reports a change\n");
+  printf(
+      "  -w N         Script.GetCode requests in flight during script sync "
+      "(default %d)\n",
+      SCRIPT_FETCH_WINDOW);
+  printf(
+      "  -l           Load script code on first open instead of on "
+      "connect\n");
+  printf(
+      "  -e SEC       Evict script code nobody has opened for SEC "
+      "seconds\n");
+  printf(
+      "  -c DIR       Keep a state snapshot in DIR and mount from it on "
+      "start\n");
+  printf(
+      "  -H N         Keep the last N status updates per switch/input in "
+      "proc/.../history\n");
+  printf(
+      "  -m URL       Also serve /metrics over HTTP, e.g. "
+      "http://0.0.0.0:9112\n");
+  printf(
+      "  -D MS        Hold switch output and config writes for MS ms so a "
+      "burst\n"
+      "               is sent as its last write only\n");
+  printf(
+      "  -f FILE      Mount every device listed in FILE (\"<name> <url>\" "
+      "lines),\n"
+      "               each as <mountpoint>/<name>\n");
+  printf(
+      "  -q           Keep writes made while a device is disconnected and "
+      "send\n"
+      "               them on reconnect (default: fail them with EROFS)\n");
+  printf(
+      "  -v SPEC      Log levels: error, warn, info (default) or debug, for "
+      "all\n"
+      "               categories or as CATEGORY=LEVEL, comma-separated (e.g.\n"
+      "               warn,script=debug). Categories: main, conn, rpc, state,\n"
+      "               script, fuse, cache, ws\n\n");
   printf("Arguments:\n");
   printf(
       "  device_url   WebSocket URL of the Shelly device (ws:// or wss://)\n");
@@ -531,62 +1053,289 @@ static void print_usage(const char *prog_name) {
   printf("  or press Ctrl+C in the terminal running shusefs\n");
 }
 
+/* Free what device_open() set up */
+static void device_close(struct ws_context *ctx) {
+  metrics_cache_destroy(&ctx->metrics);
+  device_state_destroy(ctx->dev_state);
+  request_queue_destroy(ctx->req_queue);
+  free(ctx->dev_state);
+  free(ctx->req_queue);
+  ctx->dev_state = NULL;
+  ctx->req_queue = NULL;
+}
+
+/* Set up one device's request queue, state and caches. Returns 0 on
+ * success, -1 on error (reported, nothing left allocated). */
+static int device_open(struct ws_context *ctx, struct ws_app *app,
+                       const device_entry_t *entry,
+                       const struct device_options *opts) {
+  ctx->app = app;
+  ctx->mgr = &app->mgr;
+  ctx->name = app->named ? entry->name : NULL;
+  snprintf(ctx->url, sizeof(ctx->url), "%s", entry->url);
+
+  ctx->req_queue = malloc(sizeof(request_queue_t));
+  ctx->dev_state = malloc(sizeof(device_state_t));
+  if (!ctx->req_queue || !ctx->dev_state) {
+    log_error(LOG_CAT_MAIN, "Error: Failed to allocate memory for %s\n",
+              ctx->url);
+    free(ctx->req_queue);
+    free(ctx->dev_state);
+    return -1;
+  }
+
+  /* Initialize request queue */
+  if (request_queue_init(ctx->req_queue) != 0) {
+    log_error(LOG_CAT_MAIN, "Error: Failed to initialize request queue\n");
+    free(ctx->req_queue);
+    free(ctx->dev_state);
+    return -1;
+  }
+  request_queue_set_debounce(ctx->req_queue, opts->debounce_ms);
+  /* Script transfers are bulk traffic; a larger -w needs room in that lane */
+  if (opts->fetch_window > REQUEST_LANE_BULK_INFLIGHT) {
+    request_queue_set_lane_limit(ctx->req_queue, REQUEST_LANE_BULK,
+                                 opts->fetch_window);
+  }
+
+  /* Initialize device state */
+  if (device_state_init(ctx->dev_state) != 0) {
+    log_error(LOG_CAT_MAIN, "Error: Failed to initialize device state\n");
+    request_queue_destroy(ctx->req_queue);
+    free(ctx->req_queue);
+    free(ctx->dev_state);
+    return -1;
+  }
+
+  device_state_set_script_fetch_window(ctx->dev_state, opts->fetch_window);
+  device_state_set_script_loading(ctx->dev_state, opts->lazy_scripts,
+                                  opts->evict_idle_sec);
+  if ((opts->history_depth > 0 &&
+       device_state_set_history_depth(ctx->dev_state, opts->history_depth) !=
+           0) ||
+      metrics_cache_init(&ctx->metrics) != 0) {
+    log_error(LOG_CAT_MAIN,
+              "Error: Cannot allocate status history or metrics\n");
+    device_state_destroy(ctx->dev_state);
+    request_queue_destroy(ctx->req_queue);
+    free(ctx->req_queue);
+    free(ctx->dev_state);
+    return -1;
+  }
+
+  /* Serve the mount from the last snapshot until the device confirms it */
+  if (opts->cache_dir) {
+    if (state_cache_path(opts->cache_dir, ctx->url, ctx->cache_path,
+                         sizeof(ctx->cache_path)) != 0) {
+      log_error(LOG_CAT_CACHE, "Error: Cache directory path too long\n");
+      device_close(ctx);
+      return -1;
+    }
+    if (state_cache_load(ctx->dev_state, ctx->cache_path) == 0) {
+      log_info(LOG_CAT_CACHE, "Restored device state from %s\n",
+               ctx->cache_path);
+      ctx->warm_start = 1;
+    }
+  }
+
+  return 0;
+}
+
+static void close_devices(struct ws_app *app) {
+  for (int i = 0; i < app->device_count; i++) {
+    device_close(&app->devices[i]);
+  }
+  free(app->devices);
+  app->devices = NULL;
+  app->device_count = 0;
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
+  int argi = 1;
+  struct device_options opts = {.fetch_window = SCRIPT_FETCH_WINDOW};
+  const char *metrics_url = NULL;
+  const char *device_file = NULL;
+
+  stats_init();
+
+  while (argi < argc && argv[argi][0] == '-') {
+    if (strcmp(argv[argi], "-s") == 0) {
+      /* -s: single-threaded FUSE loop (same meaning as libfuse's own -s) */
+      fuse_ops_set_multithreaded(0);
+      argi++;
+    } else if (strcmp(argv[argi], "-k") == 0) {
+      /* -k: kernel attribute/page caching with explicit invalidation */
+      fuse_ops_set_kernel_cache(1);
+      argi++;
+    } else if (strcmp(argv[argi], "-w") == 0 && argi + 1 < argc) {
+      /* -w N: Script.GetCode requests in flight during script sync */
+      opts.fetch_window = atoi(argv[argi + 1]);
+      if (opts.fetch_window < 1) {
+        fprintf(stderr, "Error: -w needs a positive number\n");
+        return EXIT_FAILURE;
+      }
+      argi += 2;
+    } else if (strcmp(argv[argi], "-l") == 0) {
+      /* -l: fetch script code on first open instead of on connect */
+      opts.lazy_scripts = 1;
+      argi++;
+    } else if (strcmp(argv[argi], "-e") == 0 && argi + 1 < argc) {
+      /* -e SEC: evict script code idle for SEC seconds */
+      opts.evict_idle_sec = atoi(argv[argi + 1]);
+      if (opts.evict_idle_sec < 1) {
+        fprintf(stderr, "Error: -e needs a positive number of seconds\n");
+        return EXIT_FAILURE;
+      }
+      argi += 2;
+    } else if (strcmp(argv[argi], "-c") == 0 && argi + 1 < argc) {
+      /* -c DIR: persist device state in DIR for warm starts */
+      opts.cache_dir = argv[argi + 1];
+      argi += 2;
+    } else if (strcmp(argv[argi], "-H") == 0 && argi + 1 < argc) {
+      /* -H N: status history depth per switch/input */
+      opts.history_depth = atoi(argv[argi + 1]);
+      if (opts.history_depth < 1) {
+        fprintf(stderr, "Error: -H needs a positive number\n");
+        return EXIT_FAILURE;
+      }
+      argi += 2;
+    } else if (strcmp(argv[argi], "-m") == 0 && argi + 1 < argc) {
+      /* -m URL: HTTP listener for Prometheus scrapes */
+      metrics_url = argv[argi + 1];
+      argi += 2;
+    } else if (strcmp(argv[argi], "-D") == 0 && argi + 1 < argc) {
+      /* -D MS: debounce window for coalescing writes */
+      opts.debounce_ms = atoi(argv[argi + 1]);
+      if (opts.debounce_ms < 1) {
+        fprintf(stderr, "Error: -D needs a positive number of milliseconds\n");
+        return EXIT_FAILURE;
+      }
+      argi += 2;
+    } else if (strcmp(argv[argi], "-q") == 0) {
+      /* -q: keep writes while disconnected, send them on reconnect */
+      fuse_ops_set_offline_writes(1);
+      argi++;
+    } else if (strcmp(argv[argi], "-f") == 0 && argi + 1 < argc) {
+      /* -f FILE: mount the devices listed in FILE */
+      device_file = argv[argi + 1];
+      argi += 2;
+    } else if (strcmp(argv[argi], "-v") == 0 && argi + 1 < argc) {
+      /* -v SPEC: log levels, overall and per category */
+      if (log_configure(argv[argi + 1]) != 0) {
+        fprintf(stderr, "Error: Invalid log levels \"%s\"\n", argv[argi + 1]);
+        return EXIT_FAILURE;
+      }
+      argi += 2;
+    } else {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - argi != (device_file ? 1 : 2)) {
     print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
-  struct ws_context ctx = {0};
+  /* The devices to mount: the list file, or the one URL given */
+  device_list_t list = {0};
+  if (device_file) {
+    if (device_list_load(&list, device_file) != 0) {
+      return EXIT_FAILURE;
+    }
+  } else {
+    const char *url = argv[argi];
+    if (strncmp(url, "ws://", 5) != 0 && strncmp(url, "wss://", 6) != 0) {
+      fprintf(stderr, "Error: URL must start with ws:// or wss://\n");
+      return EXIT_FAILURE;
+    }
+    list.devices = calloc(1, sizeof(device_entry_t));
+    if (!list.devices) {
+      return EXIT_FAILURE;
+    }
+    list.count = 1;
+    snprintf(list.devices[0].url, sizeof(list.devices[0].url), "%s", url);
+  }
+
+  /* From here on the event loop and FUSE threads log; hand the writing to
+   * the log thread, and write out what is left on the way out */
+  if (log_start() == 0) {
+    atexit(log_stop);
+  }
+
+  struct ws_app app = {0};
   pthread_t ws_thread;
   pthread_t fuse_thread;
-  request_queue_t req_queue;
-  device_state_t dev_state;
 
-  /* Initialize request queue */
-  if (request_queue_init(&req_queue) != 0) {
-    fprintf(stderr, "Error: Failed to initialize request queue\n");
+  app.named = device_file != NULL;
+  app.mountpoint = argv[argc - 1];
+  app.metrics_url = metrics_url;
+  app.devices = calloc(list.count, sizeof(struct ws_context));
+  if (!app.devices) {
+    log_error(LOG_CAT_MAIN, "Error: Failed to allocate memory for devices\n");
+    device_list_free(&list);
     return EXIT_FAILURE;
   }
 
-  /* Initialize device state */
-  if (device_state_init(&dev_state) != 0) {
-    fprintf(stderr, "Error: Failed to initialize device state\n");
-    request_queue_destroy(&req_queue);
-    return EXIT_FAILURE;
+  if (opts.cache_dir && mkdir(opts.cache_dir, 0700) != 0 && errno != EEXIST) {
+    log_warn(LOG_CAT_MAIN, "Warning: Cannot create cache directory %s: %s\n",
+             opts.cache_dir, strerror(errno));
   }
 
-  ctx.req_queue = &req_queue;
-  ctx.dev_state = &dev_state;
-  ctx.mountpoint = argv[2];
-  ctx.fuse_thread = &fuse_thread;
-  ctx.fuse_started = 0;
-
-  strncpy(ctx.url, argv[1], WS_URL_MAX - 1);
-  ctx.url[WS_URL_MAX - 1] = '\0';
+  for (int i = 0; i < list.count; i++) {
+    struct ws_context *ctx = &app.devices[app.device_count];
+    if (device_open(ctx, &app, &list.devices[i], &opts) != 0) {
+      close_devices(&app);
+      device_list_free(&list);
+      return EXIT_FAILURE;
+    }
+    app.device_count++;
+
+    ctx->fuse_dev = fuse_ops_add_device(ctx->name, ctx->dev_state,
+                                        ctx->req_queue, &ctx->metrics);
+    if (!ctx->fuse_dev) {
+      log_error(LOG_CAT_MAIN, "Error: Failed to add %s to the mount\n",
+                ctx->url);
+      close_devices(&app);
+      device_list_free(&list);
+      return EXIT_FAILURE;
+    }
+  }
 
-  if (strncmp(ctx.url, "ws://", 5) != 0 && strncmp(ctx.url, "wss://", 6) != 0) {
-    fprintf(stderr, "Error: URL must start with ws:// or wss://\n");
-    device_state_destroy(&dev_state);
-    request_queue_destroy(&req_queue);
-    return EXIT_FAILURE;
+  /* Group directories, by tag or name pattern */
+  for (int i = 0; i < list.group_count; i++) {
+    device_group_t *group = &list.groups[i];
+    fuse_context_data_t *members[group->member_count + 1];
+    for (int m = 0; m < group->member_count; m++) {
+      members[m] = app.devices[group->members[m]].fuse_dev;
+    }
+    if (fuse_ops_add_group(group->name, members, group->member_count) != 0) {
+      log_error(LOG_CAT_MAIN, "Error: Failed to add group @%s to the mount\n",
+                group->name);
+      close_devices(&app);
+      device_list_free(&list);
+      return EXIT_FAILURE;
+    }
+    log_info(LOG_CAT_MAIN, "Group @%s: %d device(s)\n", group->name,
+             group->member_count);
   }
 
   /* Set global context for signal handler */
-  g_ctx = &ctx;
+  g_app = &app;
 
   signal(SIGINT, signal_handler);
   signal(SIGTERM, signal_handler);
 
   /* Start FUSE filesystem immediately */
-  printf("Starting FUSE filesystem at %s...\n", ctx.mountpoint);
+  log_info(LOG_CAT_MAIN, "Starting FUSE filesystem at %s...\n", app.mountpoint);
 
   /* Prepare FUSE arguments */
   char **fuse_argv = malloc(sizeof(char *) * 5);
   if (!fuse_argv) {
-    fprintf(stderr, "Error: Failed to allocate memory for FUSE arguments\n");
-    device_state_destroy(&dev_state);
-    request_queue_destroy(&req_queue);
+    log_error(LOG_CAT_MAIN,
+              "Error: Failed to allocate memory for FUSE arguments\n");
+    close_devices(&app);
+    device_list_free(&list);
     return EXIT_FAILURE;
   }
 
@@ -594,57 +1343,59 @@ int main(int argc, char *argv[]) {
   fuse_argv[0] = strdup("shusefs");
   fuse_argv[1] = strdup("-o");
   fuse_argv[2] = strdup("default_permissions");
-  fuse_argv[3] = strdup(ctx.mountpoint);
+  fuse_argv[3] = strdup(app.mountpoint);
   fuse_argv[4] = NULL;
 
-  if (fuse_start((const char *) fuse_argv, &dev_state, &req_queue, &ctx.conn,
-                 &fuse_thread) != 0) {
-    fprintf(stderr, "Error: Failed to start FUSE filesystem\n");
+  if (fuse_start((const char *) fuse_argv, &fuse_thread) != 0) {
+    log_error(LOG_CAT_MAIN, "Error: Failed to start FUSE filesystem\n");
     for (int i = 0; fuse_argv[i] != NULL; i++) {
       free(fuse_argv[i]);
     }
     free(fuse_argv);
-    device_state_destroy(&dev_state);
-    request_queue_destroy(&req_queue);
+    close_devices(&app);
+    device_list_free(&list);
     return EXIT_FAILURE;
   }
-  ctx.fuse_started = 1;
+  app.fuse_started = 1;
 
-  printf("Connecting to %s\n", ctx.url);
-
-  if (pthread_create(&ws_thread, NULL, ws_thread_func, &ctx) != 0) {
-    fprintf(stderr, "Error: Failed to create WebSocket thread\n");
-    fuse_stop(ctx.mountpoint);
+  if (pthread_create(&ws_thread, NULL, ws_thread_func, &app) != 0) {
+    log_error(LOG_CAT_MAIN, "Error: Failed to create WebSocket thread\n");
+    fuse_stop(app.mountpoint);
     pthread_join(fuse_thread, NULL);
-    device_state_destroy(&dev_state);
-    request_queue_destroy(&req_queue);
+    close_devices(&app);
+    device_list_free(&list);
     return EXIT_FAILURE;
   }
 
   pthread_join(ws_thread, NULL);
 
   /* Clean up FUSE if it was started */
-  if (ctx.fuse_started) {
+  if (app.fuse_started) {
     /* Only call fuse_stop if signal handler didn't already unmount */
     if (s_signo == 0) {
-      printf("Unmounting FUSE filesystem...\n");
-      fuse_stop(ctx.mountpoint);
+      log_info(LOG_CAT_MAIN, "Unmounting FUSE filesystem...\n");
+      fuse_stop(app.mountpoint);
     }
     pthread_join(fuse_thread, NULL);
   }
 
   /* Clear global context pointer */
-  g_ctx = NULL;
+  g_app = NULL;
+
+  int error = 0;
+  for (int i = 0; i < app.device_count; i++) {
+    error |= app.devices[i].error;
+  }
 
   /* Clean up */
-  device_state_destroy(&dev_state);
-  request_queue_destroy(&req_queue);
+  close_devices(&app);
+  device_list_free(&list);
 
-  if (ctx.error) {
-    fprintf(stderr, "WebSocket connection terminated with errors\n");
+  if (error) {
+    log_error(LOG_CAT_MAIN, "WebSocket connection terminated with errors\n");
     return EXIT_FAILURE;
   }
 
-  printf("Disconnected successfully\n");
+  log_info(LOG_CAT_MAIN, "Disconnected successfully\n");
   return EXIT_SUCCESS;
 }
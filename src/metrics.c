@@ -0,0 +1,226 @@
+#include "../include/metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ============================================================================
+ * METRIC FAMILIES
+ * ============================================================================
+ */
+
+typedef enum { VALUE_DOUBLE, VALUE_BOOL, VALUE_INT } value_kind_t;
+
+/* One metric family, read from the same offset in every component */
+typedef struct {
+  const char *name; /* Family name; counters get "_total" on the sample */
+  const char *type; /* "gauge" or "counter" */
+  const char *unit; /* Suffix of name, or NULL */
+  const char *help;
+  value_kind_t kind;
+  size_t offset; /* Of the value in the component struct */
+} metric_family_t;
+
+static const metric_family_t s_switch_families[] = {
+    {"shelly_switch_output", "gauge", NULL, "Switch output state (1 = on)",
+     VALUE_BOOL, offsetof(switch_config_t, status.output)},
+    {"shelly_switch_apower_watts", "gauge", "watts", "Active power",
+     VALUE_DOUBLE, offsetof(switch_config_t, status.apower)},
+    {"shelly_switch_voltage_volts", "gauge", "volts", "Line voltage",
+     VALUE_DOUBLE, offsetof(switch_config_t, status.voltage)},
+    {"shelly_switch_current_amperes", "gauge", "amperes", "Current draw",
+     VALUE_DOUBLE, offsetof(switch_config_t, status.current)},
+    {"shelly_switch_freq_hertz", "gauge", "hertz", "AC frequency",
+     VALUE_DOUBLE, offsetof(switch_config_t, status.freq)},
+    {"shelly_switch_energy_watthours", "counter", "watthours",
+     "Total energy consumed", VALUE_DOUBLE,
+     offsetof(switch_config_t, status.energy_total)},
+    {"shelly_switch_ret_energy_watthours", "counter", "watthours",
+     "Total energy returned", VALUE_DOUBLE,
+     offsetof(switch_config_t, status.ret_energy_total)},
+    {"shelly_switch_temperature_celsius", "gauge", "celsius",
+     "Device temperature", VALUE_DOUBLE,
+     offsetof(switch_config_t, status.temperature_c)},
+    {"shelly_switch_overtemperature", "gauge", NULL,
+     "Overtemperature protection tripped (1 = yes)", VALUE_BOOL,
+     offsetof(switch_config_t, status.overtemperature)},
+};
+
+static const metric_family_t s_input_families[] = {
+    {"shelly_input_state", "gauge", NULL, "Input state (1 = active)",
+     VALUE_BOOL, offsetof(input_config_t, status.state)},
+};
+
+static const metric_family_t s_script_families[] = {
+    {"shelly_script_running", "gauge", NULL, "Script is running (1 = yes)",
+     VALUE_BOOL, offsetof(script_entry_t, running)},
+    {"shelly_script_mem_used_bytes", "gauge", "bytes", "Script memory in use",
+     VALUE_INT, offsetof(script_entry_t, mem_used)},
+    {"shelly_script_mem_peak_bytes", "gauge", "bytes",
+     "Peak script memory use", VALUE_INT, offsetof(script_entry_t, mem_peak)},
+};
+
+#define FAMILY_COUNT(families) (sizeof(families) / sizeof((families)[0]))
+
+/* ============================================================================
+ * RENDERING
+ * ============================================================================
+ */
+
+static void write_family_header(FILE *out, const metric_family_t *family) {
+  fprintf(out, "# TYPE %s %s\n", family->name, family->type);
+  if (family->unit) {
+    fprintf(out, "# UNIT %s %s\n", family->name, family->unit);
+  }
+  fprintf(out, "# HELP %s %s.\n", family->name, family->help);
+}
+
+/* Write a label value, escaped as OpenMetrics requires */
+static void write_label_value(FILE *out, const char *value) {
+  for (; *value; value++) {
+    if (*value == '\\' || *value == '"') {
+      fputc('\\', out);
+      fputc(*value, out);
+    } else if (*value == '\n') {
+      fputs("\\n", out);
+    } else {
+      fputc(*value, out);
+    }
+  }
+}
+
+/* Write the sample of `family` for one component (labels without braces) */
+static void write_sample(FILE *out, const metric_family_t *family,
+                         const void *component, const char *labels) {
+  const char *value = (const char *) component + family->offset;
+  const char *suffix = strcmp(family->type, "counter") == 0 ? "_total" : "";
+
+  fprintf(out, "%s%s{%s} ", family->name, suffix, labels);
+  switch (family->kind) {
+    case VALUE_BOOL: fprintf(out, "%d\n", *(const bool *) value ? 1 : 0); break;
+    case VALUE_INT: fprintf(out, "%d\n", *(const int *) value); break;
+    default: fprintf(out, "%.15g\n", *(const double *) value); break;
+  }
+}
+
+/* Render the whole exposition (caller holds the state lock) */
+static void write_metrics_locked(device_state_t *state, FILE *out) {
+  char labels[128];
+
+  for (size_t f = 0; f < FAMILY_COUNT(s_switch_families); f++) {
+    write_family_header(out, &s_switch_families[f]);
+    for (int i = 0; i < MAX_SWITCHES; i++) {
+      switch_config_t *sw = state->switches.switches[i];
+      if (sw && sw->valid) {
+        snprintf(labels, sizeof(labels), "id=\"%d\"", i);
+        write_sample(out, &s_switch_families[f], sw, labels);
+      }
+    }
+  }
+
+  for (size_t f = 0; f < FAMILY_COUNT(s_input_families); f++) {
+    write_family_header(out, &s_input_families[f]);
+    for (int i = 0; i < MAX_INPUTS; i++) {
+      input_config_t *inp = state->inputs.inputs[i];
+      if (inp && inp->valid) {
+        snprintf(labels, sizeof(labels), "id=\"%d\"", i);
+        write_sample(out, &s_input_families[f], inp, labels);
+      }
+    }
+  }
+
+  /* Scripts are also labelled with their name, which needs escaping */
+  for (size_t f = 0; f < FAMILY_COUNT(s_script_families); f++) {
+    write_family_header(out, &s_script_families[f]);
+    for (int i = 0; i < MAX_SCRIPTS; i++) {
+      script_entry_t *script = &state->scripts.scripts[i];
+      if (!script->valid) {
+        continue;
+      }
+
+      char *name = NULL;
+      size_t name_len = 0;
+      FILE *mem = open_memstream(&name, &name_len);
+      if (!mem) {
+        continue;
+      }
+      fprintf(mem, "id=\"%d\",name=\"", i);
+      write_label_value(mem, script->name);
+      fputc('"', mem);
+      fclose(mem);
+
+      write_sample(out, &s_script_families[f], script, name);
+      free(name);
+    }
+  }
+
+  fputs("# EOF\n", out);
+}
+
+/* ============================================================================
+ * CACHE
+ * ============================================================================
+ */
+
+int metrics_cache_init(metrics_cache_t *cache) {
+  if (!cache) {
+    return -1;
+  }
+
+  memset(cache, 0, sizeof(*cache));
+  if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+void metrics_cache_destroy(metrics_cache_t *cache) {
+  if (!cache) {
+    return;
+  }
+
+  free(cache->buf);
+  cache->buf = NULL;
+  pthread_mutex_destroy(&cache->lock);
+}
+
+int metrics_get_locked(metrics_cache_t *cache, device_state_t *state,
+                       char **out, size_t *len) {
+  if (!cache || !state || !out || !len) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+
+  /* Read under the state lock with the data, see device_state_generation() */
+  unsigned long generation = device_state_generation(state);
+  if (!cache->buf || cache->generation != generation) {
+    char *buf = NULL;
+    size_t buf_len = 0;
+    FILE *mem = open_memstream(&buf, &buf_len);
+    if (!mem) {
+      pthread_mutex_unlock(&cache->lock);
+      return -1;
+    }
+    write_metrics_locked(state, mem);
+    if (fclose(mem) != 0) {
+      free(buf);
+      pthread_mutex_unlock(&cache->lock);
+      return -1;
+    }
+
+    free(cache->buf);
+    cache->buf = buf;
+    cache->len = buf_len;
+    cache->generation = generation;
+  }
+
+  *out = malloc(cache->len + 1);
+  if (*out) {
+    memcpy(*out, cache->buf, cache->len + 1);
+    *len = cache->len;
+  }
+
+  pthread_mutex_unlock(&cache->lock);
+  return *out ? 0 : -1;
+}
@@ -3,7 +3,188 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include "../include/log.h"
 #include "../include/mongoose.h"
+#include "../include/stats.h"
+
+/* Build the JSON-RPC frame of a request (free() it) */
+static char *build_request(const char *method, int id, const char *params) {
+  static const char *client_id = "shusefs-client";
+  int has_params = params && *params;
+
+  /* The method and params, plus the rest of the frame */
+  size_t size = strlen(method) + (has_params ? strlen(params) : 0) + 128;
+  char *request = malloc(size);
+  if (!request) {
+    return NULL;
+  }
+
+  if (has_params) {
+    snprintf(request, size,
+             "{\"jsonrpc\":\"2.0\",\"id\":%d,\"src\":\"%s\","
+             "\"method\":\"%s\",\"params\":%s}",
+             id, client_id, method, params);
+  } else {
+    snprintf(request, size,
+             "{\"jsonrpc\":\"2.0\",\"id\":%d,\"src\":\"%s\",\"method\":\"%s\"}",
+             id, client_id, method);
+  }
+  return request;
+}
+
+/* Look up a live entry by request ID (caller holds the mutex) */
+static request_entry_t *find_entry(request_queue_t *queue, int req_id) {
+  if (req_id <= 0) {
+    return NULL;
+  }
+
+  request_entry_t *entry = &queue->entries[req_id & (queue->capacity - 1)];
+  return (entry->id == req_id) ? entry : NULL;
+}
+
+/* Free an entry's data and mark its slot free, releasing its lane's
+ * in-flight slot if it had been sent (caller holds the mutex) */
+static void retire_entry(request_queue_t *queue, request_entry_t *entry) {
+  if (entry->state != REQ_STATE_QUEUED) {
+    queue->lanes[entry->desc.lane].in_flight--;
+  }
+  if (entry->request_data) {
+    free(entry->request_data);
+    entry->request_data = NULL;
+  }
+  entry->id = -1;
+  queue->count--;
+}
+
+/* Grow the ID ring until every live request (plus the one about to be added
+ * with ID next_id) has a slot of its own. Caller holds the mutex. */
+static int grow_entries(request_queue_t *queue) {
+  /* Live IDs lie in [oldest, next_id], so a ring larger than that span has
+   * no collisions */
+  int oldest = queue->next_id;
+  for (int i = 0; i < queue->capacity; i++) {
+    if (queue->entries[i].id != -1 && queue->entries[i].id < oldest) {
+      oldest = queue->entries[i].id;
+    }
+  }
+
+  int new_capacity = queue->capacity * 2;
+  while (new_capacity <= queue->next_id - oldest) {
+    new_capacity *= 2;
+  }
+
+  if (new_capacity > REQUEST_QUEUE_MAX_CAPACITY) {
+    return -1;
+  }
+
+  request_entry_t *new_entries = malloc(sizeof(request_entry_t) * new_capacity);
+  if (!new_entries) {
+    return -1;
+  }
+
+  for (int i = 0; i < new_capacity; i++) {
+    new_entries[i].id = -1;
+    new_entries[i].request_data = NULL;
+  }
+
+  for (int i = 0; i < queue->capacity; i++) {
+    if (queue->entries[i].id != -1) {
+      new_entries[queue->entries[i].id & (new_capacity - 1)] =
+          queue->entries[i];
+    }
+  }
+
+  free(queue->entries);
+  queue->entries = new_entries;
+  queue->capacity = new_capacity;
+  return 0;
+}
+
+/* Append a request ID to a lane's send FIFO, growing it if needed. Caller
+ * holds the mutex. */
+static int fifo_push(request_lane_queue_t *lane, int req_id) {
+  if (lane->fifo_len == lane->fifo_capacity) {
+    int new_capacity = lane->fifo_capacity * 2;
+    int *new_fifo = malloc(sizeof(int) * new_capacity);
+    if (!new_fifo) {
+      return -1;
+    }
+
+    /* Unwrap the ring so the oldest ID lands at index 0 */
+    for (int i = 0; i < lane->fifo_len; i++) {
+      new_fifo[i] =
+          lane->send_fifo[(lane->fifo_head + i) % lane->fifo_capacity];
+    }
+
+    free(lane->send_fifo);
+    lane->send_fifo = new_fifo;
+    lane->fifo_capacity = new_capacity;
+    lane->fifo_head = 0;
+  }
+
+  int tail = (lane->fifo_head + lane->fifo_len) % lane->fifo_capacity;
+  lane->send_fifo[tail] = req_id;
+  lane->fifo_len++;
+  return 0;
+}
+
+/* Entry of the i-th ID in a lane's FIFO, or NULL if that request is gone.
+ * Caller holds the mutex. */
+static request_entry_t *fifo_at(request_queue_t *queue,
+                                request_lane_queue_t *lane, int i) {
+  return find_entry(queue,
+                    lane->send_fifo[(lane->fifo_head + i) %
+                                    lane->fifo_capacity]);
+}
+
+/* Drop FIFO heads that are no longer QUEUED (sent out of order, or retired).
+ * Caller holds the mutex. */
+static void fifo_trim(request_queue_t *queue, request_lane_queue_t *lane) {
+  while (lane->fifo_len > 0) {
+    request_entry_t *entry = fifo_at(queue, lane, 0);
+    if (entry && entry->state == REQ_STATE_QUEUED) {
+      return;
+    }
+
+    lane->fifo_head = (lane->fifo_head + 1) % lane->fifo_capacity;
+    lane->fifo_len--;
+  }
+}
+
+/* First queued entry of a lane whose debounce window is over (FIFO order
+ * otherwise). Caller holds the mutex. */
+static request_entry_t *fifo_next_due(request_queue_t *queue,
+                                      request_lane_queue_t *lane,
+                                      uint64_t now) {
+  fifo_trim(queue, lane);
+
+  for (int i = 0; i < lane->fifo_len; i++) {
+    request_entry_t *entry = fifo_at(queue, lane, i);
+    if (entry && entry->state == REQ_STATE_QUEUED && entry->not_before <= now) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+/* Queued coalescing request that a new request with `desc` replaces, if any.
+ * Caller holds the mutex. */
+static request_entry_t *find_superseded(request_queue_t *queue,
+                                        const request_desc_t *desc) {
+  request_lane_queue_t *lane = &queue->lanes[desc->lane];
+
+  for (int i = 0; i < lane->fifo_len; i++) {
+    request_entry_t *entry = fifo_at(queue, lane, i);
+    if (entry && entry->state == REQ_STATE_QUEUED && entry->desc.coalesce &&
+        entry->desc.method == desc->method &&
+        entry->desc.component_id == desc->component_id) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
 
 int request_queue_init(request_queue_t *queue) {
   if (!queue) {
@@ -16,15 +197,34 @@ int request_queue_init(request_queue_t *queue) {
     return -1;
   }
 
-  for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
+  queue->entries =
+      malloc(sizeof(request_entry_t) * REQUEST_QUEUE_INITIAL_CAPACITY);
+  int ok = queue->entries != NULL;
+  for (int i = 0; i < REQUEST_LANE_COUNT; i++) {
+    queue->lanes[i].send_fifo =
+        malloc(sizeof(int) * REQUEST_QUEUE_INITIAL_CAPACITY);
+    queue->lanes[i].fifo_capacity = REQUEST_QUEUE_INITIAL_CAPACITY;
+    ok = ok && queue->lanes[i].send_fifo != NULL;
+  }
+  if (!ok) {
+    free(queue->entries);
+    for (int i = 0; i < REQUEST_LANE_COUNT; i++) {
+      free(queue->lanes[i].send_fifo);
+    }
+    pthread_mutex_destroy(&queue->mutex);
+    return -1;
+  }
+  queue->lanes[REQUEST_LANE_INTERACTIVE].max_in_flight =
+      REQUEST_LANE_INTERACTIVE_INFLIGHT;
+  queue->lanes[REQUEST_LANE_CONFIG].max_in_flight =
+      REQUEST_LANE_CONFIG_INFLIGHT;
+  queue->lanes[REQUEST_LANE_BULK].max_in_flight = REQUEST_LANE_BULK_INFLIGHT;
+
+  queue->capacity = REQUEST_QUEUE_INITIAL_CAPACITY;
+  for (int i = 0; i < queue->capacity; i++) {
     queue->entries[i].id = -1;
     queue->entries[i].state = REQ_STATE_PENDING;
     queue->entries[i].request_data = NULL;
-    queue->entries[i].response_data = NULL;
-    if (pthread_cond_init(&queue->entries[i].cond, NULL) != 0) {
-      pthread_mutex_destroy(&queue->mutex);
-      return -1;
-    }
   }
 
   queue->next_id = 1;
@@ -38,93 +238,206 @@ void request_queue_destroy(request_queue_t *queue) {
 
   pthread_mutex_lock(&queue->mutex);
 
-  for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
+  for (int i = 0; i < queue->capacity; i++) {
     if (queue->entries[i].request_data) {
       free(queue->entries[i].request_data);
     }
-    if (queue->entries[i].response_data) {
-      free(queue->entries[i].response_data);
-    }
-    pthread_cond_destroy(&queue->entries[i].cond);
+  }
+  free(queue->entries);
+  queue->entries = NULL;
+  for (int i = 0; i < REQUEST_LANE_COUNT; i++) {
+    free(queue->lanes[i].send_fifo);
+    queue->lanes[i].send_fifo = NULL;
   }
 
   pthread_mutex_unlock(&queue->mutex);
   pthread_mutex_destroy(&queue->mutex);
 }
 
-int request_queue_peek_next_id(request_queue_t *queue) {
+void request_queue_set_debounce(request_queue_t *queue, int ms) {
   if (!queue) {
-    return -1;
+    return;
   }
 
   pthread_mutex_lock(&queue->mutex);
-  int next_id = queue->next_id;
+  queue->debounce_ms = ms > 0 ? ms : 0;
   pthread_mutex_unlock(&queue->mutex);
+}
+
+void request_queue_set_lane_limit(request_queue_t *queue, request_lane_t lane,
+                                  int max_in_flight) {
+  if (!queue || lane < 0 || lane >= REQUEST_LANE_COUNT) {
+    return;
+  }
 
-  return next_id;
+  pthread_mutex_lock(&queue->mutex);
+  queue->lanes[lane].max_in_flight = max_in_flight > 0 ? max_in_flight : 0;
+  pthread_mutex_unlock(&queue->mutex);
 }
 
-int request_queue_add(request_queue_t *queue, const char *request_data) {
-  if (!queue || !request_data) {
+void request_queue_set_notify(request_queue_t *queue, request_notify_fn_t fn,
+                              void *user_data) {
+  if (!queue) {
+    return;
+  }
+
+  pthread_mutex_lock(&queue->mutex);
+  queue->notify_fn = fn;
+  queue->notify_data = user_data;
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+void request_queue_set_retire_hook(request_queue_t *queue,
+                                   request_retire_fn_t fn, void *user_data) {
+  if (!queue) {
+    return;
+  }
+
+  pthread_mutex_lock(&queue->mutex);
+  queue->retire_fn = fn;
+  queue->retire_data = user_data;
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+void request_queue_set_add_hook(request_queue_t *queue, request_added_fn_t fn,
+                                void *user_data) {
+  if (!queue) {
+    return;
+  }
+
+  pthread_mutex_lock(&queue->mutex);
+  queue->added_fn = fn;
+  queue->added_data = user_data;
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+int request_queue_add(request_queue_t *queue, const char *method,
+                      const char *params, const request_desc_t *desc) {
+  if (!queue || !method) {
     return -1;
   }
 
+  request_desc_t d;
+  if (desc) {
+    d = *desc;
+  } else {
+    memset(&d, 0, sizeof(d));
+    d.component_id = -1;
+  }
+  if (d.lane < 0 || d.lane >= REQUEST_LANE_COUNT) {
+    d.lane = REQUEST_LANE_CONFIG;
+  }
+
   pthread_mutex_lock(&queue->mutex);
 
-  int slot = -1;
-  for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
-    if (queue->entries[i].id == -1) {
-      slot = i;
-      break;
-    }
+  /* The slot for the next ID is still held by a request issued `capacity`
+   * IDs ago - make room */
+  if (queue->entries[queue->next_id & (queue->capacity - 1)].id != -1 &&
+      grow_entries(queue) != 0) {
+    pthread_mutex_unlock(&queue->mutex);
+    log_error(LOG_CAT_RPC, "Error: Request queue is full\n");
+    return -1;
   }
 
-  if (slot == -1) {
+  char *data = build_request(method, queue->next_id, params);
+  if (!data || fifo_push(&queue->lanes[d.lane], queue->next_id) != 0) {
     pthread_mutex_unlock(&queue->mutex);
-    fprintf(stderr, "Error: Request queue is full\n");
+    free(data);
+    log_error(LOG_CAT_RPC, "Error: Failed to allocate %s request\n", method);
     return -1;
   }
 
+  /* A burst of coalescing requests is sent once, as its last request, when
+   * the window opened by its first one closes */
+  uint64_t not_before = mg_millis();
+  int superseded_id = -1;
+  request_desc_t superseded_desc;
+  if (d.coalesce) {
+    request_entry_t *old = find_superseded(queue, &d);
+    if (old) {
+      superseded_id = old->id;
+      superseded_desc = old->desc;
+      not_before = old->not_before;
+      retire_entry(queue, old);
+    } else {
+      not_before += (uint64_t) queue->debounce_ms;
+    }
+  }
+
   int req_id = queue->next_id++;
-  queue->entries[slot].id = req_id;
-  queue->entries[slot].state =
-      REQ_STATE_QUEUED; /* Request is queued, not yet sent */
-  queue->entries[slot].request_data = strdup(request_data);
-  queue->entries[slot].response_data = NULL;
-  queue->entries[slot].timestamp = time(NULL);
+  request_entry_t *entry = &queue->entries[req_id & (queue->capacity - 1)];
+  entry->id = req_id;
+  entry->state = REQ_STATE_QUEUED; /* Request is queued, not yet sent */
+  entry->request_data = data;
+  entry->desc = d;
+  entry->timestamp = time(NULL);
+  entry->not_before = not_before;
+  queue->count++;
+
+  /* Run the hooks while still holding the lock, so they cannot be cleared
+   * (and their targets freed) between the check and the call, and the
+   * observer hears of the request before it can be sent and answered */
+  if (queue->added_fn) {
+    queue->added_fn(queue->added_data, req_id);
+  }
+  if (queue->notify_fn) {
+    queue->notify_fn(queue->notify_data);
+  }
+
+  request_retire_fn_t retire_fn = queue->retire_fn;
+  void *retire_data = queue->retire_data;
 
   pthread_mutex_unlock(&queue->mutex);
 
+  stats_add(STATS_REQUESTS_QUEUED, 1);
+  if (superseded_id > 0) {
+    stats_add(STATS_REQUESTS_SUPERSEDED, 1);
+    log_debug(LOG_CAT_RPC, "Request %d superseded by request %d\n",
+              superseded_id, req_id);
+    if (superseded_desc.done_fn) {
+      superseded_desc.done_fn(superseded_id, &superseded_desc, NULL);
+    }
+    if (retire_fn) {
+      retire_fn(retire_data, superseded_id, req_id, NULL);
+    }
+  }
+
   return req_id;
 }
 
 int request_queue_handle_response(request_queue_t *queue, int req_id,
-                                  const char *response_data) {
-  if (!queue || !response_data) {
+                                  const jsonrpc_frame_t *response) {
+  if (!queue || !response) {
     return -1;
   }
 
   pthread_mutex_lock(&queue->mutex);
 
-  int slot = -1;
-  for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
-    if (queue->entries[i].id == req_id &&
-        queue->entries[i].state == REQ_STATE_PENDING) {
-      slot = i;
-      break;
-    }
-  }
-
-  if (slot == -1) {
+  request_entry_t *entry = find_entry(queue, req_id);
+  if (!entry || entry->state != REQ_STATE_PENDING) {
     pthread_mutex_unlock(&queue->mutex);
     return -1;
   }
 
-  queue->entries[slot].response_data = strdup(response_data);
-  queue->entries[slot].state = REQ_STATE_COMPLETED;
-  pthread_cond_signal(&queue->entries[slot].cond);
+  /* The response has already been applied by the caller; nothing waits on
+   * the entry, so free the slot right away */
+  request_desc_t desc = entry->desc;
+  uint64_t sent_ns = entry->sent_ns;
+  entry->state = REQ_STATE_COMPLETED;
+  retire_entry(queue, entry);
+  request_retire_fn_t retire_fn = queue->retire_fn;
+  void *retire_data = queue->retire_data;
 
   pthread_mutex_unlock(&queue->mutex);
+
+  stats_add(STATS_REQUESTS_ANSWERED, 1);
+  stats_rpc(desc.method, stats_now() - sent_ns);
+  if (desc.done_fn) {
+    desc.done_fn(req_id, &desc, response);
+  }
+  if (retire_fn) {
+    retire_fn(retire_data, req_id, 0, response);
+  }
   return 0;
 }
 
@@ -138,26 +451,64 @@ void request_queue_handle_unsolicited(const char *msg, size_t len,
   handler(msg, len, user_data);
 }
 
-void request_queue_cleanup_timeouts(request_queue_t *queue) {
-  if (!queue) {
-    return;
-  }
-
+/* Retire the requests sent at or before `cutoff` as unanswered, saying
+ * `why`. Returns how many there were. */
+static int expire_pending(request_queue_t *queue, time_t cutoff,
+                          const char *why) {
+  int expired = 0;
   pthread_mutex_lock(&queue->mutex);
 
-  time_t now = time(NULL);
-
-  for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
-    if (queue->entries[i].id != -1 &&
-        queue->entries[i].state == REQ_STATE_PENDING &&
-        (now - queue->entries[i].timestamp) > REQUEST_TIMEOUT_SEC) {
-      fprintf(stderr, "Request %d timed out\n", queue->entries[i].id);
-      queue->entries[i].state = REQ_STATE_TIMEOUT;
-      pthread_cond_signal(&queue->entries[i].cond);
+  for (int i = 0; i < queue->capacity && queue->count > 0; i++) {
+    request_entry_t *entry = &queue->entries[i];
+    /* A claimed request whose send failed is as good as lost */
+    if (entry->id != -1 &&
+        (entry->state == REQ_STATE_PENDING ||
+         entry->state == REQ_STATE_SENDING) &&
+        entry->timestamp <= cutoff) {
+      int req_id = entry->id;
+      request_desc_t desc = entry->desc;
+
+      log_warn(LOG_CAT_RPC, "Request %d %s\n", req_id, why);
+      entry->state = REQ_STATE_TIMEOUT;
+      retire_entry(queue, entry);
+      expired++;
+
+      /* The callbacks may queue new requests (and grow the ring), so run
+       * them unlocked; entries moved by a resize are picked up next round */
+      request_retire_fn_t retire_fn = queue->retire_fn;
+      void *retire_data = queue->retire_data;
+      if (desc.done_fn || retire_fn) {
+        pthread_mutex_unlock(&queue->mutex);
+        if (desc.done_fn) {
+          desc.done_fn(req_id, &desc, NULL);
+        }
+        if (retire_fn) {
+          retire_fn(retire_data, req_id, 0, NULL);
+        }
+        pthread_mutex_lock(&queue->mutex);
+      }
     }
   }
 
   pthread_mutex_unlock(&queue->mutex);
+  return expired;
+}
+
+void request_queue_cleanup_timeouts(request_queue_t *queue) {
+  if (!queue) {
+    return;
+  }
+  int expired =
+      expire_pending(queue, time(NULL) - REQUEST_TIMEOUT_SEC - 1, "timed out");
+  stats_add(STATS_REQUESTS_TIMED_OUT, (uint64_t) expired);
+}
+
+void request_queue_fail_pending(request_queue_t *queue) {
+  if (!queue) {
+    return;
+  }
+  int lost = expire_pending(queue, time(NULL), "lost with the connection");
+  stats_add(STATS_REQUESTS_LOST, (uint64_t) lost);
 }
 
 const char *request_queue_get_request_data(request_queue_t *queue, int req_id) {
@@ -167,18 +518,30 @@ const char *request_queue_get_request_data(request_queue_t *queue, int req_id) {
 
   pthread_mutex_lock(&queue->mutex);
 
-  const char *result = NULL;
-  for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
-    if (queue->entries[i].id == req_id) {
-      result = queue->entries[i].request_data;
-      break;
-    }
-  }
+  request_entry_t *entry = find_entry(queue, req_id);
+  const char *result = entry ? entry->request_data : NULL;
 
   pthread_mutex_unlock(&queue->mutex);
   return result;
 }
 
+int request_queue_get_desc(request_queue_t *queue, int req_id,
+                           request_desc_t *desc) {
+  if (!queue || !desc) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&queue->mutex);
+
+  request_entry_t *entry = find_entry(queue, req_id);
+  if (entry) {
+    *desc = entry->desc;
+  }
+
+  pthread_mutex_unlock(&queue->mutex);
+  return entry ? 0 : -1;
+}
+
 int request_queue_get_next_to_send(request_queue_t *queue, char **request_data,
                                    int *req_id) {
   if (!queue || !request_data || !req_id) {
@@ -187,16 +550,37 @@ int request_queue_get_next_to_send(request_queue_t *queue, char **request_data,
 
   pthread_mutex_lock(&queue->mutex);
 
-  /* Find the first queued request */
-  for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
-    if (queue->entries[i].id != -1 &&
-        queue->entries[i].state == REQ_STATE_QUEUED) {
-      *req_id = queue->entries[i].id;
-      *request_data = queue->entries[i].request_data;
-      pthread_mutex_unlock(&queue->mutex);
-      return 0;
+  /* Oldest queued request that isn't held back, from the first lane in
+   * priority order that has one and room for it in flight */
+  static const request_lane_t order[] = {REQUEST_LANE_INTERACTIVE,
+                                         REQUEST_LANE_CONFIG,
+                                         REQUEST_LANE_BULK};
+  uint64_t now = mg_millis();
+  request_entry_t *entry = NULL;
+  for (int i = 0; i < REQUEST_LANE_COUNT && !entry; i++) {
+    request_lane_queue_t *lane = &queue->lanes[order[i]];
+    if (lane->max_in_flight == 0 || lane->in_flight < lane->max_in_flight) {
+      entry = fifo_next_due(queue, lane, now);
     }
   }
+  if (entry) {
+    /* Claim it, so a coalescing request queued while it is written out
+     * cannot retire it (and free its data) under the sender. It takes its
+     * lane's in-flight slot from now on. */
+    entry->state = REQ_STATE_SENDING;
+    entry->timestamp = time(NULL);
+    request_lane_queue_t *lane = &queue->lanes[entry->desc.lane];
+    lane->in_flight++;
+
+    /* Normally the request being sent is its lane's FIFO head; pop it.
+     * Anything else is skipped lazily by fifo_trim(). */
+    fifo_trim(queue, lane);
+
+    *req_id = entry->id;
+    *request_data = entry->request_data;
+    pthread_mutex_unlock(&queue->mutex);
+    return 0;
+  }
 
   pthread_mutex_unlock(&queue->mutex);
   return -1; /* No queued requests */
@@ -209,53 +593,146 @@ int request_queue_mark_sent(request_queue_t *queue, int req_id) {
 
   pthread_mutex_lock(&queue->mutex);
 
-  /* Find the request and mark it as sent */
-  for (int i = 0; i < MAX_PENDING_REQUESTS; i++) {
-    if (queue->entries[i].id == req_id) {
-      if (queue->entries[i].state == REQ_STATE_QUEUED) {
-        queue->entries[i].state = REQ_STATE_PENDING;
-        queue->entries[i].timestamp =
-            time(NULL); /* Reset timestamp for timeout tracking */
-        pthread_mutex_unlock(&queue->mutex);
-        return 0;
-      } else {
-        pthread_mutex_unlock(&queue->mutex);
-        return -1; /* Request not in QUEUED state */
+  request_entry_t *entry = find_entry(queue, req_id);
+  if (!entry) {
+    pthread_mutex_unlock(&queue->mutex);
+    return -1; /* Request not found */
+  }
+
+  if (entry->state != REQ_STATE_SENDING) {
+    pthread_mutex_unlock(&queue->mutex);
+    return -1; /* Request not claimed for sending */
+  }
+
+  entry->state = REQ_STATE_PENDING;
+  entry->timestamp = time(NULL); /* Reset timestamp for timeout tracking */
+  entry->sent_ns = stats_now();
+
+  pthread_mutex_unlock(&queue->mutex);
+  stats_add(STATS_REQUESTS_SENT, 1);
+  return 0;
+}
+
+int request_queue_next_due_ms(request_queue_t *queue) {
+  if (!queue) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&queue->mutex);
+
+  uint64_t now = mg_millis();
+  int delay = -1;
+  for (int l = 0; l < REQUEST_LANE_COUNT; l++) {
+    request_lane_queue_t *lane = &queue->lanes[l];
+    for (int i = 0; i < lane->fifo_len; i++) {
+      request_entry_t *entry = fifo_at(queue, lane, i);
+      if (entry && entry->state == REQ_STATE_QUEUED &&
+          entry->not_before > now) {
+        int due = (int) (entry->not_before - now);
+        if (delay < 0 || due < delay) {
+          delay = due;
+        }
       }
     }
   }
 
   pthread_mutex_unlock(&queue->mutex);
-  return -1; /* Request not found */
+  return delay;
 }
 
-int jsonrpc_parse_id(const char *json, size_t len) {
-  if (!json || len == 0) {
-    return -1;
+void request_queue_get_depth(request_queue_t *queue,
+                             int queued[REQUEST_LANE_COUNT],
+                             int in_flight[REQUEST_LANE_COUNT]) {
+  for (int l = 0; l < REQUEST_LANE_COUNT; l++) {
+    queued[l] = 0;
+    in_flight[l] = 0;
   }
+  if (!queue) {
+    return;
+  }
+
+  pthread_mutex_lock(&queue->mutex);
 
-  double id_val = 0;
-  if (mg_json_get_num(mg_str_n(json, len), "$.id", &id_val)) {
-    return (int) id_val;
+  for (int i = 0; i < queue->capacity; i++) {
+    request_entry_t *entry = &queue->entries[i];
+    if (entry->id != -1 && entry->state == REQ_STATE_QUEUED) {
+      queued[entry->desc.lane]++;
+    }
+  }
+  for (int l = 0; l < REQUEST_LANE_COUNT; l++) {
+    in_flight[l] = queue->lanes[l].in_flight;
   }
 
-  return -1;
+  pthread_mutex_unlock(&queue->mutex);
 }
 
-int jsonrpc_is_response(const char *json, size_t len) {
-  if (!json || len == 0) {
-    printf("Not a response definitely\n");
-    return 0;
+int jsonrpc_classify_frame(const char *json, size_t len,
+                           jsonrpc_frame_t *frame) {
+  if (!frame) {
+    return -1;
+  }
+
+  memset(frame, 0, sizeof(*frame));
+  frame->id = -1;
+
+  if (!json || len < 2 || json[0] != '{') {
+    return -1;
   }
 
-  struct mg_str json_str = mg_str_n(json, len);
+  /* Walk the top-level members once; values are only delimited, not parsed,
+   * except for the small "id" and "method" tokens */
+  struct mg_str obj = mg_str_n(json, len);
+  struct mg_str key, val;
+  size_t ofs = 0;
+  int has_result = 0;
 
-  /* Check if $.result or $.error exists (returns non-negative if found) */
-  int result_pos = mg_json_get(json_str, "$.result", NULL);
-  int error_pos = mg_json_get(json_str, "$.error", NULL);
+  while ((ofs = mg_json_next(obj, ofs, &key, &val)) > 0) {
+    if (key.len < 2) {
+      continue;
+    }
+    struct mg_str name = mg_str_n(key.buf + 1, key.len - 2);
 
-  /* Response if either result or error exists */
-  int is_resp = (result_pos >= 0 || error_pos >= 0) ? 1 : 0;
+    if (mg_strcmp(name, mg_str("id")) == 0) {
+      double id_val = 0;
+      if (mg_json_get_num(val, "$", &id_val)) {
+        frame->id = (int) id_val;
+      }
+    } else if (mg_strcmp(name, mg_str("method")) == 0) {
+      if (val.len >= 2 && val.buf[0] == '"') {
+        frame->method = val.buf + 1;
+        frame->method_len = val.len - 2;
+      }
+    } else if (mg_strcmp(name, mg_str("result")) == 0) {
+      frame->result = val.buf;
+      frame->result_len = val.len;
+      has_result = 1;
+    } else if (mg_strcmp(name, mg_str("error")) == 0) {
+      frame->result = val.buf;
+      frame->result_len = val.len;
+      frame->is_error = 1;
+      has_result = 1;
+    } else if (mg_strcmp(name, mg_str("params")) == 0) {
+      frame->params = val.buf;
+      frame->params_len = val.len;
+    }
+  }
+
+  if (has_result) {
+    frame->kind = JSONRPC_FRAME_RESPONSE;
+  } else if (frame->method) {
+    frame->kind = JSONRPC_FRAME_NOTIFICATION;
+  } else {
+    frame->kind = JSONRPC_FRAME_OTHER;
+  }
+
+  return 0;
+}
+
+int jsonrpc_frame_method_is(const jsonrpc_frame_t *frame, const char *method) {
+  if (!frame || !frame->method || !method) {
+    return 0;
+  }
 
-  return is_resp;
+  return mg_strcmp(mg_str_n(frame->method, frame->method_len),
+                   mg_str(method)) == 0;
 }
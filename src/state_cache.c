@@ -0,0 +1,290 @@
+#include "../include/state_cache.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "../include/log.h"
+#include "../include/mongoose.h"
+
+/* ============================================================================
+ * CACHE FILE LOCATION
+ * ============================================================================
+ */
+
+int state_cache_path(const char *dir, const char *url, char *buf,
+                     size_t size) {
+  if (!dir || !url || !buf || size == 0) {
+    return -1;
+  }
+
+  /* Name the file after the URL without its scheme, keeping only characters
+   * that are safe in a file name */
+  const char *name = strstr(url, "://");
+  name = name ? name + 3 : url;
+
+  int n = snprintf(buf, size, "%s/", dir);
+  if (n < 0 || (size_t) n >= size) {
+    return -1;
+  }
+
+  size_t pos = (size_t) n;
+  for (; *name && pos + 1 < size; name++) {
+    char ch = *name;
+    int safe = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+               (ch >= '0' && ch <= '9') || ch == '.' || ch == '-';
+    buf[pos++] = safe ? ch : '_';
+  }
+  buf[pos] = '\0';
+
+  if (*name || strlen(buf) + 6 > size) {
+    return -1;
+  }
+  strcat(buf, ".json");
+
+  return 0;
+}
+
+/* ============================================================================
+ * SAVING
+ * ============================================================================
+ */
+
+/* Write a JSON string literal */
+static void put_json_str(FILE *out, const char *str) {
+  char *esc = mg_mprintf("%m", MG_ESC(str ? str : ""));
+  if (esc) {
+    fputs(esc, out);
+    free(esc);
+  }
+}
+
+/* Serialize the cached parts of the state (caller holds the state lock) */
+static void write_snapshot_locked(device_state_t *state, FILE *out) {
+  fprintf(out, "{\"version\":%d,\"config\":{", STATE_CACHE_VERSION);
+
+  /* Component configs, keyed like a Shelly.GetConfig result */
+  fprintf(out, "\"sys\":%s", state->sys_config.raw_json);
+  if (state->mqtt_config.valid && state->mqtt_config.raw_json) {
+    fprintf(out, ",\"mqtt\":%s", state->mqtt_config.raw_json);
+  }
+  for (int i = 0; i < MAX_SWITCHES; i++) {
+    switch_config_t *sw = state->switches.switches[i];
+    if (sw && sw->valid && sw->raw_json) {
+      fprintf(out, ",\"switch:%d\":%s", i, sw->raw_json);
+    }
+  }
+  for (int i = 0; i < MAX_INPUTS; i++) {
+    input_config_t *inp = state->inputs.inputs[i];
+    if (inp && inp->valid && inp->raw_json) {
+      fprintf(out, ",\"input:%d\":%s", i, inp->raw_json);
+    }
+  }
+
+  /* Script list, shaped like a Script.List result */
+  fputs("},\"scripts\":{\"scripts\":[", out);
+  int first = 1;
+  for (int i = 0; i < MAX_SCRIPTS; i++) {
+    script_entry_t *script = &state->scripts.scripts[i];
+    if (!script->valid) {
+      continue;
+    }
+    fprintf(out, "%s{\"id\":%d,\"name\":", first ? "" : ",", i);
+    put_json_str(out, script->name);
+    fprintf(out, ",\"enable\":%s}", script->enable ? "true" : "false");
+    first = 0;
+  }
+
+  /* Script code for the scripts that have it loaded */
+  fputs("]},\"code\":{", out);
+  first = 1;
+  for (int i = 0; i < MAX_SCRIPTS; i++) {
+    script_entry_t *script = &state->scripts.scripts[i];
+    if (!script->valid || !script->code) {
+      continue;
+    }
+    fprintf(out, "%s\"%d\":", first ? "" : ",", i);
+    put_json_str(out, script->code);
+    first = 0;
+  }
+
+  /* Schedules, shaped like a Schedule.List result */
+  fputs("},\"schedules\":{\"jobs\":[", out);
+  first = 1;
+  for (int i = 0; i < state->schedules.count; i++) {
+    schedule_entry_t *sched = &state->schedules.schedules[i];
+    if (!sched->valid) {
+      continue;
+    }
+    fprintf(out, "%s{\"id\":%d,\"enable\":%s,\"timespec\":",
+            first ? "" : ",", sched->id, sched->enable ? "true" : "false");
+    put_json_str(out, sched->timespec);
+    fputs(",\"calls\":[", out);
+    for (int j = 0; j < sched->call_count; j++) {
+      fprintf(out, "%s{\"method\":", j ? "," : "");
+      put_json_str(out, sched->calls[j].method);
+      if (sched->calls[j].params_json) {
+        fprintf(out, ",\"params\":%s", sched->calls[j].params_json);
+      }
+      fputc('}', out);
+    }
+    fputs("]}", out);
+    first = 0;
+  }
+  fprintf(out, "],\"rev\":%d}}\n", state->schedules.rev);
+}
+
+int state_cache_save(device_state_t *state, const char *path) {
+  if (!state || !path) {
+    return -1;
+  }
+
+  /* Serialize to memory under the read lock, write the file after */
+  char *data = NULL;
+  size_t data_len = 0;
+  FILE *mem = open_memstream(&data, &data_len);
+  if (!mem) {
+    return -1;
+  }
+
+  pthread_rwlock_rdlock(&state->lock);
+  int have_state = state->sys_config.valid && state->sys_config.raw_json;
+  if (have_state) {
+    write_snapshot_locked(state, mem);
+  }
+  pthread_rwlock_unlock(&state->lock);
+
+  fclose(mem);
+
+  if (!have_state) {
+    /* Nothing fetched yet; keep whatever snapshot is on disk */
+    free(data);
+    return -1;
+  }
+
+  /* Write next to the cache file and rename over it, so a crash never
+   * leaves a truncated snapshot behind */
+  char tmp_path[PATH_MAX];
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+      (int) sizeof(tmp_path)) {
+    free(data);
+    return -1;
+  }
+
+  FILE *out = fopen(tmp_path, "w");
+  if (!out) {
+    log_error(LOG_CAT_CACHE, "Error: Cannot write state cache %s: %s\n",
+              tmp_path, strerror(errno));
+    free(data);
+    return -1;
+  }
+
+  size_t written = fwrite(data, 1, data_len, out);
+  int close_err = fclose(out);
+  free(data);
+
+  if (written != data_len || close_err != 0 || rename(tmp_path, path) != 0) {
+    log_error(LOG_CAT_CACHE, "Error: Failed to save state cache %s\n", path);
+    remove(tmp_path);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ============================================================================
+ * LOADING
+ * ============================================================================
+ */
+
+/* Read a whole file into a NUL-terminated buffer */
+static char *read_file(const char *path, size_t *len) {
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    return NULL;
+  }
+
+  char *buf = NULL;
+  struct stat st;
+  if (fstat(fileno(in), &st) == 0 && st.st_size > 0) {
+    buf = malloc((size_t) st.st_size + 1);
+    if (buf) {
+      *len = fread(buf, 1, (size_t) st.st_size, in);
+      buf[*len] = '\0';
+    }
+  }
+
+  fclose(in);
+  return buf;
+}
+
+/* Present a cached section as a successful response frame so the regular
+ * response parsers can apply it. The frame points into `json`. Returns 0 if
+ * the section exists. */
+static int section_frame(struct mg_str json, const char *path,
+                         jsonrpc_frame_t *frame) {
+  int len = 0;
+  int pos = mg_json_get(json, path, &len);
+  if (pos < 0 || len <= 0) {
+    return -1;
+  }
+  memset(frame, 0, sizeof(*frame));
+  frame->kind = JSONRPC_FRAME_RESPONSE;
+  frame->result = json.buf + pos;
+  frame->result_len = (size_t) len;
+  return 0;
+}
+
+int state_cache_load(device_state_t *state, const char *path) {
+  if (!state || !path) {
+    return -1;
+  }
+
+  size_t len = 0;
+  char *data = read_file(path, &len);
+  if (!data) {
+    return -1; /* No snapshot yet */
+  }
+
+  struct mg_str json = mg_str_n(data, len);
+  if (mg_json_get_long(json, "$.version", 0) != STATE_CACHE_VERSION) {
+    log_warn(LOG_CAT_CACHE,
+             "Warning: Ignoring state cache %s (unknown version)\n", path);
+    free(data);
+    return -1;
+  }
+
+  /* Configs first: they mark components valid */
+  discovery_result_t found;
+  jsonrpc_frame_t section;
+  int ret = section_frame(json, "$.config", &section) == 0
+                ? device_state_update_device_config(state, &section, &found)
+                : -1;
+  if (ret != 0 || !found.has_sys) {
+    log_warn(LOG_CAT_CACHE,
+             "Warning: Ignoring state cache %s (no sys config)\n", path);
+    free(data);
+    return -1;
+  }
+
+  if (section_frame(json, "$.scripts", &section) == 0) {
+    device_state_update_script_list(state, &section);
+  }
+
+  for (int i = 0; i < MAX_SCRIPTS; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), "$.code.%d", i);
+    char *code = mg_json_get_str(json, key);
+    if (code) {
+      device_state_restore_script_code(state, i, code);
+    }
+  }
+
+  if (section_frame(json, "$.schedules", &section) == 0) {
+    device_state_update_schedule_list(state, &section);
+  }
+
+  free(data);
+  return 0;
+}
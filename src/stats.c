@@ -0,0 +1,430 @@
+#include "../include/stats.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/device_state.h"
+
+/* ============================================================================
+ * SHARDS
+ * ============================================================================
+ *
+ * Each counting thread owns one shard and is its only writer, so an update
+ * is a relaxed load and store instead of a locked read-modify-write. Shards
+ * are pushed onto a list readers walk without a lock, and never freed: when
+ * a thread exits (FUSE retires idle workers) its shard is handed to the next
+ * new thread, keeping its counts.
+ */
+
+/* Upper bounds of the latency buckets in microseconds; a last bucket counts
+ * everything slower */
+static const unsigned int s_bucket_us[] = {
+    10,    25,    50,     100,    250,    500,     1000,    2500,
+    5000,  10000, 25000,  50000,  100000, 250000,  500000,  1000000,
+};
+#define STATS_BUCKETS (sizeof(s_bucket_us) / sizeof(s_bucket_us[0]) + 1)
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t buckets[STATS_BUCKETS];
+} stats_histogram_t;
+
+/* Shards start on a cache line and fill whole lines, so two threads' shards
+ * never share one */
+#define STATS_CACHE_LINE 64
+
+typedef struct stats_shard {
+  uint64_t counters[STATS_COUNTER_COUNT];
+  stats_histogram_t fuse_ops[STATS_FUSE_OP_COUNT];
+  stats_histogram_t rpc[RESPONSE_TYPE_COUNT];
+  stats_histogram_t notification;
+  int in_use;               /* Owned by a live thread */
+  struct stats_shard *next; /* In g_shards */
+} __attribute__((aligned(STATS_CACHE_LINE))) stats_shard_t;
+
+static stats_shard_t *g_shards = NULL;
+static pthread_key_t g_shard_key;
+static pthread_once_t g_shard_once = PTHREAD_ONCE_INIT;
+static _Thread_local stats_shard_t *t_shard = NULL;
+static uint64_t g_start_ns = 0;
+
+/* Thread exit: free the shard for adoption */
+static void shard_release(void *arg) {
+  stats_shard_t *shard = (stats_shard_t *) arg;
+  __atomic_store_n(&shard->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void shard_key_init(void) {
+  pthread_key_create(&g_shard_key, shard_release);
+}
+
+/* The calling thread's shard: adopted from an exited thread, or new. NULL if
+ * out of memory (the update is dropped). */
+static stats_shard_t *shard_get(void) {
+  if (t_shard) {
+    return t_shard;
+  }
+  pthread_once(&g_shard_once, shard_key_init);
+
+  stats_shard_t *shard = __atomic_load_n(&g_shards, __ATOMIC_ACQUIRE);
+  for (; shard; shard = shard->next) {
+    int idle = 0;
+    if (__atomic_compare_exchange_n(&shard->in_use, &idle, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+
+  if (!shard) {
+    shard = aligned_alloc(STATS_CACHE_LINE, sizeof(*shard));
+    if (!shard) {
+      return NULL;
+    }
+    memset(shard, 0, sizeof(*shard));
+    shard->in_use = 1;
+    shard->next = __atomic_load_n(&g_shards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&g_shards, &shard->next, shard, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+  }
+
+  pthread_setspecific(g_shard_key, shard);
+  t_shard = shard;
+  return shard;
+}
+
+/* Add to a value of the own shard (single writer) */
+static void bump(uint64_t *value, uint64_t n) {
+  __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+static uint64_t peek(const uint64_t *value) {
+  return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static void histogram_record(stats_histogram_t *h, uint64_t ns) {
+  size_t bucket = 0;
+  while (bucket < STATS_BUCKETS - 1 &&
+         ns > (uint64_t) s_bucket_us[bucket] * 1000) {
+    bucket++;
+  }
+  bump(&h->count, 1);
+  bump(&h->sum_ns, ns);
+  bump(&h->buckets[bucket], 1);
+  if (ns > peek(&h->max_ns)) {
+    __atomic_store_n(&h->max_ns, ns, __ATOMIC_RELAXED);
+  }
+}
+
+/* Add a shard's histogram into `sum` */
+static void histogram_merge(stats_histogram_t *sum,
+                            const stats_histogram_t *h) {
+  sum->count += peek(&h->count);
+  sum->sum_ns += peek(&h->sum_ns);
+  uint64_t max_ns = peek(&h->max_ns);
+  if (max_ns > sum->max_ns) {
+    sum->max_ns = max_ns;
+  }
+  for (size_t i = 0; i < STATS_BUCKETS; i++) {
+    sum->buckets[i] += peek(&h->buckets[i]);
+  }
+}
+
+/* ============================================================================
+ * COUNTING
+ * ============================================================================
+ */
+
+void stats_init(void) {
+  g_start_ns = stats_now();
+}
+
+uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+void stats_add(stats_counter_t counter, uint64_t n) {
+  stats_shard_t *shard = shard_get();
+  if (shard && counter >= 0 && counter < STATS_COUNTER_COUNT) {
+    bump(&shard->counters[counter], n);
+  }
+}
+
+void stats_fuse_op(stats_fuse_op_t op, uint64_t start) {
+  stats_shard_t *shard = shard_get();
+  if (shard && op >= 0 && op < STATS_FUSE_OP_COUNT) {
+    histogram_record(&shard->fuse_ops[op], stats_now() - start);
+  }
+}
+
+void stats_rpc(int method, uint64_t rtt_ns) {
+  stats_shard_t *shard = shard_get();
+  if (shard && method >= 0 && method < RESPONSE_TYPE_COUNT) {
+    histogram_record(&shard->rpc[method], rtt_ns);
+  }
+}
+
+void stats_notification(uint64_t parse_ns) {
+  stats_shard_t *shard = shard_get();
+  if (shard) {
+    histogram_record(&shard->notification, parse_ns);
+  }
+}
+
+/* ============================================================================
+ * RENDERING
+ * ============================================================================
+ */
+
+static const char *const s_counter_names[STATS_COUNTER_COUNT] = {
+    [STATS_REQUESTS_QUEUED] = "requests_queued",
+    [STATS_REQUESTS_SENT] = "requests_sent",
+    [STATS_REQUESTS_ANSWERED] = "requests_answered",
+    [STATS_REQUESTS_SUPERSEDED] = "requests_superseded",
+    [STATS_REQUESTS_TIMED_OUT] = "requests_timed_out",
+    [STATS_REQUESTS_LOST] = "requests_lost",
+    [STATS_FRAMES_RECEIVED] = "frames_received",
+    [STATS_BYTES_SENT] = "bytes_sent",
+    [STATS_BYTES_RECEIVED] = "bytes_received",
+    [STATS_CONNECTS] = "connects",
+    [STATS_DISCONNECTS] = "disconnects",
+    [STATS_RECONNECT_ATTEMPTS] = "reconnect_attempts",
+    [STATS_LOG_DROPPED] = "log_dropped",
+};
+
+static const char *const s_fuse_op_names[STATS_FUSE_OP_COUNT] = {
+    [STATS_FUSE_GETATTR] = "getattr", [STATS_FUSE_READDIR] = "readdir",
+    [STATS_FUSE_OPEN] = "open",       [STATS_FUSE_READ] = "read",
+    [STATS_FUSE_WRITE] = "write",     [STATS_FUSE_TRUNCATE] = "truncate",
+    [STATS_FUSE_FLUSH] = "flush",     [STATS_FUSE_RELEASE] = "release",
+    [STATS_FUSE_POLL] = "poll",
+};
+
+/* JSON-RPC method of each request tag */
+static const char *const s_method_names[RESPONSE_TYPE_COUNT] = {
+    [RESPONSE_TYPE_UNKNOWN] = "other",
+    [RESPONSE_TYPE_SYS_GETCONFIG] = "Sys.GetConfig",
+    [RESPONSE_TYPE_SYS_SETCONFIG] = "Sys.SetConfig",
+    [RESPONSE_TYPE_MQTT_GETCONFIG] = "MQTT.GetConfig",
+    [RESPONSE_TYPE_MQTT_SETCONFIG] = "MQTT.SetConfig",
+    [RESPONSE_TYPE_SWITCH_GETCONFIG] = "Switch.GetConfig",
+    [RESPONSE_TYPE_SWITCH_SETCONFIG] = "Switch.SetConfig",
+    [RESPONSE_TYPE_SWITCH_SET] = "Switch.Set",
+    [RESPONSE_TYPE_SWITCH_GETSTATUS] = "Switch.GetStatus",
+    [RESPONSE_TYPE_INPUT_GETCONFIG] = "Input.GetConfig",
+    [RESPONSE_TYPE_INPUT_SETCONFIG] = "Input.SetConfig",
+    [RESPONSE_TYPE_INPUT_GETSTATUS] = "Input.GetStatus",
+    [RESPONSE_TYPE_SCRIPT_LIST] = "Script.List",
+    [RESPONSE_TYPE_SCRIPT_GETCODE] = "Script.GetCode",
+    [RESPONSE_TYPE_SCRIPT_PUTCODE] = "Script.PutCode",
+    [RESPONSE_TYPE_SCRIPT_CREATE] = "Script.Create",
+    [RESPONSE_TYPE_SCRIPT_DELETE] = "Script.Delete",
+    [RESPONSE_TYPE_SCHEDULE_LIST] = "Schedule.List",
+    [RESPONSE_TYPE_SCHEDULE_CREATE] = "Schedule.Create",
+    [RESPONSE_TYPE_SCHEDULE_UPDATE] = "Schedule.Update",
+    [RESPONSE_TYPE_SCHEDULE_DELETE] = "Schedule.Delete",
+    [RESPONSE_TYPE_SHELLY_GETCONFIG] = "Shelly.GetConfig",
+    [RESPONSE_TYPE_SHELLY_GETSTATUS] = "Shelly.GetStatus",
+    [RESPONSE_TYPE_OTHER] = "other",
+};
+
+static const char *const s_lane_names[REQUEST_LANE_COUNT] = {
+    [REQUEST_LANE_CONFIG] = "config",
+    [REQUEST_LANE_INTERACTIVE] = "interactive",
+    [REQUEST_LANE_BULK] = "bulk",
+};
+
+/* Every shard added up */
+typedef struct {
+  uint64_t counters[STATS_COUNTER_COUNT];
+  stats_histogram_t fuse_ops[STATS_FUSE_OP_COUNT];
+  stats_histogram_t rpc[RESPONSE_TYPE_COUNT];
+  stats_histogram_t notification;
+} stats_totals_t;
+
+static void totals_collect(stats_totals_t *totals) {
+  memset(totals, 0, sizeof(*totals));
+  stats_shard_t *shard = __atomic_load_n(&g_shards, __ATOMIC_ACQUIRE);
+  for (; shard; shard = shard->next) {
+    for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+      totals->counters[i] += peek(&shard->counters[i]);
+    }
+    for (int i = 0; i < STATS_FUSE_OP_COUNT; i++) {
+      histogram_merge(&totals->fuse_ops[i], &shard->fuse_ops[i]);
+    }
+    for (int i = 0; i < RESPONSE_TYPE_COUNT; i++) {
+      histogram_merge(&totals->rpc[i], &shard->rpc[i]);
+    }
+    histogram_merge(&totals->notification, &shard->notification);
+  }
+}
+
+/* Estimated quantile in microseconds: the upper bound of the bucket it
+ * falls in, or the maximum if that is lower */
+static double histogram_quantile_us(const stats_histogram_t *h, double q) {
+  double max_us = (double) h->max_ns / 1000.0;
+  uint64_t rank = (uint64_t) ((double) h->count * q + 0.5);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < STATS_BUCKETS - 1; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank && seen > 0) {
+      return s_bucket_us[i] < max_us ? s_bucket_us[i] : max_us;
+    }
+  }
+  return max_us;
+}
+
+/* "<family> <name> count N avg A p50 P p90 P p99 P max M" (microseconds),
+ * skipped when nothing was recorded */
+static void histogram_text(FILE *out, const char *family, const char *name,
+                           const stats_histogram_t *h) {
+  if (h->count == 0) {
+    return;
+  }
+  fprintf(out,
+          "%s %s count %llu avg %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+          family, name, (unsigned long long) h->count,
+          (double) h->sum_ns / 1000.0 / (double) h->count,
+          histogram_quantile_us(h, 0.50), histogram_quantile_us(h, 0.90),
+          histogram_quantile_us(h, 0.99), (double) h->max_ns / 1000.0);
+}
+
+static void histogram_json(FILE *out, const char *name,
+                           const stats_histogram_t *h, int first) {
+  fprintf(out,
+          "%s\"%s\":{\"count\":%llu,\"sum_us\":%.1f,\"max_us\":%.1f,"
+          "\"buckets\":[",
+          first ? "" : ",", name, (unsigned long long) h->count,
+          (double) h->sum_ns / 1000.0, (double) h->max_ns / 1000.0);
+  for (size_t i = 0; i < STATS_BUCKETS; i++) {
+    fprintf(out, "%s%llu", i ? "," : "", (unsigned long long) h->buckets[i]);
+  }
+  fputs("]}", out);
+}
+
+static void render_text(FILE *out, const stats_totals_t *totals,
+                        const stats_source_t *sources, int source_count) {
+  fprintf(out, "uptime_seconds %.0f\n",
+          (double) (stats_now() - g_start_ns) / 1e9);
+  for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+    fprintf(out, "%s %llu\n", s_counter_names[i],
+            (unsigned long long) totals->counters[i]);
+  }
+
+  for (int i = 0; i < source_count; i++) {
+    int queued[REQUEST_LANE_COUNT];
+    int in_flight[REQUEST_LANE_COUNT];
+    request_queue_get_depth(sources[i].queue, queued, in_flight);
+    for (int l = 0; l < REQUEST_LANE_COUNT; l++) {
+      fprintf(out, "queue %s %s queued %d in_flight %d\n",
+              sources[i].name ? sources[i].name : "-", s_lane_names[l],
+              queued[l], in_flight[l]);
+    }
+  }
+
+  /* Durations, in microseconds */
+  for (int i = 0; i < RESPONSE_TYPE_COUNT; i++) {
+    histogram_text(out, "rtt_us", s_method_names[i], &totals->rpc[i]);
+  }
+  histogram_text(out, "notification_us", "parse", &totals->notification);
+  for (int i = 0; i < STATS_FUSE_OP_COUNT; i++) {
+    histogram_text(out, "fuse_us", s_fuse_op_names[i], &totals->fuse_ops[i]);
+  }
+}
+
+static void render_json(FILE *out, const stats_totals_t *totals,
+                        const stats_source_t *sources, int source_count) {
+  fprintf(out, "{\"uptime_seconds\":%.0f,\"counters\":{",
+          (double) (stats_now() - g_start_ns) / 1e9);
+  for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+    fprintf(out, "%s\"%s\":%llu", i ? "," : "", s_counter_names[i],
+            (unsigned long long) totals->counters[i]);
+  }
+
+  /* Device names are restricted to file name characters (device_list.h),
+   * none of which needs escaping */
+  fputs("},\"queues\":[", out);
+  for (int i = 0; i < source_count; i++) {
+    int queued[REQUEST_LANE_COUNT];
+    int in_flight[REQUEST_LANE_COUNT];
+    request_queue_get_depth(sources[i].queue, queued, in_flight);
+    if (sources[i].name) {
+      fprintf(out, "%s{\"device\":\"%s\"", i ? "," : "", sources[i].name);
+    } else {
+      fprintf(out, "%s{\"device\":null", i ? "," : "");
+    }
+    for (int l = 0; l < REQUEST_LANE_COUNT; l++) {
+      fprintf(out, ",\"%s\":{\"queued\":%d,\"in_flight\":%d}",
+              s_lane_names[l], queued[l], in_flight[l]);
+    }
+    fputc('}', out);
+  }
+
+  fputs("],\"bucket_le_us\":[", out);
+  for (size_t i = 0; i < STATS_BUCKETS - 1; i++) {
+    fprintf(out, "%s%u", i ? "," : "", s_bucket_us[i]);
+  }
+
+  /* Both tags of unclassified requests render as "other": merge them */
+  stats_histogram_t other = totals->rpc[RESPONSE_TYPE_OTHER];
+  histogram_merge(&other, &totals->rpc[RESPONSE_TYPE_UNKNOWN]);
+  fputs("],\"rtt\":{", out);
+  int first = 1;
+  for (int i = 0; i < RESPONSE_TYPE_COUNT; i++) {
+    const stats_histogram_t *h =
+        i == RESPONSE_TYPE_OTHER ? &other : &totals->rpc[i];
+    if (i != RESPONSE_TYPE_UNKNOWN && h->count > 0) {
+      histogram_json(out, s_method_names[i], h, first);
+      first = 0;
+    }
+  }
+
+  fputs("},\"notification_parse\":{", out);
+  histogram_json(out, "parse", &totals->notification, 1);
+  fputs("},\"fuse\":{", out);
+  for (int i = 0; i < STATS_FUSE_OP_COUNT; i++) {
+    histogram_json(out, s_fuse_op_names[i], &totals->fuse_ops[i], i == 0);
+  }
+  fputs("}}\n", out);
+}
+
+int stats_render(int json, const stats_source_t *sources, int source_count,
+                 char **out, size_t *len) {
+  if (!out || !len) {
+    return -1;
+  }
+
+  stats_totals_t *totals = malloc(sizeof(*totals));
+  if (!totals) {
+    return -1;
+  }
+  totals_collect(totals);
+
+  char *buf = NULL;
+  size_t buf_len = 0;
+  FILE *mem = open_memstream(&buf, &buf_len);
+  if (!mem) {
+    free(totals);
+    return -1;
+  }
+  if (json) {
+    render_json(mem, totals, sources, source_count);
+  } else {
+    render_text(mem, totals, sources, source_count);
+  }
+  free(totals);
+  if (fclose(mem) != 0) {
+    free(buf);
+    return -1;
+  }
+
+  *out = buf;
+  *len = buf_len;
+  return 0;
+}
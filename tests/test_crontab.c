@@ -0,0 +1,125 @@
+/* Crontab round-trip test for shusefs (make test).
+ *
+ * Loads a schedule list into a device state, renders it as the crontab file
+ * and syncs the rendering back, the way saving an unchanged
+ * /proc/schedules/crontab does. That must not queue any request; changing
+ * one call of a multi-call schedule must queue exactly one update.
+ *
+ * Prints one line per failed check and exits nonzero if any failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/device_state.h"
+#include "../include/log.h"
+
+static int s_failures = 0;
+
+#define CHECK(cond)                                                    \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #cond);                                                  \
+      s_failures++;                                                    \
+    }                                                                  \
+  } while (0)
+
+/* One job per kind of crontab entry: several calls, a disabled one, and a
+ * call without params */
+static const char *s_schedule_list =
+    "{\"id\":1,\"src\":\"shellyplus1pm\",\"result\":{\"jobs\":["
+    "{\"id\":1,\"enable\":true,\"timespec\":\"0 0 7 * * MON-FRI\","
+    "\"calls\":[{\"method\":\"Switch.Set\",\"params\":{\"id\":0,\"on\":true}},"
+    "{\"method\":\"Switch.Set\",\"params\":{\"id\":1,\"on\":true}},"
+    "{\"method\":\"Script.Start\",\"params\":{\"id\":2}}]},"
+    "{\"id\":2,\"enable\":false,\"timespec\":\"0 30 22 * * *\","
+    "\"calls\":[{\"method\":\"Switch.Set\",\"params\":{\"id\":0,\"on\":false}},"
+    "{\"method\":\"Switch.Set\",\"params\":{\"id\":1,\"on\":false}}]},"
+    "{\"id\":3,\"enable\":true,\"timespec\":\"0 0 3 1 * *\","
+    "\"calls\":[{\"method\":\"Shelly.Reboot\"}]}"
+    "],\"rev\":7}}";
+
+/* Requests waiting to be sent, over all lanes */
+static int queued_requests(request_queue_t *queue) {
+  int queued[REQUEST_LANE_COUNT], in_flight[REQUEST_LANE_COUNT];
+  request_queue_get_depth(queue, queued, in_flight);
+  int total = 0;
+  for (int i = 0; i < REQUEST_LANE_COUNT; i++) {
+    total += queued[i];
+  }
+  return total;
+}
+
+/* Copy of `text` with the first `from` replaced by `to`, or NULL */
+static char *replace_first(const char *text, const char *from,
+                           const char *to) {
+  const char *at = strstr(text, from);
+  if (!at) {
+    return NULL;
+  }
+  size_t head = at - text;
+  size_t size = strlen(text) - strlen(from) + strlen(to) + 1;
+  char *out = malloc(size);
+  if (out) {
+    snprintf(out, size, "%.*s%s%s", (int) head, text, to, at + strlen(from));
+  }
+  return out;
+}
+
+/* Sync `crontab` against state and return the requests it queued, or -1 if
+ * that differs from the operations the sync reports */
+static int sync_queued(device_state_t *state, const char *crontab) {
+  request_queue_t queue;
+  if (request_queue_init(&queue) != 0) {
+    return -1;
+  }
+
+  /* Never dereferenced: the requests are only queued */
+  struct mg_connection *conn = (struct mg_connection *) &queue;
+  int ops = device_state_sync_crontab(state, &queue, conn, crontab,
+                                      strlen(crontab));
+  int queued = queued_requests(&queue);
+  request_queue_destroy(&queue);
+  return ops == queued ? queued : -1;
+}
+
+int main(void) {
+  log_configure("error");
+
+  device_state_t state;
+  CHECK(device_state_init(&state) == 0);
+
+  jsonrpc_frame_t frame;
+  CHECK(jsonrpc_classify_frame(s_schedule_list, strlen(s_schedule_list),
+                               &frame) == 0);
+  CHECK(device_state_update_schedule_list(&state, &frame) == 3);
+
+  char *crontab = NULL;
+  CHECK(device_state_get_crontab_str(&state, &crontab) == 0 && crontab);
+  if (!crontab) {
+    return 1;
+  }
+
+  /* Unchanged file: nothing to do */
+  CHECK(sync_queued(&state, crontab) == 0);
+
+  /* One call of the first job changed: one Schedule.Update */
+  char *edited = replace_first(crontab, "{\"id\":1,\"on\":true}",
+                               "{\"id\":1,\"on\":false}");
+  CHECK(edited != NULL);
+  if (edited) {
+    CHECK(sync_queued(&state, edited) == 1);
+    free(edited);
+  }
+
+  free(crontab);
+  device_state_destroy(&state);
+
+  if (s_failures > 0) {
+    fprintf(stderr, "%d check(s) failed\n", s_failures);
+    return 1;
+  }
+  printf("crontab: ok\n");
+  return 0;
+}